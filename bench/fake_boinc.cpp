@@ -0,0 +1,201 @@
+//
+// Fake BOINC runtime for the OpenIFS controller benchmark harness.
+//
+// Implements the subset of libboinc_api and libboinc_zip used by openifs.cpp so that the controller can be
+// run end-to-end without a BOINC client. It is compiled against the BOINC headers and linked with libboinc,
+// which still provides the file utilities (boinc_copy, boinc_resolve_filename_s, linux_cpu_time).
+// Behaviour is driven by environment variables:
+//
+//    FAKE_BOINC_STANDALONE     : 1 = behave as boinc_is_standalone(), default 0 (running under a client)
+//    FAKE_BOINC_PROJECT_DIR    : project directory returned in APP_INIT_DATA
+//    FAKE_BOINC_WU_NAME        : workunit name returned in APP_INIT_DATA
+//    FAKE_BOINC_APP_VERSION    : app version returned in APP_INIT_DATA (e.g. 105)
+//    FAKE_BOINC_UPLOAD_DELAY   : seconds before a registered upload reports completion, default 2
+//    FAKE_BOINC_DISK_BOUND     : rsc_disk_bound returned in APP_INIT_DATA (bytes)
+//    FAKE_BOINC_MEMORY_BOUND   : rsc_memory_bound returned in APP_INIT_DATA (bytes)
+//    FAKE_BOINC_LOG            : file to record API events (uploads, trickles, fraction done)
+//
+//  Zipping and unzipping is delegated to the Info-ZIP command line tools, which is the same code
+//  BOINC builds into libboinc_zip.
+//
+//  See bench/run_bench.py for the harness that uses this.
+//
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "boinc/boinc_api.h"
+#include "boinc/boinc_zip.h"
+#include "boinc/error_numbers.h"
+
+using namespace std::chrono;
+
+struct FAKE_UPLOAD {
+    std::string name;
+    steady_clock::time_point registered;
+};
+
+static std::vector<FAKE_UPLOAD> fake_uploads;
+static int                      fake_critical_depth = 0;
+
+static std::string fake_env(const char* name, const char* defval) {
+    const char* val = getenv(name);
+    return (val && *val) ? std::string(val) : std::string(defval);
+}
+
+static void fake_log(const std::string& event) {
+    std::string logfile = fake_env("FAKE_BOINC_LOG", "");
+    if (logfile.empty()) return;
+
+    std::ofstream log(logfile, std::ios::app);
+    double now = duration<double>(system_clock::now().time_since_epoch()).count();
+    log.precision(3);
+    log << std::fixed << now << " " << event << '\n';
+}
+
+static int fake_run(std::vector<std::string> args) {
+    std::vector<char*> argv;
+    for (auto& a : args) argv.push_back(&a[0]);
+    argv.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+       execvp(argv[0], argv.data());
+       _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    int stat;
+    if (waitpid(pid, &stat, 0) < 0) return -1;
+    return (WIFEXITED(stat) ? WEXITSTATUS(stat) : -1);
+}
+
+int boinc_init(void) {
+    fake_log("init");
+    return 0;
+}
+
+int boinc_finish(int status) {
+    fake_log("finish " + std::to_string(status));
+    std::cerr.flush();
+    exit(status);
+}
+
+int boinc_parse_init_data_file(void) {
+    return 0;
+}
+
+int boinc_get_init_data(APP_INIT_DATA& aid) {
+    aid = APP_INIT_DATA();
+    aid.app_version = std::stoi(fake_env("FAKE_BOINC_APP_VERSION", "100"));
+    snprintf(aid.project_dir, sizeof(aid.project_dir), "%s", fake_env("FAKE_BOINC_PROJECT_DIR", "../projects").c_str());
+    snprintf(aid.wu_name, sizeof(aid.wu_name), "%s", fake_env("FAKE_BOINC_WU_NAME", "fake_wu").c_str());
+    snprintf(aid.result_name, sizeof(aid.result_name), "%s", (std::string(aid.wu_name) + "_0").c_str());
+    aid.rsc_disk_bound   = atof(fake_env("FAKE_BOINC_DISK_BOUND", "10e9").c_str());
+    aid.rsc_memory_bound = atof(fake_env("FAKE_BOINC_MEMORY_BOUND", "4e9").c_str());
+    aid.ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    aid.host_info.p_ncpus = (int) aid.ncpus;
+    aid.host_info.m_nbytes = (double) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    return 0;
+}
+
+void boinc_options_defaults(BOINC_OPTIONS& options) {
+    memset(&options, 0, sizeof(options));
+}
+
+int boinc_init_options(BOINC_OPTIONS*) {
+    return 0;
+}
+
+int boinc_is_standalone(void) {
+    return fake_env("FAKE_BOINC_STANDALONE", "0") == "1";
+}
+
+int boinc_get_status(BOINC_STATUS* status) {
+    memset(status, 0, sizeof(*status));
+    return 0;
+}
+
+int boinc_begin_critical_section(void) {
+    fake_critical_depth++;
+    return 0;
+}
+
+int boinc_end_critical_section(void) {
+    if (fake_critical_depth > 0) fake_critical_depth--;
+    return 0;
+}
+
+int boinc_fraction_done(double fraction_done) {
+    static double last_logged = -1.0;
+    // Only log each whole percent to keep the event log small
+    if ((int)(fraction_done * 100.0) != (int)(last_logged * 100.0)) {
+       std::ostringstream event;
+       event << "fraction_done " << fraction_done;
+       fake_log(event.str());
+       last_logged = fraction_done;
+    }
+    return 0;
+}
+
+int boinc_report_app_status(double, double, double) {
+    return 0;
+}
+
+int boinc_send_trickle_up(char* variety, char* text) {
+    std::string body(text);
+    for (auto& c : body) if (c == '\n') c = ' ';
+    fake_log(std::string("trickle ") + variety + " " + std::to_string(strlen(text)) + " " + body);
+    return 0;
+}
+
+int boinc_upload_file(std::string& name) {
+    fake_uploads.push_back({name, steady_clock::now()});
+    fake_log("upload_file " + name);
+    return 0;
+}
+
+int boinc_upload_status(std::string& name) {
+    double delay = atof(fake_env("FAKE_BOINC_UPLOAD_DELAY", "2").c_str());
+    for (auto& up : fake_uploads) {
+       if (up.name == name) {
+          if (duration<double>(steady_clock::now() - up.registered).count() >= delay) return 0;
+          return ERR_NOT_FOUND;
+       }
+    }
+    return ERR_NOT_FOUND;
+}
+
+int boinc_calling_thread_cpu_time(double& cpu) {
+    cpu = (double) clock() / CLOCKS_PER_SEC;
+    return 0;
+}
+
+int boinc_zip(int bZipType, const std::string szFileZip, const ZipFileList* pvectszFileIn) {
+    if (bZipType == ZIP_IT) {
+       std::vector<std::string> args = {"zip", "-j", "-q", szFileZip};
+       for (auto& f : *pvectszFileIn) args.push_back(f);
+       return fake_run(args);
+    }
+    // unzip: pvectszFileIn holds the destination directory
+    std::string dest = (pvectszFileIn && pvectszFileIn->size()) ? (*pvectszFileIn)[0] : std::string(".");
+    return fake_run({"unzip", "-o", "-q", szFileZip, "-d", dest});
+}
+
+int boinc_zip(int bZipType, const std::string szFileZip, const std::string szFileIn) {
+    ZipFileList files;
+    files.push_back(szFileIn);
+    return boinc_zip(bZipType, szFileZip, &files);
+}
+
+int boinc_zip(int bZipType, const char* pszFileZip, const char* pszFileIn) {
+    return boinc_zip(bZipType, std::string(pszFileZip), std::string(pszFileIn));
+}
@@ -0,0 +1,672 @@
+//
+// Micro-benchmarks for the OpenIFS controller's string and parsing helpers (oifs_parse.cpp)
+// the fort.4 namelist parser (oifs_namelist.cpp), the GRIB output indexer (oifs_grib.cpp) and the CRC32 used
+// to match GRIB messages in the delta encoding of uploads (oifs_delta.cpp)
+//
+// A small runner in the style of Google Benchmark: each benchmark is run for increasing numbers of
+// iterations until it takes at least --min-time secs, and the time and heap allocations per iteration
+// are reported. The original implementations of the helpers are kept below as 'baseline' so that
+// each helper is measured against them, and before anything is timed the current helpers are checked
+// to give the same results as the baseline on the same inputs.
+//
+//    make microbench
+//    ./bench/micro_bench [--filter <substring>] [--min-time <secs>] [--check-only]
+//
+// Exits with status 1 if a helper's result differs from the baseline.
+//
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../oifs_parse.h"
+#include "../oifs_namelist.h"
+#include "../oifs_grib.h"
+#include "../oifs_delta.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Count heap allocations, to report allocations per iteration
+static long allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Stop the compiler optimising away a result
+template <class T> static void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+
+// Values read from fort.4 by the controller
+struct namelist_values {
+    std::string ifsdata_file, ic_ancil_file, climate_data_file, horiz_resolution, vert_resolution, grid_type;
+    int upload_interval = 0, timestep_interval = 0, ICM_file_interval = 0, restart_interval = 0;
+    bool operator==(const namelist_values& o) const {
+       return ifsdata_file == o.ifsdata_file && ic_ancil_file == o.ic_ancil_file && climate_data_file == o.climate_data_file &&
+              horiz_resolution == o.horiz_resolution && vert_resolution == o.vert_resolution && grid_type == o.grid_type &&
+              upload_interval == o.upload_interval && timestep_interval == o.timestep_interval &&
+              ICM_file_interval == o.ICM_file_interval && restart_interval == o.restart_interval;
+    }
+};
+
+// The original implementations, as they were in openifs.cpp
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+namespace baseline {
+
+std::string get_tag(const std::string &filename) {
+    std::ifstream file(filename);
+    if (file.is_open()) {
+       std::string line;
+       while (getline(file, line)) {
+          std::string::size_type start = line.find('>');
+          if (start != line.npos) {
+             std::string::size_type end = line.find('<', start + 1);
+             if (end != line.npos) {
+                ++start;
+                std::string::size_type count_size = end - start;
+                return line.substr(start, count_size);
+             }
+          }
+          return "";
+       }
+       file.close();
+    }
+    return "";
+}
+
+std::string get_second_part(string last_iter, string exptid) {
+   std::string second_part="";
+
+   if (last_iter.length() == 1) {
+      second_part = exptid +"+"+ "00000" + last_iter;
+   }
+   else if (last_iter.length() == 2) {
+      second_part = exptid + "+" + "0000" + last_iter;
+   }
+   else if (last_iter.length() == 3) {
+      second_part = exptid + "+" + "000" + last_iter;
+   }
+   else if (last_iter.length() == 4) {
+      second_part = exptid + "+" + "00" + last_iter;
+   }
+   else if (last_iter.length() == 5) {
+      second_part = exptid + "+" + "0" + last_iter;
+   }
+   else if (last_iter.length() == 6) {
+      second_part = exptid + "+" + last_iter;
+   }
+
+   return second_part;
+}
+
+bool check_stoi(std::string& cin) {
+    //  check input string is convertable to an integer by checking for any letters
+    //  nb. stoi() will convert leading digits if alphanumeric but we know step must be all digits.
+    //  Returns true on success, false if non-numeric data in input string.
+    //  Glenn Carver
+
+    int step;
+
+    if (std::any_of(cin.begin(), cin.end(), ::isalpha)) {
+        cerr << "..Invalid characters in stoi string: " << cin << std::endl;
+        return false;
+    }
+
+    //  check stoi standard exceptions
+    //  n.b. still need to check step <= max_step
+    try {
+        step = std::stoi(cin);
+        //cerr << "step converted is : " << step << '\n';
+        return true;
+    }
+    catch (const std::invalid_argument &excep) {
+        cerr << "..Invalid input argument for stoi : " << excep.what() << std::endl;
+        return false;
+    }
+    catch (const std::out_of_range &excep) {
+        cerr << "..Out of range value for stoi : " << excep.what() << std::endl;
+        return false;
+    }
+}
+
+bool oifs_parse_stat(std::string& logline, std::string& stat_column, int index) {
+   //   Parse a line of the OpenIFS ifs.stat log file, previously obtained from oifs_get_statline
+   //      logline  : incoming ifs.stat logfile line to be parsed
+   //      stat_col : returned string given by position 'index'
+   //  Returns false if string is empty.
+
+   istringstream tokens;
+   std::string statstr="";
+
+   //  split input, get token specified by 'column' unless file is corrupted
+   tokens.str(logline);
+   for (int i=0; i<index; ++i)
+      tokens >> statstr;
+
+   if ( statstr.empty() ){
+      return false;
+   } else {
+      stat_column = statstr;
+      //cerr << "oifs_parse_ifsstat: parsed string  = " << stat_column << " index " << index << '\n';
+      return true;
+   }
+}
+
+bool oifs_valid_step(std::string& step, int nsteps) {
+   //  checks for a valid step count in arg 'step'
+   //  Returns :   true if step is valid, otherwise false
+   //      Glenn
+
+   // make sure step is valid integer
+   if (!check_stoi(step)) {
+      cerr << "oifs_valid_step: Invalid characters in stoi string, unable to convert step to int: " << step << '\n';
+      return false;
+   } else {
+      // check step is in valid range: 0 -> total no. of steps
+      if (stoi(step)<0) {
+         return false;
+      } else if (stoi(step) > nsteps) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// The fort.4 parsing loop from main()
+
+void parse_namelist(const std::vector<std::string>& lines, namelist_values& v) {
+    std::string delimiter="=", tmpstr1, tmpstr2, tmpstr3;
+    for (const std::string& namelist_line : lines) {
+       std::istringstream nss(namelist_line);   //put line into stringstream
+
+       if (nss.str().find("IFSDATA_FILE") != std::string::npos) {
+          v.ifsdata_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.ifsdata_file.erase(std::remove(v.ifsdata_file.begin(), v.ifsdata_file.end(), ' '), v.ifsdata_file.end());
+       }
+       else if (nss.str().find("IC_ANCIL_FILE") != std::string::npos) {
+          v.ic_ancil_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.ic_ancil_file.erase(std::remove(v.ic_ancil_file.begin(), v.ic_ancil_file.end(), ' '), v.ic_ancil_file.end());
+       }
+       else if (nss.str().find("CLIMATE_DATA_FILE") != std::string::npos) {
+          v.climate_data_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.climate_data_file.erase(std::remove(v.climate_data_file.begin(),v.climate_data_file.end(),' '), v.climate_data_file.end());
+       }
+       else if (nss.str().find("HORIZ_RESOLUTION") != std::string::npos) {
+          v.horiz_resolution = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.horiz_resolution.erase(std::remove(v.horiz_resolution.begin(),v.horiz_resolution.end(),' '), v.horiz_resolution.end());
+       }
+       else if (nss.str().find("VERT_RESOLUTION") != std::string::npos) {
+          v.vert_resolution = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.vert_resolution.erase(std::remove(v.vert_resolution.begin(), v.vert_resolution.end(), ' '), v.vert_resolution.end());
+       }
+       else if (nss.str().find("GRID_TYPE") != std::string::npos) {
+          v.grid_type = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          v.grid_type.erase(std::remove(v.grid_type.begin(), v.grid_type.end(),' '), v.grid_type.end());
+       }
+       else if (nss.str().find("UPLOAD_INTERVAL") != std::string::npos) {
+          tmpstr1 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          tmpstr1.erase(std::remove(tmpstr1.begin(), tmpstr1.end(),' '), tmpstr1.end());
+          v.upload_interval=std::stoi(tmpstr1);
+       }
+       else if (nss.str().find("UTSTEP") != std::string::npos) {
+          tmpstr2 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          tmpstr2.erase(std::remove(tmpstr2.begin(), tmpstr2.end(),','), tmpstr2.end());
+          tmpstr2.erase(std::remove(tmpstr2.begin(), tmpstr2.end(),' '), tmpstr2.end());
+          v.timestep_interval = std::stoi(tmpstr2);
+       }
+       else if (nss.str().find("!NFRPOS") != std::string::npos) {
+          tmpstr3 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),','), tmpstr3.end());
+          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),' '), tmpstr3.end());
+          v.ICM_file_interval = std::stoi(tmpstr3);
+       }
+       else if (nss.str().find("NFRRES") != std::string::npos) {
+          tmpstr3 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
+          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),','), tmpstr3.end());
+          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),' '), tmpstr3.end());
+          if ( check_stoi(tmpstr3) ) {
+            v.restart_interval = stoi(tmpstr3);
+          } else {
+            v.restart_interval = 0;
+          }
+       }
+    }
+}
+
+}  // namespace baseline
+#pragma GCC diagnostic pop
+
+
+// The fort.4 parsing in main() using the namelist parser
+static bool parse_namelist(std::istream& input, namelist_values& v) {
+    oifs_namelist nml;
+    std::string tmpstr1;
+    if (!namelist_parse(input, nml)) return false;
+    namelist_cpdn_value(nml, "IFSDATA_FILE", v.ifsdata_file);
+    namelist_cpdn_value(nml, "IC_ANCIL_FILE", v.ic_ancil_file);
+    namelist_cpdn_value(nml, "CLIMATE_DATA_FILE", v.climate_data_file);
+    namelist_cpdn_value(nml, "HORIZ_RESOLUTION", v.horiz_resolution);
+    namelist_cpdn_value(nml, "VERT_RESOLUTION", v.vert_resolution);
+    namelist_cpdn_value(nml, "GRID_TYPE", v.grid_type);
+    if (namelist_cpdn_value(nml, "UPLOAD_INTERVAL", tmpstr1)) oifs_parse_int(tmpstr1, v.upload_interval);
+    if (namelist_cpdn_value(nml, "UTSTEP", tmpstr1)) oifs_parse_int(tmpstr1, v.timestep_interval);
+    if (namelist_cpdn_value(nml, "NFRPOS", tmpstr1)) oifs_parse_int(tmpstr1, v.ICM_file_interval);
+    if (namelist_cpdn_value(nml, "NFRRES", tmpstr1)) {
+       v.restart_interval = check_stoi(tmpstr1) ? std::stoi(tmpstr1) : 0;
+    }
+    return true;
+}
+
+
+// Inputs, representative of what the controller sees
+
+// Lines of ifs.stat as written by OpenIFS 43r3, including a partly written last line
+static const std::vector<std::string> stat_lines = {
+    " 09:43:26 0AAA00AAA CNT3      -999   0:00.0   0.00000000000000E+00     0:00     0:00",
+    " 09:44:10 0AAA00AAA STEPO        0  44.061   0.13468372138798E+06    0:44    0:44",
+    " 09:45:02 0AAA00AAA STEPO       17  51.874   0.13468372213344E+06    1:35    1:36",
+    " 10:21:37 0AAA00AAA STEPO     1439  52.007   0.13468379987656E+06   38:11   38:12",
+    " 11:02:40 0AAA00AAA CNT0      2928   0:00.0   0.00000000000000E+00    79:14   79:15",
+    " 11:02:41 0AAA00AAA STEPO",
+    "" };
+
+static const std::vector<std::string> step_strings = {
+    "0", "7", "24", "145", "1439", "2928", "99999", "100000", "999999", "1000000", "", "-1", "+5", "+-5", " 12",
+    "12:", "1.5", "STEPO", "2147483648", "-999" };
+
+// fort.4 from a CPDN OpenIFS workunit: the CPDN directives and a selection of the model's namelists
+static const char* fort4 = R"(!IFSDATA_FILE=ifsdata_gw3a_00001
+!IC_ANCIL_FILE=ic_ancil_gw3a_00001
+!CLIMATE_DATA_FILE=clim_data_gw3a_00001
+!HORIZ_RESOLUTION=159
+!VERT_RESOLUTION=91
+!GRID_TYPE=l_2
+!UPLOAD_INTERVAL=24
+!NFRPOS=24
+ &NACIFV
+ /
+ &NACOBS
+ /
+ &NAEPHY
+   LEPHYS=true,
+   LEVDIF=true,
+   LESURF=true,
+   LECOND=true,
+   LECUMF=true,
+   LEPCLD=true,
+   LEEVAP=true,
+   LEVGEN=true,
+   LESSRO=true,
+   LECURR=false,
+   LEGWDG=true,
+   LEGWWMS=true,
+   LEOCWA=false,
+   LEOCCO=false,
+   LEOCSA=true,
+ /
+ &NAMCT0
+   NCONF=1,
+   CNMEXP="gw3a",
+   CTYPE="fc",
+   LECMWF=true,
+   LSMSSIG=false,
+   LSLAG=true,
+   LFDBOP=false,
+   LFPOS=true,
+   NFRHIS=24,
+   NFRPOS=24,
+   NFRRES=-720,
+   NFRDHP=24,
+   NFRSDI=24,
+   NHISTS(0)=-1,
+   NPOSTS(0)=0,
+   NSTOP=0,
+   NSPPR=0,
+   NPRINTLEV=0,
+   LREFOUT=false,
+ /
+ &NAMDIM
+   NPROMA=-32,
+ /
+ &NAMDYN
+   TSTEP=3600.0,
+   LSETTLS=true,
+   VESL=0.0,
+   SITR=350.0,
+   NITMP=3,
+ /
+ &NAMFPC
+   CFPFMT="GAUSS",
+   NFP3DFS=6,
+   MFP3DFS=130,129,133,135,138,155,
+   NRFP3S=1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+   NFP2DF=2,
+   MFP2DF=152,129,
+   NFPPHY=35,
+   MFPPHY=31,32,33,34,35,36,37,38,39,40,41,42,139,141,142,143,144,146,147,151,164,165,166,167,168,169,170,172,175,176,177,178,179,180,181,
+ /
+ &NAMGFL
+   YQ_NL%LGP=true,
+   YL_NL%LGP=true,
+   YI_NL%LGP=true,
+   YA_NL%LGP=true,
+   YO3_NL%LGP=true,
+ /
+ &NAMIO_SERV
+   NPROC_IO=0,
+ /
+ &NAMPAR0
+   NPROC=1,
+   LSTATS=false,
+   NOUTPUT=1,
+   MP_TYPE=2,
+   MBX_SIZE=128000000,
+ /
+ &NAMPAR1
+   LSPLIT=true,
+   NFLDIN=0,
+   NFLDOUT=0,
+   NSTRIN=1,
+ /
+ &NAMRIP
+   CSTOP="d30",
+   TSTEP=3600.0,
+   UTSTEP=3600.0,
+ /
+ &NAMTRAJP
+ /
+ &NAMVAR
+ /
+)";
+
+static std::vector<std::string> namelist_lines() {
+    std::vector<std::string> lines;
+    std::istringstream text(fort4);
+    std::string line;
+    while (std::getline(text, line)) lines.push_back(line);
+    return lines;
+}
+
+
+// A result file of GRIB1 fields like the model's grid point output: 'nfields' messages of 'npoints' 16 bit values,
+// with the field number as the level and the step as 'step' hours
+static std::vector<unsigned char> grib_file(int nfields, long npoints, int step) {
+    std::vector<unsigned char> file;
+    for (int f = 0; f < nfields; f++) {
+       size_t bds_len = 11 + 2 * npoints + 1, len = 8 + 28 + bds_len + 4;
+       std::vector<unsigned char> msg(len, 0);
+       memcpy(msg.data(), "GRIB", 4);
+       msg[4] = len >> 16; msg[5] = len >> 8; msg[6] = len;
+       msg[7] = 1;
+       unsigned char* pds = msg.data() + 8;
+       pds[2] = 28; pds[3] = 128; pds[8] = 130; pds[9] = 109;
+       pds[10] = (f + 1) >> 8; pds[11] = f + 1;
+       pds[17] = 1; pds[18] = step;
+       unsigned char* bds = pds + 28;
+       bds[0] = bds_len >> 16; bds[1] = bds_len >> 8; bds[2] = bds_len; bds[3] = 8; bds[10] = 16;
+       memcpy(msg.data() + len - 4, "7777", 4);
+       file.insert(file.end(), msg.begin(), msg.end());
+    }
+    return file;
+}
+
+// Equivalence checks: the helpers must give the same results as the baseline
+
+static int failures = 0;
+
+template <class T> static void check(const std::string& what, const std::string& input, const T& expected, const T& got) {
+    if (!(expected == got)) {
+       failures++;
+       std::ostringstream msg;
+       msg << "..MISMATCH " << what << " input '" << input << "': baseline '" << expected << "', new '" << got << "'";
+       fprintf(stderr, "%s\n", msg.str().c_str());
+    }
+}
+
+// The GRIB indexer has no baseline: check the index of a generated file against the fields written to it
+static void check_grib_index() {
+    std::vector<unsigned char> file = grib_file(10, 1000, 6);
+    std::vector<grib_index_entry> index;
+    check("grib_index_buffer", std::string("grib"), true, grib_index_buffer(file.data(), file.size(), index));
+    check("grib_index_buffer", std::string("grib"), (size_t) 10, index.size());
+    size_t offset = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+       const grib_index_entry& e = index[i];
+       std::string got = std::to_string(e.offset) + " " + e.param + " " + e.levtype + " " + std::to_string(e.level) + " " + std::to_string(e.step);
+       std::string expected = std::to_string(offset) + " 130 ml " + std::to_string(i + 1) + " " + std::to_string(6.0);
+       check("grib_index_buffer", "field " + std::to_string(i), expected, got);
+       offset += e.length;
+    }
+    check("grib_index_buffer", std::string("grib"), file.size(), offset);
+
+    // A truncated file is not indexed
+    check("grib_index_buffer", std::string("truncated"), false, grib_index_buffer(file.data(), file.size() - 10, index));
+
+    // The CRC32 check value, and the same CRC in pieces that are not a multiple of the 8 bytes per step
+    check("oifs_crc32", std::string("123456789"), (uint32_t) 0xcbf43926, oifs_crc32(0, "123456789", 9));
+    uint32_t crc = oifs_crc32(0, file.data(), 13);
+    check("oifs_crc32", std::string("grib"), oifs_crc32(0, file.data(), file.size()), oifs_crc32(crc, file.data() + 13, file.size() - 13));
+}
+
+// Namelist parser cases the baseline does not handle, checked against the expected values
+static void check_namelist() {
+    oifs_namelist nml;
+    std::string value;
+    int ivalue = 0;
+    double dvalue = 0;
+
+    std::istringstream input(
+       "!NFRPOS=6\n"
+       " &NAMCT0\n"
+       "   NFRPOS=12, NFRRES=-24,  ! comment, NFRHIS=1\n"
+       "   NFRHIS=6,CNMEXP='gw3a',\n"
+       "   NPOSTS(0)=2, NPOSTS(1)=-6,-12,\n"
+       "   CTEXT='a, b / c ''d''',\n"
+       " /\n"
+       " &NAMDIM NPROMA=-32 /\n"
+       " &NAMRIP\n"
+       "   TSTEP=1.8D3,\n"
+       "   UTSTEP=3600.0,\n"
+       " /\n");
+    check("namelist_parse", std::string("cases"), true, namelist_parse(input, nml));
+    check("namelist_get_int", std::string("NFRPOS"), true, namelist_get_int(nml, "NAMCT0", "NFRPOS", ivalue) && ivalue == 12);
+    check("namelist_get_int", std::string("NFRHIS"), true, namelist_get_int(nml, "namct0", "nfrhis", ivalue) && ivalue == 6);
+    check("namelist_get", std::string("NPOSTS(1)"), true, namelist_get(nml, "NAMCT0", "NPOSTS(1)", value) && value == "-6,-12");
+    check("namelist_get_string", std::string("CTEXT"), true, namelist_get_string(nml, "NAMCT0", "CTEXT", value) && value == "a, b / c 'd'");
+    check("namelist_get_int", std::string("NPROMA"), true, namelist_get_int(nml, "NAMDIM", "NPROMA", ivalue) && ivalue == -32);
+    check("namelist_get_double", std::string("TSTEP"), true, namelist_get_double(nml, "NAMRIP", "TSTEP", dvalue) && dvalue == 1800.0);
+    check("namelist_find", std::string("TSTEP in NAMCT0"), true, namelist_find(nml, "NAMCT0", "TSTEP") == NULL);
+    check("namelist_directive", std::string("NFRPOS"), true, namelist_directive(nml, "NFRPOS", value) && value == "6");
+    check("namelist_cpdn_value", std::string("NFRPOS"), true, namelist_cpdn_value(nml, "NFRPOS", value) && value == "12");
+    check("namelist_cpdn_value", std::string("STEP"), false, namelist_cpdn_value(nml, "STEP", value));
+
+    // Changing values: in place, over several lines, a new variable and a new group
+    std::vector<std::string> before = nml.lines;
+    check("namelist_set", std::string("NFRPOS"), true, namelist_set(nml, "NAMCT0", "NFRPOS", "24"));
+    check("namelist_set", std::string("NFRPOS line"), std::string("   NFRPOS=24, NFRRES=-24,  ! comment, NFRHIS=1"), nml.lines[2]);
+    check("namelist_set", std::string("NFRRES"), true, namelist_set(nml, "NAMCT0", "NFRRES", "-48"));
+    check("namelist_set", std::string("NFRRES line"), std::string("   NFRPOS=24, NFRRES=-48,  ! comment, NFRHIS=1"), nml.lines[2]);
+    check("namelist_set", std::string("NPOSTS(1)"), true, namelist_set(nml, "NAMCT0", "NPOSTS(1)", "-3"));
+    check("namelist_set", std::string("NPROMA"), true, namelist_set(nml, "NAMDIM", "NPROMA", "-16"));
+    check("namelist_set", std::string("NSTOP"), true, namelist_set(nml, "NAMCT0", "NSTOP", "0"));
+    check("namelist_set", std::string("NAMPAR0"), true, namelist_set(nml, "NAMPAR0", "NPROC", "1"));
+
+    std::ostringstream text;
+    for (auto& line : nml.lines) text << line << '\n';
+    std::istringstream updated(text.str());
+    oifs_namelist reread;
+    check("namelist_set", std::string("reparse"), true, namelist_parse(updated, reread));
+    check("namelist_set", std::string("NFRPOS"), true, namelist_get_int(reread, "NAMCT0", "NFRPOS", ivalue) && ivalue == 24);
+    check("namelist_set", std::string("NPOSTS(1)"), true, namelist_get(reread, "NAMCT0", "NPOSTS(1)", value) && value == "-3");
+    check("namelist_set", std::string("NPOSTS(0)"), true, namelist_get(reread, "NAMCT0", "NPOSTS(0)", value) && value == "2");
+    check("namelist_set", std::string("NPROMA"), true, namelist_get_int(reread, "NAMDIM", "NPROMA", ivalue) && ivalue == -16);
+    check("namelist_set", std::string("NSTOP"), true, namelist_get_int(reread, "NAMCT0", "NSTOP", ivalue) && ivalue == 0);
+    check("namelist_set", std::string("NPROC"), true, namelist_get_int(reread, "NAMPAR0", "NPROC", ivalue) && ivalue == 1);
+    check("namelist_set", std::string("UTSTEP"), true, namelist_get(reread, "NAMRIP", "UTSTEP", value) && value == "3600.0");
+    check("namelist_set", std::string("comments kept"), before[0] + before[9], reread.lines[0] + reread.lines[10]);
+}
+
+static void run_checks(const std::string& link_file) {
+    // The helpers report invalid input on cerr, which is not what is being compared
+    std::ostringstream discard;
+    std::streambuf* saved = std::cerr.rdbuf(discard.rdbuf());
+
+    for (const std::string& step : step_strings) {
+       for (const std::string& exptid : {std::string("gw3a"), std::string("h0d7")}) {
+          check("get_second_part", step, baseline::get_second_part(step, exptid), get_second_part(step, exptid));
+       }
+       std::string input = step;
+       check("check_stoi", step, baseline::check_stoi(input), check_stoi(step));
+       for (int nsteps : {0, 24, 2928}) {
+          check("oifs_valid_step", step, baseline::oifs_valid_step(input, nsteps), oifs_valid_step(step, nsteps));
+       }
+    }
+
+    for (const std::string& line : stat_lines) {
+       for (int index : {1, 3, 4, 8, 12}) {
+          std::string input = line, expected = "unset", got = "unset";
+          bool expected_ok = baseline::oifs_parse_stat(input, expected, index);
+          bool got_ok = oifs_parse_stat(line, got, index);
+          check("oifs_parse_stat", line + "' column '" + std::to_string(index), expected_ok, got_ok);
+          check("oifs_parse_stat", line + "' column '" + std::to_string(index), expected, got);
+       }
+    }
+
+    check("get_tag", link_file, baseline::get_tag(link_file), get_tag(link_file));
+    check("get_tag", std::string("missing"), baseline::get_tag("/nonexistent/file"), get_tag("/nonexistent/file"));
+
+    namelist_values expected, got;
+    std::istringstream fort4_input(fort4);
+    baseline::parse_namelist(namelist_lines(), expected);
+    check("namelist_parse", std::string("fort.4"), true, parse_namelist(fort4_input, got));
+    check("namelist", std::string("fort.4"), expected.ifsdata_file + " " + expected.grid_type + " " + std::to_string(expected.restart_interval),
+                                            got.ifsdata_file + " " + got.grid_type + " " + std::to_string(got.restart_interval));
+    check("namelist", std::string("fort.4"), true, expected == got);
+
+    check_namelist();
+    check_grib_index();
+
+    std::cerr.rdbuf(saved);
+}
+
+
+// Benchmark runner
+
+struct benchmark {
+    std::string name;
+    std::function<void(long)> run;     // run the benchmark for the given number of iterations
+};
+
+static void run_benchmark(const benchmark& b, double min_time) {
+    long   iterations = 1;
+    double elapsed = 0;
+    long   allocs = 0;
+
+    while (true) {
+       long start_allocs = allocations;
+       auto start = steady_clock::now();
+       b.run(iterations);
+       elapsed = duration<double>(steady_clock::now() - start).count();
+       allocs = allocations - start_allocs;
+       if (elapsed >= min_time || iterations >= 1000000000L) break;
+       // Aim for the minimum time with a margin, growing by at most 10x per round
+       double scale = (elapsed > 0) ? 1.4 * min_time / elapsed : 10;
+       iterations = (long) (iterations * std::min(std::max(scale, 2.0), 10.0));
+    }
+    printf("%-36s %12.1f %14ld %12.2f\n", b.name.c_str(), 1.0e9 * elapsed / iterations, iterations, (double) allocs / iterations);
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    double min_time = 0.2;
+    bool check_only = false;
+
+    for (int i = 1; i < argc; i++) {
+       if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+       else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) min_time = atof(argv[++i]);
+       else if (strcmp(argv[i], "--check-only") == 0) check_only = true;
+       else {
+          fprintf(stderr, "usage: %s [--filter <substring>] [--min-time <secs>] [--check-only]\n", argv[0]);
+          return 2;
+       }
+    }
+
+    // A BOINC soft link file, as read by get_tag() when staging the input files
+    char link_file[] = "/tmp/oifs_micro_bench_XXXXXX";
+    int fd = mkstemp(link_file);
+    if (fd < 0) {
+       perror("mkstemp");
+       return 2;
+    }
+    const char* link = "<soft_link>../../projects/climateprediction.net/jf_ic_ancil_gw3a_00001_0123456789abcdef</soft_link>\n";
+    if (write(fd, link, strlen(link)) < 0) perror("write");
+    close(fd);
+
+    run_checks(link_file);
+    if (failures) {
+       fprintf(stderr, "..%d results differ from the baseline\n", failures);
+       unlink(link_file);
+       return 1;
+    }
+    printf("All results match the baseline\n");
+    if (check_only) {
+       unlink(link_file);
+       return 0;
+    }
+
+    const std::vector<std::string> lines = namelist_lines();
+    oifs_namelist nml;
+    std::istringstream fort4_input(fort4);
+    namelist_parse(fort4_input, nml);
+    const std::string exptid = "gw3a";
+    const std::vector<std::string> steps = {"0", "24", "145", "1439", "2928"};
+    std::string column, stat_line = stat_lines[3], step = "1439";
+    // 91 model levels of a T159 grid point field, about 6 MB
+    const std::vector<unsigned char> icm_file = grib_file(91, 35718, 24);
+    std::vector<grib_index_entry> index;
+
+    std::vector<benchmark> benchmarks = {
+       {"get_second_part/baseline", [&](long n) { for (long i = 0; i < n; i++) keep(baseline::get_second_part(steps[i % 5], exptid)); }},
+       {"get_second_part/new",      [&](long n) { for (long i = 0; i < n; i++) keep(get_second_part(steps[i % 5], exptid)); }},
+       {"oifs_parse_stat/baseline", [&](long n) { for (long i = 0; i < n; i++) keep(baseline::oifs_parse_stat(stat_line, column, 4)); }},
+       {"oifs_parse_stat/new",      [&](long n) { for (long i = 0; i < n; i++) keep(oifs_parse_stat(stat_line, column, 4)); }},
+       {"check_stoi/baseline",      [&](long n) { for (long i = 0; i < n; i++) keep(baseline::check_stoi(step)); }},
+       {"check_stoi/new",           [&](long n) { for (long i = 0; i < n; i++) keep(check_stoi(step)); }},
+       {"oifs_valid_step/baseline", [&](long n) { for (long i = 0; i < n; i++) keep(baseline::oifs_valid_step(step, 2928)); }},
+       {"oifs_valid_step/new",      [&](long n) { for (long i = 0; i < n; i++) keep(oifs_valid_step(step, 2928)); }},
+       {"get_tag/baseline",         [&](long n) { for (long i = 0; i < n; i++) keep(baseline::get_tag(link_file)); }},
+       {"get_tag/new",              [&](long n) { for (long i = 0; i < n; i++) keep(get_tag(link_file)); }},
+       {"namelist/baseline",        [&](long n) { for (long i = 0; i < n; i++) { namelist_values v; baseline::parse_namelist(lines, v); keep(v); } }},
+       {"namelist/new",             [&](long n) { for (long i = 0; i < n; i++) { namelist_values v; std::istringstream in(fort4); parse_namelist(in, v); keep(v); } }},
+       {"namelist_set",             [&](long n) { for (long i = 0; i < n; i++) { keep(namelist_set(nml, "NAMDIM", "NPROMA", (i & 1) ? "-16" : "-32")); } }},
+       {"grib_index_buffer/6MB",    [&](long n) { for (long i = 0; i < n; i++) keep(grib_index_buffer(icm_file.data(), icm_file.size(), index)); }},
+       {"oifs_crc32/6MB",           [&](long n) { for (long i = 0; i < n; i++) keep(oifs_crc32(0, icm_file.data(), icm_file.size())); }},
+    };
+
+    printf("%-36s %12s %14s %12s\n", "Benchmark", "Time (ns)", "Iterations", "Allocs/iter");
+    for (const benchmark& b : benchmarks) {
+       if (filter.empty() || b.name.find(filter) != std::string::npos) run_benchmark(b, min_time);
+    }
+
+    unlink(link_file);
+    return 0;
+}
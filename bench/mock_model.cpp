@@ -0,0 +1,443 @@
+//
+// Mock OpenIFS model for the controller benchmark harness.
+//
+// Stands in for oifs_43r3_model.exe: it is launched by the controller in the slot directory as
+// 'oifs_43r3_model.exe -e <exptid>' and writes the files the controller watches, ifs.stat,
+// NODE.001_01 and the ICMGG/ICMSH/ICMUA output files, at a configurable size and cadence.
+// Settings are taken from environment variables, as the controller passes no other arguments:
+//
+//    MOCK_NSTEPS        : number of model steps, default 24
+//    MOCK_STEP_SECS     : wall time of one model step (secs), default 0.5
+//    MOCK_OUTPUT_EVERY  : steps between output files, default 1
+//    MOCK_FILE_BYTES    : size of each ICMGG/ICMSH/ICMUA file (bytes), default 1 MB
+//    MOCK_CPU_FRACTION  : fraction of each step the OpenMP threads spend busy, default 0 (sleep only)
+//    OMP_NUM_THREADS    : number of threads used for MOCK_CPU_FRACTION, as set by the controller
+//    MOCK_GRIB          : 1 = write the output files as GRIB1 fields (16 bit simple packing, pressure level fields
+//                         that vary with the step and surface fields that do not) rather than filler, for the
+//                         controller's output manifest processing and delta encoding
+//    MOCK_RESTART_EVERY : steps between restart points, default 0 (none). The step of the last restart
+//                         point is kept in mock_restart, and a relaunched model continues after it.
+//    MOCK_RESTART_BYTES : size of the restart set written at each restart point (bytes), default 0 (none).
+//                         Written as the model does, as srf<DDDDHHMM>.<nnnn> files then rcf, and a
+//                         relaunched model fails if the files of the set named by rcf are not there.
+//    MOCK_UTSTEP        : model timestep (secs) for the restart set times, default 3600
+//    DR_HOOK_OPT        : 'prof' = write a DrHook profile, DR_HOOK_PROFILE.1, at the end of the run, sharing
+//                         the run's wall time between a few routines on each thread, as set by the controller
+//
+// Replay mode reproduces the timeline of a captured ifs.stat, e.g. from a volunteer's task:
+//
+//    MOCK_REPLAY        : captured ifs.stat. Its lines are written with the same intervals between them,
+//                         with the time column replaced by the current time.
+//    MOCK_REPLAY_SIZES  : optional list of the output files and their sizes, one per line, e.g. the output
+//                         of 'unzip -l' or 'ls -l' on the task's result files. Only the files listed are
+//                         written. Without it, outputs are written as set by MOCK_OUTPUT_EVERY & MOCK_FILE_BYTES.
+//    MOCK_SPEEDUP       : divide the intervals between lines by this factor, default 1
+//    MOCK_MAX_GAP       : longest interval between lines after the speedup (secs), default none.
+//                         Use this to skip over the time a task was suspended.
+//
+// Each step completion is also recorded in mock_model.log as '<epoch secs> <step>' at sub-second
+// resolution, so the harness can measure how long the controller takes to pick up the outputs.
+//
+// As the model does, it fails at the start if its initial files, ICMGG<exptid>INIT and ICMSH<exptid>INIT, are
+// not in its working directory, e.g. not linked into the controller's calibration folder.
+//
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <map>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace std::chrono;
+
+static double env_value(const char* name, double default_value) {
+    const char* value = getenv(name);
+    return (value && *value) ? atof(value) : default_value;
+}
+
+// A GRIB1 message of npts values with 16 bit simple packing at a step (hours), with a pattern of values
+// varying with 'phase'
+static std::vector<char> grib_message(int param, int levtype, int level, int npts, long step, double phase) {
+    std::vector<unsigned char> msg = {'G', 'R', 'I', 'B', 0, 0, 0, 1};
+    unsigned char pds[28] = {0, 0, 28, 128, 98, 145, 255, 0, (unsigned char) param, (unsigned char) levtype,
+                             (unsigned char) (level >> 8), (unsigned char) (level & 0xff), 100, 1, 1, 0, 0, 1,
+                             (unsigned char) (step > 255 ? 255 : step)};
+    msg.insert(msg.end(), pds, pds + 28);
+
+    int bds_len = 11 + 2 * npts;
+    unsigned char bds[11] = {(unsigned char) (bds_len >> 16), (unsigned char) (bds_len >> 8), (unsigned char) bds_len,
+                             0, 0x80, 10, 0x42, 0xc8, 0, 0, 16};       // E = -10, R = 200.0 (IBM float)
+    msg.insert(msg.end(), bds, bds + 11);
+    for (int i = 0; i < npts; i++) {
+       unsigned value = (unsigned) (32768 + 30000 * sin(i * 0.01 + param + level * 0.001 + phase)) ^ (i & 0x3f);
+       msg.push_back(value >> 8);
+       msg.push_back(value & 0xff);
+    }
+    msg.insert(msg.end(), {'7', '7', '7', '7'});
+    size_t len = msg.size();
+    msg[4] = len >> 16; msg[5] = len >> 8; msg[6] = len & 0xff;
+    return std::vector<char>(msg.begin(), msg.end());
+}
+
+// Write an output file of GRIB fields up to about nbytes: temperature, winds and humidity on pressure levels
+// followed by some surface fields, repeated as needed. The surface fields are the same at every step.
+static bool write_grib_output(const std::string& filename, long nbytes, long step) {
+    static const int levels[] = {1000, 925, 850, 700, 500, 300, 200, 100};
+    static const int pl_params[] = {130, 131, 132, 133};
+    static const int sfc_params[] = {167, 151, 164};
+    FILE* output = fopen(filename.c_str(), "w");
+    if (output == NULL) return false;
+    long written = 0;
+    while (written < nbytes) {
+       for (int param : pl_params) {
+          for (int level : levels) {
+             std::vector<char> msg = grib_message(param, 100, level, 16000, step, step * 0.05);
+             written += fwrite(msg.data(), 1, msg.size(), output);
+          }
+       }
+       for (int param : sfc_params) {
+          std::vector<char> msg = grib_message(param, 1, 0, 16000, step, 0);
+          written += fwrite(msg.data(), 1, msg.size(), output);
+       }
+    }
+    return fclose(output) == 0;
+}
+
+// Time of a step as in the names of the restart files, DDDDHHMM
+static std::string restart_tag(long step, long utstep) {
+    long minutes = step * utstep / 60;
+    char tag[32];
+    snprintf(tag, sizeof(tag), "%04ld%02ld%02ld", minutes / 1440, (minutes / 60) % 24, minutes % 60);
+    return tag;
+}
+
+// Write a restart set of four srf files, then rcf naming it
+static bool write_restart_set(long step, long utstep, long nbytes, const std::vector<char>& block) {
+    std::string tag = restart_tag(step, utstep);
+    for (int n = 1; n <= 4; n++) {
+       char name[32];
+       snprintf(name, sizeof(name), "srf%s.%04d", tag.c_str(), n);
+       FILE* output = fopen(name, "w");
+       if (output == NULL) return false;
+       for (long written = 0; written < nbytes / 4; written += block.size())
+          fwrite(block.data(), 1, (size_t) std::min((long) block.size(), nbytes / 4 - written), output);
+       if (fclose(output) != 0) return false;
+    }
+    FILE* rcf = fopen("rcf", "w");
+    if (rcf == NULL) return false;
+    fprintf(rcf, " &NAMRCF\n   CSTEP=\"%8ld\",\n   CTIME=\"%s\",\n /\n", step, tag.c_str());
+    return fclose(rcf) == 0;
+}
+
+// Check the restart set named by rcf is in the slot, as the model needs to continue from it
+static bool check_restart_set() {
+    std::ifstream rcf("rcf");
+    std::string line, tag;
+    while (std::getline(rcf, line)) {
+       size_t pos = line.find("CTIME=\"");
+       if (pos != std::string::npos) tag = line.substr(pos + 7, 8);
+    }
+    if (tag.empty()) return true;
+    for (int n = 1; n <= 4; n++) {
+       char name[32];
+       snprintf(name, sizeof(name), "srf%s.%04d", tag.c_str(), n);
+       struct stat st;
+       if (stat(name, &st) != 0) {
+          cerr << "..mock model: restart file " << name << " is missing" << std::endl;
+          return false;
+       }
+    }
+    return true;
+}
+
+// Write an output file in blocks, as the model does through its GRIB library
+static bool write_output(const std::string& filename, long nbytes, long step, const std::vector<char>& block) {
+    if (getenv("MOCK_GRIB") && atoi(getenv("MOCK_GRIB")) == 1) return write_grib_output(filename, nbytes, step);
+    FILE* output = fopen(filename.c_str(), "w");
+    if (output == NULL) return false;
+    for (long written = 0; written < nbytes; written += block.size()) {
+       size_t len = (size_t) std::min((long) block.size(), nbytes - written);
+       if (fwrite(block.data(), 1, len, output) != len) {
+          fclose(output);
+          return false;
+       }
+    }
+    return fclose(output) == 0;
+}
+
+// One line of ifs.stat to write, after 'secs' from the previous line, with the model's output files
+// for that step written first
+struct stat_event {
+    double      secs;
+    std::string line;            // ifs.stat line after the time column
+    std::string type;            // CNT3, STEPO, CNT0 ...
+    long        step;
+    std::vector<std::pair<std::string, long>> outputs;   // file name, size (bytes)
+};
+
+static std::string second_part(const std::string& exptid, long step) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s+%06ld", exptid.c_str(), step);
+    return buffer;
+}
+
+static std::string stat_line(const char* type, long step) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), " 0AAA00AAA %-5s %8ld   0:00.0   0.00000000000000E+00     0:00     0:00", type, step);
+    return buffer;
+}
+
+// Timeline of a model run with a fixed step time and output cadence
+static std::vector<stat_event> synthetic_timeline(const std::string& exptid, long nsteps, double step_secs,
+                                                  long output_every, long file_bytes) {
+    std::vector<stat_event> timeline;
+    timeline.push_back({0, stat_line("CNT3", -999), "CNT3", -999, {}});
+    for (long step = 0; step <= nsteps; step++) {
+       stat_event event = {step > 0 ? step_secs : 0, stat_line("STEPO", step), "STEPO", step, {}};
+       if (step % output_every == 0) {
+          for (const char* prefix : {"ICMGG", "ICMSH", "ICMUA"})
+             event.outputs.push_back({prefix + second_part(exptid, step), file_bytes});
+       }
+       timeline.push_back(event);
+    }
+    timeline.push_back({0, stat_line("CNT0", nsteps), "CNT0", nsteps, {}});
+    return timeline;
+}
+
+// Sizes of the output files from a listing, keyed by file name. Any line holding an ICMGG/ICMSH/ICMUA
+// file name is used, with the largest number on the line taken as the size.
+static std::map<std::string, long> read_output_sizes(const std::string& filename) {
+    std::map<std::string, long> sizes;
+    std::ifstream listing(filename);
+    std::string line, token;
+    while (std::getline(listing, line)) {
+       std::istringstream tokens(line);
+       std::string name;
+       long size = -1;
+       while (tokens >> token) {
+          std::string base = token.substr(token.find_last_of('/') + 1);
+          if (base.compare(0, 3, "ICM") == 0 && base.find('+') != std::string::npos)
+             name = base;
+          else if (token.find_first_not_of("0123456789") == std::string::npos)
+             size = std::max(size, atol(token.c_str()));
+       }
+       if (!name.empty() && size >= 0) sizes[name] = size;
+    }
+    return sizes;
+}
+
+// Timeline from a captured ifs.stat: the time column gives the interval between lines
+static std::vector<stat_event> replay_timeline(const std::string& replay_file, const std::string& sizes_file,
+                                               const std::string& exptid, double speedup, double max_gap,
+                                               long output_every, long file_bytes) {
+    std::vector<stat_event> timeline;
+    std::map<std::string, long> sizes;
+    if (!sizes_file.empty()) sizes = read_output_sizes(sizes_file);
+
+    std::ifstream replay(replay_file);
+    std::string line;
+    long last_time = -1;
+    while (std::getline(replay, line)) {
+       int hh, mm, ss, offset = 0;
+       char field[32], type[32];
+       long step;
+       if (sscanf(line.c_str(), " %d:%d:%d%n %31s %31s %ld", &hh, &mm, &ss, &offset, field, type, &step) != 6) continue;
+
+       long   now  = hh * 3600L + mm * 60L + ss;
+       double secs = 0;
+       if (last_time >= 0) {
+          secs = now - last_time;
+          if (secs < 0) secs += 86400;            // ifs.stat times wrap at midnight
+          secs /= speedup;
+          if (max_gap > 0) secs = std::min(secs, max_gap);
+       }
+       last_time = now;
+
+       stat_event event = {secs, line.substr(offset), type, step, {}};
+       if (event.type == "STEPO") {
+          for (const char* prefix : {"ICMGG", "ICMSH", "ICMUA"}) {
+             std::string name = prefix + second_part(exptid, step);
+             if (!sizes.empty()) {
+                if (sizes.count(name)) event.outputs.push_back({name, sizes[name]});
+             }
+             else if (step % output_every == 0) {
+                event.outputs.push_back({name, file_bytes});
+             }
+          }
+       }
+       timeline.push_back(event);
+    }
+    return timeline;
+}
+
+// Write a line of ifs.stat, with the current time in place of the time the line was captured
+static void write_stat(FILE* stat_file, const std::string& line) {
+    char   now[16];
+    time_t t = time(NULL);
+    strftime(now, sizeof(now), "%H:%M:%S", localtime(&t));
+    fprintf(stat_file, " %s%s\n", now, line.c_str());
+    fflush(stat_file);
+}
+
+// Keep the cpu busy until 'until', as the model's OpenMP threads do during a step
+static void busy_until(steady_clock::time_point until) {
+    volatile double x = 1.0;
+    while (steady_clock::now() < until) {
+       for (int i = 0; i < 10000; i++) x = x * 1.0000001 + 1.0e-9;
+    }
+}
+
+// A DrHook profile as the model writes it with DR_HOOK_OPT=prof, the wall time shared between a few routines
+static bool write_drhook_profile(double wall_secs, int nthreads, long ncalls) {
+    const char* profile = getenv("DR_HOOK_PROFILE");
+    std::string filename = std::string(profile && *profile ? profile : "drhook.prof") + ".1";
+    FILE* output = fopen(filename.c_str(), "w");
+    if (output == NULL) return false;
+    const std::vector<std::pair<const char*, double>> routines = {{"CLOUDSC", 0.30}, {"LAITQM", 0.20}, {"FTDIR", 0.15},
+                                                                  {"CPG", 0.15}, {"RADLSWR", 0.10}, {"SLCOMM", 0.10}};
+    fprintf(output, "Profiling information for program='oifs_43r3_model.exe', proc#1:\n");
+    fprintf(output, "    #  %% Time         Cumul         Self        Total     # of calls        Self       Total    Routine@<thread-id>\n");
+    double cumul = 0;
+    int rank = 1;
+    for (const auto& routine : routines) {
+       for (int t = 1; t <= nthreads; t++) {
+          double self = wall_secs * routine.second;
+          cumul += self;
+          fprintf(output, "%5d %8.2f %12.3f %12.3f %12.3f %11ld %12.2f %11.2f    *%s@%d\n", rank++, 100 * routine.second / nthreads,
+                  cumul, self, self, ncalls, 1000 * self / std::max(ncalls, 1L), 1000 * self / std::max(ncalls, 1L), routine.first, t);
+       }
+    }
+    return fclose(output) == 0;
+}
+
+int main(int argc, char** argv) {
+    std::string exptid = "gw3a";
+    for (int i = 1; i < argc - 1; i++) {
+       if (strcmp(argv[i], "-e") == 0) exptid = argv[i+1];
+    }
+
+    long   nsteps        = (long) env_value("MOCK_NSTEPS", 24);
+    double step_secs     = env_value("MOCK_STEP_SECS", 0.5);
+    long   output_every  = std::max((long) env_value("MOCK_OUTPUT_EVERY", 1), 1L);
+    long   file_bytes    = (long) env_value("MOCK_FILE_BYTES", 1 << 20);
+    double cpu_fraction  = std::min(std::max(env_value("MOCK_CPU_FRACTION", 0), 0.0), 1.0);
+    int    nthreads      = std::max((int) env_value("OMP_NUM_THREADS", 1), 1);
+    long   restart_every = (long) env_value("MOCK_RESTART_EVERY", 0);
+    long   restart_bytes = (long) env_value("MOCK_RESTART_BYTES", 0);
+    long   utstep        = std::max((long) env_value("MOCK_UTSTEP", 3600), 1L);
+    double speedup       = env_value("MOCK_SPEEDUP", 1);
+    double max_gap       = env_value("MOCK_MAX_GAP", 0);
+    const char* replay_file = getenv("MOCK_REPLAY");
+    const char* sizes_file  = getenv("MOCK_REPLAY_SIZES");
+
+    std::vector<stat_event> timeline;
+    if (replay_file && *replay_file) {
+       if (speedup <= 0) speedup = 1;
+       timeline = replay_timeline(replay_file, sizes_file ? sizes_file : "", exptid, speedup, max_gap, output_every, file_bytes);
+       if (timeline.empty()) {
+          cerr << "..mock model: no ifs.stat lines found in " << replay_file << std::endl;
+          return 1;
+       }
+    }
+    else {
+       timeline = synthetic_timeline(exptid, nsteps, step_secs, output_every, file_bytes);
+    }
+
+    // After a restart, continue from the line following the last restart point reached
+    size_t first = 0;
+    long   restart_step = -1;
+    std::ifstream restart_file("mock_restart");
+    if (restart_file >> restart_step) {
+       for (size_t i = 0; i < timeline.size(); i++) {
+          if (timeline[i].type == "STEPO" && timeline[i].step == restart_step) first = i + 1;
+       }
+    }
+    restart_file.close();
+    if (first > 0 && restart_bytes > 0 && !check_restart_set()) return 1;
+    for (const char* prefix : {"ICMGG", "ICMSH"}) {
+       struct stat st;
+       std::string init_file = prefix + exptid + "INIT";
+       if (stat(init_file.c_str(), &st) != 0) {
+          cerr << "..mock model: initial file " << init_file << " is missing" << std::endl;
+          return 1;
+       }
+    }
+
+    auto  run_start = steady_clock::now();
+    FILE* stat_file = fopen("ifs.stat", "w");
+    FILE* node_file = fopen("NODE.001_01", "w");
+    FILE* step_log  = fopen("mock_model.log", first > 0 ? "a" : "w");
+    if (stat_file == NULL || node_file == NULL || step_log == NULL) {
+       cerr << "..mock model: failed to open the output logs" << std::endl;
+       return 1;
+    }
+
+    std::vector<char> block(1 << 20, 'x');
+
+    fprintf(node_file, " MOCK OPENIFS: exptid %s, nthreads %d, %s\n", exptid.c_str(), nthreads,
+            replay_file && *replay_file ? replay_file : "synthetic timeline");
+    if (first > 0) {
+       fprintf(node_file, " MOCK OPENIFS: restarting from step %ld\n", restart_step);
+       write_stat(stat_file, timeline[0].line);
+    }
+
+    for (size_t i = first; i < timeline.size(); i++) {
+       const stat_event& event = timeline[i];
+       auto start = steady_clock::now();
+
+       if (event.secs > 0 && cpu_fraction > 0) {
+          auto busy_end = start + duration_cast<steady_clock::duration>(duration<double>(event.secs * cpu_fraction));
+          std::vector<std::thread> threads;
+          for (int t = 0; t < nthreads; t++) threads.emplace_back(busy_until, busy_end);
+          for (auto& t : threads) t.join();
+       }
+       std::this_thread::sleep_until(start + duration_cast<steady_clock::duration>(duration<double>(event.secs)));
+
+       // Output files are complete before the step is written to ifs.stat
+       for (auto& output : event.outputs) {
+          if (!write_output(output.first, output.second, event.step, block)) {
+             cerr << "..mock model: failed to write " << output.first << std::endl;
+             return 1;
+          }
+       }
+       write_stat(stat_file, event.line);
+
+       if (event.type == "STEPO") {
+          fprintf(node_file, " MOCK OPENIFS: step %ld complete\n", event.step);
+          fflush(node_file);
+          fprintf(step_log, "%.3f %ld\n", duration<double>(system_clock::now().time_since_epoch()).count(), event.step);
+          fflush(step_log);
+
+          if (restart_every > 0 && event.step > 0 && event.step % restart_every == 0) {
+             if (restart_bytes > 0 && !write_restart_set(event.step, utstep, restart_bytes, block)) {
+                cerr << "..mock model: failed to write the restart set" << std::endl;
+                return 1;
+             }
+             std::ofstream restart("mock_restart");
+             restart << event.step << '\n';
+          }
+       }
+    }
+
+    fclose(step_log);
+    fclose(node_file);
+    fclose(stat_file);
+
+    const char* drhook_opt = getenv("DR_HOOK_OPT");
+    if (drhook_opt && strstr(drhook_opt, "prof") && !write_drhook_profile(duration<double>(steady_clock::now() - run_start).count(),
+                                                                          nthreads, timeline.size())) {
+       cerr << "..mock model: failed to write the DrHook profile" << std::endl;
+       return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,462 @@
+#! /usr/bin/python3
+
+# Benchmark harness for the OpenIFS controller
+#
+# Runs the controller end-to-end against the mock model (bench/mock_model.cpp) and the fake BOINC
+# runtime (bench/fake_boinc.cpp), both built by 'make bench'. A client-like directory layout is
+# created in a scratch directory: a project directory holding the app, namelist and ancillary zips,
+# and a slot directory holding the BOINC soft link files. The controller is run in the slot and
+# the harness reports:
+#
+#   - wall time, and the controller's own cpu time and I/O (sampled from /proc, excluding the model)
+#   - the controller's phase timings and counters, from the oifs_metrics.json it writes in the slot
+#   - the latency from the model completing a step to the controller moving its output files
+#   - uploads and trickles seen by the fake BOINC runtime
+#
+# The controller checks the model's progress every 10 secs and moves the outputs of the step it sees completed,
+# so the mock model's steps are longer than that by default (11 secs): with shorter steps most outputs are left
+# in the slot. The default run, 8 steps with an upload every 2, makes 3 intermediate uploads and the final one
+# in about 90 secs.
+#
+# The results can be saved as JSON and compared against a previous run to catch regressions:
+#
+#   ./bench/run_bench.py --json base.json
+#   ./bench/run_bench.py --compare base.json --tolerance 0.2
+#
+# A captured ifs.stat from a volunteer's task can be replayed to reproduce its timeline of step
+# completions, faster than real time with --speedup; the harness warns when the speedup takes the steps
+# under the 10 sec poll. --restart-after kills the controller and model
+# part way through and relaunches them in the same slot, as after a client restart:
+#
+#   ./bench/run_bench.py --replay ifs.stat --replay-sizes unzip_l.txt --speedup 20 --restart-after 60
+
+import os, sys, json, time, signal, shutil, zipfile, argparse, subprocess, tempfile
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="End-to-end benchmark of the OpenIFS controller")
+    bench_dir = os.path.dirname(os.path.abspath(__file__))
+    parser.add_argument("--controller", default=os.path.join(bench_dir, "..", "oifs_43r3_1.00_bench"),
+                        help="controller built against the fake BOINC runtime")
+    parser.add_argument("--model", default=os.path.join(bench_dir, "oifs_43r3_model.exe"), help="mock model executable")
+    parser.add_argument("--workdir", default="", help="scratch directory, default a new temporary directory")
+    parser.add_argument("--keep", action="store_true", help="keep the scratch directory")
+    parser.add_argument("--fclen", type=int, default=1, help="forecast length (days)")
+    parser.add_argument("--utstep", type=int, default=10800, help="model timestep (secs)")
+    parser.add_argument("--step-secs", type=float, default=11.0,
+                        help="wall time of a mock model step (secs), longer than the controller's 10 sec poll for its outputs to be moved")
+    parser.add_argument("--output-every", type=int, default=1, help="model steps between output files")
+    parser.add_argument("--file-mb", type=float, default=1.0, help="size of each ICMGG/ICMSH/ICMUA file (MB)")
+    parser.add_argument("--cpu-fraction", type=float, default=0.0, help="fraction of each step the model threads are busy")
+    parser.add_argument("--upload-interval", type=int, default=2, help="model steps between intermediate uploads")
+    parser.add_argument("--nthreads", type=int, default=1, help="number of OpenMP threads")
+    parser.add_argument("--upload-delay", type=float, default=1.0, help="secs before the fake client completes an upload")
+    parser.add_argument("--standalone", action="store_true", help="run the controller in standalone mode")
+    parser.add_argument("--exptid", default="gw3a")
+    parser.add_argument("--replay", default="", help="captured ifs.stat to replay instead of a fixed step time")
+    parser.add_argument("--replay-sizes", default="", help="listing of the output files and sizes for the replay")
+    parser.add_argument("--speedup", type=float, default=1.0, help="replay faster than the captured timeline by this factor")
+    parser.add_argument("--max-gap", type=float, default=0, help="longest gap between replayed lines (secs), e.g. to skip suspends")
+    parser.add_argument("--grib", action="store_true", help="mock model writes GRIB fields rather than filler")
+    parser.add_argument("--output-manifest", default="", help="output manifest to include in the workunit")
+    parser.add_argument("--restart-mb", type=float, default=0, help="size of the restart set the mock model writes (MB)")
+    parser.add_argument("--restart-keep", type=int, default=-1, help="restart sets to keep, default the controller's")
+    parser.add_argument("--restart-compress", action="store_true", help="compress the newest restart set")
+    parser.add_argument("--upload-delta", action="store_true", help="delta encode the result files in the uploads")
+    parser.add_argument("--upload-target-mb", type=int, default=0, help="size targeted uploads (MB), default every upload interval")
+    parser.add_argument("--upload-max-latency-mins", type=int, default=-1, help="longest wait of a result file with --upload-target-mb")
+    parser.add_argument("--drhook-profile-fraction", type=float, default=0, help="fraction of tasks run with DrHook profiling")
+    parser.add_argument("--ram-staging-mb", type=int, default=0, help="stage the result files in memory, up to this (MB)")
+    parser.add_argument("--calibrate-steps", type=int, default=0, help="steps of the calibration run at the first start, default none")
+    parser.add_argument("--spool-high-mb", type=int, default=0, help="output spool high water mark (MB), default the controller's")
+    parser.add_argument("--restart-after", type=float, default=0, help="kill and relaunch the controller after this many secs")
+    parser.add_argument("--json", default="", help="write the results to this file")
+    parser.add_argument("--compare", default="", help="compare with the results of a previous run")
+    parser.add_argument("--tolerance", type=float, default=0.2, help="fractional increase reported as a regression")
+    return parser.parse_args()
+
+
+def make_zip(zip_path, files):
+    # files: dict of name -> contents, or name -> path of a file to add
+    with zipfile.ZipFile(zip_path, "w", zipfile.ZIP_DEFLATED) as zf:
+        for name, item in files.items():
+            if isinstance(item, str) and os.path.isfile(item):
+                zf.write(item, name)
+            else:
+                zf.writestr(name, item)
+
+
+def soft_link(path, target):
+    with open(path, "w") as f:
+        f.write("<soft_link>" + target + "</soft_link>\n")
+
+
+def create_layout(args, root, nuploads):
+    # Lay out the project and slot directories as the BOINC client would for a workunit
+    project_dir = os.path.join(root, "projects")
+    slot_dir = os.path.join(root, "slots", "0")
+    os.makedirs(project_dir)
+    os.makedirs(slot_dir)
+
+    app_zip = "oifs_43r3_app_" + args.version + "_x86_64-pc-linux-gnu.zip"
+    make_zip(os.path.join(project_dir, app_zip), {"oifs_43r3_model.exe": args.model})
+
+    namelist = "\n".join([
+        "!IFSDATA_FILE=ifsdata_00001",
+        "!IC_ANCIL_FILE=ic_ancil_00001",
+        "!CLIMATE_DATA_FILE=clim_data_00001",
+        "!HORIZ_RESOLUTION=159",
+        "!VERT_RESOLUTION=91",
+        "!GRID_TYPE=l_2",
+        "!UPLOAD_INTERVAL=%d" % args.upload_interval,
+        "!SPOOL_HIGH_WATER_MB=%d" % args.spool_high_mb if args.spool_high_mb > 0 else "!",
+        "!UPLOAD_DELTA=1" if args.upload_delta else "!",
+        "!UPLOAD_TARGET_MB=%d" % args.upload_target_mb if args.upload_target_mb > 0 else "!",
+        "!UPLOAD_MAX_LATENCY_MINS=%d" % args.upload_max_latency_mins if args.upload_max_latency_mins >= 0 else "!",
+        "!RESTART_KEEP=%d" % args.restart_keep if args.restart_keep >= 0 else "!",
+        "!RESTART_COMPRESS=1" if args.restart_compress else "!",
+        "!CALIBRATE_STEPS=%d" % args.calibrate_steps if args.calibrate_steps > 0 else "!",
+        "!RAM_STAGING_MB=%d" % args.ram_staging_mb if args.ram_staging_mb > 0 else "!",
+        "!DRHOOK_PROFILE_FRACTION=%g" % args.drhook_profile_fraction if args.drhook_profile_fraction > 0 else "!",
+        " &NAMRIP",
+        "   UTSTEP=%d.0," % args.utstep,
+        " /",
+        " &NAMCT0",
+        "   NFRRES=%d," % max(args.upload_interval, 1),
+        "   NFRPOS=%d," % args.output_every,
+        " /", ""])
+    wu_files = {"fort.4": namelist, "wam_namelist": "&NAWAM\n/\n"}
+    if args.output_manifest:
+        wu_files["output_manifest"] = os.path.abspath(args.output_manifest)
+    make_zip(os.path.join(project_dir, "bench_wu.zip"), wu_files)
+    make_zip(os.path.join(project_dir, "bench_ic_ancil.zip"), {"ICMGG" + args.exptid + "INIT": "ic", "ICMSH" + args.exptid + "INIT": "ic",
+                                                               "ICMGG" + args.exptid + "INIUA": "ic"})
+    make_zip(os.path.join(project_dir, "bench_ifsdata.zip"), {"rad_data": "ifsdata"})
+    make_zip(os.path.join(project_dir, "bench_clim.zip"), {"lsm": "climate"})
+
+    write_slot_links(args, slot_dir, nuploads)
+    return project_dir, slot_dir
+
+
+def write_slot_links(args, slot_dir, nuploads):
+    # The client writes the soft link files for the task's input and output files each time it starts the task
+    soft_link(os.path.join(slot_dir, "oifs_43r3_%s_2000010100_%d_1_00001.zip" % ("0001", args.fclen)), "../../projects/bench_wu.zip")
+    soft_link(os.path.join(slot_dir, "ic_ancil_00001.zip"), "../../projects/bench_ic_ancil.zip")
+    soft_link(os.path.join(slot_dir, "ifsdata_00001.zip"), "../../projects/bench_ifsdata.zip")
+    soft_link(os.path.join(slot_dir, "clim_data_00001.zip"), "../../projects/bench_clim.zip")
+    for i in range(nuploads):
+        soft_link(os.path.join(slot_dir, "upload_file_%d.zip" % i), "../../projects/bench_result_%d.zip" % i)
+
+
+def proc_sample(pid):
+    # Own cpu time (secs) and I/O of a process, excluding its children
+    sample = {}
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        ticks = os.sysconf("SC_CLK_TCK")
+        sample["cpu_user"] = int(fields[11]) / ticks
+        sample["cpu_system"] = int(fields[12]) / ticks
+        with open("/proc/%d/io" % pid) as f:
+            for line in f:
+                key, value = line.split(":")
+                sample[key] = int(value)
+    except (OSError, IndexError, ValueError):
+        pass
+    return sample
+
+
+def run_controller(args, project_dir, slot_dir, nsteps, nuploads):
+    env = dict(os.environ)
+    env.update({
+        "FAKE_BOINC_STANDALONE": "1" if args.standalone else "0",
+        "FAKE_BOINC_PROJECT_DIR": project_dir,
+        "FAKE_BOINC_APP_VERSION": "100",
+        "FAKE_BOINC_WU_NAME": "oifs_43r3_bench",
+        "FAKE_BOINC_UPLOAD_DELAY": str(args.upload_delay),
+        "FAKE_BOINC_LOG": os.path.join(slot_dir, "..", "..", "boinc_events.log"),
+        "MOCK_NSTEPS": str(nsteps),
+        "MOCK_STEP_SECS": str(args.step_secs),
+        "MOCK_OUTPUT_EVERY": str(args.output_every),
+        "MOCK_FILE_BYTES": str(int(args.file_mb * 1048576)),
+        "MOCK_CPU_FRACTION": str(args.cpu_fraction),
+        "MOCK_GRIB": "1" if args.grib else "0",
+        "MOCK_RESTART_EVERY": str(max(args.upload_interval, 1)),
+        "MOCK_RESTART_BYTES": str(int(args.restart_mb * 1048576)),
+        "MOCK_UTSTEP": str(args.utstep)})
+    if args.replay:
+        env.update({
+            "MOCK_REPLAY": os.path.abspath(args.replay),
+            "MOCK_REPLAY_SIZES": os.path.abspath(args.replay_sizes) if args.replay_sizes else "",
+            "MOCK_SPEEDUP": str(args.speedup),
+            "MOCK_MAX_GAP": str(args.max_gap)})
+
+    cmd = [os.path.abspath(args.controller), "2000010100", args.exptid, "0001", "1", "00001", str(args.fclen),
+           "oifs_43r3", str(args.nthreads), args.version]
+
+    # Poll the slot for the output files: the time each disappears is when the controller moved it.
+    # The controller is run in its own process group so that it can be killed along with the model.
+    moved = {}
+    present = set()
+    totals = {}
+    last_sample = {}
+    restarts = 0
+    start = time.time()
+    with open(os.path.join(slot_dir, "stdout.txt"), "w") as out, open(os.path.join(slot_dir, "stderr.txt"), "w") as err:
+        proc = subprocess.Popen(cmd, cwd=slot_dir, env=env, stdout=out, stderr=err, start_new_session=True)
+        while proc.poll() is None:
+            now = time.time()
+            files = set(f for f in os.listdir(slot_dir) if f.startswith("ICMGG" + args.exptid + "+"))
+            for f in present - files:
+                moved[f] = now
+            present = files
+            sample = proc_sample(proc.pid)
+            if sample:
+                last_sample = sample
+
+            if args.restart_after > 0 and restarts == 0 and now - start >= args.restart_after:
+                os.killpg(proc.pid, signal.SIGKILL)
+                proc.wait()
+                for key, value in last_sample.items():
+                    totals[key] = totals.get(key, 0) + value
+                last_sample = {}
+                restarts += 1
+                err.write("\n---- benchmark harness: controller killed and relaunched ----\n")
+                err.flush()
+                write_slot_links(args, slot_dir, nuploads)
+                proc = subprocess.Popen(cmd, cwd=slot_dir, env=env, stdout=out, stderr=err, start_new_session=True)
+            time.sleep(0.05)
+    wall = time.time() - start
+    for key, value in last_sample.items():
+        totals[key] = totals.get(key, 0) + value
+    return proc.returncode, wall, totals, moved, restarts
+
+
+def pickup_latency(slot_dir, moved, exptid):
+    # Time from the model writing a step to ifs.stat to the controller moving that step's output files
+    step_time = {}
+    log = os.path.join(slot_dir, "mock_model.log")
+    if os.path.exists(log):
+        with open(log) as f:
+            for line in f:
+                t, step = line.split()
+                step_time[int(step)] = float(t)
+    latency = []
+    for name, t in moved.items():
+        step = int(name.split("+")[1])
+        if step in step_time:
+            latency.append(t - step_time[step])
+    latency.sort()
+    if not latency:
+        return {}
+    return {"count": len(latency), "mean": sum(latency) / len(latency),
+            "p95": latency[min(int(0.95 * len(latency)), len(latency) - 1)], "max": latency[-1]}
+
+
+def boinc_events(events_log):
+    # Uploads, trickles and the progress reported to the fake client. A fraction done that goes
+    # backwards is a progress bar going backwards on the volunteer's machine.
+    events = {"uploads": 0, "trickles": 0, "upload_intervals": [], "fraction_done": 0.0, "fraction_backwards": 0}
+    last_upload = None
+    if os.path.exists(events_log):
+        with open(events_log) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) < 2:
+                    continue
+                if fields[1] == "upload_file":
+                    events["uploads"] += 1
+                    if last_upload is not None:
+                        events["upload_intervals"].append(round(float(fields[0]) - last_upload, 1))
+                    last_upload = float(fields[0])
+                elif fields[1] == "trickle":
+                    events["trickles"] += 1
+                elif fields[1] == "fraction_done" and len(fields) > 2:
+                    fraction = float(fields[2])
+                    if fraction < events["fraction_done"]:
+                        events["fraction_backwards"] += 1
+                    events["fraction_done"] = fraction
+    return events
+
+
+def replay_steps(replay_file):
+    # Last step in a captured ifs.stat
+    nsteps = 0
+    with open(replay_file) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) > 3 and fields[2] == "STEPO":
+                nsteps = max(nsteps, int(fields[3]))
+    return nsteps
+
+
+def replay_step_secs(replay_file, nsteps):
+    # Mean wall time of a step in a captured ifs.stat, from its time column (wrapping at midnight)
+    total, last = 0, None
+    with open(replay_file) as f:
+        for line in f:
+            fields = line.split()
+            hms = fields[0].split(":") if fields else []
+            if len(hms) != 3 or not all(x.isdigit() for x in hms):
+                continue
+            now = int(hms[0]) * 3600 + int(hms[1]) * 60 + int(hms[2])
+            if last is not None:
+                total += (now - last) % 86400
+            last = now
+    return total / max(nsteps, 1)
+
+
+def report(results):
+    print("Controller benchmark: %d steps, exit status %d" % (results["nsteps"], results["exit_status"]))
+    print("  %-28s %10.3f" % ("wall (secs)", results["wall"]))
+    print("  %-28s %10.3f" % ("controller cpu (secs)", results["controller_cpu"]))
+    for key in ("rchar", "wchar", "read_bytes", "write_bytes"):
+        if key in results["controller_io"]:
+            print("  %-28s %10.1f" % ("controller " + key + " (MB)", results["controller_io"][key] / 1048576))
+    latency = results["pickup_latency"]
+    if latency:
+        print("  %-28s %10.3f   p95 %.3f  max %.3f" % ("output pickup latency (secs)", latency["mean"], latency["p95"], latency["max"]))
+    print("  %-28s %10d   trickles %d" % ("uploads", results["boinc_events"]["uploads"], results["boinc_events"]["trickles"]))
+    print("  %-28s %10d" % ("outputs left in slot", results["outputs_left"]))
+    events = results["boinc_events"]
+    print("  %-28s %10.4f   backwards %d" % ("final fraction done", events["fraction_done"], events["fraction_backwards"]))
+    if events["upload_intervals"]:
+        print("  %-28s %s" % ("upload intervals (secs)", " ".join(str(i) for i in events["upload_intervals"])))
+    if results["restarts"]:
+        print("  %-28s %10d" % ("restarts", results["restarts"]))
+
+    metrics = results["metrics"]
+    if metrics:
+        print("Phases:")
+        for phase, value in sorted(metrics.get("phases", {}).items()):
+            print("  %-28s %10.4f   calls %d" % (phase, value["seconds"], value["calls"]))
+        print("Counters:")
+        for counter, value in sorted(metrics.get("counters", {}).items()):
+            print("  %-28s %10.0f" % (counter, value))
+        phases = metrics.get("phases", {})
+        counters = metrics.get("counters", {})
+        gauges = metrics.get("gauges", {})
+        if counters.get("model_stalls", 0) > 0:
+            print("  %-28s %10.1f" % ("model stalled by spool (secs)", gauges.get("model_stalled_secs", 0)))
+        if phases.get("move_outputs", {}).get("seconds", 0) > 0:
+            print("  %-28s %10.1f" % ("move throughput (MB/s)",
+                  counters.get("bytes_moved", 0) / 1048576 / phases["move_outputs"]["seconds"]))
+        if counters.get("grib_bytes_in", 0) > 0:
+            print("  %-28s %10.3f" % ("output manifest size ratio", counters.get("grib_bytes_out", 0) / counters["grib_bytes_in"]))
+        if counters.get("delta_bytes_in", 0) > 0:
+            print("  %-28s %10.3f" % ("delta encoding size ratio", counters.get("delta_bytes_out", 0) / counters["delta_bytes_in"]))
+
+
+def compare(results, baseline, tolerance):
+    # Report the figures that have grown by more than the tolerance. Small absolute times are ignored
+    # as they are dominated by noise. Returns the number of regressions.
+    checks = {"controller_cpu": results["controller_cpu"], "wall": results["wall"]}
+    for phase, value in results["metrics"].get("phases", {}).items():
+        checks["phase:" + phase] = value["seconds"]
+    if results["pickup_latency"]:
+        checks["pickup_latency"] = results["pickup_latency"]["mean"]
+
+    base = {"controller_cpu": baseline["controller_cpu"], "wall": baseline["wall"]}
+    for phase, value in baseline["metrics"].get("phases", {}).items():
+        base["phase:" + phase] = value["seconds"]
+    if baseline.get("pickup_latency"):
+        base["pickup_latency"] = baseline["pickup_latency"]["mean"]
+
+    regressions = 0
+    print("Comparison with baseline (tolerance %.0f%%):" % (100 * tolerance))
+    for key in sorted(checks):
+        if key not in base:
+            continue
+        old, new = base[key], checks[key]
+        flag = ""
+        if new > old * (1 + tolerance) and new - old > 0.01:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("  %-28s %10.4f -> %10.4f%s" % (key, old, new, flag))
+    return regressions
+
+
+def calibration_timed(slot_dir):
+    # Whether the controller's calibration run timed the model's steps
+    with open(os.path.join(slot_dir, "stderr.txt"), errors="replace") as f:
+        return any("Calibration run: " in line and "steps timed" in line for line in f)
+
+
+def main():
+    args = parse_args()
+    args.version = "1.00"
+
+    if args.replay:
+        # The forecast length and timestep must give the number of steps in the capture
+        nsteps = replay_steps(args.replay)
+        if nsteps == 0 or 86400 * args.fclen % nsteps != 0:
+            sys.exit("..replay: cannot find a timestep for %d steps in %d days, set --fclen" % (nsteps, args.fclen))
+        args.utstep = 86400 * args.fclen // nsteps
+        step_secs = replay_step_secs(args.replay, nsteps) / args.speedup
+        if args.max_gap > 0:
+            step_secs = min(step_secs, args.max_gap)
+        if step_secs < 10:
+            # The controller moves the outputs of the step it sees completed at its 10 sec poll
+            print("Warning: the replayed steps take %.1f secs, under the controller's 10 sec poll, most outputs will be "
+                  "left in the slot; use --speedup %.1f or less to have them moved" % (step_secs, step_secs * args.speedup / 10))
+    if 86400 * args.fclen % args.utstep != 0:
+        sys.exit("..utstep must divide the forecast length")
+    nsteps = 86400 * args.fclen // args.utstep
+    nuploads = nsteps // max(args.upload_interval, 1) + 2
+    if not args.replay and args.step_secs < 10:
+        print("Warning: the mock model's steps are under the controller's 10 sec poll, most outputs will be left in the slot")
+    if not args.replay and nsteps * args.step_secs < 20:
+        # The controller first reads ifs.stat after 10 secs, a shorter model run is not seen to complete
+        print("Warning: the mock model runs for less than 20 secs, the controller may not see it complete")
+
+    root = args.workdir or tempfile.mkdtemp(prefix="oifs_bench_")
+    if os.path.exists(os.path.join(root, "projects")):
+        shutil.rmtree(os.path.join(root, "projects"))
+        shutil.rmtree(os.path.join(root, "slots"))
+    project_dir, slot_dir = create_layout(args, root, nuploads)
+
+    exit_status, wall, sample, moved, restarts = run_controller(args, project_dir, slot_dir, nsteps, nuploads)
+
+    metrics = {}
+    metrics_file = os.path.join(slot_dir, "oifs_metrics.json")
+    if os.path.exists(metrics_file):
+        with open(metrics_file) as f:
+            metrics = json.load(f)
+
+    results = {
+        "nsteps": nsteps,
+        "replay": args.replay,
+        "restarts": restarts,
+        "exit_status": exit_status,
+        "wall": wall,
+        "controller_cpu": sample.get("cpu_user", 0) + sample.get("cpu_system", 0),
+        "controller_io": {k: v for k, v in sample.items() if not k.startswith("cpu_")},
+        "pickup_latency": pickup_latency(slot_dir, moved, args.exptid),
+        "boinc_events": boinc_events(os.path.join(root, "boinc_events.log")),
+        "outputs_left": len([f for f in os.listdir(slot_dir) if f.startswith(("ICMGG", "ICMSH", "ICMUA")) and "+" in f]),
+        "metrics": metrics}
+    report(results)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+    status = 0 if exit_status == 0 else 1
+    if args.calibrate_steps > 0 and not calibration_timed(slot_dir):
+        # The mock model fails without its initial files, so this also checks they were linked for the calibration
+        print("..The calibration run did not time the model, see the slot's stderr.txt")
+        status = 1
+    if args.compare:
+        with open(args.compare) as f:
+            if compare(results, json.load(f), args.tolerance):
+                status = 1
+
+    if args.keep or args.workdir:
+        print("Scratch directory: " + root)
+    else:
+        shutil.rmtree(root)
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
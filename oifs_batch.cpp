@@ -0,0 +1,393 @@
+//
+// Ensemble (batch) runner for the OpenIFS controller
+//
+// Outside BOINC, e.g. on a workstation or a cluster node, an ensemble is run as one controller per member, each in
+// its own slot. Started as
+//
+//    <controller> --batch <members file> <app_name> <app_version> [--cores N] [--memory-mb M]
+//
+// from a directory holding the projects folder of the standalone layout (the app, workunit and ancillary zips),
+// the runner makes a slot 'member_<wuid>' next to it for each member, with a soft link file for each zip in the
+// projects folder, and starts the controller there in standalone mode, with its output to 'controller.log'.
+//
+// The members file has one member per line, '#' starts a comment:
+//
+//    <start_date> <exptid> <umid> <batchid> <wuid> <fclen> [<nthreads> [<memory_mb>]]
+//
+// Members are started in the order of the file while their threads and memory fit in what is free, N cores
+// (default all) and M MB (default 90% of the physical memory). A member that does not fit lets later, smaller
+// members start ahead of it (backfill), but only a few times, so a wide member is not held back for ever by
+// narrower ones. Each member's controller is started in its own process group, and SIGINT or SIGTERM sent to
+// the runner stops them all. When all have finished the runner reports the members' wall times and the
+// throughput of the batch, and exits non-zero if any member failed.
+//
+// The ifsdata and climate data zips are the same for all the members of an ensemble. The runner points the
+// controllers to a shared staging folder (projects/staged, by the OIFS_SHARED_STAGING environment variable), where
+// the first member to need a zip unzips it, under a lock, and all the members link to its files rather than each
+// copying and unzipping it into its slot. The initial conditions (ic_ancil) differ between members, and are
+// staged by each controller as under BOINC.
+//
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "boinc/boinc_zip.h"
+#include "oifs_parse.h"
+#include "oifs_batch.h"
+
+using std::cerr;
+using namespace std::chrono;
+
+// Times the head of the queue can be passed over by later members that fit while it does not
+static const int batch_max_skips = 4;
+
+static volatile sig_atomic_t batch_stop = 0;
+
+static void batch_signal(int) {
+   batch_stop = 1;
+}
+
+
+bool batch_read_members(const std::string& filename, std::vector<batch_member>& members) {
+   //  Read the members file, one member per line: start_date exptid umid batchid wuid fclen [nthreads [memory_mb]]
+   //  Returns: false if the file could not be read or a line is not valid, which is reported.
+
+   std::ifstream input(filename);
+   if (!input.is_open()) {
+      cerr << "..Unable to open the members file: " << filename << std::endl;
+      return false;
+   }
+
+   std::string line;
+   int line_number = 0;
+   while (std::getline(input, line)) {
+      line_number++;
+      line = line.substr(0, line.find('#'));
+
+      std::istringstream fields(line);
+      std::vector<std::string> words;
+      std::string word;
+      while (fields >> word) words.push_back(word);
+      if (words.empty()) continue;
+
+      batch_member member;
+      int fclen;
+      bool ok = (words.size() >= 6 && words.size() <= 8 && oifs_parse_int(words[5], fclen) && fclen > 0);
+      if (ok && words.size() >= 7) ok = oifs_parse_int(words[6], member.nthreads) && member.nthreads > 0;
+      if (ok && words.size() == 8) {
+         int memory_mb;
+         ok = oifs_parse_int(words[7], memory_mb) && memory_mb >= 0;
+         member.memory_mb = memory_mb;
+      }
+      if (!ok) {
+         cerr << "..Line " << line_number << " of the members file is not valid: " << line << std::endl;
+         return false;
+      }
+      member.start_date = words[0];
+      member.exptid     = words[1];
+      member.umid       = words[2];
+      member.batchid    = words[3];
+      member.wuid       = words[4];
+      member.fclen      = words[5];
+
+      // The wuid names the member's slot and its results folder in projects
+      for (const batch_member& other : members) {
+         if (other.wuid == member.wuid) {
+            cerr << "..The wuid " << member.wuid << " is used by more than one member" << std::endl;
+            return false;
+         }
+      }
+      members.push_back(member);
+   }
+   return true;
+}
+
+
+bool batch_stage_shared(const std::string& zip, const std::string& folder) {
+   //  When the controller is run by the batch runner, stage a zip shared by the members by linking the files
+   //  unzipped from it in the shared staging folder into 'folder', unzipping it there first if no member has.
+   //  Returns: false if not run by the batch runner or the files could not be linked, the caller then copies
+   //           and unzips the zip itself.
+
+   const char* shared = getenv("OIFS_SHARED_STAGING");
+   if (shared == NULL || *shared == '\0') return false;
+
+   std::error_code ec;
+   std::filesystem::path cache = std::filesystem::path(shared) / std::filesystem::path(zip).stem();
+   std::filesystem::create_directories(shared, ec);
+
+   // The lock is held by the member unzipping, the others wait for it here
+   std::string lock_file = cache.string() + ".lock";
+   int lock = open(lock_file.c_str(), O_RDWR|O_CREAT, 0644);
+   if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+      cerr << "..Unable to lock the shared staging file: " << lock_file << std::endl;
+      if (lock >= 0) close(lock);
+      return false;
+   }
+   bool ok = std::filesystem::is_directory(cache, ec);
+   if (!ok) {
+      std::string tmp = cache.string() + ".tmp";
+      std::filesystem::remove_all(tmp, ec);
+      std::filesystem::create_directories(tmp, ec);
+      cerr << "Unzipping " << zip << " to the shared staging folder: " << cache.string() << '\n';
+      ok = (boinc_zip(UNZIP_IT, zip, tmp + "/") == 0) && (rename(tmp.c_str(), cache.c_str()) == 0);
+      if (!ok) {
+         cerr << "..Unzipping to the shared staging folder failed" << std::endl;
+         std::filesystem::remove_all(tmp, ec);
+      }
+   }
+   flock(lock, LOCK_UN);
+   close(lock);
+   if (!ok) return false;
+
+   for (const auto& entry : std::filesystem::directory_iterator(cache, ec)) {
+      std::filesystem::path link = std::filesystem::path(folder) / entry.path().filename();
+      std::error_code link_ec;
+      std::filesystem::create_symlink(entry.path(), link, link_ec);
+      if (link_ec && !std::filesystem::exists(link)) {
+         cerr << "..Unable to link the shared file: " << entry.path().string() << std::endl;
+         return false;
+      }
+   }
+   cerr << "Linked the shared files of " << zip << " into: " << folder << '\n';
+   return !ec;
+}
+
+
+static bool make_slot(const std::string& root, batch_member& member) {
+   //  Make the member's slot next to the projects folder, with a soft link file to each zip in projects, as
+   //  the BOINC client makes them for the workunit's input files
+
+   member.slot = root + "/member_" + member.wuid;
+   std::error_code ec;
+   std::filesystem::create_directories(member.slot, ec);
+   if (ec) {
+      cerr << "..Unable to make the slot directory: " << member.slot << std::endl;
+      return false;
+   }
+   for (const auto& entry : std::filesystem::directory_iterator(root + "/projects", ec)) {
+      if (!entry.is_regular_file() || entry.path().extension() != ".zip") continue;
+      std::string name = entry.path().filename();
+      std::ofstream link(member.slot + "/" + name);
+      link << "<soft_link>../projects/" << name << "</soft_link>\n";
+      if (!link) return false;
+   }
+   return !ec;
+}
+
+
+static pid_t start_member(const std::string& exe, const std::string& app_name, const std::string& app_version,
+                          const std::string& shared, batch_member& member) {
+   pid_t pid = fork();
+   if (pid == 0) {
+      setpgid(0, 0);
+      if (chdir(member.slot.c_str()) != 0) _exit(127);
+      int log = open("controller.log", O_WRONLY|O_CREAT|O_APPEND, 0644);
+      if (log >= 0) {
+         dup2(log, STDOUT_FILENO);
+         dup2(log, STDERR_FILENO);
+         close(log);
+      }
+      setenv("OIFS_SHARED_STAGING", shared.c_str(), 1);
+      std::string nthreads = std::to_string(member.nthreads);
+      execl(exe.c_str(), exe.c_str(), member.start_date.c_str(), member.exptid.c_str(), member.umid.c_str(),
+            member.batchid.c_str(), member.wuid.c_str(), member.fclen.c_str(), app_name.c_str(), nthreads.c_str(),
+            app_version.c_str(), (char*) NULL);
+      _exit(127);
+   }
+   if (pid > 0) {
+      // Also set here, so the group exists for a signal sent before the child has run
+      setpgid(pid, pid);
+      member.pid = pid;
+      member.start = steady_clock::now();
+   }
+   return pid;
+}
+
+
+int batch_main(int argc, char** argv) {
+   //  Run the members of an ensemble, see the top of this file.
+   //  Returns: the exit status of the runner, 0 if all the members succeeded.
+
+   if (argc < 5) {
+      cerr << "Usage: " << argv[0] << " --batch <members file> <app_name> <app_version> [--cores N] [--memory-mb M]" << std::endl;
+      return 1;
+   }
+   std::string members_file = argv[2], app_name = argv[3], app_version = argv[4];
+
+   int cores = std::max(1u, std::thread::hardware_concurrency());
+   long long memory_mb = (long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / (1024 * 1024) * 9 / 10;
+   for (int i = 5; i < argc; i++) {
+      std::string option = argv[i];
+      int value;
+      if (i + 1 < argc && oifs_parse_int(argv[i+1], value) && value > 0 && (option == "--cores" || option == "--memory-mb")) {
+         if (option == "--cores") cores = value;
+         else memory_mb = value;
+         i++;
+      }
+      else {
+         cerr << "..Unknown or invalid batch option: " << option << std::endl;
+         return 1;
+      }
+   }
+
+   std::vector<batch_member> members;
+   if (!batch_read_members(members_file, members)) return 1;
+   if (members.empty()) {
+      cerr << "..The members file has no members: " << members_file << std::endl;
+      return 1;
+   }
+
+   std::string root = std::filesystem::current_path();
+   if (!std::filesystem::is_directory(root + "/projects")) {
+      cerr << "..There is no projects folder in: " << root << std::endl;
+      return 1;
+   }
+   std::string shared = root + "/projects/staged";
+
+   // The controller is started again for each member, from its slot
+   std::error_code ec;
+   #ifdef __linux__
+      std::string exe = std::filesystem::canonical("/proc/self/exe", ec);
+   #else
+      std::string exe = std::filesystem::canonical(argv[0], ec);
+   #endif
+   if (ec) {
+      cerr << "..Unable to find the path of the controller: " << argv[0] << std::endl;
+      return 1;
+   }
+
+   cerr << "Running " << members.size() << " members on " << cores << " cores and " << memory_mb << " MB" << '\n';
+
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = batch_signal;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   std::deque<size_t> queue;
+   for (size_t i = 0; i < members.size(); i++) {
+      batch_member& member = members[i];
+      if (member.nthreads > cores || member.memory_mb > memory_mb) {
+         cerr << "..Member " << member.wuid << " needs more cores or memory than the batch has" << std::endl;
+         member.status = 1;
+      }
+      else {
+         queue.push_back(i);
+      }
+   }
+
+   auto batch_start = steady_clock::now();
+   int free_cores = cores, running = 0;
+   long long free_mb = memory_mb;
+   bool stopping = false;
+
+   // On SIGINT or SIGTERM no more members are started, and the running members are signalled
+   auto stop_members = [&]() {
+      if (!batch_stop || stopping) return;
+      cerr << "Stopping the batch, signalling the running members" << '\n';
+      stopping = true;
+      for (const batch_member& member : members) {
+         if (member.pid > 0 && member.status < 0) kill(-member.pid, SIGTERM);
+      }
+   };
+
+   while (!queue.empty() || running > 0) {
+      stop_members();
+
+      // Start the members that fit, in order, letting later members past the head of the queue while it
+      // has not been passed over too often
+      for (auto it = queue.begin(); !stopping && !batch_stop && it != queue.end();) {
+         batch_member& member = members[*it];
+         if (member.nthreads > free_cores || member.memory_mb > free_mb) {
+            if (it == queue.begin() && member.skipped >= batch_max_skips) break;
+            ++it;
+            continue;
+         }
+         if (it != queue.begin()) members[queue.front()].skipped++;
+         if (!make_slot(root, member) || start_member(exe, app_name, app_version, shared, member) < 0) {
+            cerr << "..Unable to start member " << member.wuid << std::endl;
+            member.status = 1;
+         }
+         else {
+            cerr << "Started member " << member.wuid << " in " << member.slot << " with " << member.nthreads
+                 << " threads, process id: " << member.pid << '\n';
+            free_cores -= member.nthreads;
+            free_mb    -= member.memory_mb;
+            running++;
+         }
+         it = queue.erase(it);
+      }
+      stop_members();
+      if (running == 0) break;
+
+      // Wait a second at a time for a member to finish, so a signal arriving outside the wait is acted on
+      int status;
+      pid_t pid = waitpid(-1, &status, WNOHANG);
+      if (pid == 0) {
+         std::this_thread::sleep_for(seconds(1));
+         continue;
+      }
+      if (pid < 0) {
+         if (errno != EINTR) break;
+         continue;
+      }
+
+      auto member = std::find_if(members.begin(), members.end(), [&](const batch_member& m) { return m.pid == pid; });
+      if (member == members.end()) continue;
+      member->status    = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      member->wall_secs = duration<double>(steady_clock::now() - member->start).count();
+      free_cores += member->nthreads;
+      free_mb    += member->memory_mb;
+      running--;
+      cerr << "Member " << member->wuid << (member->status == 0 ? " finished" : " failed, exit status " +
+              std::to_string(member->status)) << ", wall time " << (long) member->wall_secs << " secs" << '\n';
+   }
+   double batch_secs = duration<double>(steady_clock::now() - batch_start).count();
+
+   // Report the batch
+   int succeeded = 0, failed = 0, not_run = 0;
+   double days = 0, core_secs = 0;
+   cerr << "Batch summary:" << '\n';
+   for (const batch_member& member : members) {
+      if (member.status == 0) {
+         succeeded++;
+         days += std::stod(member.fclen);
+      }
+      else if (member.status > 0) {
+         failed++;
+      }
+      else {
+         not_run++;
+      }
+      core_secs += member.nthreads * member.wall_secs;
+      cerr << "  member " << member.wuid << " (" << member.exptid << " " << member.umid << "): "
+           << (member.status == 0 ? "succeeded" : member.status > 0 ? "failed" : "not run")
+           << ", " << member.nthreads << " threads, wall time " << (long) member.wall_secs << " secs" << '\n';
+   }
+   cerr << "  " << succeeded << " succeeded, " << failed << " failed, " << not_run << " not run, in "
+        << (long) batch_secs << " secs" << '\n';
+   if (batch_secs > 0) {
+      cerr << "  throughput: " << succeeded * 3600 / batch_secs << " members/hour, "
+           << days * 86400 / batch_secs << " simulated days/day, "
+           << 100 * core_secs / (cores * batch_secs) << "% of the cores used" << '\n';
+   }
+   return (failed > 0 || not_run > 0) ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+//
+// Ensemble (batch) runner for the OpenIFS controller: runs the members of an ensemble outside BOINC, sharing
+// the cores and memory of the machine, see oifs_batch.cpp
+//
+
+#ifndef OIFS_BATCH_H
+#define OIFS_BATCH_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/types.h>
+
+// One member of the ensemble, a line of the members file
+struct batch_member {
+    std::string start_date, exptid, umid, batchid, wuid, fclen;
+    int         nthreads = 1;
+    long        memory_mb = 0;                // memory the member needs, 0 = not limited
+
+    std::string slot;                         // slot directory of the member's controller
+    pid_t       pid = 0;                      // controller process, 0 = not started
+    int         status = -1;                  // exit status, -1 until the member has finished
+    int         skipped = 0;                  // times later members were started ahead of it
+    std::chrono::steady_clock::time_point start;
+    double      wall_secs = 0;
+};
+
+bool batch_read_members(const std::string&, std::vector<batch_member>&);
+bool batch_stage_shared(const std::string&, const std::string&);
+int  batch_main(int, char**);
+
+#endif
@@ -0,0 +1,192 @@
+//
+// Host calibration for the OpenIFS controller
+//
+// The controller starts a forecast with no idea how fast the host is. The fraction done reported to the client
+// moves on at each step the model completes, and between steps by a guess of the passes of the main loop a step
+// takes (70 / nthreads), so the progress bar and the client's estimate of the time left are poor until well into
+// the task, and worse at the higher resolutions.
+//
+// The wall time of a model step is kept per host in the project directory (oifs_host_calibration), for each model,
+// resolution, timestep and thread count, as a line
+//
+//    <key> <secs per step> <measurements> <time of the last, epoch secs>
+//
+// It is measured at the end of each task from the step times of its run, and smoothed over the tasks. With
+// !CALIBRATE_STEPS set in fort.4, a task whose key has no entry yet first runs the model for that many steps in a
+// scratch folder of the slot (calibration), in which the slot's inputs are linked and fort.4 is rewritten to stop
+// after those steps, and times them. The controller uses the entry to advance the fraction done between steps
+// and to log a prediction of the task's runtime.
+//
+// Tasks of the same project on the host share the cache, it is locked (oifs_host_calibration.lock) while it is
+// read and rewritten (to a '.tmp' file, renamed).
+//
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/file.h>
+#include "oifs_namelist.h"
+#include "oifs_calib.h"
+
+using namespace std;
+
+// Weight of a new measurement in the smoothed step time, once there are several
+static const double calib_weight = 0.3;
+
+// Files of the slot that are not inputs of the model and are not linked into the calibration folder, with the
+// model's outputs (see model_output)
+static const char* calib_skip[] = {"fort.4", "ifs.stat", "NODE.", "srf", "rcf", "waminfo", "stderr", "progress_file",
+                                   "oifs_", "staging_manifest", "boinc_"};
+
+
+std::string calib_key(const std::string& app_name, const std::string& resolution, int timestep, int nthreads) {
+   //  Key of the cache entry, e.g. oifs_43r3_255_4_L91_3600s_4t
+   return app_name + "_" + resolution + "_" + std::to_string(timestep) + "s_" + std::to_string(nthreads) + "t";
+}
+
+
+// Read the cache into its entries, an unreadable line is dropped
+static void calib_read(const std::string& cache_file, std::vector<host_calibration>& entries) {
+   std::ifstream input(cache_file);
+   std::string line;
+   while (std::getline(input, line)) {
+      std::istringstream fields(line);
+      host_calibration entry;
+      if (fields >> entry.key >> entry.secs_per_step >> entry.samples >> entry.updated && entry.secs_per_step > 0) {
+         entries.push_back(entry);
+      }
+   }
+}
+
+
+// Lock the cache for the caller to read and rewrite it, returns the lock's descriptor or -1
+static int calib_lock(const std::string& cache_file) {
+   std::string lock_file = cache_file + ".lock";
+   int lock = open(lock_file.c_str(), O_RDWR|O_CREAT, 0644);
+   if (lock < 0) return -1;
+   if (flock(lock, LOCK_EX) != 0) {
+      close(lock);
+      return -1;
+   }
+   return lock;
+}
+
+
+static void calib_unlock(int lock) {
+   flock(lock, LOCK_UN);
+   close(lock);
+}
+
+
+bool calib_lookup(const std::string& cache_file, const std::string& key, host_calibration& calibration) {
+   //  Look up the step time of 'key' in the cache.
+   //  Returns: false if the cache has no entry for it.
+
+   int lock = calib_lock(cache_file);
+   std::vector<host_calibration> entries;
+   calib_read(cache_file, entries);
+   if (lock >= 0) calib_unlock(lock);
+
+   for (const auto& entry : entries) {
+      if (entry.key == key) {
+         calibration = entry;
+         return true;
+      }
+   }
+   return false;
+}
+
+
+bool calib_record(const std::string& cache_file, const std::string& key, double secs_per_step) {
+   //  Add a measurement of the step time of 'key' to the cache. The first measurements are averaged, later
+   //  ones smoothed with a weight of 0.3, so the entry follows a change of the host's speed.
+   //  Returns: false if the cache could not be written.
+
+   if (secs_per_step <= 0) return false;
+   int lock = calib_lock(cache_file);
+   if (lock < 0) {
+      cerr << "..Unable to lock the host calibration: " << cache_file << std::endl;
+      return false;
+   }
+   std::vector<host_calibration> entries;
+   calib_read(cache_file, entries);
+   auto found = std::find_if(entries.begin(), entries.end(), [&](const host_calibration& e) { return e.key == key; });
+   if (found == entries.end()) {
+      entries.push_back(host_calibration());
+      found = entries.end() - 1;
+      found->key = key;
+   }
+   double weight = std::max(1.0 / (found->samples + 1), calib_weight);
+   found->secs_per_step = (1 - weight) * found->secs_per_step + weight * secs_per_step;
+   found->samples++;
+   found->updated = (long) time(NULL);
+
+   std::string tmpfile = cache_file + ".tmp";
+   bool ok;
+   {
+      std::ofstream output(tmpfile);
+      for (const auto& entry : entries) {
+         output << entry.key << ' ' << entry.secs_per_step << ' ' << entry.samples << ' ' << entry.updated << '\n';
+      }
+      output.flush();
+      ok = output.good();
+   }
+   ok = ok && rename(tmpfile.c_str(), cache_file.c_str()) == 0;
+   if (!ok) {
+      cerr << "..Unable to write the host calibration: " << cache_file << std::endl;
+      std::remove(tmpfile.c_str());
+   }
+   calib_unlock(lock);
+   return ok;
+}
+
+
+// Whether a file is an output of the model, ICM??<exptid>+<step>. The initial files, ICM??<exptid>INIT and
+// ICMGG<exptid>INIUA, are inputs.
+static bool model_output(const std::string& name, const std::string& exptid) {
+   return name.size() > 5 + exptid.size() && name.compare(0, 3, "ICM") == 0 &&
+          name.compare(5, exptid.size(), exptid) == 0 && name[5 + exptid.size()] == '+';
+}
+
+
+bool calib_prepare(const std::string& slot_path, const std::string& calib_dir, const std::string& exptid,
+                   const oifs_namelist& nml, int nsteps) {
+   //  Set up the calibration folder: a link to each input in the slot, and fort.4 rewritten to stop the model
+   //  after 'nsteps' steps.
+   //  Returns: false if the folder could not be set up.
+
+   std::error_code ec;
+   std::filesystem::remove_all(calib_dir, ec);
+   if (!std::filesystem::create_directories(calib_dir, ec)) return false;
+
+   std::string calib_name = std::filesystem::path(calib_dir).filename().string();
+   for (const auto& entry : std::filesystem::directory_iterator(slot_path, ec)) {
+      std::string name = entry.path().filename().string();
+      if (name == calib_name) continue;
+      bool skip = model_output(name, exptid);
+      for (const char* prefix : calib_skip) {
+         if (name.compare(0, strlen(prefix), prefix) == 0) skip = true;
+      }
+      if (skip) continue;
+      std::error_code link_ec;
+      std::filesystem::create_symlink(entry.path(), std::filesystem::path(calib_dir) / name, link_ec);
+      if (link_ec) {
+         cerr << "..Unable to link into the calibration folder: " << name << std::endl;
+         return false;
+      }
+   }
+   if (ec) return false;
+
+   oifs_namelist calib_nml = nml;
+   if (!namelist_set(calib_nml, "NAMRIP", "CUSTOP", "'t" + std::to_string(nsteps) + "'")) return false;
+   return namelist_write(calib_nml, calib_dir + "/fort.4");
+}
@@ -0,0 +1,24 @@
+//
+// Host calibration for the OpenIFS controller: the wall time of a model step on this host, measured by a short
+// run of the model before the forecast or by earlier tasks, and cached in the project directory, see oifs_calib.cpp
+//
+
+#ifndef OIFS_CALIB_H
+#define OIFS_CALIB_H
+
+#include <string>
+#include "oifs_namelist.h"
+
+struct host_calibration {
+    std::string key;                          // model, resolution, timestep and thread count measured
+    double      secs_per_step = 0;            // smoothed wall time of a model step, 0 if not known
+    int         samples = 0;                  // measurements (calibration runs and tasks) smoothed
+    long        updated = 0;                  // time of the last measurement, epoch secs
+};
+
+std::string calib_key(const std::string&, const std::string&, int, int);
+bool calib_lookup(const std::string&, const std::string&, host_calibration&);
+bool calib_record(const std::string&, const std::string&, double);
+bool calib_prepare(const std::string&, const std::string&, const std::string&, const oifs_namelist&, int);
+
+#endif
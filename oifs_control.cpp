@@ -0,0 +1,351 @@
+//
+// Control socket for the OpenIFS controller
+//
+// A running task could only be watched by tailing its stderr.txt, and only be stopped and started by the client's
+// suspend and resume. On a host running many tasks, an operator wanting to see how each is doing, or to ease the
+// I/O of the tasks on a busy disk, had to kill them. The controller serves a Unix-domain socket in the slot,
+// oifs_control.sock, readable and writable by the owner and group of the slot, taking one command a line:
+//
+//    status                            the task's state, a 'key value' line each: step, step rate, bytes waiting
+//                                      to upload, the model's last resource sample, the I/O settings, ...
+//    upload                            make an upload as soon as the upload files declared allow, rather than
+//                                      waiting for the upload interval or the size target (see oifs_plan.cpp)
+//    pause [mins]                      defer the I/O work: the upload zips and the restart housekeeping, for at
+//                                      most 'mins' (default 60). The model is still paused by the spool when the
+//                                      results waiting to upload reach its high water mark.
+//    resume                            resume the I/O work
+//    set <key> <value>                 change an I/O setting until the end of the run:
+//                                          zip_level 0-9, io_priority 0-7 or idle, spool_high_mb, spool_low_mb,
+//                                          upload_target_mb (0 to upload every upload interval),
+//                                          upload_max_latency_mins, log_rate_limit
+//    diag                              write the diagnostics bundle of a failed run (see oifs_diag.cpp) to the
+//                                      slot, without uploading it
+//    help                              list the commands
+//    quit                              close the connection, once the replies to the commands before it are sent
+//
+// Each reply ends with a line 'ok', or 'error <reason>'. For example:
+//
+//    echo status | socat - UNIX-CONNECT:slots/3/oifs_control.sock
+//
+// The socket is polled by the controller's main loop once a second without waiting, so a command is answered
+// within a second, but not while the controller is busy zipping an upload or the task is suspended by the client.
+// A few connections are served at once, and a connection sending a line longer than 4 KB is closed.
+//
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "oifs_parse.h"
+#include "oifs_log.h"
+#include "oifs_control.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const char* control_name = "oifs_control.sock";
+static const size_t control_max_clients = 4;
+static const size_t control_max_line = 4096;
+static const size_t control_max_output = 1 << 20;
+
+
+// Make a descriptor non-blocking and not inherited by the model
+static bool set_flags(int fd) {
+   int flags = fcntl(fd, F_GETFL);
+   if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) return false;
+#ifdef SO_NOSIGPIPE
+   int on = 1;
+   setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+   return fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+
+// Send what the client's replies it can without waiting. Returns false if the connection is lost.
+static bool flush_client(control_client& client) {
+   while (!client.output.empty()) {
+      ssize_t sent = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+      if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+      client.output.erase(0, sent);
+   }
+   return true;
+}
+
+
+static void drop_client(control_socket& control, size_t index) {
+   close(control.clients[index].fd);
+   control.clients.erase(control.clients.begin() + index);
+}
+
+
+bool control_open(control_socket& control, const std::string& folder) {
+   //  Serve the control socket, oifs_control.sock in 'folder', replacing one left by an earlier start.
+   //  Returns: false if the socket could not be made.
+
+   control = control_socket();
+   std::string path = folder + "/" + control_name;
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+
+   // A path too long for the address is bound relative to the working directory, when that is the folder
+   std::string bind_path = path;
+   if (bind_path.size() >= sizeof(addr.sun_path)) {
+      char cwd[PATH_MAX];
+      struct stat cwd_st, folder_st;
+      if (getcwd(cwd, sizeof(cwd)) == NULL || stat(cwd, &cwd_st) != 0 || stat(folder.c_str(), &folder_st) != 0 ||
+          cwd_st.st_dev != folder_st.st_dev || cwd_st.st_ino != folder_st.st_ino) return false;
+      bind_path = control_name;
+   }
+   strncpy(addr.sun_path, bind_path.c_str(), sizeof(addr.sun_path) - 1);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) return false;
+   unlink(path.c_str());
+   if (!set_flags(fd) || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, (int) control_max_clients) != 0) {
+      close(fd);
+      return false;
+   }
+   chmod(path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+   control.path      = path;
+   control.listen_fd = fd;
+   return true;
+}
+
+
+int control_poll(control_socket& control, std::vector<control_command>& commands) {
+   //  Accept new connections, read the lines sent and send the replies waiting, without waiting on any of them.
+   //  Connections that are closed, or send 'quit', are dropped once the replies to their commands are sent; the
+   //  lines after a 'quit' are not read.
+   //  Returns: the number of commands added to 'commands'.
+
+   commands.clear();
+   if (control.listen_fd < 0) return 0;
+
+   int fd;
+   while ((fd = accept(control.listen_fd, NULL, NULL)) >= 0) {
+      if (control.clients.size() >= control_max_clients || !set_flags(fd)) {
+         const char busy[] = "error too many connections\n";
+         send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+         close(fd);
+         continue;
+      }
+      control_client client;
+      client.fd = fd;
+      control.clients.push_back(client);
+   }
+
+   char buffer[4096];
+   for (size_t i = 0; i < control.clients.size(); ) {
+      control_client& client = control.clients[i];
+      bool open = true;
+      ssize_t received = 0;
+      while (!client.eof && (received = recv(client.fd, buffer, sizeof(buffer), 0)) > 0) client.input.append(buffer, received);
+      if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) open = false;
+
+      // A client that has sent all its commands (e.g. 'echo status | socat ...') still reads the replies, the
+      // connection is closed once they are sent
+      bool replied = client.eof && client.output.empty();
+      if (received == 0 && !client.eof) {
+         client.eof = true;
+         if (!client.input.empty() && client.input.back() != '\n') client.input += '\n';
+      }
+
+      size_t end;
+      while ((end = client.input.find('\n')) != std::string::npos) {
+         std::istringstream line(client.input.substr(0, end));
+         client.input.erase(0, end + 1);
+         control_command command;
+         command.client = client.fd;
+         std::string word;
+         if (!(line >> command.verb)) continue;
+         while (line >> word) command.args.push_back(word);
+         if (command.verb == "quit") {
+            client.eof = true;
+            client.input.clear();
+         }
+         commands.push_back(command);
+      }
+      if (client.input.size() > control_max_line) open = false;
+
+      if (open && !replied && flush_client(client)) {
+         i++;
+      } else {
+         drop_client(control, i);
+      }
+   }
+   return commands.size();
+}
+
+
+void control_reply(control_socket& control, int client_fd, const std::string& text) {
+   //  Send the reply to a command, its lines ending with a line 'ok' or 'error <reason>'. What cannot be sent
+   //  now is sent at the next poll.
+
+   for (size_t i = 0; i < control.clients.size(); i++) {
+      control_client& client = control.clients[i];
+      if (client.fd != client_fd) continue;
+      client.output += text;
+      if (text.empty() || text.back() != '\n') client.output += '\n';
+      if (!flush_client(client) || client.output.size() > control_max_output) drop_client(control, i);
+      return;
+   }
+}
+
+
+void control_close(control_socket& control) {
+   //  Close the connections and the socket, and remove it from the slot.
+
+   for (auto& client : control.clients) close(client.fd);
+   control.clients.clear();
+   if (control.listen_fd >= 0) close(control.listen_fd);
+   control.listen_fd = -1;
+   if (!control.path.empty()) unlink(control.path.c_str());
+   control.path.clear();
+}
+
+
+bool control_io_priority(const std::string& setting) {
+   //  Set the I/O priority of the controller's thread, and the threads it starts after (restart compression,
+   //  output filter), to a best-effort level, 0 (highest) to 7 (lowest), or 'idle'.
+   //  Returns: false if the setting is not known, or the I/O priority cannot be set on this host.
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+   const int who_process = 1, class_shift = 13, class_best_effort = 2, class_idle = 3;
+   int value;
+   if (setting == "idle") {
+      value = class_idle << class_shift;
+   } else if (setting.size() == 1 && setting[0] >= '0' && setting[0] <= '7') {
+      value = (class_best_effort << class_shift) | (setting[0] - '0');
+   } else {
+      return false;
+   }
+   return syscall(SYS_ioprio_set, who_process, 0, value) == 0;
+#else
+   (void) setting;
+   return false;
+#endif
+}
+
+
+void control_dispatch(control_socket& control, control_settings& settings, const control_command& command) {
+   //  Carry out a command sent to the control socket, changing 'settings', and reply to it. The commands changing
+   //  the task are logged, the queries are not.
+
+   std::ostringstream reply;
+   std::string value = (command.args.size() > 1) ? command.args[1] : "";
+   int number = 0;
+   output_spool&   spool   = settings.spool;
+   upload_planner& planner = settings.planner;
+
+   if (command.verb == "status") {
+      double pause_left = settings.io_paused ?
+                          std::chrono::duration<double>(settings.io_pause_end - std::chrono::steady_clock::now()).count() : 0;
+      reply << (settings.status ? settings.status() : "")
+            << "upload_requested " << planner.requested << '\n'
+            << "io_paused_secs " << (int) std::max(pause_left, 0.0) << '\n'
+            << "zip_level " << settings.zip_level << '\n'
+            << "io_priority " << settings.io_priority << '\n'
+            << "spool_high_mb " << (spool.high_water >> 20) << '\n'
+            << "spool_low_mb " << (spool.low_water >> 20) << '\n'
+            << "upload_target_mb " << (planner.target_bytes >> 20) << '\n'
+            << "upload_max_latency_mins " << (int) (planner.max_latency / 60) << '\n'
+            << "ok";
+   }
+   else if (command.verb == "upload") {
+      int upload_step = settings.upload_step ? settings.upload_step() : -1;
+      if (upload_step < 0) {
+         reply << "error only the final upload is left";
+      } else {
+         planner.requested = true;
+         reply << "upload_step " << upload_step << '\n' << "ok";
+      }
+   }
+   else if (command.verb == "pause") {
+      number = 60;
+      if (!command.args.empty() && (!oifs_parse_int(command.args[0], number) || number < 1 || number > 1440)) {
+         reply << "error the pause is 1 to 1440 mins";
+      } else {
+         settings.io_paused = true;
+         settings.io_pause_end = std::chrono::steady_clock::now() + std::chrono::minutes(number);
+         reply << "ok";
+      }
+   }
+   else if (command.verb == "resume") {
+      settings.io_paused = false;
+      reply << "ok";
+   }
+   else if (command.verb == "set") {
+      std::string key = command.args.empty() ? "" : command.args[0];
+      bool is_number = oifs_parse_int(value, number);
+      long long mb = (long long) number << 20;
+      if (key == "zip_level" && is_number && number >= 0 && number <= 9) settings.zip_level = number;
+      else if (key == "io_priority" && control_io_priority(value)) settings.io_priority = value;
+      else if (key == "spool_high_mb" && is_number && mb > spool.low_water) spool.high_water = mb;
+      else if (key == "spool_low_mb" && is_number && number >= 0 && mb < spool.high_water) spool.low_water = mb;
+      else if (key == "upload_target_mb" && is_number && number >= 0) planner.target_bytes = mb;
+      else if (key == "upload_max_latency_mins" && is_number && number >= 0) planner.max_latency = 60.0 * number;
+      else if (key == "log_rate_limit" && is_number && number >= 0) log_set_rate_limit(number);
+      else key.clear();
+      if (key.empty()) reply << "error unknown setting or value out of range, see help";
+      else reply << "ok";
+   }
+   else if (command.verb == "diag") {
+      std::string bundle_file = settings.diagnostics ? settings.diagnostics() : "";
+      if (!bundle_file.empty()) {
+         reply << "file " << bundle_file << '\n' << "ok";
+      } else {
+         reply << "error the diagnostics could not be written";
+      }
+   }
+   else if (command.verb == "help") {
+      reply << "status" << '\n'
+            << "upload" << '\n'
+            << "pause [mins]" << '\n'
+            << "resume" << '\n'
+            << "set zip_level|io_priority|spool_high_mb|spool_low_mb|upload_target_mb|upload_max_latency_mins|log_rate_limit <value>" << '\n'
+            << "diag" << '\n'
+            << "quit" << '\n'
+            << "ok";
+   }
+   else if (command.verb == "quit") {
+      // The connection is closed by control_poll once this reply is sent
+      reply << "ok";
+   }
+   else {
+      reply << "error unknown command " << command.verb << ", see help";
+   }
+
+   if (command.verb != "status" && command.verb != "help" && command.verb != "quit") {
+      std::string line = command.verb;
+      for (const std::string& arg : command.args) line += " " + arg;
+      std::cerr << "Control socket: " << line << ": " << reply.str().substr(reply.str().rfind('\n') + 1) << '\n';
+   }
+   control_reply(control, command.client, reply.str());
+}
+
+
+bool control_io_paused(control_settings& settings) {
+   //  Check whether the I/O work is paused, ending a pause that has lasted the time asked for.
+   //  Returns: true while the I/O work is paused.
+
+   if (settings.io_paused && std::chrono::steady_clock::now() >= settings.io_pause_end) {
+      std::cerr << "Resuming the I/O work, the pause asked for through the control socket has ended" << '\n';
+      settings.io_paused = false;
+   }
+   return settings.io_paused;
+}
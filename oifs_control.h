@@ -0,0 +1,57 @@
+//
+// Control socket for the OpenIFS controller: a Unix-domain socket in the slot taking one command a line, to query
+// the state of a running task and tune its I/O work, see oifs_control.cpp
+//
+
+#ifndef OIFS_CONTROL_H
+#define OIFS_CONTROL_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "oifs_spool.h"
+#include "oifs_plan.h"
+
+struct control_client {
+    int         fd = -1;
+    std::string input;                        // received, not yet a whole line
+    std::string output;                       // replies not yet sent
+    bool        eof = false;                  // the client has sent all it will send
+};
+
+struct control_socket {
+    std::string path;                         // socket in the slot, empty if not in use
+    int         listen_fd = -1;
+    std::vector<control_client> clients;
+};
+
+struct control_command {
+    int         client = -1;                  // client to reply to, see control_reply
+    std::string verb;
+    std::vector<std::string> args;
+};
+
+// The I/O settings the commands change, and what the controller provides to answer them, see control_dispatch
+struct control_settings {
+    output_spool&   spool;                    // its high and low water marks
+    upload_planner& planner;                  // its size target and latency, and uploads asked for
+    int&            zip_level;                // of the upload zips
+    std::string     io_priority = "default";
+    bool            io_paused = false;        // the upload zips and restart housekeeping are deferred
+    std::chrono::steady_clock::time_point io_pause_end;
+
+    std::function<std::string()> status;      // the task's state, 'key value' lines, for 'status'
+    std::function<int()>         upload_step; // first step an upload asked for can be made at, -1 if none
+    std::function<std::string()> diagnostics; // write the diagnostics bundle, returns its file, empty on failure
+};
+
+bool control_open(control_socket&, const std::string&);
+int  control_poll(control_socket&, std::vector<control_command>&);
+void control_reply(control_socket&, int, const std::string&);
+void control_close(control_socket&);
+bool control_io_priority(const std::string&);
+void control_dispatch(control_socket&, control_settings&, const control_command&);
+bool control_io_paused(control_settings&);
+
+#endif
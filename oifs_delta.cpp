@@ -0,0 +1,318 @@
+//
+// Delta encoding of the result files in an upload for the OpenIFS controller
+//
+// Consecutive ICMGG/ICMSH/ICMUA files of a run hold many GRIB fields that are identical from step to step, e.g.
+// the land-sea mask, orography and the slowly varying soil fields, but each file is deflated on its own in the
+// upload zip. With delta encoding on (the !UPLOAD_DELTA=1 directive in fort.4), the data of a field repeating one
+// in a file earlier in the same upload is stored as a reference to it, and a file with any such references is
+// zipped as '<file>.delta' in place of the file. References never point outside the zip, so each upload can be
+// decoded on its own, by oifs_upload_decode.py, which rebuilds the original files exactly.
+//
+// The messages' headers differ between steps (they hold the step), so only the data section onwards of each
+// message is matched, which is the bulk of the message. Data sections are matched by their CRC32 and length
+// (from the GRIB section lengths, see grib_index_buffer), and compared byte for byte before a reference is written.
+//
+// The .delta format, with integers big-endian:
+//
+//    "OIFSDLT1"
+//    'L' <length u64> <bytes>                                  bytes of the file as they are
+//    'R' <name length u16> <name> <offset u64> <length u64>    bytes at offset in the file 'name' in the same upload
+//    ...
+//    'E' <size u64> <crc32 u32>                                size and CRC32 (as zlib's) of the original file
+//
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "oifs_grib.h"
+#include "oifs_delta.h"
+
+
+// CRC32 tables for slicing-by-8, which takes the CRC of eight bytes per step: table k gives the CRC of a byte
+// followed by k zero bytes
+static uint32_t crc_tables[8][256];
+
+static bool init_crc_tables() {
+   for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xedb88320u : (c >> 1);
+      crc_tables[0][i] = c;
+   }
+   for (uint32_t i = 0; i < 256; i++) {
+      for (int t = 1; t < 8; t++)
+         crc_tables[t][i] = (crc_tables[t - 1][i] >> 8) ^ crc_tables[0][crc_tables[t - 1][i] & 0xff];
+   }
+   return true;
+}
+
+
+#if defined(__x86_64__)
+// CRC32 of blocks of 16 bytes, at least 64, by folding with carry-less multiplies (PCLMULQDQ), from Intel's "Fast
+// CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" with the constants for the bit-reflected
+// CRC32 polynomial. Takes and returns the CRC not inverted. Several times the speed of slicing-by-8.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char* buf, size_t len) {
+   alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+   alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+   alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+   alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+   __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+   // Fold 4 x 128 bits at a time
+   x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+   x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+   x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+   x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+   x0 = _mm_load_si128((const __m128i*) k1k2);
+   buf += 64;
+   len -= 64;
+   for (; len >= 64; buf += 64, len -= 64) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) (buf + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*) (buf + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*) (buf + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*) (buf + 0x30)));
+   }
+
+   // Fold into 128 bits, then 128 bits at a time
+   x0 = _mm_load_si128((const __m128i*) k3k4);
+   for (__m128i next : { x2, x3, x4 }) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+   }
+   for (; len >= 16; buf += 16, len -= 16) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*) buf)), x5);
+   }
+
+   // Fold 128 to 64 bits, and Barrett reduce to 32
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   x0 = _mm_load_si128((const __m128i*) poly);
+   x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+   x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+
+uint32_t oifs_crc32(uint32_t crc, const void* buffer, size_t len) {
+   //  Update a CRC32 (as zlib's crc32(), start from 0) with 'len' bytes. Uses carry-less multiplies on x86-64
+   //  cpus that have them, slicing-by-8 otherwise and for the bytes left over.
+   static const bool tables_ready = init_crc_tables();
+   (void) tables_ready;
+
+   const unsigned char* p = (const unsigned char*) buffer;
+   const uint32_t (*t)[256] = crc_tables;
+   crc = ~crc;
+#if defined(__x86_64__)
+   static const bool have_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+   if (have_pclmul && len >= 64) {
+      size_t blocks = len & ~(size_t) 15;
+      crc = crc32_pclmul(crc, p, blocks);
+      p += blocks;
+      len -= blocks;
+   }
+#endif
+   for (; len >= 8; p += 8, len -= 8) {
+      uint32_t a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+      uint32_t b = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+      crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+            t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+   }
+   while (len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+   return ~crc;
+}
+
+
+// A result file of the upload, memory mapped read only
+struct mapped_file {
+    std::string          path, name;
+    const unsigned char* data = nullptr;
+    size_t               size = 0;
+};
+
+static bool map_file(const std::string& path, mapped_file& file) {
+   file.path = path;
+   file.name = path.substr(path.find_last_of('/') + 1);
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return false;
+   }
+   void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) return false;
+   madvise(data, st.st_size, MADV_SEQUENTIAL);
+   file.data = (const unsigned char*) data;
+   file.size = st.st_size;
+   return true;
+}
+
+static void unmap_file(mapped_file& file) {
+   if (file.data) munmap((void*) file.data, file.size);
+   file.data = nullptr;
+}
+
+// A run of the file's bytes (literal), or a message's data found in an earlier file of the upload
+struct delta_record {
+    bool   ref;
+    size_t offset, length;      // in this file
+    int    file;                // the earlier file, for a reference
+    size_t file_offset;
+};
+
+static void put_uint(FILE* output, uint64_t value, int nbytes) {
+   for (int i = nbytes - 1; i >= 0; i--) fputc((value >> (8 * i)) & 0xff, output);
+}
+
+static bool write_delta(const std::string& filename, const mapped_file& file, const std::vector<delta_record>& records,
+                        const std::vector<mapped_file>& mapped, long long& size) {
+   std::string tmpfile = filename + ".tmp";
+   FILE* output = fopen(tmpfile.c_str(), "wb");
+   if (output == NULL) return false;
+
+   fwrite("OIFSDLT1", 1, 8, output);
+   for (const delta_record& record : records) {
+      if (record.ref) {
+         const std::string& name = mapped[record.file].name;
+         fputc('R', output);
+         put_uint(output, name.size(), 2);
+         fwrite(name.data(), 1, name.size(), output);
+         put_uint(output, record.file_offset, 8);
+         put_uint(output, record.length, 8);
+      }
+      else {
+         fputc('L', output);
+         put_uint(output, record.length, 8);
+         fwrite(file.data + record.offset, 1, record.length, output);
+      }
+   }
+   fputc('E', output);
+   put_uint(output, file.size, 8);
+   put_uint(output, oifs_crc32(0, file.data, file.size), 4);
+
+   size = ftell(output);
+   bool failed = ferror(output);
+   if (fclose(output) != 0 || failed || rename(tmpfile.c_str(), filename.c_str()) != 0) {
+      std::remove(tmpfile.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+bool delta_encode_upload(std::vector<std::string>& files, std::vector<std::string>& replaced, delta_stats& stats) {
+   //  Delta encode the GRIB files in the list of files for an upload zip. A file with fields whose data repeat
+   //  those of a file earlier in the list is written as '<file>.delta', which takes its place in the list, and the
+   //  file is added to 'replaced' to be deleted once the zip is made. Other files are left in the list as they are.
+   //  A .delta file already in the list was left by an upload that was interrupted, and is dropped from it.
+   //  Returns: false if a .delta file could not be written, the list is then unchanged.
+
+   std::vector<mapped_file> mapped;
+   std::unordered_map<uint64_t, std::pair<int, size_t>> seen;     // CRC32 and length -> file and offset of the first copy
+   std::vector<std::string> upload, encoded;
+   std::vector<grib_index_entry> index;
+   std::vector<delta_record> records;
+   delta_stats upload_stats;
+   bool ok = true;
+
+   for (const std::string& path : files) {
+      if (path.size() > 6 && path.compare(path.size() - 6, 6, ".delta") == 0) continue;
+
+      mapped_file file;
+      if (!map_file(path, file) || !grib_index_buffer(file.data, file.size, index) || index.empty()) {
+         unmap_file(file);
+         upload.push_back(path);
+         continue;
+      }
+      int this_file = mapped.size();
+      mapped.push_back(file);
+      upload_stats.files++;
+      upload_stats.bytes_in += file.size;
+
+      records.clear();
+      bool shared = false;
+      for (const grib_index_entry& msg : index) {
+         upload_stats.messages++;
+         size_t data = msg.offset + msg.data_offset, length = msg.length - msg.data_offset;
+         size_t literal = msg.length;
+         uint64_t key = ((uint64_t) oifs_crc32(0, file.data + data, length) << 32) ^ length;
+         auto first = seen.emplace(key, std::make_pair(this_file, data));
+         if (!first.second) {
+            int other = first.first->second.first;
+            size_t other_offset = first.first->second.second;
+            if (other != this_file && memcmp(mapped[other].data + other_offset, file.data + data, length) == 0) {
+               literal = msg.data_offset;
+               upload_stats.messages_shared++;
+               shared = true;
+            }
+         }
+
+         // The message's header, or all of it if its data is not shared, extends a run of literal bytes
+         if (!records.empty() && !records.back().ref)
+            records.back().length += literal;
+         else
+            records.push_back({false, msg.offset, literal, -1, 0});
+         if (literal < msg.length) records.push_back({true, data, length, first.first->second.first, first.first->second.second});
+      }
+
+      if (!shared) {
+         upload.push_back(path);
+         upload_stats.bytes_out += file.size;
+         continue;
+      }
+      long long size = 0;
+      if (!write_delta(path + ".delta", file, records, mapped, size)) {
+         ok = false;
+         break;
+      }
+      upload.push_back(path + ".delta");
+      encoded.push_back(path);
+      upload_stats.encoded++;
+      upload_stats.bytes_out += size;
+   }
+
+   for (mapped_file& file : mapped) unmap_file(file);
+   if (!ok) {
+      for (const std::string& path : encoded) std::remove((path + ".delta").c_str());
+      return false;
+   }
+
+   files = upload;
+   replaced.insert(replaced.end(), encoded.begin(), encoded.end());
+   stats.files           += upload_stats.files;
+   stats.encoded         += upload_stats.encoded;
+   stats.messages        += upload_stats.messages;
+   stats.messages_shared += upload_stats.messages_shared;
+   stats.bytes_in        += upload_stats.bytes_in;
+   stats.bytes_out       += upload_stats.bytes_out;
+   return true;
+}
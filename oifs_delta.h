@@ -0,0 +1,21 @@
+//
+// Delta encoding of the result files in an upload for the OpenIFS controller, see oifs_delta.cpp
+//
+
+#ifndef OIFS_DELTA_H
+#define OIFS_DELTA_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct delta_stats {
+    long      files = 0, encoded = 0;
+    long      messages = 0, messages_shared = 0;
+    long long bytes_in = 0, bytes_out = 0;
+};
+
+uint32_t oifs_crc32(uint32_t, const void*, size_t);
+bool delta_encode_upload(std::vector<std::string>&, std::vector<std::string>&, delta_stats&);
+
+#endif
@@ -0,0 +1,129 @@
+//
+// Diagnostics of a failed run for the OpenIFS controller
+//
+// When the model stops the controller prints the last lines of its logs (NODE.001_01, ifs.stat, rcf, waminfo and
+// the progress file) to stderr. NODE.001_01 grows through the run, to hundreds of MB for a long forecast, and was
+// read line by line to keep its last 70. tail_lines() reads a file backwards from its end, 64 kB at a time with
+// pread(), until it has the lines asked for, so the cost depends on the lines read, not the size of the file. At
+// most 4 MB is read, for files with very long lines.
+//
+// When the model fails, the controller puts together a bundle of what is needed to find out why: the reason, the
+// last resource sample of the model, and the last lines of the model's logs, the progress file, the performance
+// log and the controller's own log. The bundle is written gzipped to the slot, as
+//
+//    ==> <title> <==
+//    <text>
+//
+// for each part, and the controller zips it as the task's next upload, so a failed task returns it to the
+// project rather than only the few lines of stderr the client reports.
+//
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "oifs_diag.h"
+
+static const size_t tail_chunk = 65536;
+static const off_t  tail_max_bytes = 4 << 20;
+
+
+int tail_lines(const std::string& path, int nlines, std::string& tail) {
+   //  Read the last 'nlines' lines of a file into 'tail', reading backwards from its end.
+   //  Returns: the number of lines read, may be less than nlines, or -1 if the file could not be read.
+
+   tail.clear();
+   if (nlines <= 0) return 0;
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) return -1;
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      close(fd);
+      return -1;
+   }
+
+   // Chunks read from the end, the last first
+   std::vector<std::string> chunks;
+   off_t  pos = st.st_size, limit = std::max((off_t) 0, st.st_size - tail_max_bytes);
+   size_t start = std::string::npos;          // start of the lines in the last chunk read
+   int    count = 0;
+   bool   skip_newline = true;                // the newline ending the file does not start a line
+   while (pos > limit && start == std::string::npos) {
+      size_t n = std::min((off_t) tail_chunk, pos - limit);
+      std::string chunk(n, '\0');
+      ssize_t got = pread(fd, &chunk[0], n, pos - n);
+      if (got < 0 && errno == EINTR) continue;
+      if (got != (ssize_t) n) break;
+      pos -= n;
+      for (size_t i = n; i-- > 0;) {
+         if (chunk[i] != '\n') {
+            skip_newline = false;
+            continue;
+         }
+         if (skip_newline) {
+            skip_newline = false;
+            continue;
+         }
+         if (++count == nlines) {
+            start = i + 1;
+            break;
+         }
+      }
+      chunks.push_back(std::move(chunk));
+   }
+   close(fd);
+
+   if (chunks.empty()) return 0;
+   if (start == std::string::npos) {
+      // The whole file was read (or 4 MB of it), its first line is counted too
+      start = 0;
+      if (!skip_newline) count++;
+   }
+   tail.append(chunks.back(), start, std::string::npos);
+   for (size_t i = chunks.size() - 1; i-- > 0;) tail.append(chunks[i]);
+   return count;
+}
+
+
+void diag_add_text(diag_bundle& bundle, const std::string& title, const std::string& text) {
+   bundle.sections.emplace_back(title, text);
+}
+
+
+bool diag_add_tail(diag_bundle& bundle, const std::string& path, int nlines) {
+   //  Add the last lines of a file to the bundle, titled by the file's name.
+   //  Returns: false if the file could not be read, it is then left out.
+
+   std::string tail;
+   if (tail_lines(path, nlines, tail) < 0) return false;
+   bundle.sections.emplace_back(path.substr(path.find_last_of('/') + 1), tail);
+   return true;
+}
+
+
+bool diag_write(const diag_bundle& bundle, const std::string& path) {
+   //  Write the bundle gzipped to 'path', through a temporary file.
+   //  Returns: false if it could not be written.
+
+   std::string tmpfile = path + ".tmp";
+   gzFile output = gzopen(tmpfile.c_str(), "wb6");
+   if (output == NULL) return false;
+   bool ok = true;
+   for (const auto& section : bundle.sections) {
+      std::string text = "==> " + section.first + " <==\n" + section.second;
+      if (text.back() != '\n') text.push_back('\n');
+      text.push_back('\n');
+      if (gzwrite(output, text.data(), text.size()) != (int) text.size()) ok = false;
+   }
+   if (gzclose(output) != Z_OK) ok = false;
+   if (!ok || rename(tmpfile.c_str(), path.c_str()) != 0) {
+      std::remove(tmpfile.c_str());
+      return false;
+   }
+   return true;
+}
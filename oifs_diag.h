@@ -0,0 +1,22 @@
+//
+// Diagnostics of a failed run for the OpenIFS controller: the last lines of the model's logs, read from the end of
+// each file, and a compressed bundle of them uploaded with the failed task, see oifs_diag.cpp
+//
+
+#ifndef OIFS_DIAG_H
+#define OIFS_DIAG_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+struct diag_bundle {
+    std::vector<std::pair<std::string, std::string>> sections;   // title and text of each part of the bundle
+};
+
+int  tail_lines(const std::string&, int, std::string&);
+void diag_add_text(diag_bundle&, const std::string&, const std::string&);
+bool diag_add_tail(diag_bundle&, const std::string&, int);
+bool diag_write(const diag_bundle&, const std::string&);
+
+#endif
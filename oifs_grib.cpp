@@ -0,0 +1,641 @@
+//
+// GRIB output subsetting and repacking for the OpenIFS controller
+//
+// The model writes every field requested by the workunit's fullpos namelist to the ICMGG/ICMSH/ICMUA files,
+// and these are uploaded whole. A workunit can instead include an output manifest (file 'output_manifest' in
+// the workunit zip) listing the fields to keep and the precision to keep them at. After the result files are
+// moved out of the slot, and before they are zipped, each file is rewritten keeping only the fields selected
+// and with the selected fields repacked to fewer bits per value.
+//
+// The files are processed with a built-in walker of the GRIB sections rather than eccodes, as only the
+// eccodes definitions and samples are shipped with the model, not the library. It handles the GRIB editions
+// 1 and 2 messages written by OpenIFS 43r3. Repacking is only done for simple packing (grid point fields);
+// fields with other packings, e.g. the spectral fields in ICMSH, are kept as they are.
+//
+// Each processed file also gets an index, '<file>.idx', with the offset, length and identification of each of
+// its GRIB messages, found from the section lengths without decoding the data. The index is uploaded with the
+// file so fields can be extracted on the server without decoding the whole file. As only the section headers
+// are read, the scan runs at memory speed on a memory mapped file.
+//
+// Repacking to fewer bits keeps the reference value and decimal scale and raises the binary scale factor:
+// each packed value X becomes round(X / 2^shift), so no floating point decoding is needed.
+//
+// Manifest format, one rule per line, '#' starts a comment:
+//
+//    keep  param=130,131,132 levtype=pl level=500,850     fields to keep; if there are no 'keep' rules all
+//    keep  param=167,151,164 levtype=sfc                  fields are kept unless dropped
+//    drop  param=0.1.0                                    fields to drop (GRIB2 discipline.category.number)
+//    bits  12 param=130 levtype=pl                        repack to 12 bits per value, the first match applies
+//    bits  16                                             (a rule with no selection matches every field)
+//    files ICMGG,ICMUA                                    output files to process, default ICMGG,ICMSH,ICMUA
+//    threads 2                                            most threads to use, default all idle cpus
+//
+// param is the ECMWF paramId; the model level fields that OpenIFS writes in GRIB2 are also matched by their
+// paramId. levtype is sfc, pl, ml, pt or pv, or the GRIB level type code. level is in hPa for pl.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "oifs_grib.h"
+
+using namespace std;
+
+
+// Fields OpenIFS writes in GRIB2 (model level fields) by their ECMWF paramId
+static const std::map<std::string, std::string> grib2_params = {
+    {"129", "0.3.4"},   {"130", "0.0.0"},   {"131", "0.2.2"},   {"132", "0.2.3"},   {"133", "0.1.0"},
+    {"135", "0.2.8"},   {"138", "0.2.12"},  {"155", "0.2.13"},  {"157", "0.1.1"},   {"246", "0.1.83"},
+    {"247", "0.1.84"} };
+
+// A GRIB message found by scan_message(): its identification, and where its data sections are
+struct grib_message {
+    grib_index_entry field;
+    size_t bds;                 // GRIB1 binary data section
+    size_t sec5, sec7;          // GRIB2 data representation and data sections
+    int    nfields;             // GRIB2 fields in the message
+};
+
+static inline unsigned long get_uint(const unsigned char* p, int nbytes) {
+   unsigned long value = 0;
+   for (int i = 0; i < nbytes; i++) value = (value << 8) | p[i];
+   return value;
+}
+
+static inline void put_uint(unsigned char* p, int nbytes, unsigned long long value) {
+   for (int i = nbytes - 1; i >= 0; i--) {
+      p[i] = value & 0xff;
+      value >>= 8;
+   }
+}
+
+// GRIB uses sign and magnitude for signed integers
+static inline long get_signed(const unsigned char* p, int nbytes) {
+   long magnitude = get_uint(p, nbytes) & ~(1UL << (8 * nbytes - 1));
+   return (p[0] & 0x80) ? -magnitude : magnitude;
+}
+
+static inline void put_signed(unsigned char* p, int nbytes, long value) {
+   put_uint(p, nbytes, (unsigned long) labs(value));
+   if (value < 0) p[0] |= 0x80;
+}
+
+static std::string levtype_name(int edition, int code) {
+   static const std::map<int, std::string> grib1 = {{1, "sfc"}, {100, "pl"}, {109, "ml"}, {113, "pt"}, {117, "pv"}};
+   static const std::map<int, std::string> grib2 = {{1, "sfc"}, {100, "pl"}, {105, "ml"}, {107, "pt"}, {109, "pv"}};
+   const std::map<int, std::string>& names = (edition == 1) ? grib1 : grib2;
+   auto name = names.find(code);
+   return (name == names.end()) ? std::to_string(code) : name->second;
+}
+
+
+static bool selector_matches(const grib_selector& select, const grib_index_entry& field) {
+   if (!select.params.empty() &&
+       std::find(select.params.begin(), select.params.end(), field.param) == select.params.end()) return false;
+   if (!select.levtypes.empty() &&
+       std::find(select.levtypes.begin(), select.levtypes.end(), field.levtype) == select.levtypes.end() &&
+       std::find(select.levtypes.begin(), select.levtypes.end(), std::to_string(field.levtype_code)) == select.levtypes.end()) return false;
+   if (!select.levels.empty() &&
+       std::find(select.levels.begin(), select.levels.end(), field.level) == select.levels.end()) return false;
+   return true;
+}
+
+// Whether to keep a field, and the bits per value to repack it to (0 = leave as it is)
+static bool field_wanted(const grib_manifest& manifest, const grib_index_entry& field, int& bits) {
+   bool keep = !manifest.has_keep;
+   bits = 0;
+   for (const grib_rule& rule : manifest.rules) {
+      if (!selector_matches(rule.select, field)) continue;
+      if (rule.action == grib_rule::DROP) return false;
+      if (rule.action == grib_rule::KEEP) keep = true;
+      if (rule.action == grib_rule::BITS && bits == 0) bits = rule.bits;
+   }
+   return keep;
+}
+
+
+static std::vector<std::string> split_list(const std::string& list) {
+   std::vector<std::string> items;
+   std::string item;
+   std::istringstream tokens(list);
+   while (std::getline(tokens, item, ',')) {
+      if (!item.empty()) items.push_back(item);
+   }
+   return items;
+}
+
+bool grib_read_manifest(const std::string& filename, grib_manifest& manifest) {
+   //  Read the output manifest. Lines that cannot be understood are reported and ignored.
+   //  Returns: false if the manifest could not be read.
+
+   std::ifstream input(filename);
+   if (!input.is_open()) {
+      cerr << "..Unable to open the output manifest: " << filename << std::endl;
+      return false;
+   }
+
+   manifest = grib_manifest();
+   std::string line, action, token;
+   int lineno = 0;
+   while (std::getline(input, line)) {
+      lineno++;
+      line = line.substr(0, line.find('#'));
+      std::istringstream tokens(line);
+      if (!(tokens >> action)) continue;
+
+      if (action == "files" || action == "threads") {
+         tokens >> token;
+         if (action == "files") manifest.files = split_list(token);
+         else manifest.max_threads = atoi(token.c_str());
+         continue;
+      }
+
+      grib_rule rule;
+      if (action == "keep") {
+         rule.action = grib_rule::KEEP;
+         manifest.has_keep = true;
+      }
+      else if (action == "drop") {
+         rule.action = grib_rule::DROP;
+      }
+      else if (action == "bits") {
+         rule.action = grib_rule::BITS;
+         if (!(tokens >> rule.bits) || rule.bits < 1 || rule.bits > 32) {
+            cerr << "..Output manifest line " << lineno << ": expected bits per value 1-32, ignored: " << line << std::endl;
+            continue;
+         }
+      }
+      else {
+         // e.g. 'packing ccsds': CCSDS packing needs libaec, which is not available to the controller
+         cerr << "..Output manifest line " << lineno << ": unsupported rule, ignored: " << line << std::endl;
+         continue;
+      }
+
+      bool valid = true;
+      while (tokens >> token) {
+         size_t eq = token.find('=');
+         std::string key = token.substr(0, eq);
+         std::vector<std::string> values = (eq == std::string::npos) ? std::vector<std::string>() : split_list(token.substr(eq + 1));
+         if (key == "param") {
+            for (auto& param : values) {
+               rule.select.params.push_back(param);
+               auto grib2 = grib2_params.find(param);
+               if (grib2 != grib2_params.end()) rule.select.params.push_back(grib2->second);
+            }
+         }
+         else if (key == "levtype") {
+            rule.select.levtypes = values;
+         }
+         else if (key == "level") {
+            for (auto& level : values) rule.select.levels.push_back(atol(level.c_str()));
+         }
+         else {
+            valid = false;
+         }
+      }
+      if (!valid) {
+         cerr << "..Output manifest line " << lineno << ": unknown selection, ignored: " << line << std::endl;
+         continue;
+      }
+      manifest.rules.push_back(rule);
+   }
+
+   if (manifest.files.empty()) manifest.files = {"ICMGG", "ICMSH", "ICMUA"};
+   return true;
+}
+
+
+bool grib_manifest_applies(const grib_manifest& manifest, const std::string& filename) {
+   //  Whether an output file is one the manifest processes, by the prefix of its name
+   std::string base = filename.substr(filename.find_last_of('/') + 1);
+   for (auto& prefix : manifest.files) {
+      if (base.compare(0, prefix.size(), prefix) == 0) return true;
+   }
+   return false;
+}
+
+
+// Repack 'count' values of simple packed data from 'nbits' to 'new_bits' bits per value, appending to 'out'
+static void repack_values(const unsigned char* data, long count, int nbits, int new_bits, std::vector<unsigned char>& out) {
+   int shift = nbits - new_bits;
+   unsigned long long max_value = (1ULL << new_bits) - 1;
+   unsigned long long half = 1ULL << (shift - 1);
+   unsigned long long acc = 0;
+   int nacc = 0;
+   size_t bitpos = 0;
+
+   for (long i = 0; i < count; i++, bitpos += nbits) {
+      // Read the value: it spans at most 5 bytes for up to 32 bits
+      size_t byte = bitpos >> 3;
+      int needed = (bitpos & 7) + nbits;
+      int nbytes = (needed + 7) >> 3;
+      unsigned long long value = 0;
+      for (int b = 0; b < nbytes; b++) value = (value << 8) | data[byte + b];
+      value = (value >> (nbytes * 8 - needed)) & ((1ULL << nbits) - 1);
+
+      value = std::min((value + half) >> shift, max_value);
+
+      acc = (acc << new_bits) | value;
+      nacc += new_bits;
+      while (nacc >= 8) {
+         nacc -= 8;
+         out.push_back((acc >> nacc) & 0xff);
+      }
+      acc &= (1ULL << nacc) - 1;
+   }
+   if (nacc > 0) out.push_back((acc << (8 - nacc)) & 0xff);
+}
+
+
+// Forecast step in hours from a time unit code (GRIB1 and GRIB2 codes, which agree but for seconds)
+static double step_hours(int unit, long value, int edition) {
+   switch (unit) {
+      case 0:   return value / 60.0;
+      case 1:   return value;
+      case 2:   return value * 24.0;
+      case 10:  return value * 3.0;
+      case 11:  return value * 6.0;
+      case 12:  return value * 12.0;
+      case 13:  return (edition == 2) ? value / 3600.0 : value / 4.0;     // GRIB1 13 is 15 minutes
+      case 254: return value / 3600.0;
+      default:  return -1;
+   }
+}
+
+// Identify a GRIB1 message and find its data section
+static bool scan_grib1(const unsigned char* msg, size_t len, grib_message& m) {
+   // Layer level types have the top and bottom of the layer in one octet each
+   static const int layers[] = {101, 104, 106, 108, 110, 112, 114, 116, 120, 121, 128, 141};
+
+   const unsigned char* pds = msg + 8;
+   size_t pos = 8 + get_uint(pds, 3);
+   if (get_uint(pds, 3) < 28 || pos + 4 > len) return false;
+   if (pds[7] & 0x80) pos += get_uint(msg + pos, 3);         // grid description section
+   if (pos + 4 > len) return false;
+   if (pds[7] & 0x40) pos += get_uint(msg + pos, 3);         // bit map section
+   if (pos + 11 > len) return false;
+   if (pos + get_uint(msg + pos, 3) + 4 != len) return false;
+   m.bds = pos;
+   m.field.data_offset = pos;
+
+   grib_index_entry& field = m.field;
+   int table = pds[3];
+   field.param = (table == 128) ? std::to_string(pds[8]) : std::to_string(table * 1000 + pds[8]);
+   field.levtype_code = pds[9];
+   field.levtype = levtype_name(1, pds[9]);
+   if (std::find(std::begin(layers), std::end(layers), pds[9]) != std::end(layers))
+      field.level = pds[10];
+   else
+      field.level = get_uint(pds + 10, 2);
+
+   // Time range indicator: 0, 1 forecast at P1; 2-5 a period from P1 to P2; 10 P1 occupies two octets
+   int range = pds[20];
+   long value = (range == 10) ? (long) get_uint(pds + 18, 2) : (range >= 2 && range <= 5) ? pds[19] : pds[18];
+   field.step = step_hours(pds[17], value, 1);
+   return true;
+}
+
+// Identify a GRIB2 message and find its data sections
+static bool scan_grib2(const unsigned char* msg, size_t len, grib_message& m) {
+   size_t sec4 = 0;
+   m.sec5 = m.sec7 = 0;
+   m.nfields = 0;
+   for (size_t pos = 16; pos + 4 < len; ) {
+      size_t sec_len = get_uint(msg + pos, 4);
+      if (sec_len < 5 || pos + sec_len > len - 4) return false;
+      switch (msg[pos + 4]) {
+         case 4: if (sec4 == 0) sec4 = pos; break;
+         case 5: if (m.sec5 == 0) m.sec5 = pos; break;
+         case 7: if (m.sec7 == 0) m.sec7 = pos; m.nfields++; break;
+      }
+      pos += sec_len;
+   }
+   if (sec4 == 0 || m.sec5 == 0 || m.sec7 == 0 || get_uint(msg + sec4, 4) < 34) return false;
+   m.field.data_offset = m.sec7;
+
+   grib_index_entry& field = m.field;
+   const unsigned char* pds = msg + sec4;
+   int template_number = get_uint(pds + 7, 2);
+   field.param = std::to_string(msg[6]) + "." + std::to_string(pds[9]) + "." + std::to_string(pds[10]);
+   field.levtype_code = -1;
+   field.level = 0;
+   field.step = -1;
+   if (template_number < 16) {               // product templates with the time and fixed surfaces at octets 18-28
+      field.levtype_code = pds[22];
+      field.level = get_uint(pds + 24, 4);
+      if (pds[23] != 0 && pds[23] != 0xff) field.level = lround(field.level * pow(10.0, -(signed char) pds[23]));
+      if (field.levtype_code == 100) field.level /= 100;          // Pa to hPa
+      field.step = step_hours(pds[17], get_uint(pds + 18, 4), 2);
+
+      // Statistics over a period (templates 4.8 and 4.11): the step is the end of the period
+      size_t period = (template_number == 8) ? 48 : (template_number == 11) ? 51 : 0;
+      if (period > 0 && get_uint(pds, 4) >= period + 5 && field.step >= 0)
+         field.step += step_hours(pds[period], get_uint(pds + period + 1, 4), 2);
+   }
+   field.levtype = levtype_name(2, field.levtype_code);
+   return true;
+}
+
+// Find the extent of the GRIB message at the start of 'msg' and identify it.
+// Returns: false if there is not a complete GRIB message this can read.
+static bool scan_message(const unsigned char* msg, size_t avail, grib_message& m) {
+   if (avail < 16 || memcmp(msg, "GRIB", 4) != 0) return false;
+
+   size_t len;
+   int edition = msg[7];
+   if (edition == 1) {
+      len = get_uint(msg + 4, 3);
+      if (len & 0x800000) return false;       // ECMWF's encoding of messages over 8 MB is not handled
+   }
+   else if (edition == 2) {
+      len = get_uint(msg + 8, 8);
+   }
+   else {
+      return false;
+   }
+   if (len < 16 || len > avail || memcmp(msg + len - 4, "7777", 4) != 0) return false;
+
+   m.field.length  = len;
+   m.field.edition = edition;
+   return (edition == 1) ? scan_grib1(msg, len, m) : scan_grib2(msg, len, m);
+}
+
+
+// Filter a GRIB1 message: drop, copy or repack it
+static void filter_grib1(const grib_manifest& manifest, const unsigned char* msg, const grib_message& m,
+                         std::vector<unsigned char>& out, grib_filter_stats& stats) {
+   size_t len = m.field.length, pos = m.bds;
+   const unsigned char* bds = msg + pos;
+   size_t bds_len = get_uint(bds, 3);
+
+   int bits;
+   if (!field_wanted(manifest, m.field, bits)) {
+      stats.fields_dropped++;
+      return;
+   }
+
+   int nbits = bds[10];
+   bool simple = (bds[3] & 0xd0) == 0;          // grid point, simple packing, no additional flags
+   if (bits == 0 || !simple || nbits <= bits || nbits > 32) {
+      out.insert(out.end(), msg, msg + len);
+      return;
+   }
+
+   long count = ((long) (bds_len - 11) * 8 - (bds[3] & 0x0f)) / nbits;
+   size_t start = out.size();
+   out.insert(out.end(), msg, bds + 11);
+   repack_values(bds + 11, count, nbits, bits, out);
+   if ((out.size() - start - pos) & 1) out.push_back(0);    // sections have an even length
+
+   size_t new_bds_len = out.size() - start - pos;
+   unsigned char* new_bds = out.data() + start + pos;
+   int unused = (int) ((new_bds_len - 11) * 8 - (size_t) count * bits);
+   put_uint(new_bds, 3, new_bds_len);
+   new_bds[3] = (bds[3] & 0xf0) | unused;
+   put_signed(new_bds + 4, 2, get_signed(bds + 4, 2) + (nbits - bits));
+   new_bds[10] = bits;
+   out.insert(out.end(), {'7', '7', '7', '7'});
+   put_uint(out.data() + start + 4, 3, out.size() - start);
+   stats.fields_repacked++;
+}
+
+
+// Filter a GRIB2 message: drop, copy or repack it. Only messages holding a single field are repacked.
+static bool filter_grib2(const grib_manifest& manifest, const unsigned char* msg, const grib_message& m,
+                         std::vector<unsigned char>& out, grib_filter_stats& stats) {
+   size_t len = m.field.length, sec5 = m.sec5, sec7 = m.sec7;
+
+   int bits;
+   if (!field_wanted(manifest, m.field, bits)) {
+      stats.fields_dropped++;
+      return true;
+   }
+
+   const unsigned char* drs = msg + sec5;
+   int nbits = drs[19];
+   bool simple = get_uint(drs + 9, 2) == 0 && get_uint(drs, 4) >= 21;
+   if (bits == 0 || !simple || m.nfields != 1 || nbits <= bits || nbits > 32 || sec5 > sec7) {
+      out.insert(out.end(), msg, msg + len);
+      return true;
+   }
+
+   long count = get_uint(drs + 5, 4);
+   if ((size_t) count * nbits > (get_uint(msg + sec7, 4) - 5) * 8) return false;
+
+   size_t start = out.size();
+   out.insert(out.end(), msg, msg + sec7 + 5);
+   repack_values(msg + sec7 + 5, count, nbits, bits, out);
+   unsigned char* new_msg = out.data() + start;
+   put_uint(new_msg + sec7, 4, out.size() - start - sec7);
+   put_signed(new_msg + sec5 + 15, 2, get_signed(drs + 15, 2) + (nbits - bits));
+   new_msg[sec5 + 19] = bits;
+   out.insert(out.end(), {'7', '7', '7', '7'});
+   put_uint(out.data() + start + 8, 8, out.size() - start);
+   stats.fields_repacked++;
+   return true;
+}
+
+
+bool grib_filter_buffer(const grib_manifest& manifest, const std::vector<unsigned char>& in,
+                        std::vector<unsigned char>& out, grib_filter_stats& stats) {
+   //  Apply the manifest to the GRIB messages in 'in', writing the messages kept to 'out'.
+   //  Returns: false if 'in' is not a sequence of GRIB messages this can process, 'out' is then incomplete.
+
+   out.clear();
+   out.reserve(in.size());
+   grib_message m;
+   for (size_t pos = 0; pos < in.size(); pos += m.field.length) {
+      const unsigned char* msg = in.data() + pos;
+      if (!scan_message(msg, in.size() - pos, m)) return false;
+      stats.fields_in++;
+      if (m.field.edition == 1)
+         filter_grib1(manifest, msg, m, out, stats);
+      else if (!filter_grib2(manifest, msg, m, out, stats))
+         return false;
+   }
+   return true;
+}
+
+
+bool grib_index_buffer(const unsigned char* data, size_t size, std::vector<grib_index_entry>& index) {
+   //  Index the GRIB messages in a buffer, reading only their section headers.
+   //  Returns: false if the buffer is not a sequence of GRIB messages this can read.
+
+   index.clear();
+   grib_message m;
+   for (size_t pos = 0; pos < size; pos += m.field.length) {
+      if (!scan_message(data + pos, size - pos, m)) return false;
+      m.field.offset = pos;
+      index.push_back(m.field);
+   }
+   return true;
+}
+
+
+bool grib_file_is_grib(const std::string& filename) {
+   //  Check whether a file starts with a GRIB message, from its first four bytes, without reading further.
+   //  Returns: false if the file could not be read or does not start with 'GRIB'.
+
+   char magic[4];
+   int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   ssize_t n = read(fd, magic, sizeof(magic));
+   close(fd);
+   return n == (ssize_t) sizeof(magic) && memcmp(magic, "GRIB", 4) == 0;
+}
+
+
+bool grib_index_file(const std::string& filename, std::vector<grib_index_entry>& index) {
+   //  Index the GRIB messages in a file, memory mapped so only the pages holding the headers are read.
+   //  Returns: false if the file could not be read or is not a sequence of GRIB messages.
+
+   int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+   }
+   index.clear();
+   if (st.st_size == 0) {
+      close(fd);
+      return true;
+   }
+
+   void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) return false;
+   madvise(data, st.st_size, MADV_RANDOM);       // the data between the headers is not needed
+   bool ok = grib_index_buffer((const unsigned char*) data, st.st_size, index);
+   munmap(data, st.st_size);
+   return ok;
+}
+
+
+bool grib_write_index(const std::string& filename, const std::vector<grib_index_entry>& index) {
+   //  Write an index as text, one line per message. The step is in hours, -1 if not known.
+   std::string tmpfile = filename + ".tmp";
+   FILE* output = fopen(tmpfile.c_str(), "w");
+   if (output == NULL) return false;
+   fprintf(output, "# offset length edition param levtype level step\n");
+   for (auto& entry : index) {
+      fprintf(output, "%zu %zu %d %s %s %ld %g\n", entry.offset, entry.length, entry.edition,
+              entry.param.c_str(), entry.levtype.c_str(), entry.level, entry.step);
+   }
+   if (fclose(output) != 0 || rename(tmpfile.c_str(), filename.c_str()) != 0) {
+      std::remove(tmpfile.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+bool grib_filter_file(const grib_manifest& manifest, const std::string& filename, grib_filter_stats& stats) {
+   //  Rewrite an output file with the manifest applied. The file is left as it is if it can not be
+   //  processed, so that a problem here never loses the model's output.
+   //  Returns: false if the file could not be processed.
+
+   std::vector<unsigned char> in, out;
+   FILE* input = fopen(filename.c_str(), "rb");
+   if (input == NULL) return false;
+   fseek(input, 0, SEEK_END);
+   long size = ftell(input);
+   fseek(input, 0, SEEK_SET);
+   in.resize(size > 0 ? size : 0);
+   bool read_ok = size >= 0 && fread(in.data(), 1, in.size(), input) == in.size();
+   fclose(input);
+
+   grib_filter_stats file_stats;
+   if (!read_ok || !grib_filter_buffer(manifest, in, out, file_stats)) {
+      cerr << "..Unable to process the GRIB file, it is left unchanged: " << filename << std::endl;
+      stats.failed++;
+      return false;
+   }
+   file_stats.files = 1;
+   file_stats.bytes_in = in.size();
+   file_stats.bytes_out = out.size();
+
+   if (file_stats.fields_dropped > 0 || file_stats.fields_repacked > 0) {
+      std::string tmpfile = filename + ".tmp";
+      FILE* output = fopen(tmpfile.c_str(), "wb");
+      bool write_ok = output != NULL && fwrite(out.data(), 1, out.size(), output) == out.size();
+      if (output != NULL && fclose(output) != 0) write_ok = false;
+      if (!write_ok || rename(tmpfile.c_str(), filename.c_str()) != 0) {
+         cerr << "..Unable to write the processed GRIB file, it is left unchanged: " << filename << std::endl;
+         std::remove(tmpfile.c_str());
+         stats.failed++;
+         return false;
+      }
+   }
+
+   stats.files           += file_stats.files;
+   stats.fields_in       += file_stats.fields_in;
+   stats.fields_dropped  += file_stats.fields_dropped;
+   stats.fields_repacked += file_stats.fields_repacked;
+   stats.bytes_in        += file_stats.bytes_in;
+   stats.bytes_out       += file_stats.bytes_out;
+   return true;
+}
+
+
+int grib_idle_cpus() {
+   //  Number of cpus not in use by the model or other work, from the load average. At least 1.
+   double loadavg = 0;
+   long   ncpus   = sysconf(_SC_NPROCESSORS_ONLN);
+   if (getloadavg(&loadavg, 1) != 1) loadavg = 0;
+   return std::max((int) (ncpus - ceil(loadavg)), 1);
+}
+
+
+void grib_filter_files(const grib_manifest& manifest, const std::vector<std::string>& files, int max_threads,
+                       grib_filter_stats& stats) {
+   //  Apply the manifest to a set of output files, in parallel on up to max_threads threads. The threads
+   //  run at a low priority so they only use cpu the model leaves idle (the controller's own thread waits,
+   //  as its priority could not be raised again afterwards).
+
+   if (files.empty()) return;
+   int nthreads = std::max(std::min(max_threads, (int) files.size()), 1);
+   std::atomic<size_t> next(0);
+   std::mutex stats_lock;
+
+   auto worker = [&]() {
+      #ifdef __linux__
+         setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+      #endif
+      for (size_t i = next++; i < files.size(); i = next++) {
+         grib_filter_stats file_stats;
+         grib_filter_file(manifest, files[i], file_stats);
+         std::lock_guard<std::mutex> lock(stats_lock);
+         stats.files           += file_stats.files;
+         stats.failed          += file_stats.failed;
+         stats.fields_in       += file_stats.fields_in;
+         stats.fields_dropped  += file_stats.fields_dropped;
+         stats.fields_repacked += file_stats.fields_repacked;
+         stats.bytes_in        += file_stats.bytes_in;
+         stats.bytes_out       += file_stats.bytes_out;
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (int t = 0; t < nthreads; t++) threads.emplace_back(worker);
+   for (auto& t : threads) t.join();
+}
@@ -0,0 +1,61 @@
+//
+// GRIB output indexing, subsetting and repacking for the OpenIFS controller, see oifs_grib.cpp
+//
+
+#ifndef OIFS_GRIB_H
+#define OIFS_GRIB_H
+
+#include <string>
+#include <vector>
+
+// A GRIB message in an output file, see grib_index_file()
+struct grib_index_entry {
+    size_t      offset = 0, length = 0;
+    int         edition = 0;
+    std::string param;                  // ECMWF paramId (GRIB1), or discipline.category.number (GRIB2)
+    std::string levtype;                // sfc, pl, ml, pt, pv or the level type code
+    int         levtype_code = -1;
+    long        level = 0;              // hPa for pl
+    double      step = -1;              // forecast step (hours), -1 if not known
+    size_t      data_offset = 0;        // the data section (GRIB1 section 4, GRIB2 section 7), from the start of the message
+};
+
+// Fields a manifest rule applies to, an empty list matches any value
+struct grib_selector {
+    std::vector<std::string> params;    // ECMWF paramId e.g. 130, or GRIB2 discipline.category.number e.g. 0.0.0
+    std::vector<std::string> levtypes;  // sfc, pl, ml, pt, pv
+    std::vector<long>        levels;    // hPa for pl, model level for ml, K for pt
+};
+
+struct grib_rule {
+    enum { KEEP, DROP, BITS } action;
+    int bits = 0;                       // bits per value for BITS
+    grib_selector select;
+};
+
+// The output manifest sent with the workunit
+struct grib_manifest {
+    std::vector<grib_rule>   rules;
+    std::vector<std::string> files;     // output file prefixes to process, default ICMGG, ICMSH, ICMUA
+    int                      max_threads = 0;     // 0 = use all idle cpus
+    bool                     has_keep = false;
+};
+
+struct grib_filter_stats {
+    long      files = 0, failed = 0;
+    long      fields_in = 0, fields_dropped = 0, fields_repacked = 0;
+    long long bytes_in = 0, bytes_out = 0;
+};
+
+bool grib_read_manifest(const std::string&, grib_manifest&);
+bool grib_manifest_applies(const grib_manifest&, const std::string&);
+bool grib_filter_buffer(const grib_manifest&, const std::vector<unsigned char>&, std::vector<unsigned char>&, grib_filter_stats&);
+bool grib_filter_file(const grib_manifest&, const std::string&, grib_filter_stats&);
+bool grib_file_is_grib(const std::string&);
+bool grib_index_buffer(const unsigned char*, size_t, std::vector<grib_index_entry>&);
+bool grib_index_file(const std::string&, std::vector<grib_index_entry>&);
+bool grib_write_index(const std::string&, const std::vector<grib_index_entry>&);
+int  grib_idle_cpus();
+void grib_filter_files(const grib_manifest&, const std::vector<std::string>&, int, grib_filter_stats&);
+
+#endif
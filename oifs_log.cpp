@@ -0,0 +1,437 @@
+//
+// Logging for the OpenIFS controller
+//
+// The controller's diagnostics are written to cerr, which under BOINC is the slot's stderr.txt, and cerr is
+// unbuffered: every line (and every '<<') was a write to the file, made by the main loop while it waited on
+// them, including the lines for each file moved and zipped. On a slow or busy disk these writes stall the loop.
+//
+// log_init() points cerr at a stream buffer that collects each thread's output into lines, and queues the lines
+// in a ring in memory. A background thread takes them from the ring every 20 ms and writes them to stderr (file
+// descriptor 2, which BOINC has pointed at stderr.txt) in a single write, each line starting with the time it
+// was logged, e.g.
+//
+//    14:02:31.120 Moving to projects directory: ...
+//
+// The ring is a bounded queue of fixed size cells, each with a sequence number (after D. Vyukov's bounded MPMC
+// queue): a thread logging a line takes as many cells as it needs with one atomic add, fills them and publishes
+// each by its sequence number, so threads never lock or wait on each other. A line only waits if the ring is
+// full, for the writer to free cells. The lines are written in the order they took their cells.
+//
+// Lines starting with '..' are errors, others are information, and lines logged by log_printf() can also be
+// debug output. Lines below the level set (by !LOG_LEVEL=debug|info|error in fort.4, default info) are dropped.
+// With !LOG_RATE_LIMIT set in fort.4 (default 0, no limit), information lines that repeat are limited to that
+// number per minute, and the number of lines not written is logged when the minute ends. A line logged by
+// log_printf() repeats its format, a line written to cerr repeats the same text. Error lines, and the lines of a
+// dump (e.g. the tail of a file, see log_dump) are never limited.
+//
+// The time of a line is written into its cells when it is logged. The ring is written out when the controller
+// exits (atexit), before a fork (so a child writing to stderr does not overtake the lines before it, a child
+// writes its lines directly), and by a handler for the signals of a crash (SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+// SIGABRT). The handler only writes the cells as they are, with write(2), then passes the signal on to the
+// handler it replaced.
+//
+
+#include <string>
+#include <thread>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <streambuf>
+#include <unordered_map>
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "oifs_log.h"
+
+using namespace std::chrono;
+
+static const size_t ring_cells = 4096;            // a power of 2
+static const size_t cell_text = 232;              // bytes of a line in each cell, the cell is 256 bytes
+static const size_t max_line_cells = 16;          // longer lines are cut
+
+static const size_t stamp_length = 13;            // 'HH:MM:SS.mmm ' at the start of each line
+
+struct log_cell {
+    std::atomic<uint64_t> seq;                    // position + 1 when filled, position + ring_cells when free
+    const char* key;                              // what the line repeats for the rate limit: log_printf's format,
+                                                  // or null for the text of the line
+    uint16_t length;
+    uint8_t  level;
+    uint8_t  more;                                // the line continues in the next cell
+    uint8_t  dump;                                // the line is part of a dump, it is not rate limited
+    char     text[cell_text];
+};
+
+static log_cell ring[ring_cells];
+static std::atomic<uint64_t> enqueue_pos{0};
+static uint64_t dequeue_pos = 0;                  // only used holding drain_lock
+static std::atomic_flag drain_lock = ATOMIC_FLAG_INIT;
+
+static std::atomic<bool> direct{true};            // write lines straight to stderr, not through the ring
+static std::atomic<bool> stopping{false};
+static std::atomic<int>  level_threshold{log_info};
+static std::atomic<int>  rate_limit{0};
+static std::atomic<long> stat_lines{0}, stat_suppressed{0}, stat_waits{0};
+static std::atomic<long long> stat_bytes{0};
+static std::thread flusher;
+static pid_t owner_pid = 0;
+static std::streambuf* saved_cerr = nullptr;
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction previous_actions[5];
+
+
+static double wall_time() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void write_all(const char* data, size_t length) {
+   while (length > 0) {
+      ssize_t n = write(STDERR_FILENO, data, length);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return;
+      data += n;
+      length -= n;
+   }
+}
+
+// Write the time a line is logged, 'HH:MM:SS.mmm ', to 'stamp' (stamp_length + 1 bytes)
+static void time_stamp(char* stamp, double time) {
+   static thread_local time_t stamp_secs = -1;
+   static thread_local char   stamp_hms[9];
+   time_t secs = (time_t) time;
+   if (secs != stamp_secs) {
+      struct tm tm;
+      localtime_r(&secs, &tm);
+      snprintf(stamp_hms, sizeof(stamp_hms), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+      stamp_secs = secs;
+   }
+   snprintf(stamp, stamp_length + 1, "%s.%03u ", stamp_hms, (unsigned) ((time - secs) * 1000) % 1000);
+}
+
+// Append a line with its time to 'out'
+static void format_line(std::string& out, double time, const char* text, size_t length) {
+   char stamp[stamp_length + 1];
+   time_stamp(stamp, time);
+   out.append(stamp, stamp_length);
+   out.append(text, length);
+   out.push_back('\n');
+}
+
+
+// The rate limit of each line repeated, kept by the thread writing the ring
+struct rate_entry {
+    double window_start = 0;
+    int    count = 0;
+    long   suppressed = 0;
+};
+static std::unordered_map<std::string, rate_entry> rates;
+static const size_t max_rates = 4096;             // lines tracked, those whose minute has ended are dropped above it
+
+static void report_suppressed(std::string& out, double time, const std::string& key, long suppressed) {
+   std::string like = key.substr(0, std::min(key.find('\n'), (size_t) 60));
+   std::string text = "(" + std::to_string(suppressed) + " more lines like '" + like + "' not shown)";
+   format_line(out, time, text.data(), text.size());
+}
+
+static bool rate_limited(std::string& out, int level, bool dump, double time, const std::string& key) {
+   int limit = rate_limit.load(std::memory_order_relaxed);
+   if (level >= log_error || dump || limit <= 0) return false;
+
+   if (rates.size() > max_rates) {
+      for (auto it = rates.begin(); it != rates.end(); ) {
+         if (time - it->second.window_start < 60) {
+            ++it;
+            continue;
+         }
+         if (it->second.suppressed > 0) report_suppressed(out, time, it->first, it->second.suppressed);
+         it = rates.erase(it);
+      }
+   }
+   rate_entry& entry = rates[key];
+   if (time - entry.window_start >= 60) {
+      if (entry.suppressed > 0) report_suppressed(out, time, key, entry.suppressed);
+      entry.window_start = time;
+      entry.count = 0;
+      entry.suppressed = 0;
+   }
+   if (++entry.count <= limit) return false;
+   entry.suppressed++;
+   stat_suppressed++;
+   return true;
+}
+
+
+// Write the lines in the ring to stderr. Returns: the number of cells taken from the ring.
+static std::string pending_line;
+static int pending_level;
+static bool pending_dump;
+static const char* pending_key;
+
+static size_t drain() {
+   // The lock is only held by a thread writing out the ring
+   while (drain_lock.test_and_set(std::memory_order_acquire)) std::this_thread::sleep_for(microseconds(1000));
+
+   std::string out;
+   size_t cells = 0;
+   for (;;) {
+      log_cell& cell = ring[dequeue_pos & (ring_cells - 1)];
+      if (cell.seq.load(std::memory_order_acquire) != dequeue_pos + 1) break;
+      if (pending_line.empty()) {
+         pending_level = cell.level;
+         pending_dump  = cell.dump;
+         pending_key   = cell.key;
+      }
+      pending_line.append(cell.text, cell.length);
+      bool more = cell.more;
+      cell.seq.store(dequeue_pos + ring_cells, std::memory_order_release);
+      dequeue_pos++;
+      cells++;
+      if (more) continue;
+
+      std::string key = pending_key ? std::string(pending_key) : pending_line.substr(std::min(stamp_length, pending_line.size()));
+      if (!rate_limited(out, pending_level, pending_dump, wall_time(), key)) {
+         out.append(pending_line);
+         out.push_back('\n');
+         stat_lines++;
+      }
+      pending_line.clear();
+   }
+   if (!out.empty()) {
+      write_all(out.data(), out.size());
+      stat_bytes += out.size();
+   }
+   drain_lock.clear(std::memory_order_release);
+   return cells;
+}
+
+static void flush_loop() {
+   while (!stopping.load()) {
+      if (drain() == 0) std::this_thread::sleep_for(milliseconds(20));
+   }
+}
+
+
+// Lines logged by this thread are part of a dump, see log_dump
+static thread_local bool dumping = false;
+
+static void log_line(int level, const char* text, size_t length, const char* key) {
+   if (level < level_threshold.load(std::memory_order_relaxed)) return;
+   double time = wall_time();
+
+   if (direct.load(std::memory_order_acquire)) {
+      std::string out;
+      format_line(out, time, text, length);
+      write_all(out.data(), out.size());
+      return;
+   }
+
+   // The cells hold the line with its time in front
+   char stamp[stamp_length + 1];
+   time_stamp(stamp, time);
+   size_t total = stamp_length + length;
+   size_t ncells = std::min((total + cell_text - 1) / cell_text, max_line_cells);
+   total = std::min(total, ncells * cell_text);
+   uint64_t pos = enqueue_pos.fetch_add(ncells);
+   bool waited = false;
+   for (size_t k = 0; k < ncells; k++) {
+      log_cell& cell = ring[(pos + k) & (ring_cells - 1)];
+      while (cell.seq.load(std::memory_order_acquire) != pos + k) {
+         waited = true;
+         std::this_thread::sleep_for(microseconds(100));
+      }
+      size_t offset = k * cell_text, chunk = std::min(total - offset, cell_text);
+      char*  dest = cell.text;
+      if (offset < stamp_length) {
+         size_t n = std::min(chunk, stamp_length - offset);
+         memcpy(dest, stamp + offset, n);
+         dest += n;
+         memcpy(dest, text, chunk - n);
+      } else {
+         memcpy(dest, text + (offset - stamp_length), chunk);
+      }
+      cell.length = chunk;
+      cell.level  = level;
+      cell.key    = key;
+      cell.dump   = dumping;
+      cell.more   = (k + 1 < ncells);
+      cell.seq.store(pos + k + 1, std::memory_order_release);
+   }
+   if (waited) stat_waits++;
+}
+
+
+// cerr's stream buffer: collects the text written by each thread into lines
+static thread_local std::string cerr_line;
+
+class log_streambuf : public std::streambuf {
+  protected:
+    int_type overflow(int_type c) override {
+       if (c != traits_type::eof()) {
+          char ch = c;
+          append(&ch, 1);
+       }
+       return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+       append(s, n);
+       return n;
+    }
+  private:
+    static void append(const char* s, size_t n) {
+       while (n > 0) {
+          const char* newline = (const char*) memchr(s, '\n', n);
+          if (newline == NULL) {
+             cerr_line.append(s, n);
+             return;
+          }
+          cerr_line.append(s, newline - s);
+          log_line(cerr_line.compare(0, 2, "..") == 0 ? log_error : log_info, cerr_line.data(), cerr_line.size(), nullptr);
+          cerr_line.clear();
+          n -= newline - s + 1;
+          s = newline + 1;
+       }
+    }
+};
+static log_streambuf cerr_buffer;
+
+
+static void crash_handler(int sig) {
+   // Only async-signal-safe calls: the cells waiting in the ring are written as they are, without the lock of the
+   // thread writing the ring, which may be the thread that crashed
+   int saved_errno = errno;
+   direct = true;
+   for (uint64_t pos = dequeue_pos; ; pos++) {
+      log_cell& cell = ring[pos & (ring_cells - 1)];
+      if (cell.seq.load(std::memory_order_acquire) != pos + 1) break;
+      write_all(cell.text, cell.length);
+      if (!cell.more) write_all("\n", 1);
+   }
+   errno = saved_errno;
+   for (size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+      if (crash_signals[i] == sig) sigaction(sig, &previous_actions[i], NULL);
+   }
+   // Delivered to the previous handler, or the default action, once this handler returns
+   raise(sig);
+}
+
+static void before_fork() {
+   if (!direct.load()) drain();
+}
+
+static void in_child() {
+   // The thread writing the ring is not in the child: its handle is replaced, without being destroyed, so the
+   // child can exit without std::thread terminating it for a thread still joinable
+   direct = true;
+   owner_pid = 0;
+   new (&flusher) std::thread();
+}
+
+
+void log_init() {
+   //  Start logging the lines written to cerr through the ring, see the top of this file
+
+   if (owner_pid == getpid()) return;
+   for (size_t i = 0; i < ring_cells; i++) ring[i].seq.store(i, std::memory_order_relaxed);
+   owner_pid = getpid();
+   direct = false;
+   stopping = false;
+   saved_cerr = std::cerr.rdbuf(&cerr_buffer);
+   flusher = std::thread(flush_loop);
+
+   static bool registered = false;
+   if (!registered) {
+      atexit(log_shutdown);
+      pthread_atfork(before_fork, NULL, in_child);
+      registered = true;
+   }
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = crash_handler;
+   sigemptyset(&action.sa_mask);
+   for (size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+      sigaction(crash_signals[i], &action, &previous_actions[i]);
+   }
+}
+
+
+void log_set_level(int level) {
+   level_threshold = std::min(std::max(level, (int) log_debug), (int) log_error);
+}
+
+void log_set_rate_limit(int per_minute) {
+   rate_limit = per_minute;
+}
+
+
+void log_printf(int level, const char* format, ...) {
+   //  Log a line given as by printf, with its level. The trailing newline is optional.
+
+   char buffer[1024];
+   va_list args;
+   va_start(args, format);
+   int length = vsnprintf(buffer, sizeof(buffer), format, args);
+   va_end(args);
+   if (length < 0) return;
+   length = std::min(length, (int) sizeof(buffer) - 1);
+   if (length > 0 && buffer[length - 1] == '\n') length--;
+   log_line(level, buffer, length, format);
+}
+
+
+void log_dump(bool on) {
+   //  Mark the lines this thread logs from now on, until log_dump(false), as a dump (e.g. the tail of a file),
+   //  which is not rate limited
+
+   dumping = on;
+}
+
+
+void log_flush() {
+   //  Write out the lines logged so far
+   if (!direct.load()) drain();
+}
+
+
+void log_shutdown() {
+   //  Write out the ring and stop the thread writing it, the lines logged from now on are written directly
+
+   if (owner_pid != getpid() || direct.load()) return;
+   stopping = true;
+   if (flusher.joinable()) flusher.join();
+   direct = true;
+   drain();
+
+   std::string out;
+   double time = wall_time();
+   for (const auto& entry : rates) {
+      if (entry.second.suppressed > 0) report_suppressed(out, time, entry.first, entry.second.suppressed);
+   }
+   rates.clear();
+   if (!cerr_line.empty()) format_line(out, time, cerr_line.data(), cerr_line.size());
+   cerr_line.clear();
+   write_all(out.data(), out.size());
+   if (saved_cerr) std::cerr.rdbuf(saved_cerr);
+}
+
+
+log_stats log_get_stats() {
+   log_stats stats;
+   stats.lines      = stat_lines;
+   stats.bytes      = stat_bytes;
+   stats.suppressed = stat_suppressed;
+   stats.waits      = stat_waits;
+   return stats;
+}
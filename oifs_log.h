@@ -0,0 +1,27 @@
+//
+// Logging for the OpenIFS controller: the lines written to cerr are queued in memory and written to stderr by
+// a background thread, with a timestamp, see oifs_log.cpp
+//
+
+#ifndef OIFS_LOG_H
+#define OIFS_LOG_H
+
+enum { log_debug = 0, log_info = 1, log_error = 2 };
+
+struct log_stats {
+    long      lines = 0;                      // written to stderr
+    long long bytes = 0;
+    long      suppressed = 0;                 // by the rate limit
+    long      waits = 0;                      // lines that waited for room in the ring
+};
+
+void log_init();
+void log_set_level(int);
+void log_set_rate_limit(int);
+void log_printf(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+void log_dump(bool);
+void log_flush();
+void log_shutdown();
+log_stats log_get_stats();
+
+#endif
@@ -0,0 +1,419 @@
+//
+// Fortran namelist parser for the OpenIFS fort.4 file
+//
+// The namelist is read once, a line at a time, into an index of every group and variable, along
+// with the CPDN '!KEY=value' directive lines that carry the workunit's settings (IFSDATA_FILE,
+// UPLOAD_INTERVAL ...). Values can be read by group and name, or changed and written back to a new
+// fort.4 with the rest of the file unchanged, e.g. to adjust NPROMA or the output frequency before
+// the model is launched.
+//
+// The subset of namelist syntax used in fort.4 files is supported:
+//
+//    &GROUP                              group start, ended by '/' or '&END'
+//       NAME=value,                      one or more entries per line
+//       ARRAY=1,2,3,                     values continue until the next 'NAME=' or the end of the group,
+//          4,5,6,                        including on following lines
+//       NAME(1)=value, A%B=value,        indexed and derived type names
+//       STR='text, with / and !',        quoted strings may contain separators
+//    /
+//    ! comment                           comments outside quotes
+//
+
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "oifs_parse.h"
+#include "oifs_namelist.h"
+
+using namespace std;
+
+
+static inline bool is_space(char c) {
+   return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static std::string upper_case(std::string_view str) {
+   std::string upper(str);
+   for (char& c : upper) c = toupper((unsigned char) c);
+   return upper;
+}
+
+static std::string_view trim(std::string_view str) {
+   while (!str.empty() && is_space(str.front())) str.remove_prefix(1);
+   while (!str.empty() && is_space(str.back())) str.remove_suffix(1);
+   return str;
+}
+
+// Length of a variable name starting at pos: a letter followed by letters, digits, '_', '%'
+// and bracketed indices. Zero if there is no name there.
+static size_t name_length(std::string_view line, size_t pos) {
+   size_t end = pos;
+   if (end >= line.size() || !isalpha((unsigned char) line[end])) return 0;
+   while (end < line.size()) {
+      char c = line[end];
+      if (isalnum((unsigned char) c) || c == '_' || c == '%') {
+         end++;
+      }
+      else if (c == '(') {
+         size_t close = line.find(')', end);
+         if (close == std::string_view::npos) return 0;
+         end = close + 1;
+      }
+      else {
+         break;
+      }
+   }
+   return end - pos;
+}
+
+// If a 'NAME =' starts at pos, return the name's length and set 'value_pos' to after the '='
+static size_t assignment_at(std::string_view line, size_t pos, size_t& value_pos) {
+   size_t len = name_length(line, pos);
+   if (len == 0) return 0;
+   size_t eq = pos + len;
+   while (eq < line.size() && is_space(line[eq])) eq++;
+   if (eq >= line.size() || line[eq] != '=') return 0;
+   value_pos = eq + 1;
+   return len;
+}
+
+// Record a CPDN directive from a comment: '!KEY=value', with the spaces removed from the value
+static void parse_directive(std::string_view comment, oifs_namelist& nml) {
+   size_t pos = 0, value_pos;
+   while (pos < comment.size() && is_space(comment[pos])) pos++;
+   size_t len = assignment_at(comment, pos, value_pos);
+   if (len == 0) return;
+
+   std::string value;
+   for (char c : comment.substr(value_pos)) {
+      if (!is_space(c)) value.push_back(c);
+   }
+   nml.directives[upper_case(comment.substr(pos, len))] = value;
+}
+
+
+bool namelist_parse(std::istream& input, oifs_namelist& nml) {
+   //  Parse a namelist file into 'nml', replacing its contents.
+   //  Returns: false if a group or quoted string is not terminated.
+
+   nml = oifs_namelist();
+
+   // The file is read in one go and its lines and variables sized from its line count, so they are not grown
+   // line by line
+   std::string text(std::istreambuf_iterator<char>(input), {});
+   size_t nlines = std::count(text.begin(), text.end(), '\n') + 1;
+   nml.lines.reserve(nlines);
+   nml.variables.reserve(nlines);
+
+   bool   in_group = false;
+   long   current = -1;           // variable whose value is being read, -1 if none
+   char   quote = 0;              // quote character of a string that continues onto the next line
+
+   for (size_t line_start = 0; line_start < text.size(); ) {
+      size_t line_end = text.find('\n', line_start);
+      if (line_end == std::string::npos) line_end = text.size();
+      size_t next_line = line_end + 1;
+      if (line_end > line_start && text[line_end - 1] == '\r') line_end--;
+      nml.lines.emplace_back(text, line_start, line_end - line_start);
+      line_start = next_line;
+      size_t lineno = nml.lines.size() - 1;
+      std::string_view line(nml.lines.back());
+      size_t pos = 0;
+
+      while (pos < line.size()) {
+         // Reading a value: up to a comment, the end of the group, or the next 'NAME='
+         if (in_group && current >= 0 && (quote || !(is_space(line[pos]) || line[pos] == '!' || line[pos] == '/' || line[pos] == '&'))) {
+            size_t start = pos, value_pos = 0, next = 0;
+            bool   separator = true;
+            while (pos < line.size()) {
+               char c = line[pos];
+               if (quote) {
+                  if (c == quote) quote = 0;
+               }
+               else if (c == '\'' || c == '"') {
+                  quote = c;
+               }
+               else if (c == '!' || c == '/' || c == '&') {
+                  break;
+               }
+               else if (separator && (next = assignment_at(line, pos, value_pos)) > 0) {
+                  break;
+               }
+               separator = (c == ',' || is_space(c));
+               pos++;
+            }
+
+            // The value without the separators after it
+            size_t end = pos;
+            while (end > start && (is_space(line[end-1]) || line[end-1] == ',')) end--;
+            if (end > start) {
+               namelist_variable& var = nml.variables[current];
+               if (!var.value.empty()) var.value.push_back(',');
+               var.value.append(line.substr(start, end - start));
+               var.spans.push_back({lineno, start, end - start});
+            }
+            if (next > 0) current = -1;
+            continue;
+         }
+
+         if (is_space(line[pos]) || line[pos] == ',') {
+            pos++;
+         }
+         else if (line[pos] == '!') {
+            parse_directive(line.substr(pos + 1), nml);
+            break;
+         }
+         else if (line[pos] == '&') {
+            size_t len = name_length(line, pos + 1);
+            std::string name = upper_case(line.substr(pos + 1, len));
+            if (in_group) nml.groups.back().end_line = lineno;      // '&END', or a group not ended by '/'
+            in_group = (name != "END" && len > 0);
+            if (in_group) nml.groups.push_back({name, lineno, std::string::npos});
+            current = -1;
+            pos += len + 1;
+         }
+         else if (line[pos] == '/' && in_group) {
+            nml.groups.back().end_line = lineno;
+            in_group = false;
+            current = -1;
+            pos++;
+         }
+         else if (in_group) {
+            size_t value_pos = 0;
+            size_t len = assignment_at(line, pos, value_pos);
+            if (len == 0) {
+               // Not a 'NAME=', skip the token
+               while (pos < line.size() && !is_space(line[pos]) && line[pos] != ',') pos++;
+               continue;
+            }
+            nml.variables.emplace_back();
+            namelist_variable& var = nml.variables.back();
+            var.group = nml.groups.back().name;
+            var.name  = upper_case(line.substr(pos, len));
+            current = nml.variables.size() - 1;
+            pos = value_pos;
+            while (pos < line.size() && is_space(line[pos])) pos++;
+         }
+         else {
+            break;       // text outside a group
+         }
+      }
+   }
+
+   if (quote) {
+      cerr << "..namelist: unterminated string in the namelist" << std::endl;
+      return false;
+   }
+   if (in_group) {
+      cerr << "..namelist: group " << nml.groups.back().name << " is not terminated" << std::endl;
+      return false;
+   }
+   return true;
+}
+
+
+bool namelist_read(const std::string& filename, oifs_namelist& nml) {
+   std::ifstream input(filename);
+   if (!input.is_open()) {
+      cerr << "..namelist: unable to open " << filename << std::endl;
+      return false;
+   }
+   return namelist_parse(input, nml);
+}
+
+
+// Position in nml.variables of a variable by group and name (upper case), searched from the end, as a repeated
+// name takes the last value in Fortran. An empty group finds the variable in any group. A fort.4 has some tens
+// of variables, and is searched a few times at the start of a task, a scan is quicker than building an index.
+// Returns: -1 if not present.
+static long variable_position(const oifs_namelist& nml, std::string_view group, std::string_view name) {
+   for (size_t i = nml.variables.size(); i-- > 0; ) {
+      const namelist_variable& var = nml.variables[i];
+      if (var.name == name && (group.empty() || var.group == group)) return i;
+   }
+   return -1;
+}
+
+
+const namelist_variable* namelist_find(const oifs_namelist& nml, std::string_view group, std::string_view name) {
+   //  Find a variable by group and name (case insensitive). An empty group finds the variable in any group.
+   //  Returns: NULL if not present.
+
+   long found = variable_position(nml, upper_case(group), upper_case(name));
+   return (found < 0) ? NULL : &nml.variables[found];
+}
+
+
+bool namelist_get(const oifs_namelist& nml, std::string_view group, std::string_view name, std::string& value) {
+   //  Value of a variable as written in the namelist. Returns false if not present.
+   const namelist_variable* var = namelist_find(nml, group, name);
+   if (var == NULL) return false;
+   value = var->value;
+   return true;
+}
+
+
+bool namelist_get_int(const oifs_namelist& nml, std::string_view group, std::string_view name, int& value) {
+   const namelist_variable* var = namelist_find(nml, group, name);
+   return var != NULL && oifs_parse_int(var->value, value);
+}
+
+
+bool namelist_get_double(const oifs_namelist& nml, std::string_view group, std::string_view name, double& value) {
+   //  Real values may use a Fortran double precision exponent, e.g. 1.0D0
+   const namelist_variable* var = namelist_find(nml, group, name);
+   if (var == NULL || var->value.empty()) return false;
+
+   std::string number = var->value;
+   for (char& c : number) if (c == 'D' || c == 'd') c = 'E';
+   char* end;
+   value = strtod(number.c_str(), &end);
+   return end != number.c_str() && *end == '\0';
+}
+
+
+bool namelist_get_string(const oifs_namelist& nml, std::string_view group, std::string_view name, std::string& value) {
+   //  String value without its quotes, a doubled quote inside the string is a single quote
+   const namelist_variable* var = namelist_find(nml, group, name);
+   if (var == NULL) return false;
+
+   std::string_view text = trim(var->value);
+   if (text.size() >= 2 && (text.front() == '\'' || text.front() == '"') && text.back() == text.front()) {
+      char q = text.front();
+      value.clear();
+      for (size_t i = 1; i + 1 < text.size(); i++) {
+         value.push_back(text[i]);
+         if (text[i] == q && text[i+1] == q) i++;
+      }
+   }
+   else {
+      value = text;
+   }
+   return true;
+}
+
+
+bool namelist_directive(const oifs_namelist& nml, std::string_view key, std::string& value) {
+   auto found = nml.directives.find(upper_case(key));
+   if (found == nml.directives.end()) return false;
+   value = found->second;
+   return true;
+}
+
+
+bool namelist_cpdn_value(const oifs_namelist& nml, std::string_view key, std::string& value) {
+   //  A setting the controller reads from fort.4: the value of a variable of that name in any group,
+   //  or if there is none, a '!KEY=value' directive. The model only sees the group values, so these
+   //  take precedence over a directive, which is a comment to the model.
+   //  Returns false if neither is present.
+   std::string text;
+   if (namelist_get(nml, "", key, text)) {
+      value = text;
+      for (const char* strip : {" ", ","}) {
+         size_t p;
+         while ((p = value.find(strip)) != std::string::npos) value.erase(p, 1);
+      }
+      return true;
+   }
+   return namelist_directive(nml, key, value);
+}
+
+
+bool namelist_set(oifs_namelist& nml, std::string_view group, std::string_view name, const std::string& value) {
+   //  Set the value of a variable in a group, to be written by namelist_write(). 'value' is written
+   //  as given, so strings must include their quotes. A variable not in the namelist is added at the
+   //  end of its group, and a group not in the namelist is added at the end of the file.
+   //  Returns: false if the namelist could not be updated.
+
+   std::string upper_group = upper_case(group);
+   std::string upper_name  = upper_case(name);
+   long found = variable_position(nml, upper_group, upper_name);
+
+   if (found >= 0 && nml.variables[found].spans.size() == 1) {
+      // The usual case, a value on one line: replace it and move along the values after it on the line
+      namelist_variable& var  = nml.variables[found];
+      namelist_span      span = var.spans[0];
+      nml.lines[span.line].replace(span.start, span.len, value);
+      long delta = (long) value.size() - (long) span.len;
+      for (auto& other : nml.variables) {
+         for (auto& s : other.spans) {
+            if (s.line == span.line && s.start > span.start) s.start += delta;
+         }
+      }
+      var.spans[0].len = value.size();
+      var.value = value;
+      return true;
+   }
+
+   // Otherwise edit the text and parse it again
+   std::vector<std::string> lines = nml.lines;
+   if (found >= 0) {
+      // A value over several lines, or an empty value: write it in the first place it was
+      const namelist_variable& var = nml.variables[found];
+      if (var.spans.empty()) return false;
+      for (size_t i = var.spans.size(); i-- > 1; ) {
+         lines[var.spans[i].line].erase(var.spans[i].start, var.spans[i].len);
+      }
+      lines[var.spans[0].line].replace(var.spans[0].start, var.spans[0].len, value);
+   }
+   else {
+      const namelist_group* grp = NULL;
+      for (auto& g : nml.groups) {
+         if (g.name == upper_group) grp = &g;
+      }
+      std::string entry = "   " + upper_name + "=" + value + ",";
+      if (grp != NULL && grp->end_line != std::string::npos) {
+         lines.insert(lines.begin() + grp->end_line, entry);
+      }
+      else if (grp == NULL) {
+         lines.push_back(" &" + upper_group);
+         lines.push_back(entry);
+         lines.push_back(" /");
+      }
+      else {
+         return false;
+      }
+   }
+
+   std::ostringstream text;
+   for (auto& line : lines) text << line << '\n';
+   std::istringstream input(text.str());
+   oifs_namelist updated;
+   if (!namelist_parse(input, updated)) return false;
+   nml = std::move(updated);
+   return true;
+}
+
+
+bool namelist_write(const oifs_namelist& nml, const std::string& filename) {
+   //  Write the namelist to a file, by way of a temporary file so a partly written namelist
+   //  is never left for the model to read.
+   std::string tmpfile = filename + ".tmp";
+   {
+      std::ofstream output(tmpfile);
+      if (!output.is_open()) {
+         cerr << "..namelist: unable to write " << tmpfile << std::endl;
+         return false;
+      }
+      for (auto& line : nml.lines) output << line << '\n';
+      output.flush();
+      if (!output.good()) {
+         cerr << "..namelist: error writing " << tmpfile << std::endl;
+         return false;
+      }
+   }
+   if (rename(tmpfile.c_str(), filename.c_str()) != 0) {
+      cerr << "..namelist: unable to rename " << tmpfile << " to " << filename << std::endl;
+      return false;
+   }
+   return true;
+}
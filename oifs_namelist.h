@@ -0,0 +1,54 @@
+//
+// Fortran namelist parser for the OpenIFS fort.4 file, see oifs_namelist.cpp
+//
+
+#ifndef OIFS_NAMELIST_H
+#define OIFS_NAMELIST_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <istream>
+
+// Position of (part of) a value in the namelist text, for rewriting it in place
+struct namelist_span {
+    size_t line, start, len;
+};
+
+struct namelist_variable {
+    std::string group;                  // group name, upper case
+    std::string name;                   // variable name, upper case, including any index e.g. NHISTS(0)
+    std::string value;                  // value as written, without the trailing comma. Values over
+                                        // several lines are joined with a comma.
+    std::vector<namelist_span> spans;   // where the value is written, one span per line
+};
+
+struct namelist_group {
+    std::string name;                   // upper case
+    size_t first_line;                  // line of the '&NAME'
+    size_t end_line;                    // line of the terminating '/', npos if not terminated
+};
+
+// Indexed representation of a namelist file. The text is kept line by line so values can be
+// changed in place and the file written back with its layout and comments unchanged.
+struct oifs_namelist {
+    std::vector<std::string> lines;
+    std::vector<namelist_group> groups;
+    std::vector<namelist_variable> variables;           // in the order written
+    std::map<std::string, std::string> directives;     // CPDN '!KEY=value' comment lines, KEY -> value
+};
+
+bool namelist_parse(std::istream&, oifs_namelist&);
+bool namelist_read(const std::string&, oifs_namelist&);
+const namelist_variable* namelist_find(const oifs_namelist&, std::string_view, std::string_view);
+bool namelist_get(const oifs_namelist&, std::string_view, std::string_view, std::string&);
+bool namelist_get_int(const oifs_namelist&, std::string_view, std::string_view, int&);
+bool namelist_get_double(const oifs_namelist&, std::string_view, std::string_view, double&);
+bool namelist_get_string(const oifs_namelist&, std::string_view, std::string_view, std::string&);
+bool namelist_directive(const oifs_namelist&, std::string_view, std::string&);
+bool namelist_cpdn_value(const oifs_namelist&, std::string_view, std::string&);
+bool namelist_set(oifs_namelist&, std::string_view, std::string_view, const std::string&);
+bool namelist_write(const oifs_namelist&, const std::string&);
+
+#endif
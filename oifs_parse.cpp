@@ -0,0 +1,156 @@
+//
+// String and parsing helpers for the OpenIFS controller
+//
+// These are called every time round the main loop (ifs.stat parsing, step checks, output file names),
+// so they work on std::string_view and std::from_chars and reuse the caller's strings rather than
+// creating temporaries. Their behaviour is checked against the original implementations, and their
+// cost measured, by bench/micro_bench.cpp.
+//
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <ctype.h>
+#include <stdio.h>
+#include "oifs_parse.h"
+
+using namespace std;
+
+// isspace() in the "C" locale, without the locale lookup
+static inline bool is_space(char c) {
+   return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+
+// Open a file and return the string contained between the arrow tags
+std::string get_tag(const std::string &filename) {
+    std::ifstream file(filename);
+    std::string line;
+
+    // Only the first line is examined, as BOINC writes soft link files as a single line
+    if (file.is_open() && getline(file, line)) {
+       std::string_view view(line);
+       std::string_view::size_type start = view.find('>');
+       if (start != view.npos) {
+          std::string_view::size_type end = view.find('<', start + 1);
+          if (end != view.npos) return std::string(view.substr(start + 1, end - start - 1));
+       }
+    }
+    return "";
+}
+
+
+// Construct the second part of the file to be uploaded: exptid+NNNNNN, with the step zero padded to 6 digits.
+// Returns an empty string if the step is empty or longer than 6 digits.
+std::string get_second_part(const std::string& last_iter, const std::string& exptid) {
+   std::string second_part;
+
+   if (last_iter.empty() || last_iter.length() > 6) return second_part;
+
+   second_part.reserve(exptid.length() + 7);
+   second_part.append(exptid);
+   second_part.push_back('+');
+   second_part.append(6 - last_iter.length(), '0');
+   second_part.append(last_iter);
+   return second_part;
+}
+
+
+bool oifs_parse_int(std::string_view str, int& value) {
+   //  Convert a string to an integer as std::stoi does: leading whitespace and a sign are allowed
+   //  and conversion stops at the first character that is not a digit.
+   //  Returns false if there are no digits or the value is out of range, without throwing.
+
+   size_t pos = 0;
+   while (pos < str.size() && is_space(str[pos])) pos++;
+   if (pos < str.size() && str[pos] == '+') {
+      pos++;
+      if (pos < str.size() && str[pos] == '-') return false;
+   }
+
+   auto result = std::from_chars(str.data() + pos, str.data() + str.size(), value);
+   return result.ec == std::errc();
+}
+
+
+bool check_stoi(const std::string& cin) {
+    //  check input string is convertable to an integer by checking for any letters
+    //  nb. stoi() will convert leading digits if alphanumeric but we know step must be all digits.
+    //  Returns true on success, false if non-numeric data in input string.
+    //  Glenn Carver
+
+    int step;
+
+    for (char c : cin) {
+       if (isalpha((unsigned char) c)) {
+          cerr << "..Invalid characters in stoi string: " << cin << std::endl;
+          return false;
+       }
+    }
+
+    //  n.b. still need to check step <= max_step
+    if (!oifs_parse_int(cin, step)) {
+       cerr << "..Invalid input argument or out of range value for stoi : " << cin << std::endl;
+       return false;
+    }
+    return true;
+}
+
+
+bool oifs_parse_stat(const std::string& logline, std::string& stat_column, int index) {
+   //   Parse a line of the OpenIFS ifs.stat log file, previously obtained from oifs_get_statline
+   //      logline  : incoming ifs.stat logfile line to be parsed
+   //      stat_col : returned string given by position 'index'
+   //  If the line has fewer than 'index' columns, the last column is returned (as reading with an
+   //  istringstream did), the caller checks it is a valid step.
+   //  Returns false if string is empty.
+
+   std::string_view line(logline), column;
+   size_t pos = 0;
+
+   //  split input, get token specified by 'column' unless file is corrupted
+   for (int i=0; i<index; ++i) {
+      while (pos < line.size() && is_space(line[pos])) pos++;
+      if (pos == line.size()) break;
+      size_t start = pos;
+      while (pos < line.size() && !is_space(line[pos])) pos++;
+      column = line.substr(start, pos - start);
+   }
+
+   if ( column.empty() ){
+      return false;
+   } else {
+      stat_column.assign(column);      // reuses the capacity of stat_column
+      return true;
+   }
+}
+
+
+bool oifs_valid_step(const std::string& step, int nsteps) {
+   //  checks for a valid step count in arg 'step'
+   //  Returns :   true if step is valid, otherwise false
+   //      Glenn
+
+   int istep;
+
+   // make sure step is valid integer
+   if (!check_stoi(step) || !oifs_parse_int(step, istep)) {
+      cerr << "oifs_valid_step: Invalid characters in stoi string, unable to convert step to int: " << step << '\n';
+      return false;
+   }
+
+   // check step is in valid range: 0 -> total no. of steps
+   return (istep >= 0 && istep <= nsteps);
+}
+
+
+long oifs_stat_time(const std::string& logline) {
+   //  Time of day of a line of ifs.stat, from its first column 'HH:MM:SS'.
+   //  Returns: seconds since midnight, or -1 if the line has no time.
+   int hh, mm, ss;
+   if ( sscanf(logline.c_str(), " %d:%d:%d", &hh, &mm, &ss) != 3 ) return -1;
+   return hh * 3600L + mm * 60L + ss;
+}
+
@@ -0,0 +1,21 @@
+//
+// String and parsing helpers for the OpenIFS controller: file names and ifs.stat lines.
+// These run every time round the controller's main loop, so avoid allocating where they can;
+// their cost is measured by bench/micro_bench.cpp.
+//
+
+#ifndef OIFS_PARSE_H
+#define OIFS_PARSE_H
+
+#include <string>
+#include <string_view>
+
+std::string get_tag(const std::string&);
+std::string get_second_part(const std::string&, const std::string&);
+bool oifs_parse_int(std::string_view, int&);
+bool check_stoi(const std::string&);
+bool oifs_parse_stat(const std::string&, std::string&, int);
+bool oifs_valid_step(const std::string&, int);
+long oifs_stat_time(const std::string&);
+
+#endif
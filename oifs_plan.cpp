@@ -0,0 +1,107 @@
+//
+// Upload planning for the OpenIFS controller
+//
+// The result files are uploaded in zips, upload_file_0, upload_file_1, ..., declared in the task's result template
+// by the submit script, which makes one for each upload interval (UPLOAD_INTERVAL steps in fort.4) of the forecast.
+// Cutting the uploads by steps alone makes their size follow the output frequency and the resolution: an upload may
+// be a few MB or several GB, and on a slow link a failed upload of a large one is costly to retry.
+//
+// With !UPLOAD_TARGET_MB set in fort.4, an upload is cut when the result files waiting in temp_path reach that
+// size, or when the oldest of them has waited !UPLOAD_MAX_LATENCY_MINS, rather than every upload interval. The
+// upload files declared bound the number of uploads, so the upload interval then sets the most uploads a task can
+// make, and the target their size: an upload is never cut before its share of the steps left, the steps left
+// divided by the upload files left, so the declared files last to the end of the forecast. The final upload takes
+// the last declared file, and the files not used by the uploads before it are uploaded empty, so the client finds
+// every file of the result template.
+//
+// Without !UPLOAD_TARGET_MB the uploads are cut every upload interval, as they always were.
+//
+// An upload asked for through the control socket (see oifs_control.cpp) is cut as soon as its share of the steps
+// left allows, whatever the size of its files. Without a size target that is the end of the upload interval.
+//
+
+#include <string>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "oifs_plan.h"
+
+
+void plan_init(upload_planner& plan, long long target_bytes, double max_latency, int interval_steps, int total_steps) {
+   //  Set up the planner. The upload files declared are those the submit script makes, one for each
+   //  upload interval of the forecast.
+
+   plan.target_bytes   = target_bytes;
+   plan.max_latency    = max_latency;
+   plan.interval_steps = interval_steps;
+   plan.total_steps    = total_steps;
+   plan.slots          = (interval_steps > 0) ? (total_steps + interval_steps - 1) / interval_steps : 0;
+}
+
+
+// Total size of the files in temp_path, and the age of the oldest (by modification time)
+static bool scan_pending(upload_planner& plan, const std::string& temp_path) {
+   DIR* dirp = opendir(temp_path.c_str());
+   if (dirp == NULL) return false;
+   long long bytes = 0;
+   time_t oldest = 0;
+   struct dirent* dir;
+   struct stat st;
+   while ((dir = readdir(dirp)) != NULL) {
+      if (dir->d_name[0] == '.') continue;
+      if (fstatat(dirfd(dirp), dir->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+         bytes += st.st_size;
+         if (oldest == 0 || st.st_mtime < oldest) oldest = st.st_mtime;
+      }
+   }
+   closedir(dirp);
+   plan.pending_bytes = bytes;
+   plan.oldest_secs   = (oldest > 0) ? difftime(time(NULL), oldest) : 0;
+   return true;
+}
+
+
+bool plan_upload_due(upload_planner& plan, const std::string& temp_path, int upload_file_number, int first_step, int step) {
+   //  Check whether an upload of the result files of steps first_step to step - 1 is to be made now, as the
+   //  upload numbered upload_file_number. The final upload, at the end of the forecast, is made regardless.
+   //  Returns: true if the upload is due, with the reason in plan.reason.
+
+   int span = step - first_step;
+   if (step >= plan.total_steps || span <= 0) return false;
+
+   int earliest = plan_earliest_step(plan, upload_file_number, first_step);
+   if (plan.requested && earliest >= 0 && step >= earliest) {
+      plan.reason = "request";
+      return true;
+   }
+
+   if (plan.target_bytes <= 0) {
+      plan.reason = "upload interval";
+      return span >= plan.interval_steps;
+   }
+
+   // Never cut before this upload's share of the steps left
+   if (earliest < 0 || step < earliest) return false;
+
+   if (!scan_pending(plan, temp_path)) return false;
+   if (plan.pending_bytes >= plan.target_bytes) {
+      plan.reason = "size target";
+      return true;
+   }
+   if (plan.max_latency > 0 && plan.pending_bytes > 0 && plan.oldest_secs >= plan.max_latency) {
+      plan.reason = "latency limit";
+      return true;
+   }
+   return false;
+}
+
+
+int plan_earliest_step(const upload_planner& plan, int upload_file_number, int first_step) {
+   //  The first step the upload numbered upload_file_number, of the result files from first_step, can be cut at:
+   //  the end of its share of the steps left, keeping the last upload file for the final upload.
+   //  Returns: the step, or -1 if only the final upload is left.
+
+   int uploads_left = plan.slots - upload_file_number;
+   if (uploads_left <= 1) return -1;
+   return first_step + (plan.total_steps - first_step + uploads_left - 1) / uploads_left;
+}
@@ -0,0 +1,28 @@
+//
+// Upload planning for the OpenIFS controller: when to cut an upload, by its size and the age of its files within
+// the upload files declared for the task, see oifs_plan.cpp
+//
+
+#ifndef OIFS_PLAN_H
+#define OIFS_PLAN_H
+
+#include <string>
+
+struct upload_planner {
+    long long   target_bytes = 0;             // size of upload aimed for, 0 to upload every upload interval
+    double      max_latency = 0;              // secs a result file may wait to be uploaded, 0 for no limit
+    int         slots = 0;                    // upload files declared: upload_file_0 .. upload_file_<slots - 1>
+    int         interval_steps = 0;           // the upload interval, in steps
+    int         total_steps = 0;
+
+    long long   pending_bytes = 0;            // result files waiting in temp_path, at the last check
+    double      oldest_secs = 0;              // age of the oldest of them
+    const char* reason = "";                  // why the last upload was due
+    bool        requested = false;            // an upload was asked for through the control socket
+};
+
+void plan_init(upload_planner&, long long, double, int, int);
+bool plan_upload_due(upload_planner&, const std::string&, int, int, int);
+int  plan_earliest_step(const upload_planner&, int, int);
+
+#endif
@@ -0,0 +1,130 @@
+//
+// DrHook profiling for the OpenIFS controller
+//
+// The model is run with DrHook on (DR_HOOK=1) for its tracebacks, with its heap and stack checks off. DrHook can
+// also time each routine (DR_HOOK_OPT=prof): at the end of the run it writes a profile for each MPI task,
+// drhook.prof.<task>, listing for each routine and thread the time spent in it and the calls made to it:
+//
+//        #  % Time         Cumul         Self        Total     # of calls        Self       Total    Routine@<thread-id>
+//        1    10.43       30.264       30.264       30.271        1056        28.66       28.67    *CLOUDSC@1
+//
+// A fraction of the tasks, set by !DRHOOK_PROFILE_FRACTION in fort.4, run with profiling on. At the end of the
+// forecast the controller condenses the profiles to a table of the time in each routine, summed over the threads,
+// and adds it to the final upload as oifs_profile.txt:
+//
+//    # OpenIFS DrHook profile
+//    # <key> <value>                           the task, host and run: cpu, nthreads, resolution, steps, ...
+//    # routine self_secs total_secs calls threads
+//    CLOUDSC 120.480 120.512 4224 4
+//
+// The routines are listed by their own time, the most first. oifs_profile_merge.py merges the tables of many
+// tasks, from hosts with different cpus, into the share of the model's time each routine takes.
+//
+// The cost of DrHook itself is measured by running a fraction of the tasks with it off, set by
+// !DRHOOK_OFF_FRACTION, and comparing their step times with those of the tasks with it on. The setting of each
+// task is sent in its trickles (dh in <pf>). Which tasks are profiled or have DrHook off is taken from a hash of
+// the workunit id, so a task keeps its setting when it is restarted.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <stdio.h>
+#include <ctype.h>
+#include "oifs_delta.h"
+#include "oifs_profile.h"
+
+
+drhook_mode profile_select(const std::string& wuid, double profile_fraction, double off_fraction) {
+   //  Select the DrHook setting of the task from its workunit id: profiling for profile_fraction of the tasks,
+   //  off for off_fraction of them, and on for the rest.
+
+   double draw = oifs_crc32(0, wuid.data(), wuid.size()) / 4294967296.0;
+   if (draw < profile_fraction) return drhook_profiling;
+   if (draw < profile_fraction + off_fraction) return drhook_off;
+   return drhook_on;
+}
+
+
+// Add the routines of one profile file, a line per routine and thread
+static bool profile_read(const std::string& file, drhook_profile& profile) {
+   std::ifstream input(file);
+   if (!input.is_open()) return false;
+   std::string line;
+   while (std::getline(input, line)) {
+      std::istringstream fields(line);
+      std::vector<std::string> tokens;
+      std::string token;
+      while (fields >> token) tokens.push_back(token);
+      if (tokens.size() < 9 || !std::all_of(tokens[0].begin(), tokens[0].end(), ::isdigit)) continue;
+
+      double self_secs, total_secs;
+      long long calls;
+      if (sscanf(tokens[3].c_str(), "%lf", &self_secs) != 1 || sscanf(tokens[4].c_str(), "%lf", &total_secs) != 1 ||
+          sscanf(tokens[5].c_str(), "%lld", &calls) != 1) continue;
+      std::string name = tokens[8];
+      if (!name.empty() && name[0] == '*') name.erase(0, 1);
+      name = name.substr(0, name.find('@'));
+      if (name.empty()) continue;
+
+      profile_routine& routine = profile.routines[name];
+      routine.self_secs  += self_secs;
+      routine.total_secs += total_secs;
+      routine.calls      += calls;
+      routine.threads++;
+   }
+   return true;
+}
+
+
+int profile_collect(const std::string& slot_path, const std::string& prefix, drhook_profile& profile) {
+   //  Read the profile files written by the model in the slot, those whose names start with 'prefix'.
+   //  Returns: the number of files read.
+
+   std::error_code ec;
+   for (const auto& entry : std::filesystem::directory_iterator(slot_path, ec)) {
+      std::string name = entry.path().filename().string();
+      if (name.compare(0, prefix.size(), prefix) != 0 || !entry.is_regular_file(ec)) continue;
+      if (profile_read(entry.path().string(), profile)) profile.files++;
+   }
+   return profile.files;
+}
+
+
+bool profile_write(const drhook_profile& profile, const std::string& path,
+                   const std::vector<std::pair<std::string, std::string>>& header, int max_routines) {
+   //  Write the table of the routines' times, the 'max_routines' with the most time of their own, after the
+   //  header lines describing the task. The file is written under a temporary name and renamed.
+   //  Returns: false if the table could not be written.
+
+   std::vector<std::pair<std::string, profile_routine>> routines(profile.routines.begin(), profile.routines.end());
+   std::sort(routines.begin(), routines.end(),
+             [](const auto& a, const auto& b) { return a.second.self_secs > b.second.self_secs; });
+   if ((int) routines.size() > max_routines) routines.resize(max_routines);
+
+   std::string tmpfile = path + ".tmp";
+   bool ok;
+   {
+      std::ofstream output(tmpfile);
+      output << "# OpenIFS DrHook profile" << '\n';
+      for (const auto& field : header) output << "# " << field.first << ' ' << field.second << '\n';
+      output << "# routine self_secs total_secs calls threads" << '\n';
+      char line[256];
+      for (const auto& routine : routines) {
+         snprintf(line, sizeof(line), "%s %.3f %.3f %lld %d\n", routine.first.c_str(), routine.second.self_secs,
+                  routine.second.total_secs, routine.second.calls, routine.second.threads);
+         output << line;
+      }
+      output.flush();
+      ok = output.good();
+   }
+   if (!ok || rename(tmpfile.c_str(), path.c_str()) != 0) {
+      std::remove(tmpfile.c_str());
+      return false;
+   }
+   return true;
+}
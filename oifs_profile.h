@@ -0,0 +1,32 @@
+//
+// DrHook profiling for the OpenIFS controller: the profile run by a sample of tasks, condensed to a table of the
+// time spent in each routine for the final upload, see oifs_profile.cpp
+//
+
+#ifndef OIFS_PROFILE_H
+#define OIFS_PROFILE_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+// DrHook setting of a task: off, on (tracing only, the default) or on with profiling
+enum drhook_mode { drhook_off = 0, drhook_on = 1, drhook_profiling = 2 };
+
+struct profile_routine {
+    double      self_secs = 0;                // time in the routine itself, summed over the threads
+    double      total_secs = 0;               // including the routines it calls, summed over the threads
+    long long   calls = 0;
+    int         threads = 0;                  // threads the routine was called on
+};
+
+struct drhook_profile {
+    std::map<std::string, profile_routine> routines;     // by routine name, without the thread
+    int         files = 0;                    // profile files read
+};
+
+drhook_mode profile_select(const std::string&, double, double);
+int  profile_collect(const std::string&, const std::string&, drhook_profile&);
+bool profile_write(const drhook_profile&, const std::string&, const std::vector<std::pair<std::string, std::string>>&, int);
+
+#endif
@@ -0,0 +1,136 @@
+#! /usr/bin/python3
+
+# Script to merge the DrHook profiles of OpenIFS tasks
+
+# Workunits run with the !DRHOOK_PROFILE_FRACTION directive profile that fraction of their tasks, which add a
+# table of the model's time in each routine, oifs_profile.txt, to their final upload (see oifs_profile.cpp for
+# the format). This script reads the tables from the upload zips, or the tables already extracted, and merges
+# them: for each routine the share of the model's time it takes, averaged over the tasks, the spread of the share
+# and the time summed over the tasks. The tables can be grouped by the cpu, thread count or resolution of the task.
+#
+#    ./oifs_profile_merge.py upload_3.zip [upload_7.zip ...]
+#    ./oifs_profile_merge.py --by cpu --top 30 <folder of tables or zips>
+#
+# The cost of DrHook itself is taken from the tasks' trickles, whose <pf> record has the task's mean step time
+# (st) and DrHook setting (dh: 0 off, 1 on, 2 profiling). With --trickles the mean step time of each setting is
+# compared with that of the tasks with DrHook off, which should be of the same batch.
+#
+#    ./oifs_profile_merge.py --trickles <folder of trickle files> upload_3.zip ...
+
+import os, re, sys, zipfile, argparse, statistics
+
+
+def parse_table(text, source):
+    # Returns the header fields and the routines, name -> self secs, of a table
+    header, routines = {}, {}
+    for line in text.splitlines():
+        if line.startswith('#'):
+            fields = line[1:].strip().split(None, 1)
+            if len(fields) == 2 and fields[0] != 'routine':
+                header[fields[0]] = fields[1]
+            continue
+        fields = line.split()
+        if len(fields) < 2:
+            continue
+        try:
+            routines[fields[0]] = float(fields[1])
+        except ValueError:
+            print(source + ': skipping the line: ' + line, file=sys.stderr)
+    return header, routines
+
+
+def read_tables(paths):
+    # Returns the tables in the files, zips and folders given, as (source, header, routines)
+    tables = []
+    for path in paths:
+        if os.path.isdir(path):
+            tables += read_tables(sorted(os.path.join(path, name) for name in os.listdir(path)
+                                         if name.endswith('.zip') or name.endswith('oifs_profile.txt')))
+        elif zipfile.is_zipfile(path):
+            with zipfile.ZipFile(path) as zf:
+                for name in zf.namelist():
+                    if os.path.basename(name) == 'oifs_profile.txt':
+                        header, routines = parse_table(zf.read(name).decode(errors='replace'), path)
+                        tables.append((path, header, routines))
+        elif os.path.isfile(path):
+            with open(path, errors='replace') as f:
+                header, routines = parse_table(f.read(), path)
+            tables.append((path, header, routines))
+    return [table for table in tables if table[2]]
+
+
+def merge(tables, top):
+    # Print the share of the time of each routine, averaged over the tables
+    shares = {}
+    secs = {}
+    for _, _, routines in tables:
+        total = sum(routines.values())
+        if total <= 0:
+            continue
+        for name, self_secs in routines.items():
+            shares.setdefault(name, []).append(self_secs / total)
+            secs[name] = secs.get(name, 0.0) + self_secs
+    ntables = len(tables)
+    # A routine missing from a table (below its cut) counts as no time in it
+    rows = []
+    for name, values in shares.items():
+        values = values + [0.0] * (ntables - len(values))
+        rows.append((statistics.mean(values), statistics.pstdev(values), secs[name], len(shares[name]), name))
+    rows.sort(reverse=True)
+    print('%-32s %8s %8s %14s %6s' % ('routine', 'share%', 'sd%', 'self_secs', 'tasks'))
+    for mean, sd, total_secs, ntasks, name in rows[:top]:
+        print('%-32s %8.2f %8.2f %14.1f %6d' % (name, 100 * mean, 100 * sd, total_secs, ntasks))
+
+
+def drhook_cost(paths):
+    # Print the mean step time of the tasks by their DrHook setting, from the <pf> records of their trickles
+    steps = {}
+    for path in paths:
+        files = [os.path.join(path, name) for name in sorted(os.listdir(path))] if os.path.isdir(path) else [path]
+        for name in files:
+            with open(name, errors='replace') as f:
+                text = f.read()
+            for record in re.findall(r'<pf>(.*?)</pf>', text, re.S):
+                fields = dict(field.split('=', 1) for field in record.split(',') if '=' in field)
+                try:
+                    step, setting = float(fields['st']), int(float(fields.get('dh', 1)))
+                except (KeyError, ValueError):
+                    continue
+                if step > 0:
+                    steps.setdefault(setting, []).append(step)
+    names = {0: 'off', 1: 'on', 2: 'profiling'}
+    base = statistics.mean(steps[0]) if steps.get(0) else 0
+    print('%-10s %8s %12s %10s' % ('drhook', 'records', 'step_secs', 'cost%'))
+    for setting in sorted(steps):
+        mean = statistics.mean(steps[setting])
+        cost = '%10.2f' % (100 * (mean / base - 1)) if base > 0 else '%10s' % '-'
+        print('%-10s %8d %12.3f %s' % (names.get(setting, str(setting)), len(steps[setting]), mean, cost))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Merge the DrHook profiles of OpenIFS tasks')
+    parser.add_argument('paths', nargs='*', help='upload zips, oifs_profile.txt files, or folders of them')
+    parser.add_argument('--by', choices=['cpu', 'nthreads', 'resolution'], help='merge the tables of each group separately')
+    parser.add_argument('--top', type=int, default=50, help='routines to list, default 50')
+    parser.add_argument('--trickles', nargs='+', default=[], help='trickle files, or folders of them, for the cost of DrHook')
+    args = parser.parse_args()
+
+    tables = read_tables(args.paths)
+    if args.paths and not tables:
+        print('No DrHook profiles found', file=sys.stderr)
+        return 1
+    if tables:
+        groups = {}
+        for table in tables:
+            groups.setdefault(table[1].get(args.by, 'unknown') if args.by else 'all', []).append(table)
+        for group in sorted(groups):
+            print('== %s: %d tasks ==' % (group, len(groups[group])))
+            merge(groups[group], args.top)
+            print()
+    if args.trickles:
+        drhook_cost(args.trickles)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
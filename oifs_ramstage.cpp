@@ -0,0 +1,257 @@
+//
+// Output staging in memory for the OpenIFS controller
+//
+// Each result file (ICMGG/ICMSH/ICMUA) is written by the model to the slot, moved to temp_path, read again to be
+// zipped and written a third time as the upload zip. On a host with a slow disk and memory to spare, with
+// !RAM_STAGING_MB set in fort.4, the controller has the model write the result files to a folder in /dev/shm
+// (tmpfs) instead. Before the model reaches a step that writes output, the controller links the step's file
+// names in the slot to the folder, and the model writes through the links. Moving a result file to temp_path
+// moves the link, so the file is read from memory when it is zipped, and the upload zip is the only write to disk.
+//
+// The outputs held in memory are limited to !RAM_STAGING_MB, and half the memory available at the start above
+// what the host keeps available (an eighth of its memory, or 512 MB). Steps are linked a few at a time ahead of
+// the model, as far as the limit allows at the size of the largest step seen; the first steps go to disk until
+// one has been seen. When the memory available falls below what the host keeps available, the outputs in memory
+// are written to temp_path on disk and no more steps are linked until it passes. A file in memory no link refers
+// to (its step was uploaded, or rewritten by the output filter) is deleted.
+//
+// The contents of /dev/shm do not survive a reboot. The outputs in memory are written to disk whenever the model
+// makes a restart dump, so those it will not compute again when it is relaunched from the dump are on disk. The
+// links left by an earlier start whose files are gone are removed before the model is relaunched. The folder is
+// deleted when the controller ends, unless the client quit the task and will restart it.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+#include "oifs_parse.h"
+#include "oifs_zip.h"
+#include "oifs_recover.h"
+#include "oifs_ramstage.h"
+
+using namespace std;
+
+// Steps linked ahead of the model at most
+static const int ram_lookahead = 4;
+
+static const char* ram_prefixes[] = {"ICMGG", "ICMSH", "ICMUA"};
+
+
+// A value from /proc/meminfo in bytes, or -1 if it is not known
+static long long meminfo_bytes(const std::string& key) {
+   std::ifstream meminfo("/proc/meminfo");
+   std::string line;
+   while (std::getline(meminfo, line)) {
+      if (line.compare(0, key.size(), key) == 0 && line.size() > key.size() && line[key.size()] == ':') {
+         long long kb = -1;
+         std::istringstream(line.substr(key.size() + 1)) >> kb;
+         return (kb < 0) ? -1 : kb << 10;
+      }
+   }
+   return -1;
+}
+
+
+// Whether a file in 'folder' is a link into the staging folder, with the name of the file it refers to
+static bool staged_link(const ram_stage& stage, const std::filesystem::directory_entry& entry, std::string& target) {
+   std::error_code ec;
+   if (!entry.is_symlink(ec)) return false;
+   std::filesystem::path link = std::filesystem::read_symlink(entry.path(), ec);
+   if (ec || link.parent_path().string() != stage.path) return false;
+   target = link.filename().string();
+   return true;
+}
+
+
+bool ram_stage_init(ram_stage& stage, const std::string& slot_path, const std::string& temp_path, const std::string& exptid,
+                    const std::string& name, int output_interval, long long max_bytes) {
+   //  Set up the staging folder /dev/shm/<name>, to hold at most max_bytes of outputs, and remove the links
+   //  left by an earlier start whose files are gone. A folder left by an earlier start is only used if it is
+   //  a folder (not a link) owned by the user, that only the user can use: /dev/shm is writable by all users.
+   //  Returns: false if the outputs cannot be held in memory, /dev/shm is not a tmpfs, memory is short, or the
+   //  folder is not safe to use.
+
+   stage = ram_stage();
+#ifdef __linux__
+   long long available = meminfo_bytes("MemAvailable"), total = meminfo_bytes("MemTotal");
+   if (available < 0 || total <= 0) return false;
+   stage.min_available = std::max(512LL << 20, total / 8);
+   stage.budget        = std::min(max_bytes, (available - stage.min_available) / 2);
+   if (stage.budget <= 0) return false;
+
+   struct statfs fs;
+   if (statfs("/dev/shm", &fs) != 0 || fs.f_type != TMPFS_MAGIC) return false;
+   std::string path = "/dev/shm/" + name;
+   if (mkdir(path.c_str(), S_IRWXU) != 0 && errno != EEXIST) return false;
+   struct stat st;
+   if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+       (st.st_mode & 07777) != S_IRWXU) {
+      cerr << "..Staging folder in memory not used, it is not a folder only the user can use: " << path << '\n';
+      return false;
+   }
+
+   stage.path            = path;
+   stage.slot_path       = slot_path;
+   stage.temp_path       = temp_path;
+   stage.exptid          = exptid;
+   stage.output_interval = std::max(output_interval, 1);
+
+   for (const std::string& folder : {slot_path, temp_path}) {
+      std::error_code ec;
+      std::vector<std::filesystem::path> gone;
+      for (const auto& entry : std::filesystem::directory_iterator(folder, ec)) {
+         std::string target;
+         if (staged_link(stage, entry, target) && !std::filesystem::exists(path + "/" + target)) gone.push_back(entry.path());
+      }
+      for (const auto& link : gone) std::filesystem::remove(link, ec);
+      if (folder == temp_path) stage.lost = gone.size();
+   }
+   return true;
+#else
+   return false;
+#endif
+}
+
+
+void ram_stage_measure(ram_stage& stage, const std::string& second_part) {
+   //  Take the size of the outputs of a step the controller has moved to temp_path, and remove the links in the
+   //  slot for its files the model did not write (e.g. no ICMUA before 43r3).
+
+   if (stage.path.empty()) return;
+   long long bytes = 0;
+   struct stat st;
+   for (const char* prefix : ram_prefixes) {
+      std::string name = prefix + second_part;
+      if (stat((stage.temp_path + "/" + name).c_str(), &st) == 0) bytes += st.st_size;
+      if (lstat((stage.slot_path + "/" + name).c_str(), &st) == 0 && S_ISLNK(st.st_mode) &&
+          stat((stage.path + "/" + name).c_str(), &st) != 0) {
+         std::remove((stage.slot_path + "/" + name).c_str());
+      }
+   }
+   stage.step_bytes = std::max(stage.step_bytes, bytes);
+}
+
+
+bool ram_stage_check(ram_stage& stage) {
+   //  Delete the files in memory no link refers to, count those held and the steps linked the model has not
+   //  yet written, and check the memory available.
+   //  Returns: true if memory is short, the outputs are then to be written to disk (ram_stage_spill).
+
+   if (stage.path.empty()) return false;
+   std::set<std::string> linked;
+   std::set<int> pending;
+   std::error_code ec;
+   for (const std::string& folder : {stage.slot_path, stage.temp_path}) {
+      for (const auto& entry : std::filesystem::directory_iterator(folder, ec)) {
+         std::string target, second_part;
+         if (!staged_link(stage, entry, target)) continue;
+         linked.insert(target);
+         int step = output_step(target, stage.exptid, second_part);
+         if (folder == stage.slot_path && step >= 0 && !std::filesystem::exists(stage.path + "/" + target)) pending.insert(step);
+      }
+   }
+   stage.bytes = 0;
+   std::vector<std::filesystem::path> unlinked;
+   for (const auto& entry : std::filesystem::directory_iterator(stage.path, ec)) {
+      if (linked.count(entry.path().filename().string()) == 0) {
+         unlinked.push_back(entry.path());
+      } else {
+         stage.bytes += entry.file_size(ec);
+      }
+   }
+   for (const auto& file : unlinked) std::filesystem::remove(file, ec);
+   stage.pending_steps = pending.size();
+
+   long long available = meminfo_bytes("MemAvailable");
+   stage.short_of_memory = (available >= 0 && available < stage.min_available);
+   return stage.short_of_memory;
+}
+
+
+int ram_stage_link(ram_stage& stage, int step, int last_step) {
+   //  Link the files of the next steps with output, from 'step' to 'last_step', in the slot to the staging
+   //  folder, as many as fit in the memory left at the size of the largest step seen.
+   //  Returns: the number of steps linked.
+
+   if (stage.path.empty() || stage.short_of_memory || stage.step_bytes <= 0) return 0;
+   long long room = (stage.budget - stage.bytes) / stage.step_bytes - stage.pending_steps;
+   room = std::min(room, (long long) ram_lookahead - stage.pending_steps);
+
+   int first = std::max(step, stage.linked_step + 1);
+   first = ((first + stage.output_interval - 1) / stage.output_interval) * stage.output_interval;
+   int linked = 0;
+   for (int s = first; s <= last_step && linked < room; s += stage.output_interval) {
+      std::string second_part = get_second_part(std::to_string(s), stage.exptid);
+      for (const char* prefix : ram_prefixes) {
+         std::error_code ec;
+         std::filesystem::create_symlink(stage.path + "/" + prefix + second_part, stage.slot_path + "/" + prefix + second_part, ec);
+      }
+      stage.linked_step = s;
+      linked++;
+   }
+   stage.pending_steps += linked;
+   return linked;
+}
+
+
+long long ram_stage_spill(ram_stage& stage, std::map<std::string, zip_source>& moved_sources) {
+   //  Write the outputs in memory that have been moved to temp_path to disk, in place of their links, taking
+   //  their CRC32 for the upload zip as they are copied.
+   //  Returns: the bytes written to disk.
+
+   if (stage.path.empty()) return 0;
+   long long bytes = 0;
+   std::error_code ec;
+   std::vector<std::pair<std::string, std::string>> spills;
+   for (const auto& entry : std::filesystem::directory_iterator(stage.temp_path, ec)) {
+      std::string target;
+      if (staged_link(stage, entry, target)) spills.emplace_back(entry.path().string(), stage.path + "/" + target);
+   }
+   for (const auto& spill : spills) {
+      std::string copy = spill.first + ".spill";
+      zip_source source;
+      if (!zip_move_file(spill.second, copy, source) || rename(copy.c_str(), spill.first.c_str()) != 0) {
+         cerr << "..Unable to write the output held in memory to disk: " << spill.first << std::endl;
+         std::remove(copy.c_str());
+         continue;
+      }
+      source.path = spill.first;
+      if (!source.crc_known) source.size = std::filesystem::file_size(spill.first, ec);
+      moved_sources[spill.first] = source;
+      bytes += source.size;
+   }
+   return bytes;
+}
+
+
+void ram_stage_close(ram_stage& stage) {
+   //  Remove the links to the staging folder from the slot and temp_path, and the folder.
+
+   if (stage.path.empty()) return;
+   std::error_code ec;
+   std::vector<std::filesystem::path> links;
+   for (const std::string& folder : {stage.slot_path, stage.temp_path}) {
+      for (const auto& entry : std::filesystem::directory_iterator(folder, ec)) {
+         std::string target;
+         if (staged_link(stage, entry, target)) links.push_back(entry.path());
+      }
+   }
+   for (const auto& link : links) std::filesystem::remove(link, ec);
+   std::filesystem::remove_all(stage.path, ec);
+   stage.path.clear();
+}
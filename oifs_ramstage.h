@@ -0,0 +1,36 @@
+//
+// Output staging in memory for the OpenIFS controller: the model's result files written to and zipped from a tmpfs
+// folder rather than the slot's disk, written to disk when memory runs short, see oifs_ramstage.cpp
+//
+
+#ifndef OIFS_RAMSTAGE_H
+#define OIFS_RAMSTAGE_H
+
+#include <string>
+#include <map>
+#include "oifs_zip.h"
+
+struct ram_stage {
+    std::string path;                         // folder in /dev/shm holding the outputs, empty if not in use
+    std::string slot_path, temp_path, exptid;
+    int         output_interval = 1;          // steps between the model's outputs (NFRPOS)
+    long long   budget = 0;                   // most bytes of outputs held in memory
+    long long   min_available = 0;            // memory kept available, below it the outputs are written to disk
+
+    long long   step_bytes = 0;               // outputs of a step, the largest seen
+    long long   bytes = 0;                    // outputs held in memory, at the last check
+    int         pending_steps = 0;            // steps linked in the slot the model has not yet written
+    int         linked_step = -1;             // last step linked
+    bool        short_of_memory = false;      // at the last check, no more steps are linked until it passes
+    int         spilled_step = 0;             // the outputs of steps before it have been written to disk
+    long        lost = 0;                     // outputs in memory lost since the last start (host rebooted)
+};
+
+bool ram_stage_init(ram_stage&, const std::string&, const std::string&, const std::string&, const std::string&, int, long long);
+void ram_stage_measure(ram_stage&, const std::string&);
+bool ram_stage_check(ram_stage&);
+int  ram_stage_link(ram_stage&, int, int);
+long long ram_stage_spill(ram_stage&, std::map<std::string, zip_source>&);
+void ram_stage_close(ram_stage&);
+
+#endif
@@ -0,0 +1,149 @@
+//
+// Recovery of the uploads and outputs left by a controller that stopped part way through
+//
+// The controller moves each output (ICMGG/ICMSH/ICMUA) from the slot to temp_path in the project directory, and
+// every upload interval zips those of the interval into an upload zip, deletes them and has the client upload the
+// zip. When the task is restarted (killed, the host rebooted, ...) the model continues from its last restart dump,
+// and the controller's step (last_iter) is rolled back to it. Depending on where the controller stopped it left:
+//
+//    - a zip being written, with no central directory, which the next zip of that upload would fail to update
+//    - a whole zip with its files still in temp_path, or some of them, if it stopped before the upload was made
+//    - outputs in the slot that were written before the restart dump but not yet moved
+//    - outputs in temp_path of steps that have already been uploaded, e.g. recomputed by an earlier restart
+//
+// recover_uploads() is run before the model is relaunched. A zip that is not whole (see zip_verify) is deleted:
+// its files are only deleted once it is made, so they are all still in temp_path and are zipped again at the next
+// upload. A whole zip is kept and its upload resumed rather than zipping its files again: the files it holds are
+// deleted, and the first step not uploaded is moved on past them. Outputs in the slot of steps before the restart
+// dump are final and are moved to temp_path, unless already uploaded, and outputs of steps already uploaded are
+// deleted from both. Outputs of steps from the restart dump on are left for the model to write again. A zip holding
+// the diagnostics of a failed run (oifs_diagnostics.txt.gz) is not an upload of results and is left as it is.
+//
+// Only the zip of the upload in progress is read, and the slot and temp_path are each listed once, so the cost of
+// the recovery is that of the files left behind.
+//
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "oifs_zip.h"
+#include "oifs_recover.h"
+
+
+int output_step(const std::string& name, const std::string& exptid, std::string& second_part) {
+   //  Find the step of an output file's name, ICMGG/ICMSH/ICMUA<exptid>+<6 digit step> followed by any suffix
+   //  (e.g. '.idx'), and the name's second part, as get_second_part() makes it.
+   //  Returns: the step, or -1 if the name is not an output file's.
+
+   size_t length = 5 + exptid.size() + 7;
+   if (name.size() < length || name.compare(5, exptid.size(), exptid) != 0 || name[5 + exptid.size()] != '+') return -1;
+   if (name.compare(0, 5, "ICMGG") != 0 && name.compare(0, 5, "ICMSH") != 0 && name.compare(0, 5, "ICMUA") != 0) return -1;
+   int step = 0;
+   for (size_t i = length - 6; i < length; i++) {
+      if (name[i] < '0' || name[i] > '9') return -1;
+      step = 10 * step + (name[i] - '0');
+   }
+   second_part = name.substr(5, length - 5);
+   return step;
+}
+
+
+static bool ends_with(const std::string& name, const char* suffix) {
+   size_t n = strlen(suffix);
+   return name.size() > n && name.compare(name.size() - n, n, suffix) == 0;
+}
+
+static std::vector<std::string> list_dir(const std::string& path) {
+   std::vector<std::string> names;
+   DIR* dirp = opendir(path.c_str());
+   if (dirp == NULL) return names;
+   struct dirent* dir;
+   while ((dir = readdir(dirp)) != NULL) {
+      if (dir->d_name[0] != '.') names.push_back(dir->d_name);
+   }
+   closedir(dirp);
+   return names;
+}
+
+// Move a file, copying it if temp_path is on another file system
+static bool move_file(const std::string& from, const std::string& to) {
+   if (rename(from.c_str(), to.c_str()) == 0) return true;
+   if (errno != EXDEV) return false;
+   std::error_code ec;
+   std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+   if (ec) return false;
+   std::remove(from.c_str());
+   return true;
+}
+
+
+bool recover_uploads(upload_recovery& recovery) {
+   //  Recover the upload in progress and the outputs left in the slot and temp_path when the controller stopped,
+   //  see the top of this file. The results are left in 'recovery', for the controller to resume the upload.
+   //  Returns: false if the slot or temp_path could not be read.
+
+   std::string second_part;
+   struct stat st;
+
+   // The zip of the upload in progress
+   if (!recovery.upload_zip.empty() && stat(recovery.upload_zip.c_str(), &st) == 0) {
+      std::vector<zip_entry> entries;
+      int whole = zip_verify(recovery.upload_zip, entries, recovery.zip_error);
+      if (whole == 0) {
+         std::remove(recovery.upload_zip.c_str());
+         recovery.zip = -1;
+      }
+      else if (whole > 0 && recovery.resume &&
+               std::none_of(entries.begin(), entries.end(), [](const zip_entry& entry) {
+                  return entry.name.substr(entry.name.find_last_of('/') + 1) == "oifs_diagnostics.txt.gz"; })) {
+         recovery.zip = 1;
+         recovery.zip_files = entries.size();
+         int last_step = -1;
+         for (const zip_entry& entry : entries) {
+            std::string name = entry.name.substr(entry.name.find_last_of('/') + 1);
+            if (std::remove((recovery.temp_path + "/" + name).c_str()) == 0) recovery.temp_removed++;
+            // A .delta file took the place of the output it encodes
+            if (ends_with(name, ".delta")) {
+               name.erase(name.size() - 6);
+               if (std::remove((recovery.temp_path + "/" + name).c_str()) == 0) recovery.temp_removed++;
+            }
+            last_step = std::max(last_step, output_step(name, recovery.exptid, second_part));
+         }
+         recovery.upload_step = std::max(recovery.upload_step, last_step + 1);
+      }
+   }
+
+   // Files in temp_path from an upload being made, and outputs already uploaded
+   if (stat(recovery.temp_path.c_str(), &st) != 0) return false;
+   for (const std::string& name : list_dir(recovery.temp_path)) {
+      int step = output_step(name, recovery.exptid, second_part);
+      if (ends_with(name, ".tmp") || ends_with(name, ".delta") || (step >= 0 && step < recovery.upload_step)) {
+         if (std::remove((recovery.temp_path + "/" + name).c_str()) == 0) recovery.temp_removed++;
+      }
+   }
+
+   // Outputs in the slot not yet moved to temp_path
+   if (stat(recovery.slot_path.c_str(), &st) != 0) return false;
+   for (const std::string& name : list_dir(recovery.slot_path)) {
+      int step = output_step(name, recovery.exptid, second_part);
+      if (step < 0 || name.size() != 5 + second_part.size() || step >= recovery.restart_step) continue;
+
+      std::string path = recovery.slot_path + "/" + name;
+      if (step < recovery.upload_step) {
+         if (std::remove(path.c_str()) == 0) recovery.outputs_removed++;
+         continue;
+      }
+      if (stat(path.c_str(), &st) != 0 || !move_file(path, recovery.temp_path + "/" + name)) continue;
+      recovery.bytes_moved += st.st_size;
+      if (std::find(recovery.moved.begin(), recovery.moved.end(), second_part) == recovery.moved.end())
+         recovery.moved.push_back(second_part);
+   }
+   std::sort(recovery.moved.begin(), recovery.moved.end());
+   return true;
+}
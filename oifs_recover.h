@@ -0,0 +1,32 @@
+//
+// Recovery of the uploads and outputs left by a controller that stopped part way through, for the OpenIFS
+// controller, see oifs_recover.cpp
+//
+
+#ifndef OIFS_RECOVER_H
+#define OIFS_RECOVER_H
+
+#include <string>
+#include <vector>
+
+struct upload_recovery {
+    std::string slot_path, temp_path, exptid;
+    std::string upload_zip;                   // zip of the upload the controller was making
+    bool        resume = true;                // resume the upload if its zip is whole, else leave it as it is
+    int         restart_step = 0;             // first step the relaunched model computes
+    int         upload_step = 0;              // first step not uploaded, updated if the upload is resumed
+
+    int         zip = 0;                      // 1 the zip is whole and its upload is to be resumed,
+                                              // -1 it was not whole and has been deleted, 0 neither
+    std::string zip_error;
+    long        zip_files = 0;
+    long        temp_removed = 0;             // files in temp_path already uploaded, or left by an upload
+    long        outputs_removed = 0;          // outputs in the slot of steps already uploaded
+    std::vector<std::string> moved;           // outputs moved from the slot to temp_path, by their second part
+    long long   bytes_moved = 0;
+};
+
+int  output_step(const std::string&, const std::string&, std::string&);
+bool recover_uploads(upload_recovery&);
+
+#endif
@@ -0,0 +1,305 @@
+//
+// Restart dump housekeeping for the OpenIFS controller
+//
+// Every NFRRES steps the model writes a restart set, the files srf<DDDDHHMM>.<nnnn> of the model state at that
+// time, then records the time in the restart control file rcf (CTIME) from which a relaunched model continues.
+// The model never deletes the older sets, so they stay in the slot for the whole task and count against the
+// task's disk allowance. The housekeeping deletes all but the newest sets (!RESTART_KEEP in fort.4, default 1),
+// and with !RESTART_COMPRESS=1 compresses the newest set with gzip (zlib level 1) on a background thread. The
+// compressed files are restored by restart_restore() before the model is relaunched.
+//
+// A set is only treated as complete once rcf names it and the sizes of its files are unchanged between two scans.
+// Sets newer than rcf's are being written and are never touched, so the set the model would restart from is
+// always kept whole. A file is compressed to a '.tmp' file, which is synced and renamed before the original is
+// deleted, so the file is on disk in one form or the other wherever the controller is stopped.
+//
+// The wave model's restart files (BLS*, LAW*) are left as they are.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <zlib.h>
+#include "oifs_namelist.h"
+#include "oifs_restart.h"
+
+using namespace std::chrono;
+
+
+// A compression running on a detached thread, which holds a reference to the job so it can finish
+// (or be stopped by the controller exiting) without the housekeeper waiting for it
+struct restart_job {
+    std::vector<std::string> files;           // paths to compress
+    std::atomic<bool>        done{false};
+    long                     compressed_files = 0;
+    long long                bytes_in = 0, bytes_out = 0;
+    double                   secs = 0;
+};
+
+
+// Restart file names are srf<DDDDHHMM>.<nnnn>, with '.gz' added when compressed
+static bool restart_file_tag(const char* name, std::string& tag, bool& compressed) {
+   size_t len = strlen(name);
+   if (len != 16 && !(len == 19 && strcmp(name + 16, ".gz") == 0)) return false;
+   if (strncmp(name, "srf", 3) != 0 || name[11] != '.') return false;
+   for (int i = 3; i < 16; i++) {
+      if (i != 11 && !isdigit((unsigned char) name[i])) return false;
+   }
+   tag.assign(name + 3, 8);
+   compressed = (len == 19);
+   return true;
+}
+
+static bool sync_file(const std::string& path) {
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   bool ok = (fsync(fd) == 0);
+   close(fd);
+   return ok;
+}
+
+
+bool restart_scan(const std::string& slot_path, std::vector<restart_set>& sets, std::string& current) {
+   //  Find the restart sets in the slot, oldest first, and the time of the newest complete set from rcf
+   //  ('current'), empty if the model has not yet written one.
+   //  Returns: false if the slot could not be read.
+
+   sets.clear();
+   current.clear();
+   DIR* dirp = opendir(slot_path.c_str());
+   if (dirp == NULL) return false;
+
+   std::map<std::string, restart_set> by_tag;
+   std::map<std::string, size_t> compressed_files;
+   struct dirent* dir;
+   struct stat st;
+   std::string tag;
+   bool compressed;
+   while ((dir = readdir(dirp)) != NULL) {
+      if (!restart_file_tag(dir->d_name, tag, compressed)) continue;
+      if (fstatat(dirfd(dirp), dir->d_name, &st, 0) != 0) continue;
+      restart_set& set = by_tag[tag];
+      set.tag = tag;
+      set.files.push_back(dir->d_name);
+      set.bytes += st.st_size;
+      if (compressed) compressed_files[tag]++;
+   }
+   closedir(dirp);
+
+   for (auto& entry : by_tag) {
+      entry.second.compressed = (compressed_files[entry.first] == entry.second.files.size());
+      std::sort(entry.second.files.begin(), entry.second.files.end());
+      sets.push_back(entry.second);
+   }
+
+   oifs_namelist rcf;
+   if (namelist_read(slot_path + "/rcf", rcf) && namelist_get_string(rcf, "NAMRCF", "CTIME", current)) {
+      current.erase(std::remove(current.begin(), current.end(), ' '), current.end());
+   }
+   return true;
+}
+
+
+void restart_init(restart_housekeeper& keeper, const std::string& slot_path, int keep, bool compress) {
+   keeper.slot_path = slot_path;
+   keeper.keep      = std::max(keep, 0);
+   keeper.compress  = compress;
+}
+
+
+static bool compress_file(const std::string& path, std::vector<char>& buffer, long long& bytes_in, long long& bytes_out) {
+   std::string gzfile = path + ".gz", tmpfile = gzfile + ".tmp";
+   FILE* input = fopen(path.c_str(), "rb");
+   if (input == NULL) return false;
+   gzFile output = gzopen(tmpfile.c_str(), "wb1");
+   if (output == NULL) {
+      fclose(input);
+      return false;
+   }
+
+   bool ok = true;
+   size_t n;
+   bytes_in = 0;
+   while ((n = fread(buffer.data(), 1, buffer.size(), input)) > 0) {
+      if (gzwrite(output, buffer.data(), n) != (int) n) {
+         ok = false;
+         break;
+      }
+      bytes_in += n;
+   }
+   if (ferror(input)) ok = false;
+   fclose(input);
+   if (gzclose(output) != Z_OK) ok = false;
+
+   struct stat st;
+   if (ok && sync_file(tmpfile) && stat(tmpfile.c_str(), &st) == 0 && rename(tmpfile.c_str(), gzfile.c_str()) == 0) {
+      bytes_out = st.st_size;
+      std::remove(path.c_str());
+      return true;
+   }
+   std::remove(tmpfile.c_str());
+   return false;
+}
+
+static void compress_files(std::shared_ptr<restart_job> job) {
+   #ifdef __linux__
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+   #endif
+   auto start = steady_clock::now();
+   std::vector<char> buffer(1 << 20);
+   for (const std::string& path : job->files) {
+      long long bytes_in, bytes_out;
+      if (compress_file(path, buffer, bytes_in, bytes_out)) {
+         job->compressed_files++;
+         job->bytes_in  += bytes_in;
+         job->bytes_out += bytes_out;
+      }
+   }
+   job->secs = duration<double>(steady_clock::now() - start).count();
+   job->done = true;
+}
+
+
+void restart_housekeeping(restart_housekeeper& keeper, restart_stats& stats) {
+   //  Called periodically from the main loop. Collects a compression that has finished, then once the newest
+   //  restart set is complete deletes the sets older than the newest 'keep', and starts compressing the newest.
+   //  Nothing is changed while a compression is running.
+
+   if (keeper.job) {
+      if (!keeper.job->done) return;
+      stats.compressed_files     = keeper.job->compressed_files;
+      stats.compressed_bytes_in  = keeper.job->bytes_in;
+      stats.compressed_bytes_out = keeper.job->bytes_out;
+      stats.compress_secs        = keeper.job->secs;
+      keeper.job.reset();
+   }
+
+   std::vector<restart_set> sets;
+   std::string current;
+   if (!restart_scan(keeper.slot_path, sets, current)) return;
+   for (const restart_set& set : sets) {
+      stats.sets++;
+      stats.bytes += set.bytes;
+   }
+   auto newest = std::find_if(sets.begin(), sets.end(), [&](const restart_set& set) { return set.tag == current; });
+   if (newest == sets.end()) return;
+
+   // The newest set is complete once its files have stopped changing
+   std::map<std::string, long long> sizes;
+   bool complete = true;
+   struct stat st;
+   for (const std::string& name : newest->files) {
+      if (stat((keeper.slot_path + "/" + name).c_str(), &st) != 0 || st.st_size == 0) complete = false;
+      sizes[name] = st.st_size;
+   }
+   complete = complete && (sizes == keeper.sizes);
+   keeper.sizes = sizes;
+   if (!complete) return;
+
+   if (keeper.keep > 0) {
+      int kept = 0;
+      for (auto set = sets.rbegin(); set != sets.rend(); ++set) {
+         if (set->tag > current || ++kept <= keeper.keep) continue;
+         for (const std::string& name : set->files) std::remove((keeper.slot_path + "/" + name).c_str());
+         stats.pruned_sets++;
+         stats.pruned_bytes += set->bytes;
+      }
+   }
+
+   if (keeper.compress && !newest->compressed) {
+      auto job = std::make_shared<restart_job>();
+      std::string tag;
+      bool compressed;
+      for (const std::string& name : newest->files) {
+         if (restart_file_tag(name.c_str(), tag, compressed) && !compressed) job->files.push_back(keeper.slot_path + "/" + name);
+      }
+      keeper.job = job;
+      std::thread(compress_files, job).detach();
+   }
+}
+
+
+static bool decompress_file(const std::string& gzfile, const std::string& path) {
+   std::string tmpfile = path + ".tmp";
+   gzFile input = gzopen(gzfile.c_str(), "rb");
+   if (input == NULL) return false;
+   FILE* output = fopen(tmpfile.c_str(), "wb");
+   if (output == NULL) {
+      gzclose(input);
+      return false;
+   }
+
+   std::vector<char> buffer(1 << 20);
+   bool ok = true;
+   int n;
+   while ((n = gzread(input, buffer.data(), buffer.size())) > 0) {
+      if (fwrite(buffer.data(), 1, n, output) != (size_t) n) {
+         ok = false;
+         break;
+      }
+   }
+   if (n < 0) ok = false;
+   if (gzclose(input) != Z_OK) ok = false;
+   if (fflush(output) != 0 || fsync(fileno(output)) != 0) ok = false;
+   if (fclose(output) != 0) ok = false;
+
+   if (ok && rename(tmpfile.c_str(), path.c_str()) == 0) {
+      std::remove(gzfile.c_str());
+      return true;
+   }
+   std::remove(tmpfile.c_str());
+   return false;
+}
+
+
+int restart_restore(const std::string& slot_path) {
+   //  Decompress the compressed restart files in the slot before the model is relaunched, and remove the
+   //  partly written files of a compression or restore that was stopped.
+   //  Returns: the number of files restored, or -1 if a file could not be restored.
+
+   DIR* dirp = opendir(slot_path.c_str());
+   if (dirp == NULL) return -1;
+   std::vector<std::string> names;
+   struct dirent* dir;
+   while ((dir = readdir(dirp)) != NULL) names.push_back(dir->d_name);
+   closedir(dirp);
+
+   int restored = 0;
+   std::string tag;
+   bool compressed;
+   for (const std::string& name : names) {
+      std::string path = slot_path + "/" + name;
+      if (name.compare(0, 3, "srf") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+         std::remove(path.c_str());
+         continue;
+      }
+      if (!restart_file_tag(name.c_str(), tag, compressed) || !compressed) continue;
+
+      // The original is still there if the compression was stopped before it was deleted
+      std::string original = path.substr(0, path.size() - 3);
+      struct stat st;
+      if (stat(original.c_str(), &st) == 0) {
+         std::remove(path.c_str());
+         continue;
+      }
+      if (!decompress_file(path, original)) return -1;
+      restored++;
+   }
+   return restored;
+}
@@ -0,0 +1,49 @@
+//
+// Restart dump housekeeping for the OpenIFS controller: pruning and compression of the restart sets in the slot,
+// see oifs_restart.cpp
+//
+
+#ifndef OIFS_RESTART_H
+#define OIFS_RESTART_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+// The restart files written by the model at one time
+struct restart_set {
+    std::string              tag;             // DDDDHHMM of the srf files, as CTIME in rcf
+    std::vector<std::string> files;           // names in the slot, ending '.gz' when compressed
+    long long                bytes = 0;
+    bool                     compressed = false;   // all its files are compressed
+};
+
+struct restart_job;
+
+struct restart_housekeeper {
+    std::string slot_path;
+    int         keep = 1;                     // restart sets to keep, 0 = keep all
+    bool        compress = false;             // compress the newest set in the background
+
+    std::map<std::string, long long> sizes;   // file sizes of the newest set at the last scan
+    std::shared_ptr<restart_job> job;         // compression in progress
+};
+
+// What a call of restart_housekeeping() did
+struct restart_stats {
+    long      sets = 0;                       // restart sets in the slot
+    long long bytes = 0;                      // and their size
+    long      pruned_sets = 0;
+    long long pruned_bytes = 0;
+    long      compressed_files = 0;           // from a compression that has finished
+    long long compressed_bytes_in = 0, compressed_bytes_out = 0;
+    double    compress_secs = 0;
+};
+
+bool restart_scan(const std::string&, std::vector<restart_set>&, std::string&);
+void restart_init(restart_housekeeper&, const std::string&, int, bool);
+void restart_housekeeping(restart_housekeeper&, restart_stats&);
+int  restart_restore(const std::string&);
+
+#endif
@@ -0,0 +1,135 @@
+//
+// Output spool for the OpenIFS controller
+//
+// Result files wait in the task's folder in the project directory (temp_path) until they are zipped at the
+// next upload interval, and the zips then wait for the BOINC client to send them. If the client cannot upload,
+// or the output frequency is high, this backlog can fill the volunteer's disk and the task fails. The spool
+// tracks the bytes waiting and the free space on the disk, and stops the model with SIGSTOP while the backlog
+// is above a high water mark (or the disk is nearly full), resuming it with SIGCONT below the low water mark.
+//
+// A pause only helps while the backlog can drain, by the client sending uploads or the volunteer freeing
+// space, so a pause is ended after max_stall secs whatever the backlog, rather than leaving the task stopped
+// indefinitely.
+//
+
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "boinc/boinc_api.h"
+#include "boinc/error_numbers.h"
+#include "oifs_spool.h"
+
+using namespace std;
+using namespace std::chrono;
+
+
+void spool_init(output_spool& spool, const std::string& path, long long high_water, long long low_water,
+                long long min_free, double max_stall) {
+   spool.path       = path;
+   spool.high_water = high_water;
+   spool.low_water  = std::min(low_water, high_water);
+   spool.min_free   = min_free;
+   spool.max_stall  = max_stall;
+}
+
+
+void spool_add_upload(output_spool& spool, const std::string& upload_name, long long bytes) {
+   //  An upload zip has been passed to the client, it counts towards the backlog until it is sent
+   spool.uploads[upload_name] = bytes;
+}
+
+
+bool spool_scan(output_spool& spool) {
+   //  Update the pending bytes and free space: the result files in the spool folder, the uploads
+   //  the client has not yet sent, and the space available on the folder's filesystem. An upload the client
+   //  has finished with, sent or failed, no longer counts: a failed upload will not drain.
+   //  Returns: false if the spool folder could not be read.
+
+   for (auto up = spool.uploads.begin(); up != spool.uploads.end(); ) {
+      std::string name = up->first;
+      int status = boinc_is_standalone() ? 0 : boinc_upload_status(name);
+      if (status == ERR_NOT_FOUND) {
+         ++up;
+         continue;
+      }
+      if (status != 0) cerr << "..Upload failed: " << name << ", status " << status << ", no longer counted as waiting" << '\n';
+      up = spool.uploads.erase(up);
+   }
+   spool.upload_bytes = 0;
+   for (auto& up : spool.uploads) spool.upload_bytes += up.second;
+
+   DIR* dirp = opendir(spool.path.c_str());
+   if (dirp == NULL) return false;
+
+   long long bytes = 0;
+   int files = 0;
+   struct dirent* dir;
+   struct stat st;
+   while ((dir = readdir(dirp)) != NULL) {
+      if (dir->d_name[0] == '.') continue;
+      if (fstatat(dirfd(dirp), dir->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+         bytes += st.st_size;
+         files++;
+      }
+   }
+   closedir(dirp);
+   spool.pending_bytes = bytes + spool.upload_bytes;
+   spool.pending_files = files;
+
+   struct statvfs fs;
+   spool.free_bytes = (statvfs(spool.path.c_str(), &fs) == 0) ? (long long) fs.f_bavail * fs.f_frsize : -1;
+   return true;
+}
+
+
+int spool_control(output_spool& spool, long handleProcess) {
+   //  Pause or resume the model from the last spool_scan(). Called every time round the main loop,
+   //  after the BOINC client status is checked: a resume from a client suspend also sends SIGCONT,
+   //  so the model is stopped again while the spool holds it paused.
+   //  The backlog only drains while paused if the client has uploads to send: files waiting in the folder
+   //  to be zipped do not, as zips are only made when the model reaches the next upload interval.
+   //  Returns: 1 if the model was paused, -1 if it was resumed, otherwise 0.
+
+   bool low_space  = (spool.min_free > 0 && spool.free_bytes >= 0 && spool.free_bytes < spool.min_free);
+   bool backlog    = (spool.high_water > 0 && spool.pending_bytes > spool.high_water && spool.upload_bytes > 0);
+   bool space_back = (spool.min_free <= 0 || spool.free_bytes < 0 || spool.free_bytes >= 2 * spool.min_free);
+
+   if (!spool.paused) {
+      if (spool.overridden && spool.pending_bytes < spool.low_water && space_back) spool.overridden = false;
+
+      if (!spool.overridden && (backlog || low_space)) {
+         kill(handleProcess, SIGSTOP);
+         spool.paused = true;
+         spool.pause_start = steady_clock::now();
+         spool.stall_count++;
+         return 1;
+      }
+      return 0;
+   }
+
+   double stalled = duration<double>(steady_clock::now() - spool.pause_start).count();
+   bool drained   = ((spool.pending_bytes < spool.low_water || spool.upload_bytes == 0) && space_back);
+   if (drained || (spool.max_stall > 0 && stalled >= spool.max_stall)) {
+      kill(handleProcess, SIGCONT);
+      spool.paused = false;
+      spool.overridden = !drained;
+      spool.stalled_secs += stalled;
+      return -1;
+   }
+
+   kill(handleProcess, SIGSTOP);
+   return 0;
+}
+
+
+double spool_stalled_secs(const output_spool& spool) {
+   //  Total time the model has been paused by the spool, including a pause in progress
+   double stalled = spool.stalled_secs;
+   if (spool.paused) stalled += duration<double>(steady_clock::now() - spool.pause_start).count();
+   return stalled;
+}
@@ -0,0 +1,40 @@
+//
+// Output spool for the OpenIFS controller: back-pressure on the model when the upload backlog grows,
+// see oifs_spool.cpp
+//
+
+#ifndef OIFS_SPOOL_H
+#define OIFS_SPOOL_H
+
+#include <string>
+#include <map>
+#include <chrono>
+
+struct output_spool {
+    std::string path;                   // folder the result files are moved to before zipping (temp_path)
+    long long   high_water = 0;         // pause the model when the pending bytes exceed this
+    long long   low_water = 0;          // and resume it when they fall below this
+    long long   min_free = 0;           // pause the model when the free space falls below this
+    double      max_stall = 0;          // longest pause (secs), after which the model is resumed regardless
+
+    long long   pending_bytes = 0;      // result files in 'path' plus uploads the client has not yet sent
+    long long   upload_bytes = 0;       // the part of pending_bytes waiting for the client to upload
+    int         pending_files = 0;
+    long long   free_bytes = -1;        // free space on the filesystem of 'path', -1 if not known
+
+    bool        paused = false;         // the model is stopped by the spool
+    bool        overridden = false;     // the last pause hit max_stall: no new pause until below the low water
+    std::chrono::steady_clock::time_point pause_start;
+    double      stalled_secs = 0;       // total time the model was paused, including the current pause
+    int         stall_count = 0;
+
+    std::map<std::string, long long> uploads;   // logical name -> bytes, of uploads not yet sent
+};
+
+void spool_init(output_spool&, const std::string&, long long, long long, long long, double);
+void spool_add_upload(output_spool&, const std::string&, long long);
+bool spool_scan(output_spool&);
+int  spool_control(output_spool&, long);
+double spool_stalled_secs(const output_spool&);
+
+#endif
@@ -0,0 +1,161 @@
+//
+// Staging manifest for the OpenIFS controller
+//
+// At each start of a task the controller stages its inputs into the slot: the app, namelist, initial conditions
+// (ic_ancil), ifsdata and climate data zips are copied there and unzipped. When the task is restarted the files
+// are already there, and copying and unzipping them again costs minutes of disk activity on a volunteer's host,
+// and writes fort.4 and the initial conditions over the experiment part way through.
+//
+// Once an input has been staged its files, their sizes and CRC32s are recorded in the slot's staging manifest
+// (staging_manifest), which is rewritten (to a '.tmp' file, synced and renamed) after each input. On a restart an
+// input is only staged again if the manifest does not list it, or one of its files is missing or its size or
+// CRC32 has changed. The files unzipped from an input are taken from the zip's central directory (oifs_zip.cpp),
+// so a file the model creates alongside them in the slot does not belong to any input.
+//
+// The manifest is a text file, a line per file:
+//
+//    <input zip name> <size> <crc32, hex> <path relative to the slot>
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "oifs_delta.h"
+#include "oifs_zip.h"
+#include "oifs_staging.h"
+
+
+bool staging_zip_entries(const std::string& zip, std::vector<std::string>& names) {
+   //  List the files in a zip, without the directories.
+   //  Returns: false if the zip could not be read, or is a zip64 archive.
+
+   std::vector<zip_entry> entries;
+   names.clear();
+   if (!zip_read_directory(zip, entries)) return false;
+   for (const zip_entry& entry : entries) {
+      if (!entry.name.empty() && entry.name.back() != '/') names.push_back(entry.name);
+   }
+   return true;
+}
+
+
+static bool file_crc32(const std::string& path, long long& size, uint32_t& crc) {
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   #ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+   #endif
+   std::vector<char> buffer(1 << 20);
+   ssize_t n;
+   size = 0;
+   crc = 0;
+   while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+      crc = oifs_crc32(crc, buffer.data(), n);
+      size += n;
+   }
+   close(fd);
+   return n == 0;
+}
+
+
+bool staging_read(const std::string& filename, staging_manifest& manifest) {
+   //  Read the staging manifest, which is empty if the task has not staged any inputs.
+   //  Returns: false if the manifest could not be read, it is then empty.
+
+   manifest.filename = filename;
+   manifest.inputs.clear();
+   std::ifstream input(filename);
+   if (!input.is_open()) return true;
+
+   std::string line;
+   while (std::getline(input, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      std::istringstream fields(line);
+      std::string name, crc;
+      staged_file file;
+      if (!(fields >> name >> file.size >> crc) || !std::getline(fields >> std::ws, file.path) || file.path.empty()) {
+         manifest.inputs.clear();
+         return false;
+      }
+      file.crc = strtoul(crc.c_str(), NULL, 16);
+      manifest.inputs[name].push_back(file);
+   }
+   return true;
+}
+
+
+int staging_verify(const staging_manifest& manifest, const std::string& slot_path, const std::string& input, staging_stats& stats) {
+   //  Check the files staged from an input are in the slot as they were unzipped.
+   //  Returns: 1 if they are, 0 if the input is not in the manifest, or -1 if a file is missing or has changed.
+
+   auto staged = manifest.inputs.find(input);
+   if (staged == manifest.inputs.end()) return 0;
+   for (const staged_file& file : staged->second) {
+      long long size;
+      uint32_t crc;
+      struct stat st;
+      std::string path = slot_path + "/" + file.path;
+      if (stat(path.c_str(), &st) != 0 || st.st_size != file.size || !file_crc32(path, size, crc) || size != file.size || crc != file.crc) {
+         stats.failed = file.path;
+         return -1;
+      }
+      stats.files++;
+      stats.bytes += size;
+   }
+   return 1;
+}
+
+
+static bool write_manifest(const staging_manifest& manifest) {
+   std::string tmpfile = manifest.filename + ".tmp";
+   FILE* output = fopen(tmpfile.c_str(), "w");
+   if (output == NULL) return false;
+   fprintf(output, "# OpenIFS staged inputs: input size crc32 file\n");
+   for (const auto& input : manifest.inputs) {
+      for (const staged_file& file : input.second)
+         fprintf(output, "%s %lld %08x %s\n", input.first.c_str(), file.size, file.crc, file.path.c_str());
+   }
+   bool ok = (fflush(output) == 0 && fsync(fileno(output)) == 0);
+   ok = (fclose(output) == 0) && ok;
+   if (!ok || rename(tmpfile.c_str(), manifest.filename.c_str()) != 0) {
+      std::remove(tmpfile.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+bool staging_record(staging_manifest& manifest, const std::string& slot_path, const std::string& input,
+                    const std::string& zip, const std::string& folder) {
+   //  Record the files unzipped from an input zip into 'folder' (relative to the slot, empty for the slot itself)
+   //  in the manifest, and write it. The sizes and CRC32s are those in the zip's central directory, which the
+   //  unzip has checked, so the files are not read again; each is only checked to be there at its size.
+   //  Returns: false if the files could not be recorded, the input is then left out of the manifest and will be
+   //           staged again on a restart.
+
+   std::vector<zip_entry> entries;
+   std::vector<staged_file> files;
+   bool ok = zip_read_directory(zip, entries);
+   struct stat st;
+   for (const zip_entry& entry : entries) {
+      if (!ok) break;
+      if (entry.name.empty() || entry.name.back() == '/') continue;
+      staged_file file;
+      file.path = folder.empty() ? entry.name : folder + "/" + entry.name;
+      file.size = (long long) entry.size;
+      file.crc  = entry.crc;
+      ok = (stat((slot_path + "/" + file.path).c_str(), &st) == 0 && st.st_size == file.size);
+      files.push_back(file);
+   }
+   if (ok) manifest.inputs[input] = files;
+   else manifest.inputs.erase(input);
+   return write_manifest(manifest) && ok;
+}
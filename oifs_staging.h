@@ -0,0 +1,37 @@
+//
+// Staging manifest for the OpenIFS controller: the input files unzipped into the slot, so that a restarted task
+// only stages the inputs that are missing or changed, see oifs_staging.cpp
+//
+
+#ifndef OIFS_STAGING_H
+#define OIFS_STAGING_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+struct staged_file {
+    std::string path;                         // relative to the slot
+    long long   size = 0;
+    uint32_t    crc = 0;                      // CRC32 of the contents
+};
+
+struct staging_manifest {
+    std::string filename;
+    std::map<std::string, std::vector<staged_file>> inputs;   // input zip name -> files unzipped from it
+};
+
+// What a call of staging_verify() found
+struct staging_stats {
+    long      files = 0;
+    long long bytes = 0;
+    std::string failed;                       // first file missing or changed
+};
+
+bool staging_zip_entries(const std::string&, std::vector<std::string>&);
+bool staging_read(const std::string&, staging_manifest&);
+int  staging_verify(const staging_manifest&, const std::string&, const std::string&, staging_stats&);
+bool staging_record(staging_manifest&, const std::string&, const std::string&, const std::string&, const std::string&);
+
+#endif
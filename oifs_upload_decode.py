@@ -0,0 +1,102 @@
+#! /usr/bin/python3
+
+# Script to decode the delta encoded result files in OpenIFS upload zips
+
+# Workunits run with the !UPLOAD_DELTA=1 directive upload each result file whose GRIB messages repeat those of
+# an earlier file in the same zip as '<file>.delta' (see oifs_delta.cpp for the format). This script extracts
+# the upload zips and rebuilds the original files, checking their size and CRC32, then removes the .delta files.
+#
+#    ./oifs_upload_decode.py --output_dir <folder> upload_1.zip [upload_2.zip ...]
+#    ./oifs_upload_decode.py <folder>           (decode the .delta files already extracted to the folder)
+
+import os, sys, struct, zlib, zipfile, argparse
+
+
+def read_delta(path):
+    # Returns the list of records of a .delta file: ('L', bytes) or ('R', name, offset, length), and the
+    # size and CRC32 of the original file
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:8] != b'OIFSDLT1':
+        raise ValueError(path + ': not a delta encoded file')
+    records, pos = [], 8
+    while pos < len(data):
+        kind = data[pos:pos+1]
+        pos += 1
+        if kind == b'L':
+            (length,) = struct.unpack_from('>Q', data, pos)
+            records.append(('L', data[pos+8:pos+8+length]))
+            pos += 8 + length
+        elif kind == b'R':
+            (name_length,) = struct.unpack_from('>H', data, pos)
+            name = data[pos+2:pos+2+name_length].decode()
+            offset, length = struct.unpack_from('>QQ', data, pos + 2 + name_length)
+            records.append(('R', name, offset, length))
+            pos += 2 + name_length + 16
+        elif kind == b'E':
+            size, crc = struct.unpack_from('>QI', data, pos)
+            return records, size, crc
+        else:
+            raise ValueError(path + ': unknown record at offset ' + str(pos - 1))
+    raise ValueError(path + ': truncated')
+
+
+def decode_file(folder, name, decoded):
+    # Rebuild the file 'name' in the folder, decoding the files it refers to first
+    if name in decoded:
+        return decoded[name]
+    delta = os.path.join(folder, name + '.delta')
+    if not os.path.exists(delta):
+        with open(os.path.join(folder, name), 'rb') as f:
+            decoded[name] = f.read()
+        return decoded[name]
+
+    records, size, crc = read_delta(delta)
+    parts = []
+    for record in records:
+        if record[0] == 'L':
+            parts.append(record[1])
+        else:
+            _, other, offset, length = record
+            parts.append(decode_file(folder, other, decoded)[offset:offset+length])
+    data = b''.join(parts)
+    if len(data) != size or zlib.crc32(data) != crc:
+        raise ValueError(delta + ': decoded file does not match the size and CRC32 of the original')
+
+    with open(os.path.join(folder, name), 'wb') as f:
+        f.write(data)
+    os.remove(delta)
+    decoded[name] = data
+    return data
+
+
+def decode_folder(folder):
+    # Decode all the .delta files in a folder, returns the number decoded
+    names = sorted(f[:-6] for f in os.listdir(folder) if f.endswith('.delta'))
+    decoded = {}
+    for name in names:
+        decode_file(folder, name, decoded)
+        print('Decoded: ' + os.path.join(folder, name))
+    return len(names)
+
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser(description='Decode delta encoded OpenIFS result files')
+    parser.add_argument('inputs', nargs='+', help='upload zips, or folders of extracted upload zips')
+    parser.add_argument('--output_dir', help='folder to extract the upload zips to', default='.')
+    options = parser.parse_args()
+
+    try:
+        for item in options.inputs:
+            if os.path.isdir(item):
+                decode_folder(item)
+            else:
+                # Each upload is decoded on its own, as references do not point outside the zip
+                folder = os.path.join(options.output_dir, os.path.splitext(os.path.basename(item))[0])
+                os.makedirs(folder, exist_ok=True)
+                with zipfile.ZipFile(item) as upload:
+                    upload.extractall(folder)
+                decode_folder(folder)
+    except (ValueError, OSError, zipfile.BadZipFile) as error:
+        sys.exit('..' + str(error))
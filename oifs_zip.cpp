@@ -0,0 +1,454 @@
+//
+// Zip archives for the OpenIFS controller
+//
+// The input zips are made by boinc_zip, and read here without it: the list of files in an input zip for the
+// staging manifest (oifs_staging.cpp), and the check of an upload zip left by a controller that stopped while
+// making it (oifs_recover.cpp). A zip is written front to back and its central directory, which lists the files,
+// comes last, so a zip whose writing was stopped has no central directory. zip_verify() also reads each file's
+// data and checks its CRC32 against the directory, which finds a zip whose end was written but not all its data,
+// e.g. after a power cut when the zip had not been synced.
+//
+// The upload zips are written here too. Each result file used to be copied from the slot to the project directory
+// by boinc_copy (read and written once), and then read again by boinc_zip to take its CRC32 and deflate it.
+// zip_move_file() moves a result file by renaming it, which reads nothing, or if the project directory is on
+// another file system copies it and takes its CRC32 and size in the same pass. zip_write() writes each file to the
+// zip in a single pass: it deflates the file (at the level set by !UPLOAD_ZIP_LEVEL in fort.4) taking its CRC32
+// as it goes, or if it is stored (level 0) and its CRC32 is known the data is copied by the kernel without
+// being read into the controller at all. The CRC32 of a file is only used if the file's size, modification time
+// and inode are those it was taken for, so a file rewritten since (e.g. by the output manifest) is read again.
+//
+// Zip64 archives, needed for zips over 4 GB, are neither read nor written; zip_write() fails for them and the
+// controller zips with boinc_zip instead.
+//
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "oifs_delta.h"
+#include "oifs_zip.h"
+
+
+static uint32_t get_le(const unsigned char* p, int nbytes) {
+   uint32_t value = 0;
+   for (int i = nbytes - 1; i >= 0; i--) value = (value << 8) | p[i];
+   return value;
+}
+
+
+// Returns: 1 if the directory was read, 0 if the file is not a whole zip, -1 if it could not be read or is zip64
+static int read_directory(FILE* input, std::vector<zip_entry>& entries) {
+   entries.clear();
+
+   // The end of central directory record is in the last 64 kB, after the zip comment
+   std::vector<unsigned char> tail(65557);
+   if (fseeko(input, 0, SEEK_END) != 0) return -1;
+   off_t size = ftello(input);
+   size_t tail_size = std::min((off_t) tail.size(), size);
+   if (fseeko(input, size - tail_size, SEEK_SET) != 0 || fread(tail.data(), 1, tail_size, input) != tail_size) return -1;
+   long eocd = -1;
+   for (long i = (long) tail_size - 22; i >= 0; i--) {
+      if (get_le(&tail[i], 4) == 0x06054b50) {
+         eocd = i;
+         break;
+      }
+   }
+   if (eocd < 0) return 0;
+   uint32_t count = get_le(&tail[eocd + 10], 2), cd_size = get_le(&tail[eocd + 12], 4), cd_offset = get_le(&tail[eocd + 16], 4);
+   if (count == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) return -1;
+   if ((off_t) cd_offset + cd_size > size) return 0;
+
+   std::vector<unsigned char> cd(cd_size);
+   if (fseeko(input, cd_offset, SEEK_SET) != 0 || fread(cd.data(), 1, cd_size, input) != cd_size) return -1;
+   size_t pos = 0;
+   for (uint32_t n = 0; n < count; n++) {
+      if (pos + 46 > cd.size() || get_le(&cd[pos], 4) != 0x02014b50) return 0;
+      size_t name_length = get_le(&cd[pos + 28], 2), extra = get_le(&cd[pos + 30], 2), comment = get_le(&cd[pos + 32], 2);
+      if (pos + 46 + name_length > cd.size()) return 0;
+      zip_entry entry;
+      entry.name.assign((const char*) &cd[pos + 46], name_length);
+      entry.method     = get_le(&cd[pos + 10], 2);
+      entry.crc        = get_le(&cd[pos + 16], 4);
+      entry.compressed = get_le(&cd[pos + 20], 4);
+      entry.size       = get_le(&cd[pos + 24], 4);
+      entry.offset     = get_le(&cd[pos + 42], 4);
+      if (entry.compressed == 0xffffffff || entry.size == 0xffffffff || entry.offset == 0xffffffff) return -1;
+      entries.push_back(entry);
+      pos += 46 + name_length + extra + comment;
+   }
+   return 1;
+}
+
+
+bool zip_read_directory(const std::string& zip, std::vector<zip_entry>& entries) {
+   //  Read the list of files in a zip from its central directory.
+   //  Returns: false if the zip could not be read, is not a whole zip, or is a zip64 archive.
+
+   FILE* input = fopen(zip.c_str(), "rb");
+   if (input == NULL) return false;
+   int result = read_directory(input, entries);
+   fclose(input);
+   return result > 0;
+}
+
+
+// Check the CRC32 of an entry's data, which starts at the file's position
+static bool check_data(FILE* input, const zip_entry& entry, std::vector<unsigned char>& in, std::vector<unsigned char>& out) {
+   uint32_t crc = 0;
+   uint64_t remaining = entry.compressed, size = 0;
+   if (entry.method == 0) {
+      while (remaining > 0) {
+         size_t n = fread(in.data(), 1, std::min((uint64_t) in.size(), remaining), input);
+         if (n == 0) return false;
+         crc = oifs_crc32(crc, in.data(), n);
+         remaining -= n;
+         size += n;
+      }
+      return size == entry.size && crc == entry.crc;
+   }
+   if (entry.method != 8) return false;
+
+   z_stream stream;
+   memset(&stream, 0, sizeof(stream));
+   if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false;
+   int status = Z_OK;
+   while (status == Z_OK) {
+      if (stream.avail_in == 0) {
+         if (remaining == 0) break;
+         size_t n = fread(in.data(), 1, std::min((uint64_t) in.size(), remaining), input);
+         if (n == 0) break;
+         remaining -= n;
+         stream.next_in  = in.data();
+         stream.avail_in = n;
+      }
+      stream.next_out  = out.data();
+      stream.avail_out = out.size();
+      status = inflate(&stream, Z_NO_FLUSH);
+      size_t produced = out.size() - stream.avail_out;
+      crc = oifs_crc32(crc, out.data(), produced);
+      size += produced;
+      if (status == Z_BUF_ERROR && produced > 0) status = Z_OK;
+   }
+   inflateEnd(&stream);
+   return status == Z_STREAM_END && size == entry.size && crc == entry.crc;
+}
+
+
+int zip_verify(const std::string& zip, std::vector<zip_entry>& entries, std::string& error) {
+   //  Check a zip is whole: its central directory is there and the data of each file in it is as the directory
+   //  lists it (local header, size and CRC32).
+   //  Returns: 1 if it is, 0 if it is not (the reason is in 'error'), or -1 if it could not be read or is a
+   //           zip64 archive, which are not checked.
+
+   FILE* input = fopen(zip.c_str(), "rb");
+   if (input == NULL) {
+      error = "unable to open";
+      return -1;
+   }
+   int result = read_directory(input, entries);
+   if (result <= 0) error = (result == 0) ? "no central directory" : "unable to read, or a zip64 archive";
+
+   std::vector<unsigned char> in(1 << 18), out(1 << 18);
+   unsigned char header[30];
+   for (size_t i = 0; result > 0 && i < entries.size(); i++) {
+      const zip_entry& entry = entries[i];
+      if (fseeko(input, entry.offset, SEEK_SET) != 0 || fread(header, 1, 30, input) != 30 || get_le(header, 4) != 0x04034b50 ||
+          fseeko(input, get_le(header + 26, 2) + get_le(header + 28, 2), SEEK_CUR) != 0 || !check_data(input, entry, in, out)) {
+         error = "the data of " + entry.name + " is missing or corrupt";
+         result = 0;
+      }
+   }
+   fclose(input);
+   return result;
+}
+
+
+static void put_le(std::string& out, uint32_t value, int nbytes) {
+   for (int i = 0; i < nbytes; i++, value >>= 8) out.push_back((char) (value & 0xff));
+}
+
+static bool write_all(int fd, const void* data, size_t length) {
+   const char* p = (const char*) data;
+   while (length > 0) {
+      ssize_t n = write(fd, p, length);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      length -= n;
+   }
+   return true;
+}
+
+
+bool zip_move_file(const std::string& from, const std::string& to, zip_source& source) {
+   //  Move a file to be zipped by renaming it or, if 'to' is on another file system, by copying it, taking its
+   //  CRC32 and size in the same pass, for zip_write. A renamed file only has its size taken, zero if its stat fails.
+   //  Returns: false if the file could not be moved, 'from' is then left as it was.
+
+   struct stat st;
+   source = zip_source();
+   source.path = to;
+   if (rename(from.c_str(), to.c_str()) == 0) {
+      if (stat(to.c_str(), &st) == 0) {
+         source.size  = st.st_size;
+         source.mtime = st.st_mtime;
+         source.inode = st.st_ino;
+      }
+      return true;
+   }
+   if (errno != EXDEV) return false;
+
+   int input = open(from.c_str(), O_RDONLY);
+   if (input < 0) return false;
+   int output = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (output < 0) {
+      close(input);
+      return false;
+   }
+   std::vector<unsigned char> buffer(1 << 20);
+   uint32_t crc = 0;
+   uint64_t size = 0;
+   bool ok = true;
+   for (;;) {
+      ssize_t n = read(input, buffer.data(), buffer.size());
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+         ok = (n == 0);
+         break;
+      }
+      crc = oifs_crc32(crc, buffer.data(), n);
+      size += n;
+      if (!write_all(output, buffer.data(), n)) {
+         ok = false;
+         break;
+      }
+   }
+   close(input);
+   if (close(output) != 0 || !ok || stat(to.c_str(), &st) != 0 || (uint64_t) st.st_size != size) {
+      std::remove(to.c_str());
+      return false;
+   }
+   std::remove(from.c_str());
+   source.crc       = crc;
+   source.size      = size;
+   source.mtime     = st.st_mtime;
+   source.inode     = st.st_ino;
+   source.crc_known = true;
+   return true;
+}
+
+
+// Copy 'length' bytes of a file to the zip, by the kernel where it can
+static bool copy_data(int input, int output, uint64_t length, std::vector<unsigned char>& buffer) {
+#ifdef __linux__
+   while (length > 0) {
+      ssize_t n = copy_file_range(input, NULL, output, NULL, length, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      length -= n;
+   }
+#endif
+   while (length > 0) {
+      ssize_t n = read(input, buffer.data(), std::min((uint64_t) buffer.size(), length));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0 || !write_all(output, buffer.data(), n)) return false;
+      length -= n;
+   }
+   return true;
+}
+
+
+// Write one file's data to the zip, stored or deflated, taking its CRC32 unless it is known.
+// Returns: false if it could not be read or written, or is too large for a zip without zip64.
+static bool write_data(int input, int output, zip_entry& entry, bool crc_known, int level, std::vector<unsigned char>& in,
+                       std::vector<unsigned char>& out, zip_write_stats& stats) {
+   uint32_t crc = 0;
+   uint64_t size = 0;
+
+   if (entry.method == 0 && crc_known) {
+      entry.compressed = entry.size;
+      return copy_data(input, output, entry.size, in);
+   }
+
+   z_stream stream;
+   memset(&stream, 0, sizeof(stream));
+   if (entry.method == 8 && deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+   bool ok = true;
+   uint64_t compressed = 0;
+   for (bool end = false; ok && !end;) {
+      ssize_t n = read(input, in.data(), in.size());
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+         ok = false;
+         break;
+      }
+      end = (n == 0);
+      stats.bytes_read += n;
+      size += n;
+      if (!crc_known) crc = oifs_crc32(crc, in.data(), n);
+      if (entry.method == 0) {
+         ok = write_all(output, in.data(), n);
+         compressed += n;
+         continue;
+      }
+      stream.next_in  = in.data();
+      stream.avail_in = n;
+      do {
+         stream.next_out  = out.data();
+         stream.avail_out = out.size();
+         int status = deflate(&stream, end ? Z_FINISH : Z_NO_FLUSH);
+         if (status == Z_STREAM_ERROR) ok = false;
+         size_t produced = out.size() - stream.avail_out;
+         compressed += produced;
+         if (produced > 0 && !write_all(output, out.data(), produced)) ok = false;
+      } while (ok && stream.avail_out == 0);
+   }
+   if (entry.method == 8) deflateEnd(&stream);
+   if (!ok || size != entry.size || compressed >= 0xffffffff) return false;
+   if (!crc_known) entry.crc = crc;
+   entry.compressed = compressed;
+   return true;
+}
+
+
+bool zip_write(const std::string& zip, const std::vector<zip_source>& sources, int level, zip_write_stats& stats, std::string& error) {
+   //  Write a zip of the files, under their names without their folders, deflated at 'level' (1-9), or stored if
+   //  it is 0. Each file is read at most once, see the top of this file.
+   //  Returns: false if the zip could not be written (the reason is in 'error'), it is then deleted.
+
+   int output = open(zip.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (output < 0) {
+      error = "unable to create " + zip;
+      return false;
+   }
+   std::vector<unsigned char> in(1 << 20), out(1 << 20);
+   std::vector<zip_entry> entries;
+   std::vector<uint32_t> dos_times;
+   uint64_t offset = 0;
+   bool ok = true;
+
+   for (const zip_source& source : sources) {
+      struct stat st;
+      int input = open(source.path.c_str(), O_RDONLY);
+      if (input < 0 || fstat(input, &st) != 0) {
+         error = "unable to read " + source.path;
+         if (input >= 0) close(input);
+         ok = false;
+         break;
+      }
+      bool crc_known = source.crc_known && source.size == (uint64_t) st.st_size && source.mtime == (int64_t) st.st_mtime &&
+                       source.inode == (uint64_t) st.st_ino;
+
+      zip_entry entry;
+      entry.name   = source.path.substr(source.path.find_last_of('/') + 1);
+      entry.method = (level > 0) ? 8 : 0;
+      entry.crc    = crc_known ? source.crc : 0;
+      entry.size   = st.st_size;
+      entry.offset = offset;
+      entry.compressed = (entry.method == 0) ? entry.size : 0;
+      struct tm tm;
+      localtime_r(&st.st_mtime, &tm);
+      uint32_t dos_time = (std::max(tm.tm_year - 80, 0) << 25) | ((tm.tm_mon + 1) << 21) | (tm.tm_mday << 16) |
+                          (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+
+      // The local header, its CRC32 and sizes are filled in after the data if they were not known
+      std::string header;
+      put_le(header, 0x04034b50, 4);
+      put_le(header, 20, 2);
+      put_le(header, 0, 2);
+      put_le(header, entry.method, 2);
+      put_le(header, dos_time, 4);
+      put_le(header, entry.crc, 4);
+      put_le(header, entry.compressed, 4);
+      put_le(header, entry.size, 4);
+      put_le(header, entry.name.size(), 2);
+      put_le(header, 0, 2);
+      header += entry.name;
+
+      if (entry.size >= 0xffffffff || offset + header.size() + entry.size >= 0xffffffff) {
+         error = "too large for a zip without zip64";
+         ok = false;
+      }
+      else if (!write_all(output, header.data(), header.size()) ||
+               !write_data(input, output, entry, crc_known, level, in, out, stats)) {
+         error = "unable to zip " + source.path;
+         ok = false;
+      }
+      close(input);
+      if (!ok) break;
+
+      if (!crc_known || entry.method == 8) {
+         std::string sizes;
+         put_le(sizes, entry.crc, 4);
+         put_le(sizes, entry.compressed, 4);
+         put_le(sizes, entry.size, 4);
+         if (pwrite(output, sizes.data(), sizes.size(), offset + 14) != (ssize_t) sizes.size()) {
+            error = "unable to write " + zip;
+            ok = false;
+            break;
+         }
+      }
+      offset += header.size() + entry.compressed;
+      stats.files++;
+      stats.bytes_in += entry.size;
+      if (crc_known) stats.crc_reused++;
+      entries.push_back(entry);
+      dos_times.push_back(dos_time);
+   }
+
+   // The central directory and its end record
+   if (ok) {
+      std::string directory;
+      for (size_t i = 0; i < entries.size(); i++) {
+         const zip_entry& entry = entries[i];
+         put_le(directory, 0x02014b50, 4);
+         put_le(directory, (3 << 8) | 20, 2);            // made by unix
+         put_le(directory, 20, 2);
+         put_le(directory, 0, 2);
+         put_le(directory, entry.method, 2);
+         put_le(directory, dos_times[i], 4);
+         put_le(directory, entry.crc, 4);
+         put_le(directory, entry.compressed, 4);
+         put_le(directory, entry.size, 4);
+         put_le(directory, entry.name.size(), 2);
+         put_le(directory, 0, 2);
+         put_le(directory, 0, 2);
+         put_le(directory, 0, 2);
+         put_le(directory, 0, 2);
+         put_le(directory, 0100644u << 16, 4);           // a regular file, rw-r--r--
+         put_le(directory, entry.offset, 4);
+         directory += entry.name;
+      }
+      uint32_t directory_size = directory.size();
+      put_le(directory, 0x06054b50, 4);
+      put_le(directory, 0, 2);
+      put_le(directory, 0, 2);
+      put_le(directory, entries.size(), 2);
+      put_le(directory, entries.size(), 2);
+      put_le(directory, directory_size, 4);
+      put_le(directory, offset, 4);
+      put_le(directory, 0, 2);
+      if (entries.size() >= 0xffff || offset + directory.size() >= 0xffffffff) {
+         error = "too large for a zip without zip64";
+         ok = false;
+      }
+      else if (!write_all(output, directory.data(), directory.size())) {
+         error = "unable to write " + zip;
+         ok = false;
+      }
+      stats.bytes_out = offset + directory.size();
+   }
+   if (close(output) != 0 && ok) {
+      error = "unable to write " + zip;
+      ok = false;
+   }
+   if (!ok) std::remove(zip.c_str());
+   return ok;
+}
@@ -0,0 +1,44 @@
+//
+// Zip archives for the OpenIFS controller: the central directory of a zip, a check that an upload zip is complete,
+// and the writing of the upload zips from the result files, with the CRC32 taken as they were moved, see oifs_zip.cpp
+//
+
+#ifndef OIFS_ZIP_H
+#define OIFS_ZIP_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct zip_entry {
+    std::string name;
+    int         method = 0;                   // 0 stored, 8 deflated
+    uint32_t    crc = 0;
+    uint64_t    compressed = 0, size = 0;
+    uint64_t    offset = 0;                   // of the local header
+};
+
+// A file to zip, with its CRC32 if it was taken as the file was moved
+struct zip_source {
+    std::string path;
+    uint32_t    crc = 0;
+    uint64_t    size = 0;                     // size, modification time and inode of the file the CRC32 is of
+    int64_t     mtime = 0;
+    uint64_t    inode = 0;
+    bool        crc_known = false;
+};
+
+struct zip_write_stats {
+    long      files = 0;
+    long      crc_reused = 0;                 // files whose CRC32 was known
+    uint64_t  bytes_in = 0;                   // size of the files
+    uint64_t  bytes_read = 0;                 // read from them to zip them
+    uint64_t  bytes_out = 0;                  // size of the zip
+};
+
+bool zip_read_directory(const std::string&, std::vector<zip_entry>&);
+int  zip_verify(const std::string&, std::vector<zip_entry>&, std::string&);
+bool zip_move_file(const std::string&, const std::string&, zip_source&);
+bool zip_write(const std::string&, const std::vector<zip_source>&, int, zip_write_stats&, std::string&);
+
+#endif
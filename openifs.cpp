@@ -12,9 +12,14 @@
 #include <sstream>
 #include <iostream>
 #include <filesystem>  // required by file_is_empty
+#include <functional>
+#include <map>
+#include <vector>
 #include <exception>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -25,35 +30,140 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include "boinc/boinc_api.h"
+#include "boinc/error_numbers.h"
 #include "boinc/boinc_zip.h"
 #include "boinc/util.h"
 #include "rapidxml.hpp"
+#include "oifs_parse.h"
+#include "oifs_namelist.h"
+#include "oifs_spool.h"
+#include "oifs_grib.h"
+#include "oifs_delta.h"
+#include "oifs_restart.h"
+#include "oifs_batch.h"
+#include "oifs_staging.h"
+#include "oifs_zip.h"
+#include "oifs_recover.h"
+#include "oifs_log.h"
+#include "oifs_diag.h"
+#include "oifs_plan.h"
+#include "oifs_calib.h"
+#include "oifs_ramstage.h"
+#include "oifs_profile.h"
+#include "oifs_control.h"
 #include <algorithm>
 
 int check_child_status(long, int);
 int check_boinc_status(long, int);
 long launch_process(const std::string, const char*, const char*, const std::string);
-std::string get_tag(const std::string &str);
-void process_trickle(double, const std::string, const std::string, const std::string, int);
+void process_trickle(double, const std::string, const std::string, const std::string, int, const std::string, int, const std::string);
 bool file_exists(const std::string &str);
 bool file_is_empty(std::string &str);
 double cpu_time(long);
-double model_frac_done(double, double, int);
-std::string get_second_part(const std::string, const std::string);
-bool check_stoi(std::string& cin);
-bool oifs_parse_stat(std::string&, std::string&, int);
+double model_frac_done(double, double, int, double);
 bool oifs_get_stat(std::ifstream&, std::string&);
-bool oifs_valid_step(std::string&,int);
 int  print_last_lines(std::string filename, int nlines);
+bool wait_for_condition(const std::function<bool()>&, double, double, const std::string&);
+bool wait_for_file_ready(const std::string&, double);
+int  sync_file_and_dir(const std::string&);
+bool upload_and_confirm(std::string&, double);
+void telemetry_init(const std::string&, const std::string&);
+void telemetry_add_time(const std::string&, double);
+void telemetry_count(const std::string&, double);
+void telemetry_steps(int, double);
+void telemetry_gauge(const std::string&, double);
+double telemetry_get(const std::string&);
+bool telemetry_step_stats(double&, double&);
+bool telemetry_write();
+void oifs_begin_critical_section();
+void oifs_end_critical_section();
+std::string trickle_perf_record(double, double, int, int);
+struct process_sample;
+bool sample_process(long, process_sample&, bool);
+void perf_log_sample(const std::string&, const std::string&, const process_sample&);
+struct omp_efficiency;
+bool omp_efficiency_update(omp_efficiency&, const process_sample&, int, long, int, int);
+void filter_output_files(const grib_manifest&, const std::string&, const std::string&);
+void index_output_files(const std::string&, const std::string&);
+void delta_encode_zip_list(ZipFileList&, std::vector<std::string>&);
+bool input_is_staged(const staging_manifest&, const std::string&, const std::string&);
+bool write_diagnostics(const std::string&, const std::string&, const std::string&, const std::string&, const std::string&,
+                       const process_sample&, const std::string&);
+bool upload_diagnostics(const std::string&, const std::string&, const std::string&, const std::string&, const process_sample&,
+                        const std::string&, const std::string&);
+int  zip_upload(const std::string&, const ZipFileList&, std::map<std::string, zip_source>&, int);
+bool upload_empty(const std::string&, const std::string&);
+int  calibration_run(const std::string&, const std::string&, const std::string&, const std::string&, const oifs_namelist&, int,
+                     double&);
+std::string cpu_model_name();
 
 using namespace std;
 using namespace std::chrono;
 using namespace std::this_thread;
 using namespace rapidxml;
 
+// Scoped timer for a controller phase: the elapsed wall time is added to the phase's telemetry
+// when the timer goes out of scope, or earlier when stop() is called.
+class phase_timer {
+  public:
+    explicit phase_timer(const std::string& phase) : phase(phase), start(steady_clock::now()), running(true) {}
+    ~phase_timer() { stop(); }
+    double stop() {
+       double elapsed = duration<double>(steady_clock::now() - start).count();
+       if (running) telemetry_add_time(phase, elapsed);
+       running = false;
+       return elapsed;
+    }
+  private:
+    std::string phase;
+    steady_clock::time_point start;
+    bool running;
+};
+
+// Removes the folder holding the result files in memory, and its links, on every way out of the controller
+// once it is set up, unless keep() is called: a task the client quit restarts with the outputs still in memory.
+// boinc_finish() exits without it, ram_stage_close() is called before it.
+class ram_stage_guard {
+  public:
+    explicit ram_stage_guard(ram_stage& stage) : stage(stage), kept(false) {}
+    ~ram_stage_guard() { if (!kept) ram_stage_close(stage); }
+    void keep() { kept = true; }
+  private:
+    ram_stage& stage;
+    bool kept;
+};
+
+// Resource usage of the model process, filled from /proc by sample_process().
+// The same instance is reused between samples so the per-thread vectors are not reallocated.
+struct process_sample {
+    double    cpu_time = 0;           // user + system cpu time of all threads (secs)
+    long      rss_kb = 0;             // resident memory (VmRSS)
+    long      peak_rss_kb = 0;        // peak resident memory (VmHWM)
+    long      major_faults = 0;       // page faults requiring disk I/O
+    long long io_read_bytes = 0;      // bytes read by the process (rchar)
+    long long io_write_bytes = 0;     // bytes written by the process (wchar)
+    std::vector<int>    thread_ids;   // thread ids from /proc/<pid>/task
+    std::vector<double> thread_cpu;   // user + system cpu time per thread (secs)
+    std::vector<double> thread_wait;  // time each thread was runnable but waiting for a cpu (secs)
+};
+
+// Parallel efficiency of the model's OpenMP threads, updated by omp_efficiency_update() as the model steps.
+// With OMP_SCHEDULE=STATIC one pre-empted thread stalls the whole step, so a low efficiency on a busy
+// host means the task would run faster with fewer threads.
+struct omp_efficiency {
+    double efficiency = -1;           // smoothed thread cpu time / (wall time * nthreads), -1 until measured
+    double min_thread_util = -1;      // utilisation of the least busy thread over the last interval
+    double runqueue_wait = 0;         // fraction of the last interval the threads were waiting for a cpu
+    bool   oversubscribed = false;
+    int    suggested_nthreads = 0;    // thread count to use on the next restart, 0 if no suggestion
+    int    last_step = -1;            // step and ifs.stat time of the previous update
+    long   last_stat_secs = -1;
+    std::map<int, double> last_thread_cpu, last_thread_wait;
+};
+
 int main(int argc, char** argv) {
     std::string ifsdata_file, ic_ancil_file, climate_data_file, horiz_resolution, vert_resolution, grid_type;
-    std::string project_path, wu_name, version, tmpstr1, tmpstr2, tmpstr3;
+    std::string project_path, wu_name, version, tmpstr1;
     std::string ifs_line="", iter="0", ifs_word="", second_part, upload_file_name, last_line="";
     std::string upfile(""), resolved_name, upload_file, result_base_name;
     int upload_interval, timestep_interval, ICM_file_interval, retval=0, i, j;
@@ -66,9 +176,16 @@ int main(int argc, char** argv) {
     regex_t regex;
     DIR *dirp=NULL;
     ZipFileList zfl;
+    std::vector<std::string> delta_replaced;       // result files zipped as their .delta files
+    std::map<std::string, zip_source> moved_sources;   // result files moved to temp_path, with their CRC32 if taken
+    std::vector<std::string> registered_uploads;   // logical names of files passed to boinc_upload_file
     std::ifstream ifs_stat_file;
+    phase_timer startup_timer("startup");     // controller start to model launch
 	
 
+    // Run the members of an ensemble outside BOINC, see oifs_batch.cpp
+    if (argc > 1 && std::string(argv[1]) == "--batch") return batch_main(argc, argv);
+
     // Set defaults for input arguments
     std::string OIFS_EXPID;           // model experiment id, must match string in filenames
     std::string namelist="fort.4";    // namelist file, this name is fixed
@@ -97,6 +214,9 @@ int main(int argc, char** argv) {
        return retval;
     }
 
+    // From here on cerr is written to stderr by a background thread, see oifs_log.cpp
+    log_init();
+
     cerr << "(argv0) " << argv[0] << '\n';
     cerr << "(argv1) start_date: " << argv[1] << '\n';
     cerr << "(argv2) exptid: " << argv[2] << '\n';
@@ -132,6 +252,9 @@ int main(int argc, char** argv) {
       cerr << "Working directory is: "<< slot_path << '\n';      
     }
 
+    // Phase timings and counters are written to the slot as oifs_metrics.prom & oifs_metrics.json
+    telemetry_init(slot_path, wu_name);
+
     if (!boinc_is_standalone()) {
 
       // Get the project path
@@ -173,7 +296,7 @@ int main(int argc, char** argv) {
       cerr << "(argv9) app_version: " << argv[9] << '\n'; 
     }
 
-    boinc_begin_critical_section();
+    oifs_begin_critical_section();
 
     // Create temporary folder for moving the results to and uploading the results from
     // BOINC measures the disk usage on the slots directory so we must move all results out of this folder
@@ -192,64 +315,86 @@ int main(int argc, char** argv) {
        std::string app_file = app_name + std::string("_app_") + version + std::string("_x86_64-pc-linux-gnu.zip");
     #endif
 
+    // Inputs staged by an earlier start of the task are only staged again if their files are missing or changed
+    staging_manifest staged;
+    if (!staging_read(slot_path + std::string("/staging_manifest"), staged)) cerr << "..Unable to read the staging manifest, staging all the inputs" << '\n';
+
     // Copy the app file to the working directory
-    std::string app_source = project_path + app_file;
-    std::string app_destination = slot_path + std::string("/") + app_file;
-    cerr << "Copying: " << app_source << " to: " << app_destination << '\n';
-    retval = boinc_copy(app_source.c_str(), app_destination.c_str());
-    if (retval) {
-       cerr << "..Copying the app file to the working directory failed: error " << retval << std::endl;
-       return retval;
-    }
+    phase_timer stage_app_timer("stage_app");
+    if (!input_is_staged(staged, slot_path, app_file)) {
+       std::string app_source = project_path + app_file;
+       std::string app_destination = slot_path + std::string("/") + app_file;
+       cerr << "Copying: " << app_source << " to: " << app_destination << '\n';
+       retval = boinc_copy(app_source.c_str(), app_destination.c_str());
+       if (retval) {
+          cerr << "..Copying the app file to the working directory failed: error " << retval << std::endl;
+          return retval;
+       }
 
-    // Unzip the app zip file
-    std::string app_zip = slot_path + std::string("/") + app_file;
-    cerr << "Unzipping the app zip file: " << app_zip << '\n';
-    retval = boinc_zip(UNZIP_IT, app_zip.c_str(), slot_path);
+       // Unzip the app zip file
+       std::string app_zip = slot_path + std::string("/") + app_file;
+       cerr << "Unzipping the app zip file: " << app_zip << '\n';
+       retval = boinc_zip(UNZIP_IT, app_zip.c_str(), slot_path);
 
-    if (retval) {
-       cerr << "..Unzipping the app file failed" << std::endl;
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       std::remove(app_zip.c_str());       
+       if (retval) {
+          cerr << "..Unzipping the app file failed" << std::endl;
+          return retval;
+       }
+       // Remove the zip file
+       else {
+          std::remove(app_zip.c_str());       
+       }
+       if (!staging_record(staged, slot_path, app_file, app_source, "")) cerr << "..Unable to record the staged files of: " << app_file << '\n';
     }
+    stage_app_timer.stop();
 
 	
     // Process the Namelist/workunit file:
     std::string namelist_zip = slot_path + std::string("/") + app_name + std::string("_") + unique_member_id + std::string("_") + start_date +\
                       std::string("_") + std::to_string(num_days_trunc) + std::string("_") + batchid + std::string("_") + wuid + std::string(".zip");
 		
-    // Get the name of the 'jf_' filename from a link within the namelist file
-    std::string wu_source = get_tag(namelist_zip);
-
-    // Copy the namelist files to the working directory
-    std::string wu_destination = namelist_zip;
-    cerr << "Copying the namelist files from: " << wu_source << " to: " << wu_destination << '\n';
-    retval = boinc_copy(wu_source.c_str(), wu_destination.c_str());
-    if (retval) {
-       cerr << "..Copying the namelist files to the working directory failed" << std::endl;
-       return retval;
-    }
+    phase_timer stage_namelist_timer("stage_namelist");
+    std::string namelist_input = namelist_zip.substr(namelist_zip.find_last_of('/') + 1);
+    if (!input_is_staged(staged, slot_path, namelist_input)) {
+       // Get the name of the 'jf_' filename from a link within the namelist file
+       std::string wu_source = get_tag(namelist_zip);
+
+       // Copy the namelist files to the working directory
+       std::string wu_destination = namelist_zip;
+       cerr << "Copying the namelist files from: " << wu_source << " to: " << wu_destination << '\n';
+       retval = boinc_copy(wu_source.c_str(), wu_destination.c_str());
+       if (retval) {
+          cerr << "..Copying the namelist files to the working directory failed" << std::endl;
+          return retval;
+       }
 
-    // Unzip the namelist zip file
-    cerr << "Unzipping the namelist zip file: " << namelist_zip << '\n';
-    retval = boinc_zip(UNZIP_IT, namelist_zip.c_str(), slot_path);
-    if (retval) {
-       cerr << "..Unzipping the namelist file failed" << std::endl;
-       return retval;
+       // Unzip the namelist zip file
+       cerr << "Unzipping the namelist zip file: " << namelist_zip << '\n';
+       retval = boinc_zip(UNZIP_IT, namelist_zip.c_str(), slot_path);
+       if (retval) {
+          cerr << "..Unzipping the namelist file failed" << std::endl;
+          return retval;
+       }
+       // Remove the zip file
+       else {
+          std::remove(namelist_zip.c_str());
+       }
+       if (!staging_record(staged, slot_path, namelist_input, wu_source, "")) cerr << "..Unable to record the staged files of: " << namelist_input << '\n';
     }
-    // Remove the zip file
-    else {
-       std::remove(namelist_zip.c_str());
+    stage_namelist_timer.stop();
+
+    // Read the manifest of output fields to upload, if the workunit has one
+    grib_manifest output_manifest;
+    bool filter_outputs = false;
+    if (file_exists(slot_path + std::string("/output_manifest"))) {
+       filter_outputs = grib_read_manifest(slot_path + std::string("/output_manifest"), output_manifest);
+       if (filter_outputs) cerr << "Output files will be filtered by the output manifest, rules: " << output_manifest.rules.size() << '\n';
     }
 
 	
     // Parse the fort.4 namelist for the filenames and variables
     std::string namelist_file = slot_path + std::string("/") + namelist;
-    std::string namelist_line="", delimiter="=";
-    std::ifstream namelist_filestream;
+    oifs_namelist nml;
 
    // Check for the existence of the namelist
    if( !file_exists(namelist_file) ) {
@@ -257,188 +402,264 @@ int main(int argc, char** argv) {
       return 1;        // should terminate, the model won't run.
     }
 
-    // Open the namelist file
-    if(!(namelist_filestream.is_open())) {
-       namelist_filestream.open(namelist_file);
+    // Read the namelist file in one pass, then look up the values the controller needs.
+    // Each is taken from the model's namelist groups if present there, otherwise from the CPDN '!KEY=value' lines.
+    phase_timer namelist_timer("namelist_parse");
+    if (!namelist_read(namelist_file, nml)) {
+       cerr << "..Failed to parse the namelist file: " << namelist_file << std::endl;
+       return 1;
     }
 
-    // Read the namelist file
-    while(std::getline(namelist_filestream, namelist_line)) { //get 1 row as a string
-       std::istringstream nss(namelist_line);   //put line into stringstream
+    if (namelist_cpdn_value(nml, "IFSDATA_FILE", ifsdata_file))            cerr << "ifsdata_file: " << ifsdata_file << '\n';
+    if (namelist_cpdn_value(nml, "IC_ANCIL_FILE", ic_ancil_file))          cerr << "ic_ancil_file: " << ic_ancil_file << '\n';
+    if (namelist_cpdn_value(nml, "CLIMATE_DATA_FILE", climate_data_file))  cerr << "climate_data_file: " << climate_data_file << '\n';
+    if (namelist_cpdn_value(nml, "HORIZ_RESOLUTION", horiz_resolution))    cerr << "horiz_resolution: " << horiz_resolution << '\n';
+    if (namelist_cpdn_value(nml, "VERT_RESOLUTION", vert_resolution))      cerr << "vert_resolution: " << vert_resolution << '\n';
+    if (namelist_cpdn_value(nml, "GRID_TYPE", grid_type))                  cerr << "grid_type: " << grid_type << '\n';
 
-       if (nss.str().find("IFSDATA_FILE") != std::string::npos) {
-          ifsdata_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          ifsdata_file.erase(std::remove(ifsdata_file.begin(), ifsdata_file.end(), ' '), ifsdata_file.end());
-          cerr << "ifsdata_file: " << ifsdata_file << '\n';
-       }
-       else if (nss.str().find("IC_ANCIL_FILE") != std::string::npos) {
-          ic_ancil_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          ic_ancil_file.erase(std::remove(ic_ancil_file.begin(), ic_ancil_file.end(), ' '), ic_ancil_file.end());
-          cerr << "ic_ancil_file: " << ic_ancil_file << '\n'; 
-       }
-       else if (nss.str().find("CLIMATE_DATA_FILE") != std::string::npos) {
-          climate_data_file = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          climate_data_file.erase(std::remove(climate_data_file.begin(),climate_data_file.end(),' '), climate_data_file.end());
-          cerr << "climate_data_file: " << climate_data_file << '\n';
-       }
-       else if (nss.str().find("HORIZ_RESOLUTION") != std::string::npos) {
-          horiz_resolution = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          horiz_resolution.erase(std::remove(horiz_resolution.begin(),horiz_resolution.end(),' '), horiz_resolution.end());
-          cerr << "horiz_resolution: " << horiz_resolution << '\n';
-       }
-       else if (nss.str().find("VERT_RESOLUTION") != std::string::npos) {
-          vert_resolution = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          vert_resolution.erase(std::remove(vert_resolution.begin(), vert_resolution.end(), ' '), vert_resolution.end());
-          cerr << "vert_resolution: " << vert_resolution << '\n';
-       }
-       else if (nss.str().find("GRID_TYPE") != std::string::npos) {
-          grid_type = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          grid_type.erase(std::remove(grid_type.begin(), grid_type.end(),' '), grid_type.end());
-          cerr << "grid_type: " << grid_type << '\n';
-       }
-       else if (nss.str().find("UPLOAD_INTERVAL") != std::string::npos) {
-          tmpstr1 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-          tmpstr1.erase(std::remove(tmpstr1.begin(), tmpstr1.end(),' '), tmpstr1.end());
-          upload_interval=std::stoi(tmpstr1);
-          cerr << "upload_interval: " << upload_interval << '\n';
-       }
-       else if (nss.str().find("UTSTEP") != std::string::npos) {
-          tmpstr2 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace
-	  tmpstr2.erase(std::remove(tmpstr2.begin(), tmpstr2.end(),','), tmpstr2.end());
-          tmpstr2.erase(std::remove(tmpstr2.begin(), tmpstr2.end(),' '), tmpstr2.end());
-          timestep_interval = std::stoi(tmpstr2);
-          cerr << "utstep: " << timestep_interval << '\n';
-       }
-       else if (nss.str().find("!NFRPOS") != std::string::npos) {
-          tmpstr3 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace and commas
-          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),','), tmpstr3.end());
-          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),' '), tmpstr3.end());
-          ICM_file_interval = std::stoi(tmpstr3);
-          cerr << "nfrpos: " << ICM_file_interval << '\n';
-       }
-       else if (nss.str().find("NFRRES") != std::string::npos) {     // frequency of model output: +ve steps, -ve in hours.
-          tmpstr3 = nss.str().substr(nss.str().find(delimiter)+1, nss.str().length()-1);
-          // Remove any whitespace and commas
-          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),','), tmpstr3.end());
-          tmpstr3.erase(std::remove(tmpstr3.begin(), tmpstr3.end(),' '), tmpstr3.end());
-          if ( check_stoi(tmpstr3) ) {
-            restart_interval = stoi(tmpstr3);
-          } else {
-            cerr << "..Warning, unable to read restart interval, setting to zero, got string: " << tmpstr3 << std::endl;
-            restart_interval = 0;
-          }
+    upload_interval = 0;
+    if (namelist_cpdn_value(nml, "UPLOAD_INTERVAL", tmpstr1) && oifs_parse_int(tmpstr1, upload_interval)) {
+       cerr << "upload_interval: " << upload_interval << '\n';
+    }
+
+    // UTSTEP is a real, e.g. 3600.0, only whole seconds are used
+    timestep_interval = 0;
+    if (namelist_cpdn_value(nml, "UTSTEP", tmpstr1) && oifs_parse_int(tmpstr1, timestep_interval)) {
+       cerr << "utstep: " << timestep_interval << '\n';
+    }
+    if (timestep_interval <= 0) {
+       cerr << "..Unable to read a valid model timestep (UTSTEP) from the namelist" << std::endl;
+       return 1;
+    }
+
+    // frequency of model output (NFRPOS) and restart dumps (NFRRES): +ve steps, -ve in hours.
+    ICM_file_interval = 0;
+    if (namelist_cpdn_value(nml, "NFRPOS", tmpstr1) && oifs_parse_int(tmpstr1, ICM_file_interval)) {
+       if ( ICM_file_interval < 0 )   ICM_file_interval = abs(ICM_file_interval)*3600 / timestep_interval;
+       cerr << "nfrpos: " << ICM_file_interval << '\n';
+    }
+
+    restart_interval = 0;
+    if (namelist_cpdn_value(nml, "NFRRES", tmpstr1)) {
+       if ( check_stoi(tmpstr1) ) {
+         restart_interval = stoi(tmpstr1);
+       } else {
+         cerr << "..Warning, unable to read restart interval, setting to zero, got string: " << tmpstr1 << std::endl;
+         restart_interval = 0;
        }
     }
-    namelist_filestream.close();
+    namelist_timer.stop();
 
     // restart frequency might be in units of hrs, convert to model steps
     if ( restart_interval < 0 )   restart_interval = abs(restart_interval)*3600 / timestep_interval;
     cerr << "nfrres: restart dump frequency (steps) " << restart_interval << '\n';
 
+    // Limits on the backlog of result files and uploads before the model is paused. By default a half of
+    // the task's disk allowance, resuming at a quarter, unless set by !SPOOL_HIGH_WATER_MB, !SPOOL_LOW_WATER_MB
+    // and !SPOOL_MIN_FREE_MB in the namelist. A pause lasts at most an hour.
+    output_spool spool;
+    long long spool_high = (dataBOINC.rsc_disk_bound > 0) ? (long long) (dataBOINC.rsc_disk_bound / 2) : (4096LL << 20);
+    long long spool_low = spool_high / 2, spool_min_free = 1024LL << 20;
+    int spool_mb;
+    if (namelist_cpdn_value(nml, "SPOOL_HIGH_WATER_MB", tmpstr1) && oifs_parse_int(tmpstr1, spool_mb)) spool_high = (long long) spool_mb << 20;
+    if (namelist_cpdn_value(nml, "SPOOL_LOW_WATER_MB", tmpstr1) && oifs_parse_int(tmpstr1, spool_mb)) spool_low = (long long) spool_mb << 20;
+    else spool_low = spool_high / 2;
+    if (namelist_cpdn_value(nml, "SPOOL_MIN_FREE_MB", tmpstr1) && oifs_parse_int(tmpstr1, spool_mb)) spool_min_free = (long long) spool_mb << 20;
+    spool_init(spool, temp_path, spool_high, spool_low, spool_min_free, 3600);
+    cerr << "Output spool limits (MB): high water " << (spool_high >> 20) << ", low water " << (spool.low_water >> 20)
+         << ", minimum free space " << (spool_min_free >> 20) << '\n';
+
+    // Delta encode the result files in each upload, if set by !UPLOAD_DELTA=1 in the namelist
+    bool upload_delta = false;
+    int delta_flag;
+    if (namelist_cpdn_value(nml, "UPLOAD_DELTA", tmpstr1) && oifs_parse_int(tmpstr1, delta_flag)) upload_delta = (delta_flag != 0);
+    if (upload_delta) cerr << "Delta encoding the result files in the uploads" << '\n';
+
+    // Compression level of the upload zips, 1-9 deflated (default 6) or 0 stored, set by !UPLOAD_ZIP_LEVEL
+    int upload_zip_level = 6;
+    if (namelist_cpdn_value(nml, "UPLOAD_ZIP_LEVEL", tmpstr1) && oifs_parse_int(tmpstr1, upload_zip_level)) {
+       upload_zip_level = std::min(std::max(upload_zip_level, 0), 9);
+       cerr << "Upload zip level: " << upload_zip_level << '\n';
+    }
+
+    // Restart sets kept in the slot, by default the newest only unless set by !RESTART_KEEP (0 keeps them all),
+    // and compression of the newest set if set by !RESTART_COMPRESS=1 in the namelist
+    restart_housekeeper restarts;
+    int restart_keep = 1, restart_compress = 0;
+    if (namelist_cpdn_value(nml, "RESTART_KEEP", tmpstr1)) oifs_parse_int(tmpstr1, restart_keep);
+    if (namelist_cpdn_value(nml, "RESTART_COMPRESS", tmpstr1)) oifs_parse_int(tmpstr1, restart_compress);
+    restart_init(restarts, slot_path, restart_keep, restart_compress != 0);
+    cerr << "Restart sets to keep: " << restarts.keep << (restarts.compress ? ", compressing the newest" : "") << '\n';
+
+    // The level of the lines logged, !LOG_LEVEL=debug|info|error (default info), and the number of times an
+    // information line is repeated per minute, !LOG_RATE_LIMIT (default 0, no limit)
+    if (namelist_cpdn_value(nml, "LOG_LEVEL", tmpstr1)) {
+       if (tmpstr1 == "debug") log_set_level(log_debug);
+       else if (tmpstr1 == "info") log_set_level(log_info);
+       else if (tmpstr1 == "error") log_set_level(log_error);
+       else cerr << "..Unknown LOG_LEVEL in namelist: " << tmpstr1 << ", using info" << '\n';
+    }
+    int log_rate_limit;
+    if (namelist_cpdn_value(nml, "LOG_RATE_LIMIT", tmpstr1) && oifs_parse_int(tmpstr1, log_rate_limit)) log_set_rate_limit(log_rate_limit);
+
     // this should match CUSTEP in fort.4. If it doesn't we have a problem
     total_nsteps = (num_days * 86400.0) / (double) timestep_interval;
 
+    // Uploads are cut every upload interval, or if !UPLOAD_TARGET_MB is set when their files reach that size or the
+    // oldest has waited !UPLOAD_MAX_LATENCY_MINS (default 360), within the upload files declared, see oifs_plan.cpp
+    upload_planner planner;
+    int upload_target_mb = 0, upload_latency_mins = 360;
+    if (namelist_cpdn_value(nml, "UPLOAD_TARGET_MB", tmpstr1)) oifs_parse_int(tmpstr1, upload_target_mb);
+    if (namelist_cpdn_value(nml, "UPLOAD_MAX_LATENCY_MINS", tmpstr1)) oifs_parse_int(tmpstr1, upload_latency_mins);
+    plan_init(planner, (long long) std::max(upload_target_mb, 0) << 20, 60.0 * std::max(upload_latency_mins, 0),
+              upload_interval, (int) total_nsteps);
+    if (planner.target_bytes > 0) {
+       cerr << "Upload size target: " << upload_target_mb << " MB, at most " << upload_latency_mins << " mins latency, "
+            << planner.slots << " upload files" << '\n';
+    }
+
+    // The result files are written by the model to memory (/dev/shm) and zipped from there, up to !RAM_STAGING_MB
+    // (default 0, written to the slot), see oifs_ramstage.cpp
+    ram_stage ramstage;
+    ram_stage_guard ramstage_guard(ramstage);
+    int ram_staging_mb = 0;
+    if (namelist_cpdn_value(nml, "RAM_STAGING_MB", tmpstr1)) oifs_parse_int(tmpstr1, ram_staging_mb);
+    if (ram_staging_mb > 0) {
+       if (ram_stage_init(ramstage, slot_path, temp_path, exptid, "oifs_" + app_name + "_" + wuid, ICM_file_interval,
+                          (long long) ram_staging_mb << 20)) {
+          cerr << "Staging the result files in memory: " << ramstage.path << ", up to " << (ramstage.budget >> 20) << " MB" << '\n';
+          if (ramstage.lost > 0) {
+             cerr << "Result files held in memory were lost (host restarted): " << ramstage.lost
+                  << ", the model computes them again from its restart dump" << '\n';
+          }
+       }
+       else {
+          cerr << "Staging the result files on disk, memory is short or /dev/shm is not available" << '\n';
+       }
+    }
+
+    // The control socket in the slot, to query the task and tune its I/O while it runs, unless !CONTROL_SOCKET=0,
+    // see oifs_control.cpp
+    int control_flag = 1;
+    if (namelist_cpdn_value(nml, "CONTROL_SOCKET", tmpstr1)) oifs_parse_int(tmpstr1, control_flag);
+
 
     // Process the ic_ancil_file:
     std::string ic_ancil_zip = slot_path + std::string("/") + ic_ancil_file + std::string(".zip");
 	
-    // For transfer downloading, BOINC renames download files to jf_HEXADECIMAL-NUMBER, these files
-    // need to be renamed back to the original name
-    // Get the name of the 'jf_' filename from a link within the ic_ancil_file
-    std::string ic_ancil_source = get_tag(ic_ancil_zip);
-
-    // Copy the IC ancils to working directory
-    std::string ic_ancil_destination = ic_ancil_zip;
-    cerr << "Copying IC ancils from: " << ic_ancil_source << " to: " << ic_ancil_destination << '\n';
-    retval = boinc_copy(ic_ancil_source.c_str(), ic_ancil_destination.c_str());
-    if (retval) {
-       cerr << "..Copying the IC ancils to the working directory failed" << std::endl;
-       return retval;
-    }
+    phase_timer stage_ic_ancil_timer("stage_ic_ancil");
+    std::string ic_ancil_input = ic_ancil_file + std::string(".zip");
+    if (!input_is_staged(staged, slot_path, ic_ancil_input)) {
+       // For transfer downloading, BOINC renames download files to jf_HEXADECIMAL-NUMBER, these files
+       // need to be renamed back to the original name
+       // Get the name of the 'jf_' filename from a link within the ic_ancil_file
+       std::string ic_ancil_source = get_tag(ic_ancil_zip);
+
+       // Copy the IC ancils to working directory
+       std::string ic_ancil_destination = ic_ancil_zip;
+       cerr << "Copying IC ancils from: " << ic_ancil_source << " to: " << ic_ancil_destination << '\n';
+       retval = boinc_copy(ic_ancil_source.c_str(), ic_ancil_destination.c_str());
+       if (retval) {
+          cerr << "..Copying the IC ancils to the working directory failed" << std::endl;
+          return retval;
+       }
 
-    // Unzip the IC ancils zip file
-    cerr << "Unzipping the IC ancils zip file: " << ic_ancil_zip << '\n';
-    retval = boinc_zip(UNZIP_IT, ic_ancil_zip.c_str(), slot_path);
-    if (retval) {
-       cerr << "..Unzipping the IC ancils file failed" << std::endl;
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       std::remove(ic_ancil_zip.c_str());
+       // Unzip the IC ancils zip file
+       cerr << "Unzipping the IC ancils zip file: " << ic_ancil_zip << '\n';
+       retval = boinc_zip(UNZIP_IT, ic_ancil_zip.c_str(), slot_path);
+       if (retval) {
+          cerr << "..Unzipping the IC ancils file failed" << std::endl;
+          return retval;
+       }
+       // Remove the zip file
+       else {
+          std::remove(ic_ancil_zip.c_str());
+       }
+       if (!staging_record(staged, slot_path, ic_ancil_input, ic_ancil_source, "")) cerr << "..Unable to record the staged files of: " << ic_ancil_input << '\n';
     }
+    stage_ic_ancil_timer.stop();
 
 
     // Process the ifsdata_file:
     // Make the ifsdata directory
+    phase_timer stage_ifsdata_timer("stage_ifsdata");
     std::string ifsdata_folder = slot_path + std::string("/ifsdata");
     if (mkdir(ifsdata_folder.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) cerr << "..mkdir for ifsdata folder failed" << '\n';
 
-    // Get the name of the 'jf_' filename from a link within the ifsdata_file
-    std::string ifsdata_source = get_tag(slot_path + std::string("/") + ifsdata_file + std::string(".zip"));
-
-    // Copy the ifsdata_file to the working directory
-    std::string ifsdata_destination = ifsdata_folder + std::string("/") + ifsdata_file + std::string(".zip");
-    cerr << "Copying the ifsdata_file from: " << ifsdata_source << " to: " << ifsdata_destination << '\n';
-    retval = boinc_copy(ifsdata_source.c_str(), ifsdata_destination.c_str());
-    if (retval) {
-       cerr << "..Copying the ifsdata file to the working directory failed" << std::endl;
-       return retval;
-    }
+    std::string ifsdata_input = ifsdata_file + std::string(".zip");
+    if (!input_is_staged(staged, slot_path, ifsdata_input)) {
+       // Get the name of the 'jf_' filename from a link within the ifsdata_file
+       std::string ifsdata_source = get_tag(slot_path + std::string("/") + ifsdata_file + std::string(".zip"));
+
+       // Run by the batch runner, the ifsdata files are unzipped once and shared by the members
+       if (!batch_stage_shared(ifsdata_source, ifsdata_folder)) {
+          // Copy the ifsdata_file to the working directory
+          std::string ifsdata_destination = ifsdata_folder + std::string("/") + ifsdata_file + std::string(".zip");
+          cerr << "Copying the ifsdata_file from: " << ifsdata_source << " to: " << ifsdata_destination << '\n';
+          retval = boinc_copy(ifsdata_source.c_str(), ifsdata_destination.c_str());
+          if (retval) {
+             cerr << "..Copying the ifsdata file to the working directory failed" << std::endl;
+             return retval;
+          }
 
-    // Unzip the ifsdata_file zip file
-    std::string ifsdata_zip = ifsdata_folder + std::string("/") + ifsdata_file + std::string(".zip");
-    cerr << "Unzipping the ifsdata_zip file: " << ifsdata_zip << '\n';
-    retval = boinc_zip(UNZIP_IT, ifsdata_zip.c_str(), ifsdata_folder + std::string("/"));
-    if (retval) {
-       cerr << "..Unzipping the ifsdata_zip file failed" << std::endl;
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       std::remove(ifsdata_zip.c_str());
+          // Unzip the ifsdata_file zip file
+          std::string ifsdata_zip = ifsdata_folder + std::string("/") + ifsdata_file + std::string(".zip");
+          cerr << "Unzipping the ifsdata_zip file: " << ifsdata_zip << '\n';
+          retval = boinc_zip(UNZIP_IT, ifsdata_zip.c_str(), ifsdata_folder + std::string("/"));
+          if (retval) {
+             cerr << "..Unzipping the ifsdata_zip file failed" << std::endl;
+             return retval;
+          }
+          // Remove the zip file
+          else {
+             std::remove(ifsdata_zip.c_str());
+          }
+       }
+       if (!staging_record(staged, slot_path, ifsdata_input, ifsdata_source, "ifsdata")) cerr << "..Unable to record the staged files of: " << ifsdata_input << '\n';
     }
+    stage_ifsdata_timer.stop();
 
 
     // Process the climate_data_file:
     // Make the climate data directory
+    phase_timer stage_climate_timer("stage_climate_data");
     std::string climate_data_path = slot_path + std::string("/") + horiz_resolution + grid_type;
     if (mkdir(climate_data_path.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) \
                        cerr << "..mkdir for the climate data folder failed" << std::endl;
 
-    // Get the name of the 'jf_' filename from a link within the climate_data_file
-    std::string climate_data_source = get_tag(slot_path + std::string("/") + climate_data_file + std::string(".zip"));
-
-    // Copy the climate data file to working directory
-    std::string climate_data_destination = climate_data_path + std::string("/") + climate_data_file + std::string(".zip");
-    cerr << "Copying the climate data file from: " << climate_data_source << " to: " << climate_data_destination << '\n';
-    retval = boinc_copy(climate_data_source.c_str(), climate_data_destination.c_str());
-    if (retval) {
-       cerr << "..Copying the climate data file to the working directory failed" << std::endl;
-       return retval;
-    }	
+    std::string climate_data_input = climate_data_file + std::string(".zip");
+    if (!input_is_staged(staged, slot_path, climate_data_input)) {
+       // Get the name of the 'jf_' filename from a link within the climate_data_file
+       std::string climate_data_source = get_tag(slot_path + std::string("/") + climate_data_file + std::string(".zip"));
+
+       // Run by the batch runner, the climate data files are also shared by the members
+       if (!batch_stage_shared(climate_data_source, climate_data_path)) {
+          // Copy the climate data file to working directory
+          std::string climate_data_destination = climate_data_path + std::string("/") + climate_data_file + std::string(".zip");
+          cerr << "Copying the climate data file from: " << climate_data_source << " to: " << climate_data_destination << '\n';
+          retval = boinc_copy(climate_data_source.c_str(), climate_data_destination.c_str());
+          if (retval) {
+             cerr << "..Copying the climate data file to the working directory failed" << std::endl;
+             return retval;
+          }
 
-    // Unzip the climate data zip file
-    std::string climate_zip = climate_data_destination;
-    cerr << "Unzipping the climate data zip file: " << climate_zip << '\n';
-    retval = boinc_zip(UNZIP_IT, climate_zip.c_str(), climate_data_path);
-    if (retval) {
-       cerr << "..Unzipping the climate data file failed" << std::endl;
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       std::remove(climate_zip.c_str());
+          // Unzip the climate data zip file
+          std::string climate_zip = climate_data_destination;
+          cerr << "Unzipping the climate data zip file: " << climate_zip << '\n';
+          retval = boinc_zip(UNZIP_IT, climate_zip.c_str(), climate_data_path);
+          if (retval) {
+             cerr << "..Unzipping the climate data file failed" << std::endl;
+             return retval;
+          }
+          // Remove the zip file
+          else {
+             std::remove(climate_zip.c_str());
+          }
+       }
+       if (!staging_record(staged, slot_path, climate_data_input, climate_data_source, horiz_resolution + grid_type)) \
+          cerr << "..Unable to record the staged files of: " << climate_data_input << '\n';
     }
+    stage_climate_timer.stop();
 
 	
     // Set the environmental variables:
@@ -470,8 +691,16 @@ int main(int argc, char** argv) {
     pathvar = getenv("OMP_SCHEDULE");
     //cerr << "The OMP_SCHEDULE environmental variable is: " << pathvar << '\n';
 
+    // DrHook is on, with its profiling for the fraction of tasks set by !DRHOOK_PROFILE_FRACTION, and off for the
+    // fraction set by !DRHOOK_OFF_FRACTION to measure its cost (both default 0), see oifs_profile.cpp
+    double drhook_profile_fraction = 0, drhook_off_fraction = 0;
+    if (namelist_cpdn_value(nml, "DRHOOK_PROFILE_FRACTION", tmpstr1)) drhook_profile_fraction = atof(tmpstr1.c_str());
+    if (namelist_cpdn_value(nml, "DRHOOK_OFF_FRACTION", tmpstr1)) drhook_off_fraction = atof(tmpstr1.c_str());
+    drhook_mode drhook = profile_select(wuid, drhook_profile_fraction, drhook_off_fraction);
+    telemetry_gauge("drhook_mode", drhook);
+
     // Set the DR_HOOK environmental variable, this controls the tracing facility in OpenIFS, off=0 and on=1
-    std::string DR_HOOK_var("DR_HOOK=1");
+    std::string DR_HOOK_var = (drhook == drhook_off) ? "DR_HOOK=0" : "DR_HOOK=1";
     if (putenv((char *)DR_HOOK_var.c_str())) {
       cerr << "..Setting the DR_HOOK environmental variable failed" << std::endl;
       return 1;
@@ -479,6 +708,21 @@ int main(int argc, char** argv) {
     pathvar = getenv("DR_HOOK");
     //cerr << "The DR_HOOK environmental variable is: " << pathvar << '\n';
 
+    // Set DR_HOOK_OPT and DR_HOOK_PROFILE, these turn on DrHook's profiling and name its profile files, which
+    // the model writes at the end of its run
+    std::string DR_HOOK_OPT_var("DR_HOOK_OPT=prof");
+    std::string DR_HOOK_PROFILE_var = std::string("DR_HOOK_PROFILE=") + slot_path + std::string("/drhook.prof");
+    if (drhook == drhook_profiling) {
+       if (putenv((char *)DR_HOOK_OPT_var.c_str()) || putenv((char *)DR_HOOK_PROFILE_var.c_str())) {
+         cerr << "..Setting the DR_HOOK_OPT environmental variables failed" << std::endl;
+         return 1;
+       }
+       cerr << "DrHook profiling is on for this task" << '\n';
+    }
+    else if (drhook == drhook_off) {
+       cerr << "DrHook is off for this task" << '\n';
+    }
+
     // Set the DR_HOOK_HEAPCHECK environmental variable, this ensures the heap size statistics are reported
     std::string DR_HOOK_HEAP_var("DR_HOOK_HEAPCHECK=no");
     if (putenv((char *)DR_HOOK_HEAP_var.c_str())) {
@@ -549,6 +793,8 @@ int main(int argc, char** argv) {
     #endif
 
     int last_cpu_time, restart_cpu_time = 0, upload_file_number, last_upload, model_completed, restart_iter;
+    int restart_count = 0;
+    omp_efficiency omp;
     std::string last_iter = "0";
 
     // last_upload is the time of the last upload file (in seconds)
@@ -560,7 +806,8 @@ int main(int argc, char** argv) {
     // First check if a file is not already present from an unscheduled shutdown
     cerr << "Checking for progress XML file: " << progress_file << '\n';
 
-    if ( file_exists(progress_file) && !file_is_empty(progress_file) ) {
+    bool first_start = !( file_exists(progress_file) && !file_is_empty(progress_file) );
+    if ( !first_start ) {
        std::ifstream progress_file_in(progress_file);
        std::stringstream progress_file_buffer;
        xml_document<> doc;
@@ -583,6 +830,9 @@ int main(int argc, char** argv) {
        xml_node<> *last_iter_node = root_node->first_node("last_iter");
        xml_node<> *last_upload_node = root_node->first_node("last_upload");
        xml_node<> *model_completed_node = root_node->first_node("model_completed");
+       xml_node<> *restart_count_node = root_node->first_node("restart_count");
+       xml_node<> *omp_efficiency_node = root_node->first_node("omp_efficiency");
+       xml_node<> *suggested_nthreads_node = root_node->first_node("suggested_nthreads");
 
        // Set the values from the XML
        last_cpu_time = std::stoi(last_cpu_time_node->value());
@@ -590,6 +840,23 @@ int main(int argc, char** argv) {
        last_iter = last_iter_node->value();
        last_upload = std::stoi(last_upload_node->value());
        model_completed = std::stoi(model_completed_node->value());
+       // restart_count was added later, so may not be in the progress file of a task started by an older controller
+       if (restart_count_node) restart_count = std::stoi(restart_count_node->value());
+       restart_count++;
+
+       // If the previous run found the host oversubscribed, relaunch with the suggested number of threads.
+       // This is never more than the number of threads the task was sent with.
+       if (omp_efficiency_node) omp.efficiency = std::stod(omp_efficiency_node->value());
+       if (suggested_nthreads_node) omp.suggested_nthreads = std::stoi(suggested_nthreads_node->value());
+       if (omp.suggested_nthreads > 0 && omp.suggested_nthreads < std::stoi(nthreads)) {
+          cerr << "Previous run had parallel efficiency " << omp.efficiency << ", reducing nthreads from " << nthreads
+               << " to " << omp.suggested_nthreads << '\n';
+          nthreads = std::to_string(omp.suggested_nthreads);
+          if (setenv("OMP_NUM_THREADS", nthreads.c_str(), 1)) {
+             cerr << "..Setting the OMP_NUM_THREADS environmental variable failed" << std::endl;
+             return 1;
+          }
+       }
 
        // Adjust last_iter to the step of the previous model restart dump step.
        // This is always a multiple of the restart frequency
@@ -599,6 +866,69 @@ int main(int argc, char** argv) {
        restart_iter = stoi(last_iter);
        restart_iter = restart_iter - ((restart_iter % restart_interval) - 1);   // -1 because the model will continue from restart_iter.
        last_iter = to_string(restart_iter); 
+
+       // Recover the upload in progress and the outputs left behind when the controller stopped, see oifs_recover.cpp
+       phase_timer recover_timer("recover_uploads");
+       upload_recovery recovery;
+       recovery.slot_path    = slot_path;
+       recovery.temp_path    = temp_path;
+       recovery.exptid       = exptid;
+       recovery.resume       = (model_completed == 0);    // the final upload is remade from its zip as it is
+       recovery.restart_step = restart_iter;
+       recovery.upload_step  = last_upload / timestep_interval;
+       if (!boinc_is_standalone()) {
+          boinc_resolve_filename_s(("upload_file_" + std::to_string(upload_file_number) + ".zip").c_str(), recovery.upload_zip);
+       }
+       else {
+          recovery.upload_zip = project_path + app_name + std::string("_") + unique_member_id + std::string("_") + start_date + \
+                                std::string("_") + std::to_string(num_days_trunc) + std::string("_") + batchid + std::string("_") + \
+                                wuid + std::string("_") + std::to_string(upload_file_number) + std::string(".zip");
+       }
+       if (!recover_uploads(recovery)) cerr << "..Unable to read the slot or temp folder to recover the outputs" << std::endl;
+       recover_timer.stop();
+
+       if (recovery.zip < 0) {
+          cerr << "..Deleted the incomplete upload zip: " << recovery.upload_zip << ", " << recovery.zip_error << std::endl;
+          telemetry_count("recover_zips_deleted", 1);
+       }
+       for (const std::string& moved_part : recovery.moved) {
+          if (filter_outputs) filter_output_files(output_manifest, temp_path, moved_part);
+          index_output_files(temp_path, moved_part);
+       }
+       if (!recovery.moved.empty() || recovery.temp_removed > 0 || recovery.outputs_removed > 0) {
+          cerr << "Recovered outputs: " << recovery.moved.size() << " steps moved from the slot (" << recovery.bytes_moved << " bytes), "
+               << recovery.outputs_removed << " already uploaded removed from the slot, " << recovery.temp_removed
+               << " files removed from the temp folder" << '\n';
+          telemetry_count("recover_steps_moved", recovery.moved.size());
+          telemetry_count("recover_bytes_moved", recovery.bytes_moved);
+          telemetry_count("recover_files_removed", recovery.outputs_removed + recovery.temp_removed);
+       }
+
+       // The zip was made before the controller stopped, only its upload is left to do. A zip whose size
+       // cannot be read is dropped, and its upload file is used by the next upload.
+       std::error_code size_error;
+       uintmax_t recovered_size = (recovery.zip > 0) ? std::filesystem::file_size(recovery.upload_zip, size_error) : 0;
+       if (recovery.zip > 0 && size_error) {
+          cerr << "..Unable to read the size of the upload zip: " << recovery.upload_zip << ", " << size_error.message()
+               << ", its upload is not resumed" << std::endl;
+          std::remove(recovery.upload_zip.c_str());
+          telemetry_count("recover_uploads_dropped", 1);
+       }
+       else if (recovery.zip > 0) {
+          cerr << "Resuming the upload of: " << recovery.upload_zip << ", " << recovery.zip_files << " files" << '\n';
+          telemetry_count("recover_uploads_resumed", 1);
+          if (!boinc_is_standalone()) {
+             sync_file_and_dir(recovery.upload_zip);
+             upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
+             if (upload_and_confirm(upload_file_name, 5.0)) cerr << "Finished the upload of: " << upload_file_name << '\n';
+             registered_uploads.push_back(upload_file_name);
+             spool_add_upload(spool, upload_file_name, recovered_size);
+             telemetry_count("uploads", 1);
+             telemetry_count("bytes_uploaded", recovered_size);
+          }
+          upload_file_number++;
+       }
+       last_upload = recovery.upload_step * timestep_interval;
     }
     else {
        // Set the initial values for start of model run
@@ -621,6 +951,9 @@ int main(int argc, char** argv) {
     progress_file_out <<"  <last_iter>"<<last_iter<<"</last_iter>"<< '\n';
     progress_file_out <<"  <last_upload>"<<std::to_string(last_upload)<<"</last_upload>"<< '\n';
     progress_file_out <<"  <model_completed>"<<std::to_string(model_completed)<<"</model_completed>"<< '\n';
+    progress_file_out <<"  <restart_count>"<<std::to_string(restart_count)<<"</restart_count>"<< '\n';
+    progress_file_out <<"  <omp_efficiency>"<<std::to_string(omp.efficiency)<<"</omp_efficiency>"<< '\n';
+    progress_file_out <<"  <suggested_nthreads>"<<std::to_string(omp.suggested_nthreads)<<"</suggested_nthreads>"<< '\n';
     progress_file_out <<"</running_values>"<< std::endl;
     progress_file_out.close();
 
@@ -629,6 +962,8 @@ int main(int argc, char** argv) {
     cerr << "last_iter: " << last_iter << '\n';
     cerr << "last_upload: " << last_upload << '\n';
     cerr << "model_completed: " << model_completed << '\n';
+    cerr << "restart_count: " << restart_count << '\n';
+    cerr << "nthreads: " << nthreads << '\n';
 
 
     fraction_done = 0;
@@ -684,12 +1019,110 @@ int main(int argc, char** argv) {
     }	
 	
 
-    // Start the OpenIFS job
+    // Restore the restart files compressed by the housekeeping before the model reads them
+    int restored = restart_restore(slot_path);
+    if (restored < 0) {
+       cerr << "..Restoring the compressed restart files failed" << std::endl;
+       return 1;
+    }
+    if (restored > 0) cerr << "Restored " << restored << " compressed restart files" << '\n';
+
+    // The wall time of a model step on this host, from the cache in the project directory, or at the first start of
+    // a task with !CALIBRATE_STEPS set in fort.4 by running the model for that many steps first, see oifs_calib.cpp
     std::string strCmd = slot_path + std::string("/oifs_43r3_model.exe");
+    std::string calib_file = project_path + std::string("oifs_host_calibration");
+    std::string calib_name = calib_key(app_name, horiz_resolution + grid_type + "_L" + vert_resolution, timestep_interval,
+                                       std::stoi(nthreads));
+    host_calibration calibration;
+    int calibrate_steps = 0;
+    if (namelist_cpdn_value(nml, "CALIBRATE_STEPS", tmpstr1)) oifs_parse_int(tmpstr1, calibrate_steps);
+    if (!calib_lookup(calib_file, calib_name, calibration) && first_start && calibrate_steps > 1) {
+       double calib_secs = 0;
+       oifs_end_critical_section();
+       int calib_status = calibration_run(slot_path, strCmd, exptid, app_name, nml, calibrate_steps, calib_secs);
+       oifs_begin_critical_section();
+       if (calib_status == 2) {
+          // As for a quit during the forecast, the task is left for the client to restart
+          cerr << "Quit request received during the calibration run, ending the task for the client to restart it" << std::endl;
+          ramstage_guard.keep();
+          oifs_end_critical_section();
+          return 1;
+       }
+       else if (calib_status != 0) {
+          ram_stage_close(ramstage);
+          oifs_end_critical_section();
+          boinc_finish(1);
+          return 1;
+       }
+       if (calib_secs > 0 && calib_record(calib_file, calib_name, calib_secs)) calib_lookup(calib_file, calib_name, calibration);
+    }
+    if (calibration.secs_per_step > 0) {
+       double predicted = calibration.secs_per_step * (total_nsteps - std::stoi(last_iter));
+       log_printf(log_info, "Host calibration %s: %.2f secs per step (%d measurements), predicted runtime %.1f hours\n",
+                  calib_name.c_str(), calibration.secs_per_step, calibration.samples, predicted / 3600);
+       telemetry_gauge("calib_secs_per_step", calibration.secs_per_step);
+       telemetry_gauge("predicted_runtime_secs", predicted);
+    }
+    double step_secs = calibration.secs_per_step;
+
+    // Start the OpenIFS job
     handleProcess = launch_process(slot_path, strCmd.c_str(), exptid.c_str(), app_name);
     if (handleProcess > 0) process_status = 0;
 
-    boinc_end_critical_section();
+    oifs_end_critical_section();
+    startup_timer.stop();
+    telemetry_write();
+
+    // Time of the last change of step in ifs.stat, to time the model steps
+    steady_clock::time_point launch_time = steady_clock::now();
+    int launch_step = std::stoi(last_iter);
+    steady_clock::time_point last_step_time = launch_time;
+    steady_clock::time_point last_perf_log = launch_time;
+    process_sample model_sample;
+    bool first_step = true;
+    double last_step_stalled = 0;     // time the spool had paused the model at the last change of step
+
+    // The I/O work (upload zips, restart housekeeping) can be paused and the I/O settings changed through the
+    // control socket
+    control_socket control;
+    std::vector<control_command> control_commands;
+    control_settings control_io{spool, planner, upload_zip_level};
+    control_io.status = [&]() {
+       std::ostringstream status;
+       status << "step " << iter << '\n'
+              << "total_steps " << (int) total_nsteps << '\n'
+              << "fraction_done " << fraction_done << '\n'
+              << "step_secs " << step_secs << '\n'
+              << "steps_per_hour " << ((step_secs > 0) ? 3600 / step_secs : 0) << '\n'
+              << "model_paused " << spool.paused << '\n'
+              << "model_stalled_secs " << spool_stalled_secs(spool) << '\n'
+              << "pending_bytes " << spool.pending_bytes << '\n'
+              << "upload_bytes " << spool.upload_bytes << '\n'
+              << "free_bytes " << spool.free_bytes << '\n'
+              << "ram_staged_bytes " << ramstage.bytes << '\n'
+              << "upload_file_number " << upload_file_number << '\n'
+              << "upload_files " << planner.slots << '\n'
+              << "cpu_time " << current_cpu_time << '\n'
+              << "rss_kb " << model_sample.rss_kb << '\n'
+              << "peak_rss_kb " << model_sample.peak_rss_kb << '\n'
+              << "major_faults " << model_sample.major_faults << '\n'
+              << "io_read_bytes " << model_sample.io_read_bytes << '\n'
+              << "io_write_bytes " << model_sample.io_write_bytes << '\n'
+              << "model_threads " << model_sample.thread_ids.size() << '\n'
+              << "omp_efficiency " << omp.efficiency << '\n';
+       return status.str();
+    };
+    control_io.upload_step = [&]() { return plan_earliest_step(planner, upload_file_number, last_upload / timestep_interval); };
+    control_io.diagnostics = [&]() {
+       std::string bundle_file = slot_path + std::string("/oifs_diagnostics_request.txt.gz");
+       if (!write_diagnostics("request", "requested through the control socket", slot_path, progress_file, iter,
+                              model_sample, bundle_file)) bundle_file.clear();
+       return bundle_file;
+    };
+    if (control_flag != 0) {
+       if (control_open(control, slot_path)) cerr << "Serving the control socket: " << control.path << '\n';
+       else cerr << "..Unable to serve the control socket in the slot" << std::endl;
+    }
 
 
     // process_status = 0 running
@@ -698,6 +1131,7 @@ int main(int argc, char** argv) {
     // process_status = 3 stopped with child process being killed
     // process_status = 4 stopped with child process being stopped
     // process_status = 5 child process not found by waitpid()
+    // process_status = 6 stopped with abort request from BOINC
 
 
     // Main loop:	
@@ -726,6 +1160,7 @@ int main(int argc, char** argv) {
                 // When the iteration number changes in the ifs.stat file, OpenIFS has completed writing
                 // to the output files for that iteration, those files can now be moved and uploaded.
 
+                phase_timer stat_timer("ifs_stat_poll");
                 oifs_get_stat(ifs_stat_file, stat_lastline);
                 if ( oifs_parse_stat(stat_lastline, iter, 4) ) {     // iter updates
                    if ( !oifs_valid_step(iter,total_nsteps) ) {
@@ -736,54 +1171,85 @@ int main(int argc, char** argv) {
           } 
 
           if (std::stoi(iter) != std::stoi(last_iter)) {
+             // Time the model steps. The first change includes the model's own startup so is recorded separately
+             // Time paused by the spool is not part of the model's step time
+             double step_elapsed = duration<double>(steady_clock::now() - last_step_time).count();
+             last_step_time = steady_clock::now();
+             step_elapsed -= spool_stalled_secs(spool) - last_step_stalled;
+             last_step_stalled = spool_stalled_secs(spool);
+             if (first_step) {
+                telemetry_add_time("model_startup", step_elapsed);
+                first_step = false;
+             } else {
+                telemetry_steps(std::stoi(iter) - std::stoi(last_iter), step_elapsed);
+                double p95;
+                telemetry_step_stats(step_secs, p95);
+             }
+
+             // Compare the cpu time of the model threads with the wall time of the steps from ifs.stat
+             if (sample_process(handleProcess, model_sample, true) &&
+                 omp_efficiency_update(omp, model_sample, std::stoi(iter), oifs_stat_time(stat_lastline),
+                                       std::stoi(nthreads), atoi(argv[8]))) {
+                if (omp.oversubscribed) {
+                   log_printf(log_error, "..Host appears oversubscribed: parallel efficiency %.2f, run queue wait %.0f%%, "
+                                   "will use %d threads on restart\n", omp.efficiency, 100 * omp.runqueue_wait, omp.suggested_nthreads);
+                } else {
+                   log_printf(log_info, "Host no longer oversubscribed: parallel efficiency %.2f\n", omp.efficiency);
+                }
+             }
+
              // Construct file name of the ICM result file
              second_part = get_second_part(last_iter, exptid);
+             phase_timer move_timer("move_outputs");
+
+             // A step already uploaded is computed again when the model restarts from a restart dump before the
+             // last upload, its outputs are the same as those uploaded and are deleted rather than uploaded again
+             if (std::stoi(last_iter) * timestep_interval < last_upload) {
+                for (const char* prefix : {"/ICMGG", "/ICMSH", "/ICMUA"}) std::remove((slot_path + prefix + second_part).c_str());
+             }
 
              // Move the ICMGG result file to the temporary folder in the project directory
              if(file_exists(slot_path + std::string("/ICMGG") + second_part)) {
                 cerr << "Moving to projects directory: " << (slot_path + std::string("/ICMGG") + second_part) << '\n';
-                retval = boinc_copy((slot_path + std::string("/ICMGG") + second_part).c_str() , \
-                                    (temp_path + std::string("/ICMGG") + second_part).c_str());
-                if (retval) {
-                   cerr << "..Copying ICMGG result file to the temp folder in the projects directory failed" << std::endl;
-                   return retval;
-                }
-                // If result file has been successfully copied over, remove it from slots directory
-                else {
-                   std::remove((slot_path + std::string("/ICMGG") + second_part).c_str());
+                std::string moved_file = temp_path + std::string("/ICMGG") + second_part;
+                if (!zip_move_file(slot_path + std::string("/ICMGG") + second_part, moved_file, moved_sources[moved_file])) {
+                   cerr << "..Moving ICMGG result file to the temp folder in the projects directory failed" << std::endl;
+                   return 1;
                 }
+                telemetry_count("files_moved", 1);
+                telemetry_count("bytes_moved", moved_sources[moved_file].size);
              }
 
              // Move the ICMSH result file to the temporary folder in the project directory
              if(file_exists(slot_path+std::string("/ICMSH") + second_part)) {
                 cerr << "Moving to projects directory: " << (slot_path + std::string("/ICMSH") + second_part) << '\n';
-                retval = boinc_copy((slot_path + std::string("/ICMSH") + second_part).c_str() , \
-                                    (temp_path + std::string("/ICMSH") + second_part).c_str());
-                if (retval) {
-                   cerr << "..Copying ICMSH result file to the temp folder in the projects directory failed" << std::endl;
-                   return retval;
-                }
-                // If result file has been successfully copied over, remove it from slots directory
-                else {
-                   std::remove((slot_path + std::string("/ICMSH") + second_part).c_str());
+                std::string moved_file = temp_path + std::string("/ICMSH") + second_part;
+                if (!zip_move_file(slot_path + std::string("/ICMSH") + second_part, moved_file, moved_sources[moved_file])) {
+                   cerr << "..Moving ICMSH result file to the temp folder in the projects directory failed" << std::endl;
+                   return 1;
                 }
+                telemetry_count("files_moved", 1);
+                telemetry_count("bytes_moved", moved_sources[moved_file].size);
              }
 
              // Move the ICMUA result file to the temporary folder in the project directory (this is for 43r3 and above only)
              if(file_exists(slot_path+std::string("/ICMUA") + second_part)) {
                 cerr << "Moving to projects directory: " << (slot_path + std::string("/ICMUA") + second_part) << '\n';
-                retval = boinc_copy((slot_path+std::string("/ICMUA") + second_part).c_str() , \
-                                    (temp_path+std::string("/ICMUA") + second_part).c_str());
-                if (retval) {
-                   cerr << "..Copying ICMUA result file to the temp folder in the projects directory failed" << std::endl;
-                   return retval;
-                }
-                // If result file has been successfully copied over, remove it from slots directory
-                else {
-                   std::remove((slot_path+std::string("/ICMUA") + second_part).c_str());
+                std::string moved_file = temp_path + std::string("/ICMUA") + second_part;
+                if (!zip_move_file(slot_path + std::string("/ICMUA") + second_part, moved_file, moved_sources[moved_file])) {
+                   cerr << "..Moving ICMUA result file to the temp folder in the projects directory failed" << std::endl;
+                   return 1;
                 }
+                telemetry_count("files_moved", 1);
+                telemetry_count("bytes_moved", moved_sources[moved_file].size);
              }
 		  
+             move_timer.stop();
+
+             if (filter_outputs) filter_output_files(output_manifest, temp_path, second_part);
+             index_output_files(temp_path, second_part);
+             ram_stage_measure(ramstage, second_part);
+
              // Convert iteration number to seconds
              current_iter = (std::stoi(last_iter)) * timestep_interval;
 
@@ -792,12 +1258,23 @@ int main(int argc, char** argv) {
              //cerr << "current_iter: " << current_iter << '\n';
              //cerr << "last_upload: " << last_upload << '\n';
 
-             // Upload a new upload file if the end of an upload_interval has been reached
-             if((( current_iter - last_upload ) >= (upload_interval * timestep_interval)) && (current_iter < total_length_of_simulation)) {
+             // Upload a new upload file if the end of an upload_interval has been reached, or the planner's
+             // size target or latency limit, or when asked for through the control socket. Uploads wait while
+             // the I/O work is paused.
+             if (!control_io_paused(control_io) &&
+                 plan_upload_due(planner, temp_path, upload_file_number, last_upload / timestep_interval, current_iter / timestep_interval)) {
+                if (planner.reason == std::string("request")) {
+                   cerr << "Upload due by request through the control socket" << '\n';
+                }
+                else if (planner.target_bytes > 0) {
+                   cerr << "Upload due by its " << planner.reason << ": " << (planner.pending_bytes >> 20) << " MB waiting, oldest "
+                        << (int) planner.oldest_secs << " secs" << '\n';
+                }
                 // Create an intermediate results zip file using BOINC zip
                 zfl.clear();
+                delta_replaced.clear();
 
-                boinc_begin_critical_section();
+                oifs_begin_critical_section();
 
                 // Cycle through all the steps from the last upload to the current upload
                 for (i = (last_upload / timestep_interval); i < (current_iter / timestep_interval); i++) {
@@ -831,8 +1308,18 @@ int main(int argc, char** argv) {
                       // Delete the file that has been added to the zip
                       // std::remove((temp_path+std::string("/ICMUA")+second_part).c_str());
                    }
+
+                   // Add the indexes of the result files
+                   for (const char* prefix : {"/ICMGG", "/ICMSH", "/ICMUA"}) {
+                      if(file_exists(temp_path + prefix + second_part + ".idx")) {
+                         cerr << "Adding to the zip: " << (temp_path + prefix + second_part + ".idx") << '\n';
+                         zfl.push_back(temp_path + prefix + second_part + ".idx");
+                      }
+                   }
                 }
 
+                if (upload_delta) delta_encode_zip_list(zfl, delta_replaced);
+
                 // If running under a BOINC client
                 if (!boinc_is_standalone()) {
 
@@ -844,12 +1331,14 @@ int main(int argc, char** argv) {
                       cerr << "Zipping up the intermediate file: " << upload_file << '\n';
                       //upfile = string(upload_file);
                       upfile = upload_file;
-                      retval = boinc_zip(ZIP_IT, upfile, &zfl);  // n.b. pass std::string to avoid copy-on-call
+                      phase_timer zip_timer("zip");
+                      retval = zip_upload(upfile, zfl, moved_sources, upload_zip_level);
+                      zip_timer.stop();
                       upfile.clear();
 
                       if (retval) {
                          cerr << "..Zipping up the intermediate file failed" << std::endl;
-                         boinc_end_critical_section();
+                         oifs_end_critical_section();
                          return retval;
                       }
                       else {
@@ -858,22 +1347,35 @@ int main(int argc, char** argv) {
                             // Delete the zipped file
                             std::remove(zfl[j].c_str());
                          }
+                         for (auto& replaced_file : delta_replaced) std::remove(replaced_file.c_str());
                       }
                    
+                      // Make sure the zip is on disk before the client is asked to upload it
+                      phase_timer upload_timer("upload");
+                      sync_file_and_dir(upload_file);
+                      telemetry_count("uploads", 1);
+                      std::error_code size_error;
+                      uintmax_t upload_size = std::filesystem::file_size(upload_file, size_error);
+                      if (size_error) upload_size = 0;
+                      else telemetry_count("bytes_uploaded", upload_size);
+
                       // Upload the file. In BOINC the upload file is the logical name, not the physical name
                       upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
                       cerr << "Uploading the intermediate file: " << upload_file_name << '\n';
-                      sleep_until(system_clock::now() + seconds(20));
-                      boinc_upload_file(upload_file_name);
-                      retval = boinc_upload_status(upload_file_name);
-                      if (!retval) {
+                      if (upload_and_confirm(upload_file_name, 5.0)) {
                          cerr << "Finished the upload of the intermediate file: " << upload_file_name << '\n';
                       }
+                      registered_uploads.push_back(upload_file_name);
+                      spool_add_upload(spool, upload_file_name, upload_size);
+                      upload_timer.stop();
 		      
                       trickle_upload_count++;
                       if (trickle_upload_count == 10) {
                         // Produce trickle
-                        process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter);
+                        process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter,version,model_completed,
+                                        trickle_perf_record(current_cpu_time-last_cpu_time,
+                                                            duration<double>(steady_clock::now()-launch_time).count(),
+                                                            atoi(nthreads.c_str()), restart_count));
                         trickle_upload_count = 0;
                       }
                    }
@@ -893,12 +1395,14 @@ int main(int argc, char** argv) {
                    if (zfl.size() > 0){
                       //upfile = string(upload_file);
                       upfile = upload_file;
-                      retval = boinc_zip(ZIP_IT,upfile,&zfl);
+                      phase_timer zip_timer("zip");
+                      retval = zip_upload(upfile, zfl, moved_sources, upload_zip_level);
+                      zip_timer.stop();
                       upfile.clear();
 
                       if (retval) {
                          cerr << "..Creating the zipped upload file failed" << std::endl;
-                         boinc_end_critical_section();
+                         oifs_end_critical_section();
                          return retval;
                       }
                       else {
@@ -907,6 +1411,7 @@ int main(int argc, char** argv) {
                             // Delete the zipped file
                             std::remove(zfl[j].c_str());
                          }
+                         for (auto& replaced_file : delta_replaced) std::remove(replaced_file.c_str());
                       }
                    }
                    last_upload = current_iter;
@@ -914,19 +1419,43 @@ int main(int argc, char** argv) {
                    trickle_upload_count++;
                    if (trickle_upload_count == 10) {
                       // Produce trickle
-                      process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter);
+                      process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter,version,model_completed,
+                                      trickle_perf_record(current_cpu_time-last_cpu_time,
+                                                          duration<double>(steady_clock::now()-launch_time).count(),
+                                                          atoi(nthreads.c_str()), restart_count));
                       trickle_upload_count = 0;
                    }
 
                 }
-                boinc_end_critical_section();
+                oifs_end_critical_section();
                 upload_file_number++;
+                planner.requested = false;
+                telemetry_write();
+             }
+
+             // Result files held in memory are written to disk at each restart dump, as the relaunched model does
+             // not compute them again, and when memory is short. Otherwise the next steps are linked to memory.
+             if (!ramstage.path.empty()) {
+                bool short_of_memory = ram_stage_check(ramstage);
+                int dump_step = (restart_interval > 0) ? (std::stoi(iter) / restart_interval) * restart_interval : 0;
+                if (short_of_memory || dump_step > ramstage.spilled_step) {
+                   long long spilled = ram_stage_spill(ramstage, moved_sources);
+                   if (spilled > 0) {
+                      cerr << "Wrote the result files held in memory to disk: " << (spilled >> 20) << " MB"
+                           << (short_of_memory ? ", memory is short" : "") << '\n';
+                      telemetry_count("ram_bytes_spilled", spilled);
+                   }
+                   ramstage.spilled_step = std::max(dump_step, ramstage.spilled_step);
+                }
+                ram_stage_link(ramstage, std::stoi(iter), (int) total_nsteps);
+                telemetry_gauge("ram_staged_bytes", ramstage.bytes);
              }
           }
           last_iter = iter;
           count = 0;
 	       
           // Update the progress file	
+          phase_timer progress_timer("progress_file");
           progress_file_out.open(progress_file);
           progress_file_out <<"<?xml version=\"1.0\" encoding=\"utf-8\"?>"<< '\n';
           progress_file_out <<"<running_values>"<< '\n';
@@ -935,19 +1464,41 @@ int main(int argc, char** argv) {
           progress_file_out <<"  <last_iter>"<<last_iter<<"</last_iter>"<< '\n';
           progress_file_out <<"  <last_upload>"<<std::to_string(last_upload)<<"</last_upload>"<< '\n';
           progress_file_out <<"  <model_completed>"<<std::to_string(model_completed)<<"</model_completed>"<< '\n';
+          progress_file_out <<"  <restart_count>"<<std::to_string(restart_count)<<"</restart_count>"<< '\n';
+          progress_file_out <<"  <omp_efficiency>"<<std::to_string(omp.efficiency)<<"</omp_efficiency>"<< '\n';
+          progress_file_out <<"  <suggested_nthreads>"<<std::to_string(omp.suggested_nthreads)<<"</suggested_nthreads>"<< '\n';
           progress_file_out <<"</running_values>"<< std::endl;
           progress_file_out.close();
+          progress_timer.stop();
        }
 	    
-       // Calculate current_cpu_time, only update if cpu_time returns a value
-       if (cpu_time(handleProcess)) {
-          current_cpu_time = last_cpu_time + cpu_time(handleProcess);
-          //fprintf(stderr,"current_cpu_time: %1.5f\n",current_cpu_time);
+       // Sample the model's resource usage: cpu time every loop; memory, faults, I/O and per-thread cpu
+       // every 10 secs. Only update current_cpu_time if the sample returns a value.
+       if (sample_process(handleProcess, model_sample, count == 0)) {
+          if (model_sample.cpu_time > 0) {
+             current_cpu_time = last_cpu_time + model_sample.cpu_time;
+             //fprintf(stderr,"current_cpu_time: %1.5f\n",current_cpu_time);
+          }
+
+          if (count == 0) {
+             telemetry_gauge("peak_rss_kb", max(telemetry_get("peak_rss_kb"), (double) model_sample.peak_rss_kb));
+             telemetry_gauge("rss_kb", model_sample.rss_kb);
+             telemetry_gauge("major_faults", model_sample.major_faults);
+             telemetry_gauge("io_read_bytes", model_sample.io_read_bytes);
+             telemetry_gauge("io_write_bytes", model_sample.io_write_bytes);
+             telemetry_gauge("model_threads", model_sample.thread_ids.size());
+
+             // Performance log in the slot, one line every 5 mins
+             if (steady_clock::now() - last_perf_log >= minutes(5)) {
+                perf_log_sample(slot_path + std::string("/oifs_perf.log"), iter, model_sample);
+                last_perf_log = steady_clock::now();
+             }
+          }
        }
 	       
 
       // Calculate the fraction done
-      fraction_done = model_frac_done( atof(iter.c_str()), total_nsteps, atoi(nthreads.c_str()) );
+      fraction_done = model_frac_done( atof(iter.c_str()), total_nsteps, atoi(nthreads.c_str()), step_secs );
       //fprintf(stderr,"fraction done: %.6f\n", fraction_done);
      
 
@@ -968,15 +1519,91 @@ int main(int argc, char** argv) {
 	
       // Check the status of the child process    
       process_status = check_child_status(handleProcess,process_status);
-    }
 
+      // Pause the model while the backlog of results waiting to be uploaded is too large
+      if (process_status == 0) {
+         if (count == 0) {
+            spool_scan(spool);
+            telemetry_gauge("spool_pending_bytes", spool.pending_bytes);
+            telemetry_gauge("spool_upload_bytes", spool.upload_bytes);
+            telemetry_gauge("spool_free_bytes", spool.free_bytes);
+         }
+         int spool_change = spool_control(spool, handleProcess);
+         if (spool_change > 0) {
+            cerr << "..Pausing the model, " << (spool.pending_bytes >> 20) << " MB of results waiting to upload, "
+                 << (spool.free_bytes >> 20) << " MB free disk space" << std::endl;
+            telemetry_count("model_stalls", 1);
+            omp.last_step = -1;       // the paused interval is not a measure of the model's efficiency
+         }
+         else if (spool_change < 0) {
+            cerr << "Resuming the model after " << spool_stalled_secs(spool) << " secs paused, "
+                 << (spool.pending_bytes >> 20) << " MB of results waiting to upload" << std::endl;
+         }
+         telemetry_gauge("model_stalled_secs", spool_stalled_secs(spool));
+      }
 
-    // Time delay to ensure model files are all flushed to disk
-    sleep_until(system_clock::now() + seconds(60));
+      // Delete the old restart sets, and compress the newest, once the model has completed a new set
+      if (process_status == 0 && count == 0 && !control_io_paused(control_io)) {
+         restart_stats restart_work;
+         restart_housekeeping(restarts, restart_work);
+         telemetry_gauge("restart_sets", restart_work.sets);
+         telemetry_gauge("restart_bytes", restart_work.bytes);
+         if (restart_work.pruned_sets > 0) {
+            cerr << "Deleted " << restart_work.pruned_sets << " old restart sets, " << (restart_work.pruned_bytes >> 20) << " MB" << '\n';
+            telemetry_count("restart_sets_pruned", restart_work.pruned_sets);
+            telemetry_count("restart_bytes_pruned", restart_work.pruned_bytes);
+         }
+         if (restart_work.compressed_files > 0) {
+            cerr << "Compressed " << restart_work.compressed_files << " restart files in " << restart_work.compress_secs << " secs, "
+                 << restart_work.compressed_bytes_in << " bytes reduced to " << restart_work.compressed_bytes_out << '\n';
+            telemetry_add_time("restart_compress", restart_work.compress_secs);
+            telemetry_count("restart_bytes_compressed_in", restart_work.compressed_bytes_in);
+            telemetry_count("restart_bytes_compressed_out", restart_work.compressed_bytes_out);
+         }
+      }
+
+      // Answer the commands sent to the control socket, see oifs_control.cpp for the commands
+      if (process_status == 0 && control_poll(control, control_commands) > 0) {
+         for (const control_command& command : control_commands) {
+            telemetry_count("control_commands", 1);
+            control_dispatch(control, control_io, command);
+         }
+      }
+    }
+    control_close(control);
+
+
+    // Ensure model files are all flushed to disk: wait until their sizes are stable, rather than sleeping for
+    // a fixed time. All files share one bounded wait of 60 secs.
+    {
+       phase_timer flush_timer("wait_model_flush");
+       auto flush_deadline = steady_clock::now() + seconds(60);
+       second_part = get_second_part(last_iter, exptid);
+       for (std::string model_file : { std::string("/ifs.stat"), std::string("/NODE.001_01"), std::string("/ICMGG") + second_part,
+                                       std::string("/ICMSH") + second_part, std::string("/ICMUA") + second_part }) {
+          double remaining = duration<double>(flush_deadline - steady_clock::now()).count();
+          wait_for_file_ready(slot_path + model_file, std::max(remaining, 0.0));
+       }
+    }
 
     // Print content of key model files to help with diagnosing problems
     print_last_lines("NODE.001_01", 70);    //  main model output log	
 
+    // If the model failed, a bundle of diagnostics is uploaded as the final upload, the last upload file declared,
+    // which the failed task does not otherwise use. The intermediate upload files are left as they are, and the
+    // restart does not take the bundle for an upload of results (see oifs_recover.cpp). When the client stopped
+    // the task (quit or abort) it does not wait on an upload, and no diagnostics are made.
+    bool stopped_by_client = (process_status == 2 || process_status == 6);
+    int diag_upload_number = std::max(planner.slots - 1, upload_file_number);
+    std::string diag_upload_name = std::string("upload_file_") + std::to_string(diag_upload_number) + std::string(".zip");
+    std::string diag_upload_file = project_path + result_base_name + "_" + std::to_string(diag_upload_number) + ".zip";
+    if (boinc_is_standalone()) {
+       diag_upload_name = app_name + std::string("_") + unique_member_id + std::string("_") + start_date + std::string("_") + \
+                   std::to_string(num_days_trunc) + std::string("_") + batchid + std::string("_") + wuid + std::string("_") + \
+                   std::to_string(diag_upload_number) + std::string(".zip");
+       diag_upload_file = project_path + diag_upload_name;
+    }
+
     // To check whether model completed successfully, look for 'CNT0' in 3rd column of ifs.stat
     // This will always be the last line of a successful model forecast.
     if(file_exists(slot_path + std::string("/ifs.stat"))) {
@@ -991,12 +1618,21 @@ int main(int argc, char** argv) {
          print_last_lines("waminfo",17);          // wave model restart control
          print_last_lines(progress_file,8);
          cerr << "..Failed, model did not complete successfully" << std::endl;
+         if (!stopped_by_client) {
+            upload_diagnostics("model did not complete successfully, CNT0 not found in ifs.stat", slot_path, progress_file,
+                               last_iter, model_sample, diag_upload_file, diag_upload_name);
+         }
+         if (process_status == 2) ramstage_guard.keep();
          return 1;
        }
     }
     // ifs.stat has not been produced, then model did not start
     else {
        cerr << "..Failed, model did not start" << std::endl;
+       if (!stopped_by_client) {
+          upload_diagnostics("model did not start", slot_path, progress_file, last_iter, model_sample, diag_upload_file, diag_upload_name);
+       }
+       if (process_status == 2) ramstage_guard.keep();
        return 1;	    
     }
 	
@@ -1004,61 +1640,63 @@ int main(int argc, char** argv) {
     // Update model_completed
     model_completed = 1;
 
+    // Add the step time of this run to the host calibration
+    double mean_step_secs, p95_step_secs;
+    if (telemetry_step_stats(mean_step_secs, p95_step_secs)) calib_record(calib_file, calib_name, mean_step_secs);
+
     // We need to handle the last ICM files
     // Construct final file name of the ICM result file
     second_part = get_second_part(last_iter, exptid);
+    phase_timer final_move_timer("move_outputs");
 
     // Move the ICMGG result file to the temporary folder in the project directory
     if(file_exists(slot_path+std::string("/ICMGG") + second_part)) {
        cerr << "Moving to projects directory: " << (slot_path+std::string("/ICMGG") + second_part) << '\n';
-       retval = boinc_copy((slot_path + std::string("/ICMGG") + second_part).c_str() , \
-                           (temp_path + std::string("/ICMGG") + second_part).c_str());
-       if (retval) {
-          cerr << "..Copying ICMGG result file to the temp folder in the projects directory failed" << std::endl;
-          return retval;
-       }
-       // If result file has been successfully copied over, remove it from slots directory
-       else {
-          std::remove((slot_path + std::string("/ICMGG") + second_part).c_str());
+       std::string moved_file = temp_path + std::string("/ICMGG") + second_part;
+       if (!zip_move_file(slot_path + std::string("/ICMGG") + second_part, moved_file, moved_sources[moved_file])) {
+          cerr << "..Moving ICMGG result file to the temp folder in the projects directory failed" << std::endl;
+          return 1;
        }
+       telemetry_count("files_moved", 1);
+       telemetry_count("bytes_moved", moved_sources[moved_file].size);
     }
 
     // Move the ICMSH result file to the temporary folder in the project directory
     if(file_exists(slot_path+std::string("/ICMSH") + second_part)) {
        cerr << "Moving to projects directory: " << (slot_path+std::string("/ICMSH") + second_part) << '\n';
-       retval = boinc_copy((slot_path + std::string("/ICMSH") + second_part).c_str() , \
-                           (temp_path + std::string("/ICMSH") + second_part).c_str());
-       if (retval) {
-          cerr << "..Copying ICMSH result file to the temp folder in the projects directory failed" << std::endl;
-          return retval;
-       }
-       // If result file has been successfully copied over, remove it from slots directory
-       else {
-          std::remove((slot_path+std::string("/ICMSH")+second_part).c_str());
+       std::string moved_file = temp_path + std::string("/ICMSH") + second_part;
+       if (!zip_move_file(slot_path + std::string("/ICMSH") + second_part, moved_file, moved_sources[moved_file])) {
+          cerr << "..Moving ICMSH result file to the temp folder in the projects directory failed" << std::endl;
+          return 1;
        }
+       telemetry_count("files_moved", 1);
+       telemetry_count("bytes_moved", moved_sources[moved_file].size);
     }
 
     // Move the ICMUA result file to the temporary folder in the project directory (this is for 43r3 and above only)
     if(file_exists(slot_path + std::string("/ICMUA") + second_part)) {
        cerr << "Moving to projects directory: " << (slot_path+std::string("/ICMUA") + second_part) << '\n';
-       retval = boinc_copy((slot_path + std::string("/ICMUA") + second_part).c_str() , \
-                           (temp_path + std::string("/ICMUA") + second_part).c_str());
-       if (retval) {
-          cerr << "..Copying ICMUA result file to the temp folder in the projects directory failed" << std::endl;
-	  return retval;
-       }
-       // If result file has been successfully copied over, remove it from slots directory
-       else {
-          std::remove((slot_path + std::string("/ICMUA") + second_part).c_str());
+       std::string moved_file = temp_path + std::string("/ICMUA") + second_part;
+       if (!zip_move_file(slot_path + std::string("/ICMUA") + second_part, moved_file, moved_sources[moved_file])) {
+          cerr << "..Moving ICMUA result file to the temp folder in the projects directory failed" << std::endl;
+          return 1;
        }
+       telemetry_count("files_moved", 1);
+       telemetry_count("bytes_moved", moved_sources[moved_file].size);
     }
     
 	    
-    boinc_begin_critical_section();
+    final_move_timer.stop();
+
+    if (filter_outputs) filter_output_files(output_manifest, temp_path, second_part);
+    index_output_files(temp_path, second_part);
+
+    oifs_begin_critical_section();
 
     // Create the final results zip file
 
     zfl.clear();
+    delta_replaced.clear();
     std::string node_file = slot_path + std::string("/NODE.001_01");
     zfl.push_back(node_file);
     std::string ifsstat_file = slot_path + std::string("/ifs.stat");
@@ -1066,6 +1704,34 @@ int main(int argc, char** argv) {
     cerr << "Adding to the zip: " << node_file << '\n';
     cerr << "Adding to the zip: " << ifsstat_file << '\n';
 
+    // Include the table of the model's time in each routine, of a task with DrHook profiling on, see oifs_profile.cpp
+    if (drhook == drhook_profiling) {
+       drhook_profile profile;
+       std::string profile_file = slot_path + std::string("/oifs_profile.txt");
+       double profile_wall = duration<double>(steady_clock::now() - launch_time).count();
+       if (profile_collect(slot_path, "drhook.prof", profile) > 0 &&
+           profile_write(profile, profile_file,
+                         {{"wuid", wuid}, {"cpu", cpu_model_name()}, {"nthreads", nthreads},
+                          {"resolution", horiz_resolution + grid_type + "_L" + vert_resolution},
+                          {"utstep", std::to_string(timestep_interval)},
+                          {"steps", std::to_string((int) total_nsteps - launch_step)},
+                          {"wall_secs", std::to_string(profile_wall)}, {"restarts", std::to_string(restart_count)}}, 500)) {
+          zfl.push_back(profile_file);
+          cerr << "Adding to the zip: " << profile_file << '\n';
+          telemetry_gauge("profile_routines", profile.routines.size());
+       }
+       else {
+          cerr << "..No DrHook profile was found in the slot" << std::endl;
+       }
+    }
+
+    // Include the controller's phase timings so they can be aggregated across hosts
+    if (telemetry_write()) {
+       std::string metrics_file = slot_path + std::string("/oifs_metrics.json");
+       zfl.push_back(metrics_file);
+       cerr << "Adding to the zip: " << metrics_file << '\n';
+    }
+
     // Read the remaining list of files from the slots directory and add the matching files to the list of files for the zip
     dirp = opendir(temp_path.c_str());
     if (dirp) {
@@ -1082,8 +1748,19 @@ int main(int argc, char** argv) {
         closedir(dirp);
     }
 
+    if (upload_delta) delta_encode_zip_list(zfl, delta_replaced);
+
     // If running under a BOINC client
     if (!boinc_is_standalone()) {
+       // With size targeted uploads the final upload takes the last upload file, those not used are uploaded empty
+       if (planner.target_bytes > 0 && zfl.size() > 0) {
+          for (; upload_file_number < planner.slots - 1; upload_file_number++) {
+             upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
+             upload_file = project_path + result_base_name + "_" + std::to_string(upload_file_number) + ".zip";
+             if (upload_empty(upload_file, upload_file_name)) registered_uploads.push_back(upload_file_name);
+          }
+       }
+
        if (zfl.size() > 0){
 
           // Create the zipped upload file from the list of files added to zfl
@@ -1091,12 +1768,14 @@ int main(int argc, char** argv) {
 
           cerr << "Zipping up the final file: " << upload_file << '\n';
           upfile = upload_file;
-          retval = boinc_zip(ZIP_IT, upfile, &zfl);
+          phase_timer zip_timer("zip");
+          retval = zip_upload(upfile, zfl, moved_sources, upload_zip_level);
+          zip_timer.stop();
           upfile.clear();
 
           if (retval) {
              cerr << "..Zipping up the final file failed" << std::endl;
-             boinc_end_critical_section();
+             oifs_end_critical_section();
              return retval;
           }
           else {
@@ -1105,22 +1784,33 @@ int main(int argc, char** argv) {
                 // Delete the zipped file
                 std::remove(zfl[j].c_str());
              }
+             for (auto& replaced_file : delta_replaced) std::remove(replaced_file.c_str());
           }
 
+          // Make sure the zip is on disk before the client is asked to upload it
+          phase_timer upload_timer("upload");
+          sync_file_and_dir(upload_file);
+          telemetry_count("uploads", 1);
+          std::error_code size_error;
+          uintmax_t upload_size = std::filesystem::file_size(upload_file, size_error);
+          if (!size_error) telemetry_count("bytes_uploaded", upload_size);
+
           // Upload the file. In BOINC the upload file is the logical name, not the physical name
           upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
           cerr << "Uploading the final file: " << upload_file_name << '\n';
-          sleep_until(system_clock::now() + seconds(20));
-          boinc_upload_file(upload_file_name);
-          retval = boinc_upload_status(upload_file_name);
-          if (!retval) {
+          if (upload_and_confirm(upload_file_name, 5.0)) {
              cerr << "Finished the upload of the final file" << '\n';
           }
+          registered_uploads.push_back(upload_file_name);
+          upload_timer.stop();
 	       
 	  // Produce trickle
-          process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter);
+          process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter,version,model_completed,
+                          trickle_perf_record(current_cpu_time-last_cpu_time,
+                                              duration<double>(steady_clock::now()-launch_time).count(),
+                                              atoi(nthreads.c_str()), restart_count));
        }
-       boinc_end_critical_section();
+       oifs_end_critical_section();
     }
     // Else running in standalone
     else {
@@ -1134,11 +1824,13 @@ int main(int argc, char** argv) {
 
        if (zfl.size() > 0){
           upfile = upload_file;
-          retval = boinc_zip(ZIP_IT,upfile,&zfl);
+          phase_timer zip_timer("zip");
+          retval = zip_upload(upfile, zfl, moved_sources, upload_zip_level);
+          zip_timer.stop();
           upfile.clear();
           if (retval) {
              cerr << "..Creating the zipped upload file failed" << std::endl;
-             boinc_end_critical_section();
+             oifs_end_critical_section();
              return retval;
           }
           else {
@@ -1147,32 +1839,55 @@ int main(int argc, char** argv) {
                 // Delete the zipped file
                 std::remove(zfl[j].c_str());
              }
+             for (auto& replaced_file : delta_replaced) std::remove(replaced_file.c_str());
           }
         }
 	// Produce trickle
-        process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter);     
+        process_trickle(current_cpu_time,wu_name,result_base_name,slot_path,current_iter,version,model_completed,
+                        trickle_perf_record(current_cpu_time-last_cpu_time,
+                                            duration<double>(steady_clock::now()-launch_time).count(),
+                                            atoi(nthreads.c_str()), restart_count));
     }
 
     // Now task has finished, remove the temp folder
+    ram_stage_close(ramstage);
     std::remove(temp_path.c_str());
 
-    sleep_until(system_clock::now() + seconds(120));
+    // Give the client the chance to report on the uploads registered by this run before finishing.
+    // Bounded to the 120 secs previously used as a fixed delay; returns immediately in standalone.
+    phase_timer final_wait_timer("wait_final_uploads");
+    wait_for_condition([&registered_uploads]() {
+                          for (auto& name : registered_uploads) {
+                             if (boinc_upload_status(name) == ERR_NOT_FOUND) return false;
+                          }
+                          return true;
+                       }, 120.0, 1.0, "upload status of registered upload files");
+    final_wait_timer.stop();
+    log_stats logged = log_get_stats();
+    telemetry_count("log_lines", logged.lines);
+    telemetry_count("log_bytes", logged.bytes);
+    telemetry_count("log_suppressed", logged.suppressed);
+    telemetry_count("log_ring_waits", logged.waits);
+    telemetry_write();
+
+    // Write out the log before boinc_finish() writes to stderr itself and exits
+    log_shutdown();
 
     // if finished normally
     if (process_status == 1){
-      boinc_end_critical_section();
+      oifs_end_critical_section();
       boinc_finish(0);
       cerr << "Task finished" << std::endl;
       return 0;
     }
     else if (process_status == 2){
-      boinc_end_critical_section();
+      oifs_end_critical_section();
       boinc_finish(0);
       cerr << "Task finished" << std::endl;
       return 0;
     }
     else {
-      boinc_end_critical_section();
+      oifs_end_critical_section();
       boinc_finish(1);
       cerr << "Task finished" << std::endl;
       return 1;
@@ -1180,8 +1895,6 @@ int main(int argc, char** argv) {
 }
 
 
-
-
 int check_child_status(long handleProcess, int process_status) {
     int stat,pid;
 
@@ -1209,8 +1922,7 @@ int check_child_status(long handleProcess, int process_status) {
     else if ( pid == -1) {
       // should not get here, it means the child could not be found
       process_status = 5;
-      cerr << "..Unable to retrieve status of child process " << std::endl;
-      perror("waitpid() error");
+      cerr << "..Unable to retrieve status of child process, waitpid() error: " << strerror(errno) << std::endl;
     }
     return process_status;
 }
@@ -1230,7 +1942,7 @@ int check_boinc_status(long handleProcess, int process_status) {
     else if (status.abort_request) {
        cerr << "Abort request received from BOINC client, ending the child process" << std::endl;
        kill(handleProcess, SIGKILL);
-       process_status = 1;
+       process_status = 6;
        return process_status;
     }
     else if (status.no_heartbeat) {
@@ -1256,7 +1968,7 @@ int check_boinc_status(long handleProcess, int process_status) {
              else if (status.abort_request) {
                 cerr << "Abort request received from the BOINC client, ending the child process" << std::endl;
                 kill(handleProcess, SIGKILL);
-                process_status = 1;
+                process_status = 6;
                 return process_status;
              }
              else if (status.no_heartbeat) {
@@ -1280,6 +1992,7 @@ int check_boinc_status(long handleProcess, int process_status) {
 long launch_process(const std::string slot_path,const char* strCmd,const char* exptid, const std::string app_name) {
     int retval = 0;
     long handleProcess;
+    phase_timer launch_timer("launch");
 
     //cerr << "slot_path: " << slot_path << '\n';
     //cerr << "strCmd: " << strCmd << '\n';
@@ -1321,8 +2034,10 @@ long launch_process(const std::string slot_path,const char* strCmd,const char* e
           }
 
           // If execl returns then there was an error
+          // _exit, not exit: the atexit handlers and static destructors belong to the controller
           cerr << "..The execl() command failed slot_path=" << slot_path << ",strCmd=" << strCmd << ",exptid=" << exptid << std::endl;
-          exit(retval);
+          cerr.flush();
+          _exit(retval);
           break;
        }
        default: 
@@ -1332,33 +2047,13 @@ long launch_process(const std::string slot_path,const char* strCmd,const char* e
 }
 
 
-// Open a file and return the string contained between the arrow tags
-std::string get_tag(const std::string &filename) {
-    std::ifstream file(filename);
-    if (file.is_open()) {
-       std::string line;
-       while (getline(file, line)) {
-          std::string::size_type start = line.find('>');
-          if (start != line.npos) {
-             std::string::size_type end = line.find('<', start + 1);
-             if (end != line.npos) {
-                ++start;
-                std::string::size_type count_size = end - start;
-                return line.substr(start, count_size);
-             }
-          }
-          return "";
-       }
-       file.close();
-    }
-    return "";
-}
-
-
 // Produce the trickle and either upload to the project server or as a physical file
-void process_trickle(double current_cpu_time, std::string wu_name, std::string result_base_name, std::string slot_path, int timestep) {
+void process_trickle(double current_cpu_time, std::string wu_name, std::string result_base_name, std::string slot_path, int timestep,
+                     std::string version, int phase, std::string perf_record) {
     std::string trickle, trickle_location;
     int rsize;
+    phase_timer trickle_timer("trickle");
+    telemetry_count("trickles", 1);
 
     //cerr << "current_cpu_time: " << current_cpu_time << '\n';
     //cerr << "wu_name: " << wu_name << '\n';
@@ -1367,8 +2062,9 @@ void process_trickle(double current_cpu_time, std::string wu_name, std::string r
     //cerr << "timestep: " << timestep << '\n';
 
     std::stringstream trickle_buffer;
-    trickle_buffer << "<wu>" << wu_name << "</wu>\n<result>" << result_base_name << "</result>\n<ph></ph>\n<ts>" \
-                   << timestep << "</ts>\n<cp>" << current_cpu_time << "</cp>\n<vr></vr>\n";
+    trickle_buffer << "<wu>" << wu_name << "</wu>\n<result>" << result_base_name << "</result>\n<ph>" << phase << "</ph>\n<ts>" \
+                   << timestep << "</ts>\n<cp>" << current_cpu_time << "</cp>\n<vr>" << version << "</vr>\n<pf>" \
+                   << perf_record << "</pf>\n";
     trickle = trickle_buffer.str();
     cerr << "Contents of trickle:\n" << trickle << '\n';
       
@@ -1433,7 +2129,7 @@ double cpu_time(long handleProcess) {
 
 // returns fraction completed of model run
 // (candidate for moving into OpenIFS specific src file)
-double model_frac_done(double step, double total_steps, int nthreads ) {
+double model_frac_done(double step, double total_steps, int nthreads, double step_secs ) {
    static int     stepm1 = -1;
    static double  heartbeat = 0.0;
    static bool    debug = false;
@@ -1458,7 +2154,13 @@ double model_frac_done(double step, double total_steps, int nthreads ) {
    //
    // If we want more accuracy could use the ratio of the model timestep to 1h (T159 tstep) to 
    // provide a 'slowdown' factor for higher resolutions.
-   heartbeat_inc = (frac_per_step / (70.0 / (double)nthreads) );
+   //
+   // Once the wall time of a step on this host is known (step_secs, from the host calibration or the
+   // steps of this run), it is used in place of the estimate, as the mainloop takes a second.
+   if ( step_secs > 0 )
+      heartbeat_inc = frac_per_step / step_secs;
+   else
+      heartbeat_inc = (frac_per_step / (70.0 / (double)nthreads) );
 
    if ( (int) step > stepm1 ) {
       heartbeat = 0.0;
@@ -1472,96 +2174,15 @@ double model_frac_done(double step, double total_steps, int nthreads ) {
    if (frac_done < 0.0)  frac_done = 0.0;
    if (frac_done > 1.0)  frac_done = 0.9999; // never 100% until wrapper finishes
    if (debug){
-      fprintf(stderr, "    heartbeat_inc = %.8f\n", heartbeat_inc);
-      fprintf(stderr, "    heartbeat     = %.8f\n", heartbeat );
+      log_printf(log_debug, "    heartbeat_inc = %.8f\n", heartbeat_inc);
+      log_printf(log_debug, "    heartbeat     = %.8f\n", heartbeat );
       double percent = frac_done * 100.0;
-      fprintf(stderr, "     percent done = %.3f\n", percent);
+      log_printf(log_debug, "     percent done = %.3f\n", percent);
    }
 
    return frac_done;
 }
 
-// Construct the second part of the file to be uploaded
-std::string get_second_part(string last_iter, string exptid) {
-   std::string second_part="";
-
-   if (last_iter.length() == 1) {
-      second_part = exptid +"+"+ "00000" + last_iter;
-   }
-   else if (last_iter.length() == 2) {
-      second_part = exptid + "+" + "0000" + last_iter;
-   }
-   else if (last_iter.length() == 3) {
-      second_part = exptid + "+" + "000" + last_iter;
-   }
-   else if (last_iter.length() == 4) {
-      second_part = exptid + "+" + "00" + last_iter;
-   }
-   else if (last_iter.length() == 5) {
-      second_part = exptid + "+" + "0" + last_iter;
-   }
-   else if (last_iter.length() == 6) {
-      second_part = exptid + "+" + last_iter;
-   }
-
-   return second_part;
-}
-
-
-bool check_stoi(std::string& cin) {
-    //  check input string is convertable to an integer by checking for any letters
-    //  nb. stoi() will convert leading digits if alphanumeric but we know step must be all digits.
-    //  Returns true on success, false if non-numeric data in input string.
-    //  Glenn Carver
-
-    int step;
-
-    if (std::any_of(cin.begin(), cin.end(), ::isalpha)) {
-        cerr << "..Invalid characters in stoi string: " << cin << std::endl;
-        return false;
-    }
-
-    //  check stoi standard exceptions
-    //  n.b. still need to check step <= max_step
-    try {
-        step = std::stoi(cin);
-        //cerr << "step converted is : " << step << '\n';
-        return true;
-    }
-    catch (const std::invalid_argument &excep) {
-        cerr << "..Invalid input argument for stoi : " << excep.what() << std::endl;
-        return false;
-    }
-    catch (const std::out_of_range &excep) {
-        cerr << "..Out of range value for stoi : " << excep.what() << std::endl;
-        return false;
-    }
-}
-
-
-bool oifs_parse_stat(std::string& logline, std::string& stat_column, int index) {
-   //   Parse a line of the OpenIFS ifs.stat log file, previously obtained from oifs_get_statline
-   //      logline  : incoming ifs.stat logfile line to be parsed
-   //      stat_col : returned string given by position 'index'
-   //  Returns false if string is empty.
-
-   istringstream tokens;
-   std::string statstr="";
-
-   //  split input, get token specified by 'column' unless file is corrupted
-   tokens.str(logline);
-   for (int i=0; i<index; ++i)
-      tokens >> statstr;
-
-   if ( statstr.empty() ){
-      return false;
-   } else {
-      stat_column = statstr;
-      //cerr << "oifs_parse_ifsstat: parsed string  = " << stat_column << " index " << index << '\n';
-      return true;
-   }
-}
-
 
 bool oifs_get_stat(std::ifstream& ifs_stat, std::string& logline) {
    // Parse content of ifs.stat and always return last non-zero line read from log file.
@@ -1609,54 +2230,816 @@ bool oifs_get_stat(std::ifstream& ifs_stat, std::string& logline) {
 }
 
 
-bool oifs_valid_step(std::string& step, int nsteps) {
-   //  checks for a valid step count in arg 'step'
-   //  Returns :   true if step is valid, otherwise false
-   //      Glenn
+int print_last_lines(string filename, int maxlines) {
+   // Prints the last lines of a file to stderr, if it exists, reading it backwards from its end (see tail_lines).
+   // Returns: zero : either can't open file or file is empty
+   //          > 0  : no. of lines printed (may be less than maxlines)
+   //  Glenn
+
+   string  tail;
+   int     count = tail_lines(filename, maxlines, tail);
+
+   if ( count > 0 ) {
+      cerr << ">>> Printing last " << count << " lines from file: " << filename << '\n';
+      log_dump(true);
+      cerr << tail;
+      if ( tail.back() != '\n' ) cerr << '\n';
+      log_dump(false);
+      cerr << "------------------------------------------------" << std::endl;
+   }
+
+   return max(count, 0);
+}
+
+
+bool wait_for_condition(const std::function<bool()>& ready, double timeout, double poll_interval, const std::string& what) {
+   //  Polls 'ready' every poll_interval seconds until it returns true or 'timeout' seconds have passed.
+   //  Used in place of fixed sleeps; the time actually waited is reported to stderr.
+   //  Returns: true if the condition was met, false on timeout.
+
+   auto   start = steady_clock::now();
+   double elapsed = 0.0;
+   bool   ok;
+
+   while ( !(ok = ready()) ) {
+      elapsed = duration<double>(steady_clock::now() - start).count();
+      if ( elapsed >= timeout ) break;
+      sleep_for(duration<double>(min(poll_interval, timeout - elapsed)));
+   }
+   elapsed = duration<double>(steady_clock::now() - start).count();
+
+   if ( ok ) {
+      log_printf(log_info, "Waited %.2f secs for %s\n", elapsed, what.c_str());
+   } else {
+      log_printf(log_error, "..Timed out after %.2f secs waiting for %s\n", elapsed, what.c_str());
+   }
+   return ok;
+}
+
+
+bool wait_for_file_ready(const std::string& filename, double timeout) {
+   //  Waits until the size of a model output file has stopped changing, then flushes it to disk. It is called
+   //  once the model has exited, so the file is closed. A file that does not exist is treated as ready.
+   //  Returns: false if the file was still changing after 'timeout' seconds.
+
+   struct stat file_stat;
+   off_t       last_size = -1;
+   bool        ready;
+
+   ready = wait_for_condition([&]() {
+                if ( stat(filename.c_str(), &file_stat) != 0 ) return true;
+                bool stable = (file_stat.st_size == last_size);
+                last_size = file_stat.st_size;
+                return stable;
+             }, timeout, 0.2, filename + " to be stable");
+
+   if ( ready && file_exists(filename) ) sync_file_and_dir(filename);
+   return ready;
+}
+
+
+int sync_file_and_dir(const std::string& filename) {
+   //  fsync a file and the directory containing it, so both its contents and its directory entry
+   //  are on disk before the file is handed to the BOINC client.
+   //  Returns: zero on success, otherwise -1.
+
+   int retval = 0;
+   int fd = open(filename.c_str(), O_RDONLY);
+   if ( fd < 0 || fsync(fd) != 0 ) retval = -1;
+   if ( fd >= 0 ) close(fd);
 
-   // make sure step is valid integer
-   if (!check_stoi(step)) {
-      cerr << "oifs_valid_step: Invalid characters in stoi string, unable to convert step to int: " << step << '\n';
+   std::string dirname = std::filesystem::path(filename).parent_path();
+   fd = open(dirname.empty() ? "." : dirname.c_str(), O_RDONLY);
+   if ( fd < 0 || fsync(fd) != 0 ) retval = -1;
+   if ( fd >= 0 ) close(fd);
+
+   if ( retval ) cerr << "..Unable to sync to disk: " << filename << '\n';
+   return retval;
+}
+
+
+bool upload_and_confirm(std::string& upload_file_name, double timeout) {
+   //  Register a file for upload with the BOINC client, then wait (bounded by 'timeout' seconds)
+   //  for the client to report its status.
+   //  Returns: true if the client reported the upload completed successfully.
+
+   int retval = boinc_upload_file(upload_file_name);
+   if ( retval ) {
+      cerr << "..boinc_upload_file failed for: " << upload_file_name << ", error " << retval << std::endl;
       return false;
+   }
+
+   wait_for_condition([&upload_file_name]() { return boinc_upload_status(upload_file_name) != ERR_NOT_FOUND; },
+                      timeout, 0.25, "upload status of " + upload_file_name);
+
+   return (boinc_upload_status(upload_file_name) == 0);
+}
+
+
+// Controller telemetry. Wall time per phase, counters and model step times, exported to the slot
+// by telemetry_write() as a Prometheus textfile (oifs_metrics.prom) and a JSON summary (oifs_metrics.json).
+static std::string                    telemetry_slot_path, telemetry_wu_name;
+static std::map<std::string, double>  telemetry_seconds;      // phase -> total wall time (secs)
+static std::map<std::string, long>    telemetry_calls;        // phase -> number of times timed
+static std::map<std::string, double>  telemetry_counters;     // counter -> value
+static std::map<std::string, double>  telemetry_gauges;       // gauge -> last value set
+static std::vector<double>            telemetry_step_secs;    // wall time of each model step (secs)
+
+void telemetry_init(const std::string& slot_path, const std::string& wu_name) {
+   telemetry_slot_path = slot_path;
+   telemetry_wu_name   = wu_name;
+}
+
+void telemetry_add_time(const std::string& phase, double secs) {
+   telemetry_seconds[phase] += secs;
+   telemetry_calls[phase]++;
+}
+
+void telemetry_count(const std::string& counter, double increment) {
+   telemetry_counters[counter] += increment;
+}
+
+void telemetry_gauge(const std::string& gauge, double value) {
+   telemetry_gauges[gauge] = value;
+}
+
+double telemetry_get(const std::string& name) {
+   //  Returns the current value of a counter or gauge, zero if it has not been set.
+   if ( telemetry_counters.count(name) ) return telemetry_counters[name];
+   if ( telemetry_gauges.count(name) )   return telemetry_gauges[name];
+   return 0.0;
+}
+
+void telemetry_steps(int nsteps, double secs) {
+   //  Record the wall time of model steps. If several steps completed since the last check
+   //  the elapsed time is shared equally between them.
+   for (int i=0; i<nsteps; i++)
+      telemetry_step_secs.push_back(secs / nsteps);
+}
+
+static std::string telemetry_number(double value) {
+   // Counters are mostly whole numbers (bytes, files), print those without a fractional part
+   std::ostringstream out;
+   if ( value == (double)(long long) value ) {
+      out << (long long) value;
    } else {
-      // check step is in valid range: 0 -> total no. of steps
-      if (stoi(step)<0) {
-         return false;
-      } else if (stoi(step) > nsteps) {
+      out.setf(std::ios::fixed);
+      out.precision(6);
+      out << value;
+   }
+   return out.str();
+}
+
+static double telemetry_quantile(std::vector<double> values, double q) {
+   if ( values.empty() ) return 0.0;
+   size_t k = (size_t) (q * (values.size()-1) + 0.5);
+   std::nth_element(values.begin(), values.begin()+k, values.end());
+   return values[k];
+}
+
+bool telemetry_step_stats(double& mean, double& p95) {
+   //  Mean and 95th percentile of the model step wall times recorded so far.
+   //  Returns: false if no steps have been recorded.
+   mean = p95 = 0.0;
+   if ( telemetry_step_secs.empty() ) return false;
+
+   for (double s : telemetry_step_secs) mean += s;
+   mean = mean / telemetry_step_secs.size();
+   p95  = telemetry_quantile(telemetry_step_secs, 0.95);
+   return true;
+}
+
+bool telemetry_write() {
+   //  Write the current telemetry to the slot. Files are written under a temporary name and renamed,
+   //  so a reader never sees a partial file.
+   //  Returns: true if both files were written.
+
+   if ( telemetry_slot_path.empty() ) return false;
+
+   double step_sum = 0.0;
+   for (double s : telemetry_step_secs) step_sum += s;
+   double step_count = (double) telemetry_step_secs.size();
+   double step_mean  = step_count > 0 ? step_sum / step_count : 0.0;
+   double step_p50   = telemetry_quantile(telemetry_step_secs, 0.50);
+   double step_p95   = telemetry_quantile(telemetry_step_secs, 0.95);
+   double step_max   = step_count > 0 ? *std::max_element(telemetry_step_secs.begin(), telemetry_step_secs.end()) : 0.0;
+
+   std::string label = "wu=\"" + telemetry_wu_name + "\"";
+   std::ostringstream prom, json;
+   prom.setf(std::ios::fixed);  prom.precision(6);
+   json.setf(std::ios::fixed);  json.precision(6);
+
+   prom << "# HELP oifs_phase_seconds_total Wall time spent by the controller in each phase.\n";
+   prom << "# TYPE oifs_phase_seconds_total counter\n";
+   for (auto& phase : telemetry_seconds)
+      prom << "oifs_phase_seconds_total{" << label << ",phase=\"" << phase.first << "\"} " << phase.second << '\n';
+   prom << "# HELP oifs_phase_calls_total Number of times each controller phase was timed.\n";
+   prom << "# TYPE oifs_phase_calls_total counter\n";
+   for (auto& phase : telemetry_calls)
+      prom << "oifs_phase_calls_total{" << label << ",phase=\"" << phase.first << "\"} " << phase.second << '\n';
+   for (auto& counter : telemetry_counters) {
+      prom << "# TYPE oifs_" << counter.first << "_total counter\n";
+      prom << "oifs_" << counter.first << "_total{" << label << "} " << telemetry_number(counter.second) << '\n';
+   }
+   for (auto& gauge : telemetry_gauges) {
+      prom << "# TYPE oifs_" << gauge.first << " gauge\n";
+      prom << "oifs_" << gauge.first << "{" << label << "} " << telemetry_number(gauge.second) << '\n';
+   }
+   prom << "# HELP oifs_model_step_seconds Wall time per model step.\n";
+   prom << "# TYPE oifs_model_step_seconds summary\n";
+   prom << "oifs_model_step_seconds{" << label << ",quantile=\"0.5\"} "  << step_p50 << '\n';
+   prom << "oifs_model_step_seconds{" << label << ",quantile=\"0.95\"} " << step_p95 << '\n';
+   prom << "oifs_model_step_seconds_sum{" << label << "} " << step_sum << '\n';
+   prom << "oifs_model_step_seconds_count{" << label << "} " << (long) step_count << '\n';
+
+   json << "{\n  \"wu\": \"" << telemetry_wu_name << "\",\n  \"written\": " << (long) time(NULL) << ",\n";
+   json << "  \"phases\": {";
+   for (auto it = telemetry_seconds.begin(); it != telemetry_seconds.end(); ++it) {
+      json << (it == telemetry_seconds.begin() ? "\n" : ",\n");
+      json << "    \"" << it->first << "\": {\"seconds\": " << it->second << ", \"calls\": " << telemetry_calls[it->first] << "}";
+   }
+   json << "\n  },\n  \"counters\": {";
+   for (auto it = telemetry_counters.begin(); it != telemetry_counters.end(); ++it) {
+      json << (it == telemetry_counters.begin() ? "\n" : ",\n");
+      json << "    \"" << it->first << "\": " << telemetry_number(it->second);
+   }
+   json << "\n  },\n  \"gauges\": {";
+   for (auto it = telemetry_gauges.begin(); it != telemetry_gauges.end(); ++it) {
+      json << (it == telemetry_gauges.begin() ? "\n" : ",\n");
+      json << "    \"" << it->first << "\": " << telemetry_number(it->second);
+   }
+   json << "\n  },\n";
+   json << "  \"steps\": {\"count\": " << (long) step_count << ", \"mean\": " << step_mean << ", \"p50\": " << step_p50
+        << ", \"p95\": " << step_p95 << ", \"max\": " << step_max << "}\n}\n";
+
+   bool ok = true;
+   for (auto& output : { std::make_pair(std::string("/oifs_metrics.prom"), prom.str()),
+                         std::make_pair(std::string("/oifs_metrics.json"), json.str()) }) {
+      std::string filename = telemetry_slot_path + output.first;
+      std::string tmpname  = filename + ".tmp";
+      std::ofstream out(tmpname);
+      out << output.second;
+      out.close();
+      if ( !out || std::rename(tmpname.c_str(), filename.c_str()) != 0 ) {
+         cerr << "..Unable to write telemetry file: " << filename << '\n';
+         ok = false;
+      }
+   }
+   return ok;
+}
+
+
+// BOINC critical sections, timed so the time spent in them is reported in the trickle performance record
+static steady_clock::time_point critical_section_start;
+static bool                     in_critical_section = false;
+
+void oifs_begin_critical_section() {
+   boinc_begin_critical_section();
+   if ( !in_critical_section ) {
+      critical_section_start = steady_clock::now();
+      in_critical_section = true;
+   }
+}
+
+void oifs_end_critical_section() {
+   boinc_end_critical_section();
+   if ( in_critical_section ) {
+      telemetry_add_time("critical_section", duration<double>(steady_clock::now() - critical_section_start).count());
+      in_critical_section = false;
+   }
+}
+
+
+std::string trickle_perf_record(double cpu_secs, double wall_secs, int nthreads, int restart_count) {
+   //  Compact performance record sent in the <pf> element of trickles, as comma separated key=value:
+   //     st  : mean model step wall time (secs)        p95 : 95th percentile step wall time (secs)
+   //     eff : model cpu time / (wall time * nthreads) for this run of the task
+   //     rss : peak resident memory of the model (MB)
+   //     wb  : written by the model (MB)               ub  : uploaded (MB)
+   //     cs  : time spent in BOINC critical sections (secs)
+   //     rs  : number of times the task has been restarted
+   //     dh  : DrHook setting, 0 off, 1 on, 2 profiling (see oifs_profile.cpp)
+   //  Kept well below the size limit of a trickle message, fields are dropped from the end if necessary.
+
+   const size_t max_record = 256;
+   double       step_mean, step_p95;
+   char         field[64];
+   std::string  record;
+
+   telemetry_step_stats(step_mean, step_p95);
+   double eff = (wall_secs > 0 && nthreads > 0) ? cpu_secs / (wall_secs * nthreads) : 0.0;
+
+   std::vector<std::pair<const char*, double>> fields = {
+      {"st=%.2f", step_mean}, {"p95=%.2f", step_p95}, {"eff=%.3f", eff},
+      {"rss=%.0f", telemetry_get("peak_rss_kb") / 1024.0},
+      {"wb=%.1f", max(telemetry_get("io_write_bytes"), telemetry_get("bytes_moved")) / 1048576.0},
+      {"ub=%.1f", telemetry_get("bytes_uploaded") / 1048576.0},
+      {"cs=%.1f", telemetry_seconds["critical_section"]},
+      {"rs=%.0f", (double) restart_count},
+      {"dh=%.0f", telemetry_get("drhook_mode")} };
+
+   for (auto& f : fields) {
+      snprintf(field, sizeof(field), f.first, f.second);
+      if ( record.size() + strlen(field) + 1 > max_record ) break;
+      if ( !record.empty() ) record += ",";
+      record += field;
+   }
+   return record;
+}
+
+
+// Reusable buffer for reading /proc files in sample_process()
+static char proc_buffer[8192];
+
+static ssize_t read_proc_file(const std::string& filename) {
+   //  Read a (small) /proc file into proc_buffer, null terminated. Returns no. of bytes read, -1 on error.
+   int fd = open(filename.c_str(), O_RDONLY);
+   if ( fd < 0 ) return -1;
+   ssize_t len = read(fd, proc_buffer, sizeof(proc_buffer)-1);
+   close(fd);
+   proc_buffer[len > 0 ? len : 0] = '\0';
+   return len;
+}
+
+static bool parse_proc_stat(long& majflt, double& cpu) {
+   //  Parse the contents of a /proc/<pid>/stat file in proc_buffer for the major faults and cpu time.
+   //  Fields are counted from after the command name, which may itself contain spaces.
+   char *p = strrchr(proc_buffer, ')');
+   if ( p == NULL ) return false;
+
+   unsigned long long utime = 0, stime = 0;
+   p += 2;                                       // field 3, the process state
+   for (int field = 3; field <= 15 && *p; field++) {
+      if ( field == 12 ) majflt = strtol(p, NULL, 10);
+      if ( field == 14 ) utime  = strtoull(p, NULL, 10);
+      if ( field == 15 ) stime  = strtoull(p, NULL, 10);
+      while ( *p && *p != ' ' ) p++;
+      while ( *p == ' ' ) p++;
+   }
+   cpu = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+   return true;
+}
+
+static long long proc_field(const char* key) {
+   //  Value of a 'key: value' line in proc_buffer, e.g. from /proc/<pid>/status or io. Zero if not present.
+   const char *p = strstr(proc_buffer, key);
+   return ( p == NULL ) ? 0 : strtoll(p + strlen(key), NULL, 10);
+}
+
+bool sample_process(long pid, process_sample& sample, bool full) {
+   //  Sample the resource usage of process 'pid' from /proc, reading each file once.
+   //     full = false : cpu time only, from /proc/<pid>/stat
+   //     full = true  : also memory (status), I/O (io) and per-thread cpu time (task/*/stat)
+   //                    and run queue wait (task/*/schedstat, absent if the kernel lacks schedstats)
+   //  On systems without /proc (macOS) only the cpu time is available, via cpu_time().
+   //  Returns: false if the process could not be sampled.
+
+   std::string proc_dir = "/proc/" + std::to_string(pid);
+
+   if ( read_proc_file(proc_dir + "/stat") <= 0 ) {
+      #ifdef __linux__
          return false;
+      #else
+         sample.cpu_time = cpu_time(pid);
+         return true;
+      #endif
+   }
+   if ( !parse_proc_stat(sample.major_faults, sample.cpu_time) ) return false;
+   if ( !full ) return true;
+
+   if ( read_proc_file(proc_dir + "/status") > 0 ) {
+      sample.rss_kb      = proc_field("VmRSS:");
+      sample.peak_rss_kb = proc_field("VmHWM:");
+   }
+   if ( read_proc_file(proc_dir + "/io") > 0 ) {
+      sample.io_read_bytes  = proc_field("rchar:");
+      sample.io_write_bytes = proc_field("wchar:");
+   }
+
+   sample.thread_ids.clear();
+   sample.thread_cpu.clear();
+   sample.thread_wait.clear();
+   DIR *task_dir = opendir((proc_dir + "/task").c_str());
+   if ( task_dir != NULL ) {
+      struct dirent *entry;
+      long   thread_majflt;
+      double thread_cpu;
+      while ( (entry = readdir(task_dir)) != NULL ) {
+         if ( entry->d_name[0] == '.' ) continue;
+         if ( read_proc_file(proc_dir + "/task/" + entry->d_name + "/stat") > 0 &&
+              parse_proc_stat(thread_majflt, thread_cpu) ) {
+            sample.thread_ids.push_back(atoi(entry->d_name));
+            sample.thread_cpu.push_back(thread_cpu);
+            // schedstat: time on cpu, time waiting on a run queue, timeslices (nanosecs)
+            double thread_wait = 0;
+            if ( read_proc_file(proc_dir + "/task/" + entry->d_name + "/schedstat") > 0 ) {
+               char *p = proc_buffer;
+               strtoull(p, &p, 10);
+               thread_wait = strtoull(p, NULL, 10) / 1.0e9;
+            }
+            sample.thread_wait.push_back(thread_wait);
+         }
       }
+      closedir(task_dir);
    }
    return true;
 }
 
 
-int print_last_lines(string filename, int maxlines) {
-   // Opens a file if exists and uses circular buffer to read & print last lines of file to stderr.
-   // Returns: zero : either can't open file or file is empty
-   //          > 0  : no. of lines in file (may be less than maxlines)
-   //  Glenn
+void perf_log_sample(const std::string& logfile, const std::string& step, const process_sample& sample) {
+   //  Append a resource sample to the performance log, one line per sample:
+   //     time step cpu_secs rss_kb peak_rss_kb major_faults read_bytes write_bytes nthreads thread_cpu_secs,...
+
+   std::ofstream log(logfile, std::ios::app);
+   if ( !log.is_open() ) return;
+
+   log << time(NULL) << ' ' << step << ' ' << sample.cpu_time << ' ' << sample.rss_kb << ' ' << sample.peak_rss_kb << ' '
+       << sample.major_faults << ' ' << sample.io_read_bytes << ' ' << sample.io_write_bytes << ' ' << sample.thread_cpu.size() << ' ';
+   for (size_t i = 0; i < sample.thread_cpu.size(); i++)
+      log << (i ? "," : "") << sample.thread_cpu[i];
+   log << '\n';
+}
 
-   int     count = 0;
-   int     start, end;
-   string  lines[maxlines];
-   ifstream filein(filename);
 
-   if ( filein.is_open() ) {
-      while ( getline(filein, lines[count%maxlines]) )
-         count++;
+bool omp_efficiency_update(omp_efficiency& omp, const process_sample& sample, int step, long stat_secs,
+                           int nthreads, int max_nthreads) {
+   //  Update the OpenMP efficiency of the model from a full process sample taken when ifs.stat shows a new step.
+   //  The cpu time used by each thread since the previous update is compared with the wall time the model
+   //  took for those steps, from the times in ifs.stat:
+   //     thread utilisation  = thread cpu time / wall time
+   //     parallel efficiency = sum of thread cpu time / (wall time * nthreads)
+   //  The host is taken to be oversubscribed when the threads spend a significant time waiting for a cpu,
+   //  or when the efficiency is low while the load average exceeds the number of cpus. A thread count
+   //  that fits the cpus left over by other work is then suggested for the next restart, otherwise
+   //  max_nthreads, the thread count the task was sent with.
+   //  Returns: true if the oversubscribed state changed.
+
+   const double smoothing = 0.3;           // weight of the latest interval in the smoothed efficiency
+   const double max_runqueue_wait = 0.10;  // fraction of time waiting for a cpu taken as oversubscribed
+   const double min_efficiency = 0.75;
+
+   double interval_cpu = 0, interval_wait = 0, min_util = -1;
+   double wall = -1;
+   bool   was_oversubscribed = omp.oversubscribed;
+
+   if ( omp.last_step >= 0 && step > omp.last_step && stat_secs >= 0 && omp.last_stat_secs >= 0 ) {
+      wall = stat_secs - omp.last_stat_secs;
+      if ( wall < 0 ) wall += 86400;           // ifs.stat times wrap at midnight
    }
 
-   if ( count > 0 ) {
-      // find the oldest lines first in the buffer, will not be at start if count > maxlines
-      start = count > maxlines ? (count%maxlines) : 0;
-      end   = min(maxlines,count);
+   // Only threads present in both samples contribute; the model's OpenMP threads persist between steps
+   int nmatched = 0;
+   for (size_t i = 0; i < sample.thread_ids.size(); i++) {
+      auto prev_cpu = omp.last_thread_cpu.find(sample.thread_ids[i]);
+      if ( wall > 0 && prev_cpu != omp.last_thread_cpu.end() ) {
+         double cpu  = max(sample.thread_cpu[i] - prev_cpu->second, 0.0);
+         double wait = max(sample.thread_wait[i] - omp.last_thread_wait[sample.thread_ids[i]], 0.0);
+         interval_cpu  += cpu;
+         interval_wait += wait;
+         if ( min_util < 0 || cpu / wall < min_util ) min_util = cpu / wall;
+         nmatched++;
+      }
+   }
+   omp.last_thread_cpu.clear();
+   omp.last_thread_wait.clear();
+   for (size_t i = 0; i < sample.thread_ids.size(); i++) {
+      omp.last_thread_cpu[sample.thread_ids[i]]  = sample.thread_cpu[i];
+      omp.last_thread_wait[sample.thread_ids[i]] = sample.thread_wait[i];
+   }
+   omp.last_step = step;
+   omp.last_stat_secs = stat_secs;
+
+   if ( wall <= 0 || nmatched == 0 || nthreads <= 0 ) return false;
+
+   // The model may have helper threads besides the OpenMP ones, so cap the efficiency at 1
+   double efficiency = min(interval_cpu / (wall * nthreads), 1.0);
+   omp.efficiency      = ( omp.efficiency < 0 ) ? efficiency : smoothing * efficiency + (1 - smoothing) * omp.efficiency;
+   omp.min_thread_util = min(min_util, 1.0);
+   omp.runqueue_wait   = interval_wait / (wall * min(nmatched, nthreads));
+
+   double loadavg = 0;
+   long   ncpus   = sysconf(_SC_NPROCESSORS_ONLN);
+   if ( getloadavg(&loadavg, 1) != 1 ) loadavg = 0;
+
+   omp.oversubscribed = ( omp.runqueue_wait > max_runqueue_wait ) ||
+                        ( omp.efficiency < min_efficiency && ncpus > 0 && loadavg > ncpus );
+
+   if ( omp.oversubscribed ) {
+      // cpus not used by other work, and no more threads than the efficiency suggests are kept busy
+      double free_cpus = ( ncpus > 0 ) ? ncpus - max(loadavg - nthreads, 0.0) : nthreads;
+      int suggested = (int) floor(min(free_cpus, omp.efficiency * nthreads));
+      omp.suggested_nthreads = std::clamp(suggested, 1, nthreads);
+   }
+   else {
+      omp.suggested_nthreads = max_nthreads;
+   }
+
+   telemetry_gauge("omp_efficiency", omp.efficiency);
+   telemetry_gauge("omp_min_thread_util", omp.min_thread_util);
+   telemetry_gauge("omp_runqueue_wait", omp.runqueue_wait);
+   telemetry_gauge("omp_oversubscribed", omp.oversubscribed ? 1 : 0);
+   telemetry_gauge("omp_suggested_nthreads", omp.suggested_nthreads);
+
+   return omp.oversubscribed != was_oversubscribed;
+}
 
-      cerr << ">>> Printing last " << end << " lines from file: " << filename << '\n';
-      for ( int i=0; i<end; i++ ) {
-         cerr << lines[ (start+i)%maxlines ] << '\n';
+
+void filter_output_files(const grib_manifest& manifest, const std::string& temp_path, const std::string& second_part) {
+   //  Subset and repack the result files of a step, once moved to the temp folder, as set by the workunit's
+   //  output manifest. The files are processed in parallel on the cpus the model leaves idle.
+
+   std::vector<std::string> outputs;
+   for (const char* prefix : {"/ICMGG", "/ICMSH", "/ICMUA"}) {
+      std::string output = temp_path + prefix + second_part;
+      if (file_exists(output) && grib_manifest_applies(manifest, output)) outputs.push_back(output);
+   }
+   if (outputs.empty()) return;
+
+   int nthreads = grib_idle_cpus();
+   if (manifest.max_threads > 0) nthreads = min(nthreads, manifest.max_threads);
+
+   phase_timer filter_timer("grib_filter");
+   grib_filter_stats stats;
+   grib_filter_files(manifest, outputs, nthreads, stats);
+   filter_timer.stop();
+
+   cerr << "Filtered the result files: " << stats.files << " files, " << stats.fields_dropped << " of " << stats.fields_in
+        << " fields dropped, " << stats.fields_repacked << " repacked, " << stats.bytes_in << " bytes reduced to " << stats.bytes_out << '\n';
+   telemetry_count("grib_files", stats.files);
+   telemetry_count("grib_files_failed", stats.failed);
+   telemetry_count("grib_fields_dropped", stats.fields_dropped);
+   telemetry_count("grib_fields_repacked", stats.fields_repacked);
+   telemetry_count("grib_bytes_in", stats.bytes_in);
+   telemetry_count("grib_bytes_out", stats.bytes_out);
+}
+
+
+void index_output_files(const std::string& temp_path, const std::string& second_part) {
+   //  Write an index, '<file>.idx', of the GRIB messages in each result file of a step once it is in the temp folder
+   //  (and filtered), for the server to extract fields without decoding the files. The index is uploaded with the file.
+   //  Files that do not start with a GRIB message are not indexed.
+
+   phase_timer index_timer("grib_index");
+   std::vector<grib_index_entry> index;
+   for (const char* prefix : {"/ICMGG", "/ICMSH", "/ICMUA"}) {
+      std::string output = temp_path + prefix + second_part;
+      if (!grib_file_is_grib(output)) continue;
+
+      if (!grib_index_file(output, index) || !grib_write_index(output + ".idx", index)) {
+         cerr << "..Indexing the result file failed: " << output << '\n';
+         telemetry_count("grib_index_failed", 1);
+         continue;
+      }
+      telemetry_count("grib_indexed_files", 1);
+      telemetry_count("grib_indexed_messages", index.size());
+   }
+}
+
+
+void delta_encode_zip_list(ZipFileList& zfl, std::vector<std::string>& replaced) {
+   //  Delta encode the result files in the list of files for an upload zip, see oifs_delta.cpp. The files replaced
+   //  by their .delta files are added to 'replaced', to be deleted with the others once the zip is made.
+   //  If the encoding fails the files are zipped as they are.
+
+   phase_timer delta_timer("delta_encode");
+   delta_stats stats;
+   if (!delta_encode_upload(zfl, replaced, stats)) {
+      cerr << "..Delta encoding the result files failed, zipping them unencoded" << std::endl;
+      telemetry_count("delta_failed", 1);
+      return;
+   }
+   delta_timer.stop();
+
+   cerr << "Delta encoded the result files: " << stats.encoded << " of " << stats.files << " files, " << stats.messages_shared
+        << " of " << stats.messages << " messages shared, " << stats.bytes_in << " bytes reduced to " << stats.bytes_out << '\n';
+   telemetry_count("delta_files_encoded", stats.encoded);
+   telemetry_count("delta_messages_shared", stats.messages_shared);
+   telemetry_count("delta_bytes_in", stats.bytes_in);
+   telemetry_count("delta_bytes_out", stats.bytes_out);
+}
+
+
+bool input_is_staged(const staging_manifest& staged, const std::string& slot_path, const std::string& input) {
+   //  Check whether an input was staged by an earlier start of the task and its files are unchanged, see
+   //  oifs_staging.cpp.
+   //  Returns: true if the input does not need staging again.
+
+   phase_timer verify_timer("staging_verify");
+   staging_stats stats;
+   int result = staging_verify(staged, slot_path, input, stats);
+   verify_timer.stop();
+
+   if (result > 0) {
+      cerr << "Already staged: " << input << ", " << stats.files << " files, " << stats.bytes << " bytes verified" << '\n';
+      telemetry_count("staging_inputs_skipped", 1);
+      telemetry_count("staging_bytes_verified", stats.bytes);
+   }
+   else if (result < 0) {
+      cerr << "..Staging again: " << input << ", a file is missing or has changed: " << stats.failed << std::endl;
+      telemetry_count("staging_inputs_restaged", 1);
+   }
+   return result > 0;
+}
+
+
+bool write_diagnostics(const std::string& title, const std::string& reason, const std::string& slot_path,
+                       const std::string& progress_file, const std::string& last_iter, const process_sample& sample,
+                       const std::string& bundle_file) {
+   //  Write the diagnostics of the run, see oifs_diag.cpp, to bundle_file: the reason they were taken, under
+   //  'title', and the last lines of the model's logs and of the controller's.
+   //  Returns: false if the bundle could not be written.
+
+   // The latest resource sample goes in the performance log, and the latest telemetry in oifs_metrics.json
+   perf_log_sample(slot_path + std::string("/oifs_perf.log"), last_iter, sample);
+   telemetry_write();
+   log_flush();
+
+   diag_bundle bundle;
+   time_t now = time(NULL);
+   diag_add_text(bundle, title, reason + "\nstep: " + last_iter + "\ntime: " + ctime(&now));
+   diag_add_tail(bundle, slot_path + std::string("/NODE.001_01"), 500);
+   diag_add_tail(bundle, slot_path + std::string("/ifs.stat"), 50);
+   diag_add_tail(bundle, slot_path + std::string("/rcf"), 50);
+   diag_add_tail(bundle, slot_path + std::string("/waminfo"), 50);
+   diag_add_tail(bundle, progress_file, 50);
+   diag_add_tail(bundle, slot_path + std::string("/oifs_perf.log"), 50);
+   diag_add_tail(bundle, slot_path + std::string("/oifs_metrics.json"), 500);
+   diag_add_tail(bundle, slot_path + std::string("/stderr.txt"), 300);
+   if (!diag_write(bundle, bundle_file)) {
+      cerr << "..Writing the diagnostics failed: " << bundle_file << std::endl;
+      return false;
+   }
+   return true;
+}
+
+
+bool upload_diagnostics(const std::string& reason, const std::string& slot_path, const std::string& progress_file,
+                        const std::string& last_iter, const process_sample& sample,
+                        const std::string& upload_file, const std::string& upload_file_name) {
+   //  Put together the diagnostics of a failed run, see oifs_diag.cpp, zip them as upload_file and, when running
+   //  under a BOINC client, upload them as upload_file_name.
+   //  Returns: true if the diagnostics were zipped (and the upload started).
+
+   phase_timer diag_timer("diagnostics");
+   std::string bundle_file = slot_path + std::string("/oifs_diagnostics.txt.gz");
+   if (!write_diagnostics("failure", reason, slot_path, progress_file, last_iter, sample, bundle_file)) return false;
+
+   ZipFileList zfl;
+   zfl.push_back(bundle_file);
+   std::string upfile = upload_file;
+   cerr << "Zipping up the diagnostics: " << upload_file << '\n';
+   if (boinc_zip(ZIP_IT, upfile, &zfl)) {
+      cerr << "..Zipping up the diagnostics failed" << std::endl;
+      return false;
+   }
+   std::remove(bundle_file.c_str());
+   sync_file_and_dir(upload_file);
+   telemetry_count("diagnostics_uploads", 1);
+
+   if (!boinc_is_standalone()) {
+      std::string upload_name = upload_file_name;
+      cerr << "Uploading the diagnostics: " << upload_name << '\n';
+      upload_and_confirm(upload_name, 5.0);
+      // Give the client the chance to take the upload before the task fails
+      wait_for_condition([&upload_name]() { return boinc_upload_status(upload_name) != ERR_NOT_FOUND; },
+                         60.0, 1.0, "upload status of the diagnostics");
+   }
+   return true;
+}
+
+
+int zip_upload(const std::string& upload_file, const ZipFileList& zfl, std::map<std::string, zip_source>& moved_sources, int level) {
+   //  Zip the files of an upload, reading each once and using the CRC32 taken as it was moved, see oifs_zip.cpp.
+   //  Zips that need zip64 are made by boinc_zip.
+   //  Returns: zero if the zip was made, as boinc_zip.
+
+   std::vector<zip_source> sources;
+   for (const std::string& file : zfl) {
+      auto moved = moved_sources.find(file);
+      if (moved != moved_sources.end()) sources.push_back(moved->second);
+      else {
+         sources.emplace_back();
+         sources.back().path = file;
       }
-      cerr << "------------------------------------------------" << std::endl;
    }
 
-   return count;
+   zip_write_stats stats;
+   std::string error;
+   if (!zip_write(upload_file, sources, level, stats, error)) {
+      cerr << "..Writing the zip failed: " << error << ", zipping with boinc_zip" << '\n';
+      std::string upfile = upload_file;
+      return boinc_zip(ZIP_IT, upfile, &zfl);
+   }
+   for (const std::string& file : zfl) moved_sources.erase(file);
+
+   telemetry_count("zip_files", stats.files);
+   telemetry_count("zip_crc_reused", stats.crc_reused);
+   telemetry_count("zip_bytes_in", stats.bytes_in);
+   telemetry_count("zip_bytes_read", stats.bytes_read);
+   telemetry_count("zip_bytes_out", stats.bytes_out);
+   return 0;
+}
+
+
+bool upload_empty(const std::string& upload_file, const std::string& upload_file_name) {
+   //  Upload an empty zip as an upload file declared for the task that the uploads did not use, see oifs_plan.cpp.
+   //  Returns: false if the zip could not be written.
+
+   zip_write_stats stats;
+   std::string error, upload_name = upload_file_name;
+   if (!zip_write(upload_file, std::vector<zip_source>(), 0, stats, error)) {
+      cerr << "..Writing the empty upload file failed: " << error << std::endl;
+      return false;
+   }
+   sync_file_and_dir(upload_file);
+   cerr << "Uploading the empty upload file: " << upload_name << '\n';
+   upload_and_confirm(upload_name, 5.0);
+   telemetry_count("uploads_empty", 1);
+   return true;
+}
+
+
+int calibration_run(const std::string& slot_path, const std::string& strCmd, const std::string& exptid,
+                    const std::string& app_name, const oifs_namelist& nml, int nsteps, double& secs_per_step) {
+   //  Run the model for 'nsteps' steps in the calibration folder of the slot and time its steps, after the first
+   //  which includes the model's startup, see oifs_calib.cpp. The model is stopped after nsteps steps, or 30 mins.
+   //  Returns: the process status, 0 unless the client asked for the task to quit or abort, with the wall time of
+   //           a step in secs_per_step, 0 if fewer than two steps were timed.
+
+   secs_per_step = 0;
+   std::string calib_dir = slot_path + std::string("/calibration");
+   std::error_code ec;
+   if (!calib_prepare(slot_path, calib_dir, exptid, nml, nsteps)) {
+      cerr << "..Unable to set up the calibration folder: " << calib_dir << std::endl;
+      std::filesystem::remove_all(calib_dir, ec);
+      return 0;
+   }
+
+   // The model runs in the calibration folder, the controller goes back to the slot once it is launched
+   phase_timer calib_timer("calibration");
+   cerr << "Calibrating the host: running the model for " << nsteps << " steps in: " << calib_dir << '\n';
+   if (chdir(calib_dir.c_str()) != 0) {
+      cerr << "..Unable to change to the calibration folder: " << strerror(errno) << std::endl;
+      std::filesystem::remove_all(calib_dir, ec);
+      return 0;
+   }
+   long pid = launch_process(slot_path, strCmd.c_str(), exptid.c_str(), app_name);
+   if (chdir(slot_path.c_str()) != 0) cerr << "..Unable to change back to the slot: " << strerror(errno) << std::endl;
+
+   // Time from the first step seen to the last, polling the last line of ifs.stat
+   int status = 0, first_step = -1, last_step = -1;
+   bool running = true;
+   steady_clock::time_point start = steady_clock::now(), first_time, last_time;
+   while (running && status == 0 && steady_clock::now() - start < minutes(30)) {
+      sleep_until(system_clock::now() + seconds(1));
+
+      std::string line, iter;
+      if (tail_lines(calib_dir + std::string("/ifs.stat"), 1, line) > 0 && oifs_parse_stat(line, iter, 4) && check_stoi(iter)) {
+         int step = std::stoi(iter);
+         if (step > 0 && first_step < 0) {
+            first_step = step;
+            first_time = steady_clock::now();
+         }
+         else if (step > last_step && step > first_step && first_step >= 0) {
+            last_step = step;
+            last_time = steady_clock::now();
+         }
+         if (step >= nsteps) break;
+      }
+
+      // A suspend by the client is not part of the step times, the timing starts again from the next step
+      steady_clock::time_point before = steady_clock::now();
+      status = check_boinc_status(pid, status);
+      if (steady_clock::now() - before > seconds(2)) first_step = last_step = -1;
+      if (status == 0 && check_child_status(pid, 0) != 0) running = false;
+   }
+   if (running) {
+      if (status == 0) kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+   }
+   std::filesystem::remove_all(calib_dir, ec);
+
+   if (first_step >= 0 && last_step > first_step) {
+      secs_per_step = duration<double>(last_time - first_time).count() / (last_step - first_step);
+      cerr << "Calibration run: " << (last_step - first_step) << " steps timed, " << secs_per_step << " secs per step" << '\n';
+   } else if (status == 0) {
+      cerr << "..Calibration run: too few steps to time" << std::endl;
+   }
+   return status;
+}
+
+
+std::string cpu_model_name() {
+   //  Returns: the host's cpu model, from /proc/cpuinfo, or "unknown".
+
+   std::ifstream cpuinfo("/proc/cpuinfo");
+   std::string line;
+   while (std::getline(cpuinfo, line)) {
+      if (line.compare(0, 10, "model name") != 0) continue;
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) break;
+      size_t start = line.find_first_not_of(" \t", colon + 1);
+      if (start != std::string::npos) return line.substr(start);
+   }
+   return "unknown";
 }
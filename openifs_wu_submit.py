@@ -194,6 +194,16 @@ if __name__ == "__main__":
             fullpos_namelist = './config/' + fullpos_namelist_file
           print("fullpos_namelist: "+fullpos_namelist)
 
+          # The output manifest is optional, it selects the output fields the controller uploads
+          output_manifest = ''
+          if batch.getElementsByTagName('output_manifest'):
+            output_manifest_file = str(batch.getElementsByTagName('output_manifest')[0].childNodes[0].nodeValue)
+            if not(options.submission_test):
+              output_manifest = ancil_file_location + 'output_manifest/' + output_manifest_file
+            else:
+              output_manifest = './config/' + output_manifest_file
+            print("output_manifest: "+output_manifest)
+
           nthreads = str(batch.getElementsByTagName('num_threads')[0].childNodes[0].nodeValue)
           print("num_threads: "+nthreads)
 
@@ -761,6 +771,8 @@ if __name__ == "__main__":
               zip_file = zipfile.ZipFile('./download/'+workunit_name+'.zip','w')
             zip_file.write('fort.4')
             zip_file.write('wam_namelist')
+            if output_manifest:
+              zip_file.write(output_manifest,'output_manifest')
             zip_file.close()
 
             # Remove the copied wam_namelist file